@@ -28,6 +28,8 @@ cd "$PROJECT_ROOT"
 make clean
 make all
 make build-multithread
+make build-bench
+make build-stress
 
 echo ""
 echo "2. Copying files to QEMU VM..."
@@ -51,7 +53,7 @@ lsmod | grep elf_det
 
 echo "Checking /proc entries..."
 ls -la /proc/elf_det/
-echo "Expected files: det, pid, threads"
+echo "Expected files: det, exits, faults, futex, offcpu, pid, procs, profile, stats, syscalls, threads, wakeups, watch"
 
 echo ""
 echo "=== Testing Process Information (PID: $$) ==="
@@ -62,6 +64,14 @@ if ! echo "$PROC_OUT" | grep -q "Memory Pressure Statistics"; then
     echo "[FAIL] Memory pressure stats missing for PID $$"
     exit 1
 fi
+if ! echo "$PROC_OUT" | grep -Eq "^VMA Walk: +(lockless|locked)"; then
+    echo "[FAIL] VMA lookup did not run for idle PID $$"
+    exit 1
+fi
+if ! echo "$PROC_OUT" | grep -q "Read (rchar):"; then
+    echo "[FAIL] I/O accounting missing for PID $$"
+    exit 1
+fi
 if ! echo "$PROC_OUT" | grep -q "\[network\]"; then
     echo "[FAIL] Network stats section missing for PID $$"
     exit 1
@@ -78,6 +88,31 @@ if ! echo "$PROC_OUT" | grep -q "Open Sockets"; then
     echo "[FAIL] Open sockets section missing for PID $$"
     exit 1
 fi
+if ! echo "$PROC_OUT" | grep -qE "^  Limit: +[0-9]+ \(headroom [0-9]+\)"; then
+    echo "[FAIL] fd limit headroom missing for PID $$"
+    exit 1
+fi
+
+echo ""
+echo "=== Testing fd inventory pipe fill level ==="
+# The reader never reads, so the writer's 6 bytes stay queued in its stdin
+{ echo hello; exec sleep 5; } | sleep 5 &
+PIPE_PID=$!
+sleep 0.5
+echo "$PIPE_PID" | sudo tee /proc/elf_det/pid > /dev/null
+PIPE_OUT=$(sudo cat /proc/elf_det/det)
+echo "$PIPE_OUT" | sed -n '/^File Descriptors:/,/^-----/p'
+if ! echo "$PIPE_OUT" | grep -qE "^  By Type: .*pipe=[0-9]+"; then
+    echo "[FAIL] fd inventory does not count the pipe of PID $PIPE_PID"
+    exit 1
+fi
+if ! echo "$PIPE_OUT" | grep -qE "^  \[FD 0\] pipe +1/[0-9]+ slots +6 bytes"; then
+    echo "[FAIL] pipe occupancy of fd 0 is not 6 bytes for PID $PIPE_PID"
+    exit 1
+fi
+kill "$PIPE_PID" 2>/dev/null
+wait "$PIPE_PID" 2>/dev/null
+echo "[OK] fd inventory reports pipe occupancy"
 
 echo ""
 echo "=== Testing Thread Information (PID: $$) ==="
@@ -117,6 +152,15 @@ echo ""
 echo "=== Testing with user program (proc_elf_ctrl, PID=1) ==="
 sudo ./build/proc_elf_ctrl 1 || true
 
+echo ""
+echo "=== Testing multi-PID collection (proc_elf_ctrl --pids) ==="
+COLLECT_OUT=$(sudo ./build/proc_elf_ctrl --pids 1,$$ --jobs 2)
+echo "$COLLECT_OUT"
+if ! echo "$COLLECT_OUT" | grep -q "Collected 2 of 2 processes"; then
+    echo "[FAIL] Multi-PID collection did not report both PIDs"
+    exit 1
+fi
+
 echo ""
 echo "=== Testing with multi-threaded application ==="
 # Run the multi-threaded program in background
@@ -171,9 +215,347 @@ wait $MULTITHREAD_PID
 echo ""
 echo "[PASS] Multi-threaded application test completed"
 
+echo ""
+echo "=== Benchmarking det/threads read latency (elf_bench --quick) ==="
+sudo ./build/elf_bench --quick | tee bench.txt
+if [ "$(grep -c '^file=' bench.txt)" -ne 16 ]; then
+    echo "[FAIL] Benchmark did not report all configurations"
+    exit 1
+fi
+
+echo ""
+echo "=== Stressing concurrent sessions (elf_stress) ==="
+if ! sudo ./build/elf_stress --readers 1,4 --writers 2 --targets 4 --duration 1000; then
+    echo "[FAIL] Concurrent readers saw another PID's data or failed queries"
+    exit 1
+fi
+
+echo ""
+echo "=== Querying an exited (zombie) process ==="
+# The inner sleep's new parent never calls wait(), so it stays a zombie
+sh -c 'sleep 0.1 & echo $! > /tmp/zombie.pid; exec sleep 5' &
+ZOMBIE_PARENT=$!
+sleep 1
+ZOMBIE_PID=$(cat /tmp/zombie.pid)
+echo "$ZOMBIE_PID" | sudo tee /proc/elf_det/pid > /dev/null
+ZOMBIE_OUT=$(sudo cat /proc/elf_det/det)
+echo "$ZOMBIE_OUT"
+if ! echo "$ZOMBIE_OUT" | grep -q "^Status: *exited"; then
+    echo "[FAIL] Zombie PID $ZOMBIE_PID not reported as exited"
+    exit 1
+fi
+if ! sudo cat /proc/elf_det/threads > /dev/null; then
+    echo "[FAIL] threads query of zombie PID $ZOMBIE_PID failed"
+    exit 1
+fi
+kill $ZOMBIE_PARENT 2>/dev/null || true
+wait $ZOMBIE_PARENT 2>/dev/null || true
+echo "[PASS] Exited process reported cleanly"
+
+echo ""
+echo "=== Checking module self-instrumentation (/proc/elf_det/stats) ==="
+STATS_OUT=$(sudo cat /proc/elf_det/stats)
+echo "$STATS_OUT"
+for section in det threads memory_pressure vma_walk network sockets thread_loop io; do
+    if ! echo "$STATS_OUT" | grep -q "^\[$section\]"; then
+        echo "[FAIL] stats section [$section] missing"
+        exit 1
+    fi
+done
+if echo "$STATS_OUT" | grep -A1 '^\[det\]' | grep -q '^calls: 0$'; then
+    echo "[FAIL] det queries were not counted"
+    exit 1
+fi
+
+echo ""
+echo "=== Checking the result cache (cache_ttl_ms) ==="
+echo 5000 | sudo tee /sys/module/elf_det/parameters/cache_ttl_ms > /dev/null
+echo reset | sudo tee /proc/elf_det/stats > /dev/null
+echo "$$" | sudo tee /proc/elf_det/pid > /dev/null
+sudo cat /proc/elf_det/det > /dev/null
+sudo cat /proc/elf_det/det > /dev/null
+CACHE_OUT=$(sudo grep '^cache_' /proc/elf_det/stats)
+echo 0 | sudo tee /sys/module/elf_det/parameters/cache_ttl_ms > /dev/null
+echo "$CACHE_OUT"
+if ! echo "$CACHE_OUT" | grep -q '^cache_hits: [1-9]'; then
+    echo "[FAIL] Repeated det read within the TTL was not served from cache"
+    exit 1
+fi
+
+echo ""
+echo "=== Checking the watch registry (/proc/elf_det/watch) ==="
+echo "$$" | sudo tee /proc/elf_det/watch > /dev/null
+echo "$$" | sudo tee /proc/elf_det/pid > /dev/null
+sudo cat /proc/elf_det/det > /dev/null
+WATCH_OUT=$(sudo cat /proc/elf_det/det | sed -n '/^\[watch\]/,$p')
+echo "$WATCH_OUT" | head -11
+if ! echo "$WATCH_OUT" | grep -q '^samples: 2$'; then
+    echo "[FAIL] det of a watched PID lacks the [watch] block"
+    exit 1
+fi
+# Watched PIDs bypass the result cache: each read moves the reference
+echo 5000 | sudo tee /sys/module/elf_det/parameters/cache_ttl_ms > /dev/null
+echo reset | sudo tee /proc/elf_det/stats > /dev/null
+sudo cat /proc/elf_det/det > /dev/null
+WATCH_OUT=$(sudo cat /proc/elf_det/det | sed -n '/^\[watch\]/,$p')
+CACHE_OUT=$(sudo grep '^cache_hits' /proc/elf_det/stats)
+echo 0 | sudo tee /sys/module/elf_det/parameters/cache_ttl_ms > /dev/null
+if [ "$CACHE_OUT" != "cache_hits: 0" ] || ! echo "$WATCH_OUT" | grep -q '^samples: 4$'; then
+    echo "[FAIL] det of a watched PID was served from the result cache"
+    exit 1
+fi
+sudo cat /proc/elf_det/threads > /dev/null
+THREADS_WATCH=$(sudo cat /proc/elf_det/threads)
+if ! echo "$THREADS_WATCH" | grep -q 'WRITE_B/S   INT_CPU%  MAJ_FLT/S  MIN_FLT/S'; then
+    echo "[FAIL] threads of a watched PID lacks per-thread rates"
+    exit 1
+fi
+# Second read: the shell's row has interval CPU and fault rates, not "-"
+if ! echo "$THREADS_WATCH" | grep -qE "^$$ .* [0-9]+\.[0-9]{2} +[0-9]+ +[0-9]+$"; then
+    echo "[FAIL] No per-interval CPU and fault rates for thread $$"
+    exit 1
+fi
+echo "-$$" | sudo tee /proc/elf_det/watch > /dev/null
+sleep 0.5 &
+SHORT_PID=$!
+echo "$SHORT_PID" | sudo tee /proc/elf_det/watch > /dev/null
+wait $SHORT_PID
+if grep -q "pid=$SHORT_PID " /proc/elf_det/watch; then
+    echo "[FAIL] Watch of exited PID $SHORT_PID was not released"
+    exit 1
+fi
+echo "[PASS] Watch registry tracks and releases processes"
+
+echo ""
+echo "=== Checking the incremental process index (/proc/elf_det/procs) ==="
+GEN=$(sudo grep '^generation:' /proc/elf_det/procs | awk '{print $2}')
+/bin/true &
+TRUE_PID=$!
+wait $TRUE_PID
+CHANGES=$(sudo sh -c "exec 3<>/proc/elf_det/procs; echo $GEN >&3; cat <&3")
+echo "$CHANGES" | head -20
+for event in fork exec exit; do
+    if ! echo "$CHANGES" | grep -q "event=$event pid=$TRUE_PID "; then
+        echo "[FAIL] $event of PID $TRUE_PID missing from changes since generation $GEN"
+        exit 1
+    fi
+done
+if ! echo "$CHANGES" | grep -q "event=exec pid=$TRUE_PID .*exe=.*true$"; then
+    echo "[FAIL] exec of PID $TRUE_PID does not name /bin/true"
+    exit 1
+fi
+if ! sudo grep -q "^pid=$$ " /proc/elf_det/procs; then
+    echo "[FAIL] Shell PID $$ missing from the process index"
+    exit 1
+fi
+echo "[PASS] Process index reports changes since a generation"
+
+echo ""
+echo "=== Checking exit records (/proc/elf_det/exits) ==="
+sudo cat /proc/elf_det/exits > /dev/null
+sh -c 'head -c 1048576 /dev/zero > /dev/null; exit 3' &
+EXIT_PID=$!
+wait $EXIT_PID || true
+EXITS_OUT=$(sudo cat /proc/elf_det/exits)
+echo "$EXITS_OUT" | head -5
+EXIT_REC=$(echo "$EXITS_OUT" | grep "^pid=$EXIT_PID ")
+if ! echo "$EXIT_REC" | grep -q " exit=3$"; then
+    echo "[FAIL] No exit record with status 3 for PID $EXIT_PID"
+    exit 1
+fi
+if sudo grep -q "^pid=$EXIT_PID " /proc/elf_det/exits; then
+    echo "[FAIL] Exit record of PID $EXIT_PID was not drained by the first read"
+    exit 1
+fi
+echo "[PASS] Exit records capture and drain short-lived processes"
+
+echo ""
+echo "=== Checking off-CPU stacks (/proc/elf_det/offcpu) ==="
+# The shell blocks in wait4() for every sleep it runs
+sh -c 'while :; do sleep 0.05; done' &
+OFFCPU_PID=$!
+echo "$OFFCPU_PID" | sudo tee /proc/elf_det/offcpu > /dev/null
+sleep 1
+echo stop | sudo tee /proc/elf_det/offcpu > /dev/null
+kill "$OFFCPU_PID"
+wait "$OFFCPU_PID" 2>/dev/null
+OFFCPU_OUT=$(sudo cat /proc/elf_det/offcpu)
+echo "$OFFCPU_OUT" | head -5
+if ! echo "$OFFCPU_OUT" | grep -q "^# pid=$OFFCPU_PID running=0 .* weight=count$"; then
+    echo "[FAIL] off-CPU profile header missing for PID $OFFCPU_PID"
+    exit 1
+fi
+if ! echo "$OFFCPU_OUT" | grep -qE "^sh;[^ ]+ [1-9][0-9]*$"; then
+    echo "[FAIL] No folded off-CPU stack for PID $OFFCPU_PID"
+    exit 1
+fi
+OFFCPU_US=$(sudo sh -c 'exec 3<>/proc/elf_det/offcpu; echo weight=us >&3; cat <&3')
+if ! echo "$OFFCPU_US" | grep -q " weight=us$"; then
+    echo "[FAIL] weight=us was not applied to the open descriptor"
+    exit 1
+fi
+echo "[PASS] Off-CPU stacks are folded per blocking site"
+
+echo ""
+echo "=== Checking the on-CPU profile (/proc/elf_det/profile) ==="
+# A loop of shell builtins spends its time in the shell's own text
+sh -c 'while :; do :; done' &
+SPIN_PID=$!
+echo "$SPIN_PID 499" | sudo tee /proc/elf_det/profile > /dev/null
+sleep 1
+PROFILE_OUT=$(sudo cat /proc/elf_det/profile)
+echo stop | sudo tee /proc/elf_det/profile > /dev/null
+# Symbolize while the process still runs; the second run hits the cache
+SYM_OUT=$(sudo ELF_DET_SYMCACHE=/tmp/elf_det_symcache ./build/proc_elf_ctrl --symbolize profile "$SPIN_PID")
+sudo ELF_DET_SYMCACHE=/tmp/elf_det_symcache ./build/proc_elf_ctrl --symbolize profile "$SPIN_PID" > /dev/null
+kill "$SPIN_PID"
+wait "$SPIN_PID" 2>/dev/null
+echo "$PROFILE_OUT" | head -5
+echo "$PROFILE_OUT" | sed -n '/^\[vma\]/,$p' | head -5
+if ! echo "$PROFILE_OUT" | grep -qE "^# pid=$SPIN_PID hz=499 running=1 .* samples=[1-9][0-9]* "; then
+    echo "[FAIL] No on-CPU samples for PID $SPIN_PID"
+    exit 1
+fi
+if ! echo "$PROFILE_OUT" | sed -n '/^\[vma\]/,$p' | grep -qE "^samples=[1-9][0-9]* pct=[0-9.]+ region=code "; then
+    echo "[FAIL] Samples of PID $SPIN_PID not attributed to its code VMA"
+    exit 1
+fi
+if echo "0 99999" | sudo tee /proc/elf_det/profile > /dev/null 2>&1; then
+    echo "[FAIL] profile accepted an invalid command"
+    exit 1
+fi
+echo "$SYM_OUT" | grep " sym=" | head -5
+if ! echo "$SYM_OUT" | grep -qE "^samples=[1-9][0-9]* .* sym="; then
+    echo "[FAIL] proc_elf_ctrl --symbolize profile did not annotate addresses"
+    exit 1
+fi
+echo "[PASS] On-CPU profile attributes samples to VMAs"
+
+echo ""
+echo "=== Checking futex contention (/proc/elf_det/futex) ==="
+# Four workers spin holding one mutex, so three of them queue on it
+./build/test_multithread --busy 50 --shared-lock 1 --duration 4 --port 12360 > /dev/null &
+LOCK_PID=$!
+sleep 0.5
+echo "$LOCK_PID" | sudo tee /proc/elf_det/futex > /dev/null
+sleep 1
+FUTEX_THREADS=$(sudo sh -c "exec 3<>/proc/elf_det/threads; echo $LOCK_PID >&3; cat <&3")
+echo stop | sudo tee /proc/elf_det/futex > /dev/null
+FUTEX_OUT=$(sudo cat /proc/elf_det/futex)
+kill "$LOCK_PID"
+wait "$LOCK_PID" 2>/dev/null
+echo "$FUTEX_OUT" | head -8
+if ! echo "$FUTEX_OUT" | grep -qE "^# pid=$LOCK_PID running=0 .* waits=[1-9][0-9]* "; then
+    echo "[FAIL] No futex waits recorded for PID $LOCK_PID"
+    exit 1
+fi
+if ! echo "$FUTEX_OUT" | sed -n '/^\[addr\]/,$p' | grep -qE "^uaddr=0x[0-9a-f]+ .* threads=[2-9]"; then
+    echo "[FAIL] No futex address shared by several threads of PID $LOCK_PID"
+    exit 1
+fi
+if ! echo "$FUTEX_THREADS" | grep -q "FUTEX_WAITS  FUTEX_WAIT_MS  FUTEX_TOP_ADDR"; then
+    echo "[FAIL] threads view lacks futex columns while profiling"
+    exit 1
+fi
+echo "[PASS] Futex waits are attributed to threads and lock addresses"
+
+echo ""
+echo "=== Checking the syscall profile (/proc/elf_det/syscalls) ==="
+# One-byte copies: a read() and a write() per byte
+dd if=/dev/zero of=/dev/null bs=1 2>/dev/null &
+DD_PID=$!
+echo "$DD_PID" | sudo tee /proc/elf_det/syscalls > /dev/null
+sleep 1
+echo stop | sudo tee /proc/elf_det/syscalls > /dev/null
+kill "$DD_PID"
+wait "$DD_PID" 2>/dev/null
+SYSCALLS_OUT=$(sudo cat /proc/elf_det/syscalls)
+echo "$SYSCALLS_OUT" | head -5
+if ! echo "$SYSCALLS_OUT" | grep -qE "^# pid=$DD_PID running=0 .* calls=[1-9][0-9]* "; then
+    echo "[FAIL] No syscalls recorded for PID $DD_PID"
+    exit 1
+fi
+if ! echo "$SYSCALLS_OUT" | sed -n '/^\[syscall\]/,/^\[thread\]/p' | grep -qE "^nr=[0-9]+ threads=1 calls=[0-9]{4,} .* hist_ns=[0-9]+:[0-9]+"; then
+    echo "[FAIL] No per-syscall histogram for the copy loop of PID $DD_PID"
+    exit 1
+fi
+if ! echo "$SYSCALLS_OUT" | grep -qE "^tid=$DD_PID comm=dd nr="; then
+    echo "[FAIL] No per-thread syscall entries for PID $DD_PID"
+    exit 1
+fi
+echo "[PASS] Syscalls are counted per thread with latency histograms"
+
+echo ""
+echo "=== Checking the wakeup graph (/proc/elf_det/wakeups) ==="
+# Each exiting sleep wakes the shell from wait4()
+sh -c 'while :; do sleep 0.01; done' &
+WAKE_PID=$!
+echo "$WAKE_PID" | sudo tee /proc/elf_det/wakeups > /dev/null
+sleep 1
+echo stop | sudo tee /proc/elf_det/wakeups > /dev/null
+kill "$WAKE_PID"
+wait "$WAKE_PID" 2>/dev/null
+WAKEUPS_OUT=$(sudo cat /proc/elf_det/wakeups)
+echo "$WAKEUPS_OUT" | head -5
+if ! echo "$WAKEUPS_OUT" | grep -qE "^# pid=$WAKE_PID running=0 .* wakeups=[1-9][0-9]* "; then
+    echo "[FAIL] No wakeups recorded for PID $WAKE_PID"
+    exit 1
+fi
+if ! echo "$WAKEUPS_OUT" | grep -qE "^waker=[0-9]+ waker_pid=[0-9]+ waker_comm=sleep wakee=$WAKE_PID wakee_comm=sh wakeups=[1-9][0-9]* .* delay_avg_ns=[0-9]+ "; then
+    echo "[FAIL] No sleep -> sh wakeup edge for PID $WAKE_PID"
+    exit 1
+fi
+echo "[PASS] Wakeups are recorded as waker -> wakee edges"
+
+echo ""
+echo "=== Checking page-fault attribution (/proc/elf_det/faults) ==="
+# Recording starts before exec; the new image then touches every page of
+# four 2 MiB shared file mappings
+sh -c 'sleep 0.5; exec ./build/test_multithread --file-maps 4 --map-kb 2048 --duration 2 --port 12370' > /dev/null &
+FAULT_PID=$!
+if echo "$FAULT_PID" | sudo tee /proc/elf_det/faults > /dev/null 2>&1; then
+    sleep 1.5
+    echo stop | sudo tee /proc/elf_det/faults > /dev/null
+    FAULTS_OUT=$(sudo cat /proc/elf_det/faults)
+    echo "$FAULTS_OUT" | head -12
+    if ! echo "$FAULTS_OUT" | grep -qE "^# pid=$FAULT_PID period=1 running=0 .* recorded=[1-9][0-9]* .* minor=[1-9][0-9]* "; then
+        echo "[FAIL] No classified page faults for PID $FAULT_PID"
+        exit 1
+    fi
+    if ! echo "$FAULTS_OUT" | sed -n '/^\[file\]/,$p' | grep -qE "^name=test_multithread_[^ ]* offset=0x100000 "; then
+        echo "[FAIL] Faults in the mapped file not split by offset for PID $FAULT_PID"
+        exit 1
+    fi
+    echo "[PASS] Page faults are attributed to regions and file offsets"
+else
+    echo "[SKIP] No page_fault_user tracepoint on $(uname -m)"
+fi
+kill "$FAULT_PID" 2>/dev/null
+wait "$FAULT_PID" 2>/dev/null
+
+echo ""
+echo "=== Checking tracepoints (elf_det:*) ==="
+TRACEFS=/sys/kernel/tracing
+sudo test -d "$TRACEFS/events" || TRACEFS=/sys/kernel/debug/tracing
+if sudo test -d "$TRACEFS/events/elf_det"; then
+    echo 1 | sudo tee "$TRACEFS/events/elf_det/enable" > /dev/null
+    echo | sudo tee "$TRACEFS/trace" > /dev/null
+    sudo cat /proc/elf_det/det > /dev/null
+    TRACE_OUT=$(sudo cat "$TRACEFS/trace")
+    echo 0 | sudo tee "$TRACEFS/events/elf_det/enable" > /dev/null
+    echo "$TRACE_OUT" | grep elfdet_ | head -10
+    if ! echo "$TRACE_OUT" | grep -q "elfdet_query_end: pid=.* section=det"; then
+        echo "[FAIL] elfdet_query_end was not traced"
+        exit 1
+    fi
+else
+    echo "[FAIL] elf_det trace events not registered"
+    exit 1
+fi
+
 echo ""
 echo "=== Verifying all proc files are accessible ==="
-if [ -r /proc/elf_det/det ] && [ -r /proc/elf_det/pid ] && [ -r /proc/elf_det/threads ]; then
+if [ -r /proc/elf_det/det ] && [ -r /proc/elf_det/pid ] && [ -r /proc/elf_det/threads ] && [ -r /proc/elf_det/stats ] && [ -r /proc/elf_det/watch ] && [ -r /proc/elf_det/procs ] && sudo test -r /proc/elf_det/exits && sudo test -r /proc/elf_det/offcpu && sudo test -r /proc/elf_det/profile && sudo test -r /proc/elf_det/futex && sudo test -r /proc/elf_det/syscalls && sudo test -r /proc/elf_det/wakeups && sudo test -r /proc/elf_det/faults; then
     echo "[PASS] All proc files exist and are readable"
 else
     echo "[FAIL] Some proc files are missing or not readable"
@@ -198,6 +580,11 @@ echo "Test completed successfully!"
 echo "==================================================="
 ENDSSH
 
+# Keep benchmark results per kernel for comparison across module versions
+BENCH_OUT="$PROJECT_ROOT/build/bench-$(git -C "$PROJECT_ROOT" describe --always --dirty 2>/dev/null || echo local).txt"
+scp $SCP_OPTS ${SSH_USER}@${SSH_HOST}:~/kernel_module/bench.txt "$BENCH_OUT"
+echo "Benchmark results saved to $BENCH_OUT"
+
 echo ""
 echo "==================================================="
 echo "All tests passed in QEMU VM!"
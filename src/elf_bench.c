@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+// Read-latency benchmark for the /proc/elf_det files
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proc_elf_ctrl.h"
+
+#define BENCH_MAX_AXIS	   16
+#define BENCH_WARMUP	   10
+#define BENCH_ITERS_DEF	   200
+#define BENCH_READ_CHUNK   65536
+#define BENCH_FORMAT_VER   1
+
+/* Shape of one synthetic target process */
+struct bench_shape {
+	int threads; /* including the main thread */
+	int fds; /* extra descriptors, half of them sockets */
+	int vmas; /* extra single-page mappings */
+};
+
+/* A forked target; it exits when ctl is closed */
+struct bench_target {
+	pid_t pid;
+	int ctl;
+};
+
+struct bench_result {
+	unsigned long long p50_ns, p99_ns, max_ns, mean_ns;
+	unsigned long long bytes;
+	double ops_per_sec;
+	double mb_per_sec;
+};
+
+static unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+	       (unsigned long long)ts.tv_nsec;
+}
+
+/* Threads park on the control pipe and wake when the parent closes it */
+static void *target_thread(void *arg)
+{
+	char c;
+
+	while (read((int)(long)arg, &c, 1) < 0 && errno == EINTR)
+		;
+	return NULL;
+}
+
+static void target_body(const struct bench_shape *shape, int ctl, int ready)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct rlimit rl;
+	pthread_t tid;
+	int i, sv[2];
+	char c = 0;
+
+	/* Alternate protections so neighbouring mappings never merge */
+	for (i = 0; i < shape->vmas; i++) {
+		void *p = mmap(NULL, (size_t)page,
+			       (i & 1) ? PROT_READ : PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (p == MAP_FAILED)
+			_exit(2);
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t)shape->fds + 64) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	for (i = 0; i < shape->fds; i += 2) {
+		if (i < shape->fds / 2) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+				_exit(3);
+		} else {
+			sv[0] = open("/dev/null", O_RDONLY);
+			sv[1] = open("/dev/null", O_RDONLY);
+			if (sv[0] < 0 || sv[1] < 0)
+				_exit(3);
+		}
+	}
+
+	for (i = 1; i < shape->threads; i++) {
+		if (pthread_create(&tid, NULL, target_thread, (void *)(long)ctl))
+			_exit(4);
+	}
+
+	if (write(ready, &c, 1) != 1)
+		_exit(5);
+	target_thread((void *)(long)ctl);
+	_exit(0);
+}
+
+static int start_target(const struct bench_shape *shape,
+			struct bench_target *t)
+{
+	int ctl[2], ready[2];
+	char c;
+
+	if (pipe(ctl))
+		return -1;
+	if (pipe(ready)) {
+		close(ctl[0]);
+		close(ctl[1]);
+		return -1;
+	}
+
+	t->pid = fork();
+	if (t->pid == 0) {
+		close(ctl[1]);
+		close(ready[0]);
+		target_body(shape, ctl[0], ready[1]);
+	}
+
+	close(ctl[0]);
+	close(ready[1]);
+	t->ctl = ctl[1];
+	if (t->pid < 0 || read(ready[0], &c, 1) != 1) {
+		close(ready[0]);
+		close(t->ctl);
+		if (t->pid > 0)
+			waitpid(t->pid, NULL, 0);
+		return -1;
+	}
+	close(ready[0]);
+	return 0;
+}
+
+static void stop_target(struct bench_target *t)
+{
+	close(t->ctl);
+	waitpid(t->pid, NULL, 0);
+}
+
+/* Bind fd's session to pid and read the whole file from offset 0 */
+static long read_session(int fd, const char *pid_str, char *buf)
+{
+	long total = 0;
+	ssize_t n;
+
+	if (pid_str && write(fd, pid_str, strlen(pid_str)) < 0)
+		return -1;
+	while ((n = pread(fd, buf, BENCH_READ_CHUNK, total)) > 0)
+		total += n;
+	return n < 0 ? -1 : total;
+}
+
+/* Time iters queries of file for pid. reopen selects open+write+read+close
+ * per query; otherwise one bound session is re-read from offset 0.
+ */
+static int bench_file(const char *file, pid_t pid, int iters, int reopen,
+		      struct bench_result *res)
+{
+	unsigned long long *lat, start, t0, sum = 0;
+	char pid_str[16], *path, *buf;
+	int i, fd = -1, ret = -1;
+	long n;
+
+	path = build_proc_path(file);
+	buf = malloc(BENCH_READ_CHUNK);
+	lat = calloc((size_t)iters, sizeof(*lat));
+	if (!path || !buf || !lat)
+		goto out;
+	snprintf(pid_str, sizeof(pid_str), "%d", (int)pid);
+
+	if (!reopen) {
+		fd = open(path, O_RDWR);
+		if (fd < 0 || read_session(fd, pid_str, buf) < 0)
+			goto out;
+	}
+
+	memset(res, 0, sizeof(*res));
+	start = 0;
+	for (i = -BENCH_WARMUP; i < iters; i++) {
+		if (i == 0)
+			start = bench_now_ns();
+		t0 = bench_now_ns();
+		if (reopen) {
+			fd = open(path, O_RDWR);
+			if (fd < 0)
+				goto out;
+			n = read_session(fd, pid_str, buf);
+			close(fd);
+			fd = -1;
+		} else {
+			n = read_session(fd, NULL, buf);
+		}
+		if (n < 0)
+			goto out;
+		if (i >= 0) {
+			lat[i] = bench_now_ns() - t0;
+			sum += lat[i];
+			res->bytes = (unsigned long long)n;
+		}
+	}
+	start = bench_now_ns() - start;
+
+	qsort(lat, (size_t)iters, sizeof(*lat), compare_ull);
+	res->p50_ns = sorted_percentile(lat, (size_t)iters, 50);
+	res->p99_ns = sorted_percentile(lat, (size_t)iters, 99);
+	res->max_ns = lat[iters - 1];
+	res->mean_ns = sum / (unsigned long long)iters;
+	res->ops_per_sec = start ? iters * 1e9 / (double)start : 0;
+	res->mb_per_sec = res->ops_per_sec * (double)res->bytes / 1e6;
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(lat);
+	free(buf);
+	free(path);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--threads <n,n,...>] [--fds <n,n,...>] "
+		"[--vmas <n,n,...>]\n"
+		"          [--iters <n>] [--files det,threads] [--quick]\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	int threads[BENCH_MAX_AXIS] = { 1, 64, 512 }, nr_threads = 3;
+	int fds[BENCH_MAX_AXIS] = { 16, 1024 }, nr_fds = 2;
+	int vmas[BENCH_MAX_AXIS] = { 16, 4096 }, nr_vmas = 2;
+	const char *files[] = { "det", "threads" };
+	const char *only = NULL;
+	int iters = BENCH_ITERS_DEF;
+	int a, b, c, f, mode, i, failed = 0;
+	struct bench_target target;
+	struct bench_shape shape;
+	struct bench_result res;
+	struct utsname uts;
+
+	for (i = 1; i < argc; i++) {
+		const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+		int *axis = NULL, *nr = NULL;
+
+		if (!strcmp(argv[i], "--quick")) {
+			threads[0] = 1;
+			threads[1] = 32;
+			nr_threads = 2;
+			fds[0] = 16;
+			nr_fds = 1;
+			vmas[0] = 16;
+			vmas[1] = 1024;
+			nr_vmas = 2;
+			iters = 50;
+			continue;
+		}
+		if (!val) {
+			usage(argv[0]);
+			return 1;
+		}
+		i++;
+
+		if (!strcmp(argv[i - 1], "--threads")) {
+			axis = threads;
+			nr = &nr_threads;
+		} else if (!strcmp(argv[i - 1], "--fds")) {
+			axis = fds;
+			nr = &nr_fds;
+		} else if (!strcmp(argv[i - 1], "--vmas")) {
+			axis = vmas;
+			nr = &nr_vmas;
+		} else if (!strcmp(argv[i - 1], "--iters")) {
+			iters = atoi(val);
+		} else if (!strcmp(argv[i - 1], "--files")) {
+			only = val;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+
+		if (axis) {
+			*nr = parse_int_list(val, axis, BENCH_MAX_AXIS, 0);
+			if (*nr <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+		}
+	}
+	if (iters < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* One header line, then one key=value record per measurement */
+	uname(&uts);
+	printf("# elf_bench format=%d kernel=%s iters=%d warmup=%d\n",
+	       BENCH_FORMAT_VER, uts.release, iters, BENCH_WARMUP);
+
+	for (a = 0; a < nr_threads; a++) {
+		for (b = 0; b < nr_fds; b++) {
+			for (c = 0; c < nr_vmas; c++) {
+				shape.threads = threads[a] > 0 ? threads[a] : 1;
+				shape.fds = fds[b];
+				shape.vmas = vmas[c];
+				if (start_target(&shape, &target)) {
+					fprintf(stderr,
+						"cannot start target threads=%d "
+						"fds=%d vmas=%d\n",
+						shape.threads, shape.fds,
+						shape.vmas);
+					failed = 1;
+					continue;
+				}
+
+				for (f = 0; f < 2; f++) {
+					if (only && !strstr(only, files[f]))
+						continue;
+					for (mode = 0; mode < 2; mode++) {
+						if (bench_file(files[f], target.pid,
+							       iters, !mode, &res)) {
+							perror(files[f]);
+							failed = 1;
+							continue;
+						}
+						printf("file=%s mode=%s threads=%d "
+						       "fds=%d vmas=%d bytes=%llu "
+						       "p50_ns=%llu p99_ns=%llu "
+						       "max_ns=%llu mean_ns=%llu "
+						       "ops_per_sec=%.1f "
+						       "mb_per_sec=%.2f\n",
+						       files[f],
+						       mode ? "reread" : "open",
+						       shape.threads, shape.fds,
+						       shape.vmas, res.bytes,
+						       res.p50_ns, res.p99_ns,
+						       res.max_ns, res.mean_ns,
+						       res.ops_per_sec,
+						       res.mb_per_sec);
+						fflush(stdout);
+					}
+				}
+				stop_target(&target);
+			}
+		}
+	}
+	return failed;
+}
@@ -12,9 +12,34 @@
 #include <linux/mm.h> //for mm_struct and VMA access
 #include <linux/uaccess.h> //for user to kernel and vice versa access
 #include <linux/string.h> //for string libs
+#include <linux/slab.h> //for kzalloc and kfree
+#include <linux/percpu.h> //for per-CPU cost counters
+#include <linux/ktime.h> //for ktime_get_ns
+#include <linux/delay.h> //for usleep_range
+#include <linux/hash.h> //for hash_32
+#include <linux/mutex.h> //for result cache single-flight
+#include <linux/hashtable.h> //for the watch registry
+#include <linux/llist.h> //for watches freed from the exit probe
+#include <linux/workqueue.h> //for freeing watches outside the exit probe
+#include <linux/tracepoint.h> //for probes on scheduler tracepoints
+#include <linux/binfmts.h> //for linux_binprm in the exec probe
+#include <linux/vmalloc.h> //for the process index change log
+#include <linux/task_io_accounting_ops.h> //for task_io_accounting_add
+#include <linux/sort.h> //for sorting per-thread samples
+#include <linux/stacktrace.h> //for stack_trace_save in the off-CPU probe
+#include <linux/jhash.h> //for hashing off-CPU stacks
+#include <linux/kallsyms.h> //for KSYM_SYMBOL_LEN
+#include <linux/hrtimer.h> //for the on-CPU sampler
+#include <linux/cpu.h> //for cpus_read_lock
+#include <linux/version.h> //for hrtimer_setup
+#include <linux/compat.h> //for in_compat_syscall
 #include <linux/sched/signal.h> //for task iteration
+#include <linux/sched/mm.h> //for get_task_mm and mmput
+#include <linux/sched/task.h> //for put_task_struct
 #include <linux/sched/cputime.h> //for task_cputime
 #include <linux/fdtable.h> //for file descriptor table
+#include <linux/pipe_fs_i.h> //for pipe buffer occupancy
+#include <linux/magic.h> //for PIPEFS_MAGIC and ANON_INODE_FS_MAGIC
 #include <linux/net.h> //for socket operations
 #include <linux/netdevice.h> //for net_device
 #include <net/sock.h> //for sock structure
@@ -22,26 +47,244 @@
 #include <linux/in.h> //for sockaddr_in
 #include <linux/in6.h> //for sockaddr_in6
 #include <net/inet_sock.h> //for inet_sock
+#include <asm/syscall.h> //for syscall_get_arguments in the futex probe
 #include "elf_det.h"
 
+#define CREATE_TRACE_POINTS
+#include "elf_det_trace.h"
+
 MODULE_LICENSE("Dual BSD/GPL"); // module license
 
+/* Reads of the same PID within this many ms share one computation */
+static unsigned int cache_ttl_ms;
+module_param(cache_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(cache_ttl_ms,
+		 "Serve det/threads from a per-PID result cache for this many ms (0 = off)");
+
 static char buff[20] =
 	"1"; // the common(global) buffer between kernel and user space
-static int user_pid; // the desired pid that we get from user
-static int number_opens; // number of opens(writes) to the pid file
 
 // skip these instances (will be described bellow)
 static struct proc_dir_entry *elfdet_dir, *elfdet_det_entry, *elfdet_pid_entry,
-	*elfdet_threads_entry;
+	*elfdet_threads_entry, *elfdet_stats_entry, *elfdet_watch_entry,
+	*elfdet_procs_entry, *elfdet_exits_entry, *elfdet_offcpu_entry,
+	*elfdet_profile_entry, *elfdet_futex_entry, *elfdet_syscalls_entry,
+	*elfdet_wakeups_entry, *elfdet_faults_entry;
+
+/* Cost of one query section, kept per CPU and summed by the stats file */
+struct elfdet_section_stats {
+	u64 calls;
+	u64 total_ns;
+	u64 max_ns;
+	u64 bytes; /* seq_file output produced by the section */
+	u64 hist[ELFDET_HIST_BUCKETS];
+};
+
+struct elfdet_cpu_stats {
+	struct elfdet_section_stats sec[ELFDET_NR_SECTIONS];
+	u64 pid_opens;
+	u64 pid_reads;
+	u64 pid_writes;
+	u64 vma_lockless; /* VMA lookups without mmap_lock */
+	u64 mmap_lock_holds;
+	u64 mmap_lock_hold_ns;
+	u64 mmap_lock_busy; /* failed trylock attempts */
+	u64 vma_stale; /* queries answered from cached VMA values */
+	u64 exited; /* queries that found the task but not its mm */
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 cache_waits; /* readers that waited for an in-flight computation */
+};
+
+static DEFINE_PER_CPU(struct elfdet_cpu_stats, elfdet_stats);
+
+/* Where a timed section started: clock and amount of output so far */
+struct elfdet_mark {
+	u64 start_ns;
+	size_t start_count;
+	int pid;
+};
+
+static void
+elfdet_section_begin(struct seq_file *m, struct elfdet_mark *mark, int pid)
+{
+	mark->start_ns = ktime_get_ns();
+	mark->start_count = m->count;
+	mark->pid = pid;
+}
+
+static void elfdet_section_end(struct seq_file *m,
+			       int sec,
+			       const struct elfdet_mark *mark)
+{
+	u64 ns = ktime_get_ns() - mark->start_ns;
+	struct elfdet_section_stats *stats;
+	size_t bytes = 0;
+
+	/* An overflowing seq_file is retried with a bigger buffer */
+	if (m->count > mark->start_count)
+		bytes = m->count - mark->start_count;
+
+	stats = &get_cpu_ptr(&elfdet_stats)->sec[sec];
+	stats->calls++;
+	stats->total_ns += ns;
+	stats->bytes += bytes;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	stats->hist[elfdet_log2_bucket(ns)]++;
+	put_cpu_ptr(&elfdet_stats);
+
+	if (sec == ELFDET_SEC_DET || sec == ELFDET_SEC_THREADS)
+		trace_elfdet_query_end(mark->pid, sec, ns, bytes);
+	else
+		trace_elfdet_section(mark->pid, sec, ns, bytes);
+}
+
+/* Per-PID result cache: one rendered det or threads output per slot.
+ * The slot mutex makes identical concurrent queries single-flight: the
+ * first reader renders, the others sleep on the mutex and then copy.
+ * PIDs hashing to the same slot evict each other. Entries are keyed by
+ * struct pid, so readers in different pid namespaces asking for the same
+ * number do not share them.
+ */
+#define ELFDET_CACHE_BITS 6
+#define ELFDET_CACHE_KINDS 2 /* ELFDET_SEC_DET, ELFDET_SEC_THREADS */
+
+struct elfdet_cache_entry {
+	struct mutex lock;
+	struct pid *pid; /* referenced */
+	u64 generation;
+	u64 stamp_ns;
+	char *buf; /* kvmalloc'ed copy of the rendered output */
+	size_t len;
+};
+
+static struct elfdet_cache_entry elfdet_cache[ELFDET_CACHE_KINDS]
+					     [1 << ELFDET_CACHE_BITS];
+
+/* Entries rendered under an older generation are stale regardless of age */
+static atomic64_t elfdet_cache_gen = ATOMIC64_INIT(1);
+
+static void elfdet_cache_init(void)
+{
+	int k, i;
+
+	for (k = 0; k < ELFDET_CACHE_KINDS; k++)
+		for (i = 0; i < (1 << ELFDET_CACHE_BITS); i++)
+			mutex_init(&elfdet_cache[k][i].lock);
+}
+
+static void elfdet_cache_free(void)
+{
+	int k, i;
+
+	for (k = 0; k < ELFDET_CACHE_KINDS; k++) {
+		for (i = 0; i < (1 << ELFDET_CACHE_BITS); i++) {
+			kvfree(elfdet_cache[k][i].buf);
+			elfdet_cache[k][i].buf = NULL;
+			put_pid(elfdet_cache[k][i].pid);
+			elfdet_cache[k][i].pid = NULL;
+		}
+	}
+}
+
+static bool elfdet_watched(struct pid *spid);
+
+/* Produce the kind (det or threads) report of pid into m, from the cache
+ * when a copy younger than cache_ttl_ms exists, otherwise by calling report
+ * and keeping a copy of what it wrote. Watched processes are always
+ * rendered: their reports carry deltas against the previous read.
+ */
+static void elfdet_cached_report(struct seq_file *m,
+				 int kind,
+				 int pid,
+				 void (*report)(struct seq_file *, int))
+{
+	unsigned int ttl_ms = READ_ONCE(cache_ttl_ms);
+	struct elfdet_cache_entry *e;
+	size_t start = m->count;
+	struct pid *spid;
+	u64 gen, now;
+	char *copy;
+
+	spid = ttl_ms && pid > 0 ? find_get_pid(pid) : NULL;
+	if (!spid || elfdet_watched(spid)) {
+		put_pid(spid);
+		report(m, pid);
+		return;
+	}
+
+	e = &elfdet_cache[kind][hash_ptr(spid, ELFDET_CACHE_BITS)];
+	if (!mutex_trylock(&e->lock)) {
+		this_cpu_inc(elfdet_stats.cache_waits);
+		if (mutex_lock_killable(&e->lock)) {
+			put_pid(spid);
+			return;
+		}
+	}
+
+	gen = atomic64_read(&elfdet_cache_gen);
+	now = ktime_get_ns();
+	if (e->buf && e->pid == spid && e->generation == gen &&
+	    now - e->stamp_ns < (u64)ttl_ms * NSEC_PER_MSEC) {
+		seq_write(m, e->buf, e->len);
+		mutex_unlock(&e->lock);
+		put_pid(spid);
+		this_cpu_inc(elfdet_stats.cache_hits);
+		return;
+	}
+
+	this_cpu_inc(elfdet_stats.cache_misses);
+	report(m, pid);
+
+	/* An overflowed render is retried by seq_file; cache that one */
+	if (!seq_has_overflowed(m) && m->count > start) {
+		copy = kvmalloc(m->count - start, GFP_KERNEL);
+		if (copy) {
+			memcpy(copy, m->buf + start, m->count - start);
+			kvfree(e->buf);
+			e->buf = copy;
+			e->len = m->count - start;
+			swap(e->pid, spid);
+			e->generation = gen;
+			e->stamp_ns = now;
+		}
+	}
+	mutex_unlock(&e->lock);
+	put_pid(spid);
+}
+
+/* Per-open-file PID selection for det/threads readers.
+ * Writing a PID into an open det/threads descriptor binds that descriptor
+ * to the PID, so concurrent readers do not race on the global pid file.
+ */
+struct elfdet_session {
+	int pid; /* 0 means follow the global pid file */
+
+	/* VMA-derived fields of the last det query, reused when the target's
+	 * mmap_lock is busy
+	 */
+	int vma_pid;
+	unsigned long vma_elf_base;
+	unsigned long vma_stack_end;
+};
+
+/* mmap_read_trylock() attempts before falling back to cached values */
+#define ELFDET_MMAP_TRYLOCK_TRIES 4
 
 static int procfile_open(struct inode *inode, struct file *file);
 static ssize_t procfile_read(struct file *, char __user *, size_t, loff_t *);
+
+struct elfdet_futex;
+static struct elfdet_futex *elfdet_futex_get(struct task_struct *task);
+static void elfdet_futex_put(struct elfdet_futex *fx);
+static void elfdet_futex_print_thread(struct seq_file *m,
+				      struct elfdet_futex *fx, pid_t tid);
 static ssize_t
 procfile_write(struct file *, const char __user *, size_t, loff_t *);
 
 static void print_memory_layout(struct seq_file *m,
-				struct task_struct *task,
+				struct mm_struct *mm,
 				unsigned long bss_start,
 				unsigned long bss_end,
 				unsigned long heap_start,
@@ -55,9 +298,9 @@ static void print_memory_layout(struct seq_file *m,
 		 "----------------------------------------------------------");
 	seq_puts(m, "----------------------\n");
 	seq_printf(m, "  Code Section:    0x%016lx - 0x%016lx\n",
-		   task->mm->start_code, task->mm->end_code);
+		   mm->start_code, mm->end_code);
 	seq_printf(m, "  Data Section:    0x%016lx - 0x%016lx\n",
-		   task->mm->start_data, task->mm->end_data);
+		   mm->start_data, mm->end_data);
 	seq_printf(m, "  BSS Section:     0x%016lx - 0x%016lx\n", bss_start,
 		   bss_end);
 	seq_printf(m, "  Heap:            0x%016lx - 0x%016lx\n", heap_start,
@@ -68,7 +311,7 @@ static void print_memory_layout(struct seq_file *m,
 }
 
 static void print_memory_layout_visualization(struct seq_file *m,
-					      struct task_struct *task,
+					      struct mm_struct *mm,
 					      unsigned long bss_start,
 					      unsigned long bss_end,
 					      unsigned long heap_start,
@@ -78,7 +321,7 @@ static void print_memory_layout_visualization(struct seq_file *m,
 {
 	struct memory_region regions[5];
 	unsigned long total_size;
-	unsigned long lowest_addr = task->mm->start_code;
+	unsigned long lowest_addr = mm->start_code;
 	unsigned long highest_addr = stack_start;
 	const int BAR_WIDTH = 50;
 	int widths[5];
@@ -87,11 +330,11 @@ static void print_memory_layout_visualization(struct seq_file *m,
 
 	/* Setup regions */
 	regions[0].name = "CODE";
-	regions[0].size = task->mm->end_code - task->mm->start_code;
+	regions[0].size = mm->end_code - mm->start_code;
 	regions[0].exists = (regions[0].size > 0);
 
 	regions[1].name = "DATA";
-	regions[1].size = task->mm->end_data - task->mm->start_data;
+	regions[1].size = mm->end_data - mm->start_data;
 	regions[1].exists = (regions[1].size > 0);
 
 	regions[2].name = "BSS";
@@ -144,22 +387,31 @@ static void print_memory_layout_visualization(struct seq_file *m,
 	seq_puts(m, "----------------------\n");
 }
 
+/* One row of the threads table. rates adds per-second storage I/O and
+ * fault columns and the CPU usage over the interval, computed against
+ * prev, this thread's sample from the previous read of a watched process
+ * ("-" when there is none).
+ */
 static void print_thread_info_line(struct seq_file *m,
-				   struct task_struct *thread)
+				   struct task_struct *thread,
+				   const struct elfdet_thread_sample *cur,
+				   const struct elfdet_thread_sample *prev,
+				   u64 interval_ns,
+				   bool rates,
+				   struct elfdet_futex *fx)
 {
 	char state_char;
 	char cpu_affinity[32];
 	int cpu_mask[8] = {0};
 	int i;
-	u64 total_ns, delta_ns, usage_permyriad;
+	u64 delta_ns, usage_permyriad;
 
 	/* Get thread state using kernel helper */
 	state_char = task_state_to_char(thread);
 
 	/* CPU usage for this thread */
-	total_ns = (u64)thread->utime + (u64)thread->stime;
 	delta_ns = ktime_get_ns() - thread->start_time;
-	usage_permyriad = compute_usage_permyriad(total_ns, delta_ns);
+	usage_permyriad = compute_usage_permyriad(cur->cpu_ns, delta_ns);
 
 	/* Build CPU affinity mask array (show first 8 CPUs) */
 	for (i = 0; i < 8 && i < nr_cpu_ids; i++)
@@ -168,47 +420,148 @@ static void print_thread_info_line(struct seq_file *m,
 				  sizeof(cpu_affinity));
 
 	seq_printf(m,
-		   "%-5d  %-15.15s  %4llu.%02llu   %c      %4d      %4d  %s\n",
+		   "%-5d  %-15.15s  %4llu.%02llu   %c      %4d      %4d  %-16s",
 		   thread->pid, thread->comm, (usage_permyriad / 100),
 		   (usage_permyriad % 100), state_char,
 		   thread->prio - 120, /* Convert to nice value */
 		   task_nice(thread), cpu_affinity);
+	seq_printf(m, "  %12llu  %12llu  %12llu  %12llu", cur->io.rchar,
+		   cur->io.wchar, cur->io.read_bytes, cur->io.write_bytes);
+	seq_printf(m, "  %10lu  %10lu", cur->maj_flt, cur->min_flt);
+	if (rates && prev) {
+		seq_printf(m, "  %10llu  %10llu",
+			   elfdet_rate_per_sec(
+				   elfdet_counter_delta(prev->io.read_bytes,
+							cur->io.read_bytes),
+				   interval_ns),
+			   elfdet_rate_per_sec(
+				   elfdet_counter_delta(prev->io.write_bytes,
+							cur->io.write_bytes),
+				   interval_ns));
+		usage_permyriad = compute_usage_permyriad(
+			elfdet_counter_delta(prev->cpu_ns, cur->cpu_ns),
+			interval_ns);
+		seq_printf(m, "  %6llu.%02llu  %9llu  %9llu",
+			   usage_permyriad / 100, usage_permyriad % 100,
+			   elfdet_rate_per_sec(
+				   elfdet_counter_delta(prev->maj_flt,
+							cur->maj_flt),
+				   interval_ns),
+			   elfdet_rate_per_sec(
+				   elfdet_counter_delta(prev->min_flt,
+							cur->min_flt),
+				   interval_ns));
+	} else if (rates) {
+		seq_printf(m, "  %10s  %10s  %9s  %9s  %9s", "-", "-", "-", "-",
+			   "-");
+	}
+	if (fx)
+		elfdet_futex_print_thread(m, fx, thread->pid);
+	seq_puts(m, "\n");
 }
 
 // det proc file_operations starts
 
-/* Find the lower boundary of the stack VMA
- * Iterates through VMAs to find the one containing start_stack
- * Returns the vm_start (lower bound) of the stack VMA, or 0 if not found
+/* Look up the first VMA (ELF base) and the stack VMA's lower boundary.
+ * Two maple-tree lookups instead of a walk over every VMA; the caller
+ * holds either mmap_lock or, with per-VMA locking, just the RCU read lock.
  */
-static unsigned long find_stack_vma_end(struct mm_struct *mm,
-					unsigned long start_stack)
+static void elfdet_lookup_vmas(struct mm_struct *mm,
+			       unsigned long start_stack,
+			       unsigned long *elf_base,
+			       unsigned long *stack_end)
 {
+	MA_STATE(mas, &mm->mm_mt, 0, 0);
 	struct vm_area_struct *vma;
-	struct ma_state mas;
-	unsigned long stack_end = 0;
-
-	mas_init(&mas, &mm->mm_mt, 0);
-	mas_for_each(&mas, vma, ULONG_MAX)
-	{
-		/* Use helper to check if start_stack is within this VMA */
-		if (is_address_in_range(start_stack, vma->vm_start,
-					vma->vm_end)) {
-			/* Found the stack VMA */
-			stack_end = vma->vm_start; /* Stack grows down */
-			break;
+
+	vma = mas_find(&mas, ULONG_MAX);
+	*elf_base = vma ? vma->vm_start : 0;
+
+	/* Stack grows down: its VMA's vm_start is the current lower end */
+	mas_set(&mas, start_stack);
+	vma = mas_walk(&mas);
+	if (vma && is_address_in_range(start_stack, vma->vm_start, vma->vm_end))
+		*stack_end = vma->vm_start;
+	else
+		*stack_end = 0;
+}
+
+/* Read the VMA-derived fields without ever blocking on mmap_lock.
+ * With CONFIG_PER_VMA_LOCK, VMAs are freed after an RCU grace period and
+ * the maple tree can be walked under rcu_read_lock() alone. Otherwise the
+ * lock is only tried a bounded number of times; when the target keeps it
+ * busy (mmap/munmap churn) the previous query's values are reported as
+ * stale rather than waiting in line with the target's own writers.
+ */
+static int elfdet_read_vmas(struct elfdet_session *session,
+			    int pid,
+			    struct mm_struct *mm,
+			    unsigned long start_stack,
+			    unsigned long *elf_base,
+			    unsigned long *stack_end,
+			    u64 *hold_ns)
+{
+	int mode = ELFDET_VMA_NONE;
+#ifndef CONFIG_PER_VMA_LOCK
+	u64 t0;
+	int i;
+#endif
+
+	*hold_ns = 0;
+#ifdef CONFIG_PER_VMA_LOCK
+	rcu_read_lock();
+	elfdet_lookup_vmas(mm, start_stack, elf_base, stack_end);
+	rcu_read_unlock();
+	this_cpu_inc(elfdet_stats.vma_lockless);
+	mode = ELFDET_VMA_RCU;
+#else
+	for (i = 0; i < ELFDET_MMAP_TRYLOCK_TRIES; i++) {
+		if (i)
+			usleep_range(50, 100);
+		if (!mmap_read_trylock(mm)) {
+			this_cpu_inc(elfdet_stats.mmap_lock_busy);
+			continue;
+		}
+
+		t0 = ktime_get_ns();
+		elfdet_lookup_vmas(mm, start_stack, elf_base, stack_end);
+		mmap_read_unlock(mm);
+		*hold_ns = ktime_get_ns() - t0;
+
+		this_cpu_inc(elfdet_stats.mmap_lock_holds);
+		this_cpu_add(elfdet_stats.mmap_lock_hold_ns, *hold_ns);
+		mode = ELFDET_VMA_LOCKED;
+		break;
+	}
+#endif
+
+	if (mode != ELFDET_VMA_NONE) {
+		if (session) {
+			session->vma_pid = pid;
+			session->vma_elf_base = *elf_base;
+			session->vma_stack_end = *stack_end;
 		}
+		return mode;
 	}
 
-	return stack_end;
+	this_cpu_inc(elfdet_stats.vma_stale);
+	if (session && session->vma_pid == pid) {
+		*elf_base = session->vma_elf_base;
+		*stack_end = session->vma_stack_end;
+		return ELFDET_VMA_STALE;
+	}
+	*elf_base = 0;
+	*stack_end = 0;
+	return ELFDET_VMA_NONE;
 }
 
 /* Calculate and display memory pressure statistics
  * Includes RSS, PSS, swap usage, page faults, and OOM score
  */
-static void print_memory_pressure(struct seq_file *m, struct task_struct *task)
+static void print_memory_pressure(struct seq_file *m,
+				  struct task_struct *task,
+				  struct mm_struct *mm)
 {
-	struct mm_struct *mm = task->mm;
 	unsigned long rss_pages, swap_pages, file_pages, anon_pages;
 	unsigned long shmem_pages;
 	unsigned long rss_kb, swap_kb;
@@ -308,9 +661,15 @@ static void print_network_stats(struct seq_file *m, struct task_struct *task)
 	const char *dev_name;
 	int i;
 
+	/* task_lock keeps task->files from being swapped out by exit_files()
+	 * or unshare while the table is walked
+	 */
+	task_lock(task);
 	files = task->files;
-	if (!files)
+	if (!files) {
+		task_unlock(task);
 		return;
+	}
 
 	seq_puts(m, "\n[network]\n");
 
@@ -361,6 +720,7 @@ static void print_network_stats(struct seq_file *m, struct task_struct *task)
 	}
 
 	rcu_read_unlock();
+	task_unlock(task);
 
 	seq_printf(m, "sockets_total: %d (tcp: %d, udp: %d, unix: %d)\n",
 		   socket_total, tcp_count, udp_count, unix_count);
@@ -385,359 +745,4635 @@ static void print_network_stats(struct seq_file *m, struct task_struct *task)
 	seq_puts(m, "\n");
 }
 
-/* Display open socket information for the process
- * Shows socket file descriptors including family, type, state, and addresses
+/* Pipes, FIFOs and eventfds whose fill level det lists */
+#define ELFDET_FD_LEVELS_MAX 16
+
+/* Fill level of one pipe, FIFO or eventfd of the inventory */
+struct elfdet_fd_level {
+	unsigned int fd;
+	int type;
+	bool known; /* false if the pipe was busy or fdinfo unreadable */
+	unsigned int slots, max_slots; /* pipe ring buffers used / usable */
+	u64 value; /* bytes queued in a pipe, counter of an eventfd */
+};
+
+struct elfdet_fd_inventory {
+	unsigned int count[ELFDET_NR_FD_TYPES];
+	unsigned int nr_open;
+	int max_fd;
+	unsigned int nr_levels, levels_omitted;
+	struct elfdet_fd_level levels[ELFDET_FD_LEVELS_MAX];
+};
+
+static int elfdet_file_type(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+
+	if (inode->i_sb->s_magic == ANON_INODE_FS_MAGIC)
+		return elfdet_anon_fd_type(file->f_path.dentry->d_name.name);
+	if (S_ISFIFO(inode->i_mode) && inode->i_sb->s_magic == PIPEFS_MAGIC)
+		return ELFDET_FD_PIPE;
+	return elfdet_fd_type_from_mode(inode->i_mode);
+}
+
+/* Occupancy of a pipe ring. The ring can be resized under pipe->mutex, so
+ * the queued bytes are only summed when the mutex is free right now; a
+ * query must not wait for a blocked reader or writer.
  */
-static void print_sockets(struct seq_file *m, struct task_struct *task)
+static void elfdet_pipe_level(struct elfdet_fd_level *l,
+			      struct pipe_inode_info *pipe)
+{
+	unsigned int head, tail, mask, i;
+
+	if (!mutex_trylock(&pipe->mutex)) {
+		head = READ_ONCE(pipe->head);
+		tail = READ_ONCE(pipe->tail);
+		l->slots = pipe_occupancy(head, tail);
+		l->max_slots = READ_ONCE(pipe->max_usage);
+		return;
+	}
+	head = pipe->head;
+	tail = pipe->tail;
+	mask = pipe->ring_size - 1;
+	l->slots = pipe_occupancy(head, tail);
+	l->max_slots = pipe->max_usage;
+	for (i = tail; i != head; i++)
+		l->value += pipe->bufs[i & mask].len;
+	l->known = true;
+	mutex_unlock(&pipe->mutex);
+}
+
+/* The eventfd counter is private to fs/eventfd.c; its show_fdinfo() is
+ * the only interface, so let it print into m and take the output back.
+ * An overflowed buffer is left as is so that seq_file retries the query
+ * with a larger one.
+ */
+static void elfdet_eventfd_level(struct seq_file *m,
+				 struct elfdet_fd_level *l, struct file *file)
+{
+	size_t start = m->count;
+
+	if (!file->f_op->show_fdinfo)
+		return;
+	file->f_op->show_fdinfo(m, file);
+	if (seq_has_overflowed(m))
+		return;
+	l->known = !elfdet_fdinfo_hex(m->buf + start, m->count - start,
+				      "eventfd-count", &l->value);
+	m->count = start;
+}
+
+static void elfdet_fd_account(struct seq_file *m,
+			      struct elfdet_fd_inventory *inv,
+			      unsigned int fd, struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct elfdet_fd_level *l;
+	int type = elfdet_file_type(file);
+
+	inv->count[type]++;
+	inv->nr_open++;
+	inv->max_fd = fd;
+
+	/* An O_PATH descriptor does not keep a FIFO's pipe alive */
+	if ((type != ELFDET_FD_PIPE && type != ELFDET_FD_FIFO &&
+	     type != ELFDET_FD_EVENTFD) || (file->f_mode & FMODE_PATH))
+		return;
+	if (inv->nr_levels == ELFDET_FD_LEVELS_MAX) {
+		inv->levels_omitted++;
+		return;
+	}
+	l = &inv->levels[inv->nr_levels++];
+	l->fd = fd;
+	l->type = type;
+	if (type == ELFDET_FD_EVENTFD)
+		elfdet_eventfd_level(m, l, file);
+	else if (inode->i_pipe)
+		elfdet_pipe_level(l, inode->i_pipe);
+}
+
+static void print_fd_inventory(struct seq_file *m, struct task_struct *task,
+			       const struct elfdet_fd_inventory *inv)
+{
+	unsigned long limit = task_rlimit(task, RLIMIT_NOFILE);
+	const struct elfdet_fd_level *l;
+	unsigned int i;
+
+	seq_puts(m, "\nFile Descriptors:\n");
+	seq_puts(m,
+		 "----------------------------------------------------------");
+	seq_puts(m, "----------------------\n");
+	seq_printf(m, "  Open:            %u (highest fd %d)\n", inv->nr_open,
+		   inv->max_fd);
+	seq_printf(m, "  Limit:           %lu (headroom %llu)\n", limit,
+		   elfdet_fd_headroom(limit, inv->nr_open));
+	seq_puts(m, "  By Type:        ");
+	for (i = 0; i < ELFDET_NR_FD_TYPES; i++) {
+		if (inv->count[i])
+			seq_printf(m, " %s=%u", elfdet_fd_type_name(i),
+				   inv->count[i]);
+	}
+	seq_puts(m, "\n");
+
+	for (i = 0; i < inv->nr_levels; i++) {
+		l = &inv->levels[i];
+		seq_printf(m, "  [FD %u] %-8s ", l->fd,
+			   elfdet_fd_type_name(l->type));
+		if (l->type == ELFDET_FD_EVENTFD) {
+			if (l->known)
+				seq_printf(m, "count %llu\n", l->value);
+			else
+				seq_puts(m, "count unknown\n");
+		} else if (l->known) {
+			seq_printf(m, "%u/%u slots  %llu bytes\n", l->slots,
+				   l->max_slots, l->value);
+		} else {
+			seq_printf(m, "%u/%u slots  busy\n", l->slots,
+				   l->max_slots);
+		}
+	}
+	if (inv->levels_omitted)
+		seq_printf(m, "  ... %u more pipes/eventfds\n",
+			   inv->levels_omitted);
+	seq_puts(m,
+		 "----------------------------------------------------------");
+	seq_puts(m, "----------------------\n");
+}
+
+/* Reference the next open file of task at or after *fd and set *fd to its
+ * number; NULL at the end of the table. Like /proc/PID/fd this takes no
+ * file_lock, so the target's open() and close() never wait for a reader.
+ */
+static struct file *elfdet_next_file(struct task_struct *task,
+				     unsigned int *fd)
 {
 	struct files_struct *files;
+	struct file *file = NULL;
 	struct fdtable *fdt;
-	struct file *file;
-	struct socket *sock;
-	struct sock *sk;
+	unsigned int n = *fd;
+
+	/* task_lock keeps task->files from being swapped out by exit_files() */
+	task_lock(task);
+	files = task->files;
+	if (files) {
+		rcu_read_lock();
+		for (;; n++) {
+			fdt = files_fdtable(files);
+			n = find_next_bit(fdt->open_fds, fdt->max_fds, n);
+			if (n >= fdt->max_fds)
+				break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+			/* Files are SLAB_TYPESAFE_BY_RCU: rechecks the slot */
+			file = get_file_rcu(&fdt->fd[n]);
+#else
+			file = rcu_dereference(fdt->fd[n]);
+			if (file && !get_file_rcu(file))
+				file = NULL;
+#endif
+			if (file)
+				break;
+		}
+		rcu_read_unlock();
+	}
+	task_unlock(task);
+	*fd = n;
+	return file;
+}
+
+/* One line per socket, plus its addresses for inet sockets */
+static void print_socket(struct seq_file *m, unsigned int fd, struct sock *sk)
+{
 	struct inet_sock *inet;
-	unsigned int fd;
-	int socket_count = 0;
 	unsigned short family, type;
 	unsigned char state;
 	__be32 saddr, daddr;
 	__be16 sport, dport;
 	int i;
 
-	files = task->files;
-	if (!files)
-		return;
+	family = sk->sk_family;
+	type = sk->sk_type;
+	state = sk->sk_state;
 
-	seq_puts(m, "\nOpen Sockets:\n");
-	seq_puts(m,
-		 "----------------------------------------------------------");
-	seq_puts(m, "----------------------\n");
+	seq_printf(m, "  [FD %u] Family: %-10s  Type: %-8s  State: %-12s\n",
+		   fd, socket_family_to_string(family),
+		   socket_type_to_string(type), socket_state_to_string(state));
 
-	rcu_read_lock();
-	fdt = files_fdtable(files);
+	/* Display address information for inet sockets */
+	if (family == AF_INET && sk->sk_prot) {
+		inet = inet_sk(sk);
+		if (inet) {
+			unsigned int saddr_h, daddr_h;
 
-	/* Iterate through file descriptors */
-	for (fd = 0; fd < fdt->max_fds; fd++) {
-		file = rcu_dereference(fdt->fd[fd]);
-		if (!file)
-			continue;
+			saddr = inet->inet_saddr;
+			daddr = inet->inet_daddr;
+			sport = inet->inet_sport;
+			dport = inet->inet_dport;
 
-		/* Check if this file descriptor is a socket */
-		sock = sock_from_file(file);
-		if (!sock)
-			continue;
+			/* Convert to host byte order for display */
+			saddr_h = ntohl(saddr);
+			daddr_h = ntohl(daddr);
 
-		socket_count++;
-		sk = sock->sk;
-		if (!sk)
-			continue;
+			seq_printf(m, "          Local:  %u.%u.%u.%u:%u",
+				   (saddr_h >> 24) & 0xFF,
+				   (saddr_h >> 16) & 0xFF,
+				   (saddr_h >> 8) & 0xFF,
+				   saddr_h & 0xFF, ntohs(sport));
+			seq_printf(m, "  Remote: %u.%u.%u.%u:%u\n",
+				   (daddr_h >> 24) & 0xFF,
+				   (daddr_h >> 16) & 0xFF,
+				   (daddr_h >> 8) & 0xFF,
+				   daddr_h & 0xFF, ntohs(dport));
+		}
+	} else if (family == AF_INET6 && sk->sk_prot) {
+		/* IPv6 addresses */
+		struct in6_addr *saddr6 = &sk->sk_v6_rcv_saddr;
+		struct in6_addr *daddr6 = &sk->sk_v6_daddr;
 
-		family = sk->sk_family;
-		type = sk->sk_type;
-		state = sk->sk_state;
-
-		seq_printf(
-			m,
-			"  [FD %u] Family: %-10s  Type: %-8s  State: %-12s\n",
-			fd, socket_family_to_string(family),
-			socket_type_to_string(type),
-			socket_state_to_string(state));
-
-		/* Display address information for inet sockets */
-		if (family == AF_INET && sk->sk_prot) {
-			inet = inet_sk(sk);
-			if (inet) {
-				unsigned int saddr_h, daddr_h;
-
-				saddr = inet->inet_saddr;
-				daddr = inet->inet_daddr;
-				sport = inet->inet_sport;
-				dport = inet->inet_dport;
-
-				/* Convert to host byte order for display */
-				saddr_h = ntohl(saddr);
-				daddr_h = ntohl(daddr);
-
-				seq_printf(m,
-					   "          Local:  %u.%u.%u.%u:%u",
-					   (saddr_h >> 24) & 0xFF,
-					   (saddr_h >> 16) & 0xFF,
-					   (saddr_h >> 8) & 0xFF,
-					   saddr_h & 0xFF, ntohs(sport));
-				seq_printf(m, "  Remote: %u.%u.%u.%u:%u\n",
-					   (daddr_h >> 24) & 0xFF,
-					   (daddr_h >> 16) & 0xFF,
-					   (daddr_h >> 8) & 0xFF,
-					   daddr_h & 0xFF, ntohs(dport));
+		inet = inet_sk(sk);
+		if (inet) {
+			sport = inet->inet_sport;
+			dport = inet->inet_dport;
+
+			seq_puts(m, "          Local:  ");
+			for (i = 0; i < 8; i++) {
+				if (i > 0)
+					seq_puts(m, ":");
+				seq_printf(m, "%04x",
+					   ntohs(saddr6->s6_addr16[i]));
 			}
-		} else if (family == AF_INET6 && sk->sk_prot) {
-			/* IPv6 addresses */
-			struct in6_addr *saddr6 = &sk->sk_v6_rcv_saddr;
-			struct in6_addr *daddr6 = &sk->sk_v6_daddr;
-
-			inet = inet_sk(sk);
-			if (inet) {
-				sport = inet->inet_sport;
-				dport = inet->inet_dport;
-
-				seq_puts(m, "          Local:  ");
-				for (i = 0; i < 8; i++) {
-					if (i > 0)
-						seq_puts(m, ":");
-					seq_printf(m, "%04x",
-						   ntohs(saddr6->s6_addr16[i]));
-				}
-				seq_printf(m, ":%u", ntohs(sport));
-
-				seq_puts(m, "  Remote: ");
-				for (i = 0; i < 8; i++) {
-					if (i > 0)
-						seq_puts(m, ":");
-					seq_printf(m, "%04x",
-						   ntohs(daddr6->s6_addr16[i]));
-				}
-				seq_printf(m, ":%u\n", ntohs(dport));
+			seq_printf(m, ":%u", ntohs(sport));
+
+			seq_puts(m, "  Remote: ");
+			for (i = 0; i < 8; i++) {
+				if (i > 0)
+					seq_puts(m, ":");
+				seq_printf(m, "%04x",
+					   ntohs(daddr6->s6_addr16[i]));
 			}
+			seq_printf(m, ":%u\n", ntohs(dport));
 		}
 	}
+}
 
-	rcu_read_unlock();
+/* Display open socket information for the process
+ * Shows socket file descriptors including family, type, state, and addresses,
+ * then the inventory of all descriptors gathered in the same walk
+ */
+static void print_sockets(struct seq_file *m, struct task_struct *task)
+{
+	struct elfdet_fd_inventory *inv;
+	struct socket *sock;
+	struct file *file;
+	unsigned int fd;
+	int socket_count = 0;
 
-	if (socket_count == 0)
-		seq_puts(m, "  No open sockets\n");
+	inv = kzalloc(sizeof(*inv), GFP_KERNEL);
+	if (!inv)
+		return;
+	inv->max_fd = -1;
 
+	seq_puts(m, "\nOpen Sockets:\n");
 	seq_puts(m,
 		 "----------------------------------------------------------");
 	seq_puts(m, "----------------------\n");
-}
 
-// this function is the base function to gather information from kernel
-static int elfdet_show(struct seq_file *m, void *v)
-{
-	struct task_struct *task;
-	unsigned long bss_start = 0, bss_end = 0;
-	unsigned long heap_start = 0, heap_end = 0;
-	unsigned long stack_start = 0, stack_end = 0;
-	unsigned long elf_base = 0;
-	u64 delta_ns, total_ns;
-	u64 usage_permyriad; // CPU usage in hundredths of a percent (X.XX%)
-	const struct vm_area_struct *vma;
-	struct ma_state mas;
-	int ret;
+	/* Each file is referenced while it is looked at, which keeps the
+	 * pipe the inventory looks into alive too
+	 */
+	for (fd = 0; (file = elfdet_next_file(task, &fd)); fd++) {
+		elfdet_fd_account(m, inv, fd, file);
 
-	ret = kstrtoint(buff, 10, &user_pid);
-	if (ret != 0) {
-		seq_puts(m, "Failed to parse PID\n");
-		return 0;
+		/* Check if this file descriptor is a socket */
+		sock = sock_from_file(file);
+		if (sock) {
+			socket_count++;
+			if (sock->sk)
+				print_socket(m, fd, sock->sk);
+		}
+		fput(file);
 	}
 
-	task = pid_task(find_vpid(user_pid), PIDTYPE_PID);
+	if (socket_count == 0)
+		seq_puts(m, "  No open sockets\n");
 
-	if (!task || !task->mm) {
-		seq_puts(m, "Invalid PID or process has no memory context\n");
-		return 0;
-	}
+	seq_puts(m,
+		 "----------------------------------------------------------");
+	seq_puts(m, "----------------------\n");
 
-	/* CPU usage: total CPU time of task since start divided by elapsed wall
-	 * time
-	 */
-	total_ns = (u64)task->utime + (u64)task->stime;
-	delta_ns = ktime_get_ns() - task->start_time;
-	usage_permyriad = compute_usage_permyriad(total_ns, delta_ns);
+	print_fd_inventory(m, task, inv);
+	kfree(inv);
+}
+
+/* Resolve the PID a det/threads read refers to: the PID bound to this
+ * descriptor if one was written, otherwise the global pid file.
+ */
+static int elfdet_query_pid(struct seq_file *m, int *pid)
+{
+	struct elfdet_session *session = m->private;
+	int session_pid = session ? READ_ONCE(session->pid) : 0;
 
-	// Access VMA using VMA iterator for kernel 6.8+
-	if (mmap_read_lock_killable(task->mm)) {
-		seq_puts(m, "Failed to lock mm\n");
+	if (session_pid > 0) {
+		*pid = session_pid;
 		return 0;
 	}
 
-	/* Use mm fields directly for ELF, BSS, heap, and stack
-	 * Note: Modern ELF binaries may have end_data == start_brk (no BSS)
-	 * rodata is typically merged with code section (start_code to end_code)
-	 * Heap shown is brk-based; mmap-allocated heap is not tracked here
-	 */
-
-	/* ELF base: First VMA is typically the ELF binary base (for PIE) */
-	mas_init(&mas, &task->mm->mm_mt, 0);
-	vma = mas_find(&mas, ULONG_MAX);
-	if (vma)
-		elf_base = vma->vm_start;
-
-	/* Stack: Find the [stack] VMA for actual stack boundaries */
-	stack_start = task->mm->start_stack;
-	stack_end = find_stack_vma_end(task->mm, stack_start);
-
-	/* BSS: uninitialized data between end_data and start_brk
-	 * May be zero-length in modern binaries
-	 */
-	compute_bss_range(task->mm->end_data, task->mm->start_brk, &bss_start,
-			  &bss_end);
+	return kstrtoint(buff, 10, pid);
+}
 
-	/* Heap: brk-based heap from start_brk to current brk
-	 * Note: Does not include mmap-based allocations (arena heap)
-	 */
-	compute_heap_range(task->mm->start_brk, task->mm->brk, &heap_start,
-			   &heap_end);
+/* Pin the task of pid in the reader's pid namespace, or NULL if there is
+ * none. The reference keeps task_struct and signal_struct valid for the
+ * whole query even if the process exits and is reaped meanwhile.
+ */
+static struct task_struct *elfdet_get_task(int pid)
+{
+	struct pid *p = find_get_pid(pid);
+	struct task_struct *task = get_pid_task(p, PIDTYPE_PID);
 
-	mmap_read_unlock(task->mm);
+	put_pid(p);
+	return task;
+}
 
-	// now print the information we want to the det file
+/* The task is pinned but has already released its mm or been unhashed */
+static void elfdet_report_exited(struct seq_file *m, struct task_struct *task)
+{
+	this_cpu_inc(elfdet_stats.exited);
 	seq_printf(m, "Process ID:      %d\n", task->pid);
 	seq_printf(m, "Name:            %s\n", task->comm);
-	seq_printf(m, "CPU Usage:       %llu.%02llu%%\n",
-		   (usage_permyriad / 100), (usage_permyriad % 100));
-	print_memory_pressure(m, task);
-	print_memory_layout(m, task, bss_start, bss_end, heap_start, heap_end,
-			    stack_start, stack_end, elf_base);
-	print_memory_layout_visualization(m, task, bss_start, bss_end,
-					  heap_start, heap_end, stack_start,
-					  stack_end);
-	print_network_stats(m, task);
-	print_sockets(m, task);
+	seq_puts(m, "Status:          exited\n");
+}
 
-	return 0;
+static void elfdet_io_from_ioac(struct elfdet_io *io,
+				const struct task_io_accounting *ioac)
+{
+	memset(io, 0, sizeof(*io));
+#ifdef CONFIG_TASK_XACCT
+	io->rchar = ioac->rchar;
+	io->wchar = ioac->wchar;
+	io->syscr = ioac->syscr;
+	io->syscw = ioac->syscw;
+#endif
+#ifdef CONFIG_TASK_IO_ACCOUNTING
+	io->read_bytes = ioac->read_bytes;
+	io->write_bytes = ioac->write_bytes;
+	io->cancelled_write_bytes = ioac->cancelled_write_bytes;
+#endif
 }
 
-// this function gathers thread information from kernel
-static int elfdet_threads_show(struct seq_file *m, void *v)
+/* Whole-process I/O like /proc/<pid>/io: reaped threads' totals kept in
+ * signal_struct plus every live thread's own counters.
+ */
+static void elfdet_process_io(struct task_struct *task, struct elfdet_io *io)
 {
-	struct task_struct *task, *thread;
-	int ret, thread_count = 0;
+	struct task_io_accounting ioac = task->signal->ioac;
+	struct task_struct *t;
 
-	ret = kstrtoint(buff, 10, &user_pid);
-	if (ret != 0) {
-		seq_puts(m, "Failed to parse PID\n");
+	rcu_read_lock();
+	// clang-format off
+	for_each_thread(task, t)
+		task_io_accounting_add(&ioac, &t->ioac);
+	// clang-format on
+	rcu_read_unlock();
+	elfdet_io_from_ioac(io, &ioac);
+}
+
+static void print_io_accounting(struct seq_file *m, const struct elfdet_io *io)
+{
+	seq_puts(m, "\nI/O Accounting:\n");
+	seq_puts(m,
+		 "----------------------------------------------------------");
+	seq_puts(m, "----------------------\n");
+	seq_printf(m, "  Read (rchar):    %llu bytes\n", io->rchar);
+	seq_printf(m, "  Write (wchar):   %llu bytes\n", io->wchar);
+	seq_printf(m, "  Read Syscalls:   %llu\n", io->syscr);
+	seq_printf(m, "  Write Syscalls:  %llu\n", io->syscw);
+	seq_printf(m, "  Storage Read:    %llu bytes\n", io->read_bytes);
+	seq_printf(m, "  Storage Write:   %llu bytes\n", io->write_bytes);
+	seq_printf(m, "  Cancelled Write: %llu bytes\n",
+		   io->cancelled_write_bytes);
+	seq_puts(m,
+		 "----------------------------------------------------------");
+	seq_puts(m, "----------------------\n");
+}
+
+/* Watch registry: processes added through /proc/elf_det/watch keep their
+ * counters from the previous det read, so the next read can print deltas
+ * and peaks without walking anything extra. Entries are keyed by the
+ * process's struct pid and unhashed by the sched_process_exit probe when
+ * the last thread exits.
+ */
+#define ELFDET_WATCH_BITS 6
+#define ELFDET_WATCH_MAX 1024
+
+struct elfdet_watch {
+	struct hlist_node node;
+	struct llist_node free_node; /* on elfdet_watch_doomed */
+	struct pid *tgid; /* referenced */
+	char comm[TASK_COMM_LEN];
+	u64 added_ns;
+	u64 samples; /* det reads since added */
+	struct elfdet_watch_sample last;
+	unsigned long peak_rss_kb;
+	int peak_threads;
+
+	/* Per-thread samples of the last threads read, sorted by TID */
+	struct elfdet_thread_sample *thread_samples; /* kvmalloc'ed */
+	int nr_thread_samples;
+	u64 thread_samples_ns;
+};
+
+static DEFINE_HASHTABLE(elfdet_watches, ELFDET_WATCH_BITS);
+/* Raw: taken from tracepoint probes, which run with preemption off */
+static DEFINE_RAW_SPINLOCK(elfdet_watch_lock);
+static int elfdet_nr_watches; /* under elfdet_watch_lock */
+
+/* Watches of exited processes. The exit probe runs with preemption off
+ * and thread_samples may be vmalloc'ed, so they are freed from a work item.
+ */
+static LLIST_HEAD(elfdet_watch_doomed);
+static void elfdet_watch_reap(struct work_struct *work);
+static DECLARE_WORK(elfdet_watch_reap_work, elfdet_watch_reap);
+
+static struct elfdet_watch *elfdet_watch_find(struct pid *tgid)
+{
+	struct elfdet_watch *w;
+
+	hash_for_each_possible(elfdet_watches, w, node, (unsigned long)tgid) {
+		if (w->tgid == tgid)
+			return w;
+	}
+	return NULL;
+}
+
+static void elfdet_watch_fill(struct elfdet_watch_sample *s,
+			      struct task_struct *task,
+			      struct mm_struct *mm,
+			      u64 cpu_ns,
+			      const struct elfdet_io *io)
+{
+	s->ns = ktime_get_ns();
+	s->cpu_ns = cpu_ns;
+	s->maj_flt = task->maj_flt;
+	s->min_flt = task->min_flt;
+	s->rss_kb = pages_to_kb(
+		calculate_rss_pages(get_mm_counter(mm, MM_ANONPAGES),
+				    get_mm_counter(mm, MM_FILEPAGES),
+				    get_mm_counter(mm, MM_SHMEMPAGES)));
+	s->threads = get_nr_threads(task);
+	s->io = *io;
+}
+
+static void elfdet_watch_free(struct elfdet_watch *w)
+{
+	put_pid(w->tgid);
+	kvfree(w->thread_samples);
+	kfree(w);
+}
+
+static void elfdet_watch_reap(struct work_struct *work)
+{
+	struct elfdet_watch *w, *tmp;
+
+	llist_for_each_entry_safe(w, tmp, llist_del_all(&elfdet_watch_doomed),
+				  free_node)
+		elfdet_watch_free(w);
+}
+
+static int elfdet_watch_add(int pid)
+{
+	struct elfdet_watch *w, *old;
+	struct task_struct *task;
+	struct mm_struct *mm;
+	struct elfdet_io io;
+	int ret = 0;
+
+	task = elfdet_get_task(pid);
+	if (!task)
+		return -ESRCH;
+	mm = get_task_mm(task);
+	if (!mm) {
+		put_task_struct(task);
+		return -ESRCH;
+	}
+
+	w = kzalloc(sizeof(*w), GFP_KERNEL);
+	if (!w) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	w->tgid = get_task_pid(task, PIDTYPE_TGID);
+	get_task_comm(w->comm, task);
+	elfdet_process_io(task, &io);
+	elfdet_watch_fill(&w->last, task, mm,
+			  (u64)task->utime + (u64)task->stime, &io);
+	w->added_ns = w->last.ns;
+	w->peak_rss_kb = max(w->last.rss_kb,
+			     pages_to_kb(get_mm_hiwater_rss(mm)));
+	w->peak_threads = w->last.threads;
+
+	raw_spin_lock(&elfdet_watch_lock);
+	old = elfdet_watch_find(w->tgid);
+	if (old || elfdet_nr_watches >= ELFDET_WATCH_MAX) {
+		/* Adding a watched process again keeps its history */
+		ret = old ? 0 : -ENOSPC;
+	} else {
+		hash_add(elfdet_watches, &w->node, (unsigned long)w->tgid);
+		elfdet_nr_watches++;
+		w = NULL;
+	}
+	raw_spin_unlock(&elfdet_watch_lock);
+	if (w)
+		elfdet_watch_free(w);
+out:
+	mmput(mm);
+	put_task_struct(task);
+	return ret;
+}
+
+static int elfdet_watch_remove(int pid)
+{
+	struct pid *tgid = find_get_pid(pid);
+	struct elfdet_watch *w = NULL;
+	struct task_struct *task;
+
+	/* Accept a TID as well: key by its thread group */
+	task = get_pid_task(tgid, PIDTYPE_PID);
+	put_pid(tgid);
+	if (!task)
+		return -ENOENT;
+	tgid = task_tgid(task);
+
+	raw_spin_lock(&elfdet_watch_lock);
+	w = elfdet_watch_find(tgid);
+	if (w) {
+		hash_del(&w->node);
+		elfdet_nr_watches--;
+	}
+	raw_spin_unlock(&elfdet_watch_lock);
+	put_task_struct(task);
+
+	if (!w)
+		return -ENOENT;
+	elfdet_watch_free(w);
+	return 0;
+}
+
+static void elfdet_watch_clear(void)
+{
+	struct elfdet_watch *w;
+	struct hlist_node *tmp;
+	HLIST_HEAD(doomed);
+	int bkt;
+
+	raw_spin_lock(&elfdet_watch_lock);
+	hash_for_each_safe(elfdet_watches, bkt, tmp, w, node) {
+		hash_del(&w->node);
+		hlist_add_head(&w->node, &doomed);
+	}
+	elfdet_nr_watches = 0;
+	raw_spin_unlock(&elfdet_watch_lock);
+
+	hlist_for_each_entry_safe(w, tmp, &doomed, node)
+		elfdet_watch_free(w);
+	flush_work(&elfdet_watch_reap_work);
+}
+
+/* The last thread of p's process is exiting: release its watch */
+static void elfdet_watch_exit(struct task_struct *p)
+{
+	struct elfdet_watch *w;
+
+	if (!READ_ONCE(elfdet_nr_watches))
+		return;
+
+	raw_spin_lock(&elfdet_watch_lock);
+	w = elfdet_watch_find(task_tgid(p));
+	if (w) {
+		hash_del(&w->node);
+		elfdet_nr_watches--;
+	}
+	raw_spin_unlock(&elfdet_watch_lock);
+
+	if (w && llist_add(&w->free_node, &elfdet_watch_doomed))
+		schedule_work(&elfdet_watch_reap_work);
+}
+
+/* True when the process of spid, a PID or TID, is in the watch registry */
+static bool elfdet_watched(struct pid *spid)
+{
+	struct task_struct *task;
+	bool watched = false;
+
+	if (!READ_ONCE(elfdet_nr_watches))
+		return false;
+
+	rcu_read_lock();
+	task = pid_task(spid, PIDTYPE_PID);
+	if (task) {
+		raw_spin_lock(&elfdet_watch_lock);
+		watched = elfdet_watch_find(task_tgid(task)) != NULL;
+		raw_spin_unlock(&elfdet_watch_lock);
+	}
+	rcu_read_unlock();
+	return watched;
+}
+
+/* Print counters of a watched process relative to the previous read and
+ * return this read's sample in *cur. Returns false, printing nothing, for
+ * unwatched PIDs. The watch is not updated here: seq_file discards a
+ * render that overflowed its buffer and runs it again, so the caller
+ * commits *cur with elfdet_watch_commit() once the whole report fit.
+ */
+static bool elfdet_watch_report(struct seq_file *m,
+				struct task_struct *task,
+				struct mm_struct *mm,
+				u64 cpu_ns,
+				const struct elfdet_io *io,
+				struct elfdet_watch_sample *cur)
+{
+	struct elfdet_watch_sample prev;
+	unsigned long peak_rss_kb;
+	struct elfdet_watch *w;
+	u64 interval_ns, cpu_delta, usage, samples;
+	int peak_threads;
+
+	if (!READ_ONCE(elfdet_nr_watches))
+		return false;
+
+	elfdet_watch_fill(cur, task, mm, cpu_ns, io);
+	peak_rss_kb = max(cur->rss_kb, pages_to_kb(get_mm_hiwater_rss(mm)));
+
+	raw_spin_lock(&elfdet_watch_lock);
+	w = elfdet_watch_find(task_tgid(task));
+	if (!w) {
+		raw_spin_unlock(&elfdet_watch_lock);
+		return false;
+	}
+	prev = w->last;
+	peak_rss_kb = max(w->peak_rss_kb, peak_rss_kb);
+	peak_threads = max(w->peak_threads, cur->threads);
+	samples = w->samples + 1;
+	raw_spin_unlock(&elfdet_watch_lock);
+
+	interval_ns = elfdet_counter_delta(prev.ns, cur->ns);
+	cpu_delta = elfdet_counter_delta(prev.cpu_ns, cur->cpu_ns);
+	usage = compute_usage_permyriad(cpu_delta, interval_ns);
+
+	seq_puts(m, "\n[watch]\n");
+	seq_printf(m, "interval_ns: %llu\n", interval_ns);
+	seq_printf(m, "cpu_delta_ns: %llu\n", cpu_delta);
+	seq_printf(m, "cpu_rate: %llu.%02llu%%\n", usage / 100, usage % 100);
+	seq_printf(m, "maj_flt_delta: %llu\n",
+		   elfdet_counter_delta(prev.maj_flt, cur->maj_flt));
+	seq_printf(m, "min_flt_delta: %llu\n",
+		   elfdet_counter_delta(prev.min_flt, cur->min_flt));
+	seq_printf(m, "rss_delta_kb: %ld\n",
+		   (long)cur->rss_kb - (long)prev.rss_kb);
+	seq_printf(m, "threads_delta: %d\n", cur->threads - prev.threads);
+	seq_printf(m, "rchar_per_sec: %llu\n",
+		   elfdet_rate_per_sec(
+			   elfdet_counter_delta(prev.io.rchar, cur->io.rchar),
+			   interval_ns));
+	seq_printf(m, "wchar_per_sec: %llu\n",
+		   elfdet_rate_per_sec(
+			   elfdet_counter_delta(prev.io.wchar, cur->io.wchar),
+			   interval_ns));
+	seq_printf(m, "syscr_per_sec: %llu\n",
+		   elfdet_rate_per_sec(
+			   elfdet_counter_delta(prev.io.syscr, cur->io.syscr),
+			   interval_ns));
+	seq_printf(m, "syscw_per_sec: %llu\n",
+		   elfdet_rate_per_sec(
+			   elfdet_counter_delta(prev.io.syscw, cur->io.syscw),
+			   interval_ns));
+	seq_printf(m, "read_bytes_per_sec: %llu\n",
+		   elfdet_rate_per_sec(
+			   elfdet_counter_delta(prev.io.read_bytes,
+						cur->io.read_bytes),
+			   interval_ns));
+	seq_printf(m, "write_bytes_per_sec: %llu\n",
+		   elfdet_rate_per_sec(
+			   elfdet_counter_delta(prev.io.write_bytes,
+						cur->io.write_bytes),
+			   interval_ns));
+	seq_printf(m, "peak_rss_kb: %lu\n", peak_rss_kb);
+	seq_printf(m, "peak_threads: %d\n", peak_threads);
+	seq_printf(m, "samples: %llu\n", samples);
+	return true;
+}
+
+/* Make cur, printed by elfdet_watch_report(), the next read's reference */
+static void elfdet_watch_commit(struct task_struct *task,
+				struct mm_struct *mm,
+				const struct elfdet_watch_sample *cur)
+{
+	unsigned long peak_rss_kb;
+	struct elfdet_watch *w;
+
+	peak_rss_kb = max(cur->rss_kb, pages_to_kb(get_mm_hiwater_rss(mm)));
+
+	raw_spin_lock(&elfdet_watch_lock);
+	w = elfdet_watch_find(task_tgid(task));
+	if (w) {
+		w->last = *cur;
+		w->samples++;
+		w->peak_rss_kb = max(w->peak_rss_kb, peak_rss_kb);
+		w->peak_threads = max(w->peak_threads, cur->threads);
+	}
+	raw_spin_unlock(&elfdet_watch_lock);
+}
+
+/* Incremental process index: one entry per process (thread group), kept
+ * current by the fork/exec/exit probes so readers never scan the task
+ * list. Every change gets the next generation number and is appended to a
+ * ring, so a reader holding generation G can ask for just what changed
+ * since. PIDs are those of the initial pid namespace.
+ */
+#define ELFDET_PROC_BITS 10
+#define ELFDET_PROC_MAX 65536
+#define ELFDET_PROC_LOG 4096 /* change log entries */
+#define ELFDET_EXE_LEN 64
+
+struct elfdet_proc {
+	struct hlist_node node;
+	pid_t pid;
+	pid_t ppid;
+	u64 start_ns; /* task->start_time */
+	u64 gen; /* generation of the last change, 0 if indexed at load */
+	int threads; /* live threads, kept by the fork and exit probes */
+	int peak_threads;
+	char comm[TASK_COMM_LEN];
+	char exe[ELFDET_EXE_LEN]; /* tail of the exec'd path, "" if unknown */
+};
+
+struct elfdet_proc_change {
+	u64 gen;
+	pid_t pid;
+	pid_t ppid;
+	int event; /* enum elfdet_proc_event */
+	char comm[TASK_COMM_LEN];
+	char exe[ELFDET_EXE_LEN];
+};
+
+static DEFINE_HASHTABLE(elfdet_procs, ELFDET_PROC_BITS);
+/* Raw: taken from tracepoint probes, which run with preemption off */
+static DEFINE_RAW_SPINLOCK(elfdet_procs_lock);
+static struct elfdet_proc_change *elfdet_proc_log; /* [ELFDET_PROC_LOG] */
+static u64 elfdet_proc_gen; /* last generation handed out */
+static int elfdet_nr_procs;
+static atomic64_t elfdet_procs_dropped = ATOMIC64_INIT(0);
+
+static struct elfdet_proc *elfdet_proc_find(pid_t pid)
+{
+	struct elfdet_proc *e;
+
+	hash_for_each_possible(elfdet_procs, e, node, pid) {
+		if (e->pid == pid)
+			return e;
+	}
+	return NULL;
+}
+
+/* Called with elfdet_procs_lock held; returns the new generation */
+static u64 elfdet_proc_log_change(const struct elfdet_proc *e, int event)
+{
+	struct elfdet_proc_change *c;
+	u64 gen = ++elfdet_proc_gen;
+
+	c = &elfdet_proc_log[gen % ELFDET_PROC_LOG];
+	c->gen = gen;
+	c->pid = e->pid;
+	c->ppid = e->ppid;
+	c->event = event;
+	memcpy(c->comm, e->comm, sizeof(c->comm));
+	memcpy(c->exe, e->exe, sizeof(c->exe));
+	return gen;
+}
+
+static void elfdet_proc_drop(pid_t pid)
+{
+	u64 total = atomic64_inc_return(&elfdet_procs_dropped);
+
+	trace_elfdet_dropped("procs", pid, total);
+}
+
+/* Fill an index entry for the process led by p; exe is left empty */
+static void elfdet_proc_fill(struct elfdet_proc *e, struct task_struct *p)
+{
+	e->pid = p->tgid;
+	rcu_read_lock();
+	e->ppid = task_tgid_nr(rcu_dereference(p->real_parent));
+	rcu_read_unlock();
+	e->start_ns = p->start_time;
+	e->gen = 0;
+	e->threads = get_nr_threads(p);
+	e->peak_threads = e->threads;
+	memcpy(e->comm, p->comm, sizeof(e->comm));
+	e->comm[sizeof(e->comm) - 1] = '\0';
+	e->exe[0] = '\0';
+}
+
+/* Insert e unless its PID is indexed already; frees e in that case.
+ * Called with elfdet_procs_lock held. Returns the entry in the table.
+ */
+static struct elfdet_proc *elfdet_proc_insert(struct elfdet_proc *e)
+{
+	struct elfdet_proc *old = elfdet_proc_find(e->pid);
+
+	if (old) {
+		kfree(e);
+		return old;
+	}
+	hash_add(elfdet_procs, &e->node, e->pid);
+	elfdet_nr_procs++;
+	return e;
+}
+
+static void elfdet_probe_process_fork(void *data,
+				      struct task_struct *parent,
+				      struct task_struct *child)
+{
+	struct elfdet_proc *e, *pe;
+
+	/* New threads join an indexed process */
+	if (child->pid != child->tgid) {
+		raw_spin_lock(&elfdet_procs_lock);
+		e = elfdet_proc_find(child->tgid);
+		if (e) {
+			e->threads++;
+			e->peak_threads = max(e->peak_threads, e->threads);
+		}
+		raw_spin_unlock(&elfdet_procs_lock);
+		return;
+	}
+
+	if (READ_ONCE(elfdet_nr_procs) >= ELFDET_PROC_MAX) {
+		elfdet_proc_drop(child->tgid);
+		return;
+	}
+	e = kmalloc(sizeof(*e), GFP_NOWAIT | __GFP_NOWARN);
+	if (!e) {
+		elfdet_proc_drop(child->tgid);
+		return;
+	}
+	elfdet_proc_fill(e, child);
+
+	raw_spin_lock(&elfdet_procs_lock);
+	/* A fork runs the parent's binary until it execs */
+	pe = elfdet_proc_find(parent->tgid);
+	if (pe)
+		memcpy(e->exe, pe->exe, sizeof(e->exe));
+	e = elfdet_proc_insert(e);
+	e->gen = elfdet_proc_log_change(e, ELFDET_PROC_FORK);
+	raw_spin_unlock(&elfdet_procs_lock);
+}
+
+static void elfdet_probe_process_exec(void *data,
+				      struct task_struct *p,
+				      pid_t old_pid,
+				      struct linux_binprm *bprm)
+{
+	struct elfdet_proc *e, *fresh = NULL;
+
+	raw_spin_lock(&elfdet_procs_lock);
+	e = elfdet_proc_find(p->tgid);
+	raw_spin_unlock(&elfdet_procs_lock);
+
+	/* Missed at fork (table full or no memory): index it now */
+	if (!e) {
+		fresh = kmalloc(sizeof(*fresh), GFP_NOWAIT | __GFP_NOWARN);
+		if (!fresh) {
+			elfdet_proc_drop(p->tgid);
+			return;
+		}
+		elfdet_proc_fill(fresh, p);
+	}
+
+	raw_spin_lock(&elfdet_procs_lock);
+	e = fresh ? elfdet_proc_insert(fresh) : elfdet_proc_find(p->tgid);
+	if (e) {
+		memcpy(e->comm, p->comm, sizeof(e->comm));
+		e->comm[sizeof(e->comm) - 1] = '\0';
+		elfdet_copy_tail(e->exe, sizeof(e->exe), bprm->filename);
+		e->gen = elfdet_proc_log_change(e, ELFDET_PROC_EXEC);
+	}
+	raw_spin_unlock(&elfdet_procs_lock);
+}
+
+static void elfdet_procs_thread_exit(struct task_struct *p)
+{
+	struct elfdet_proc *e;
+
+	raw_spin_lock(&elfdet_procs_lock);
+	e = elfdet_proc_find(p->tgid);
+	if (e && e->threads > 1)
+		e->threads--;
+	raw_spin_unlock(&elfdet_procs_lock);
+}
+
+/* Exit records: the final accounting of each process, captured by the exit
+ * probe into a bounded buffer that /proc/elf_det/exits drains. When the
+ * buffer is full new records are dropped (and counted) until it is read.
+ */
+#define ELFDET_EXIT_MAX 1024
+
+struct elfdet_exit_record {
+	pid_t pid;
+	pid_t ppid;
+	char comm[TASK_COMM_LEN];
+	char exe[ELFDET_EXE_LEN];
+	u64 lifetime_ns;
+	u64 utime_ns;
+	u64 stime_ns;
+	unsigned long maxrss_kb;
+	unsigned long maj_flt;
+	unsigned long min_flt;
+	u64 rchar, wchar; /* bytes through read/write syscalls */
+	u64 read_bytes, write_bytes; /* bytes to/from storage */
+	int peak_threads; /* 0 if the process was not indexed */
+	int exit_code; /* wait(2) status */
+};
+
+/* Raw: filled from the exit probe */
+static DEFINE_RAW_SPINLOCK(elfdet_exits_lock);
+static struct elfdet_exit_record *elfdet_exits; /* [ELFDET_EXIT_MAX] */
+static int elfdet_nr_exits;
+static atomic64_t elfdet_exits_dropped = ATOMIC64_INIT(0);
+
+/* Processes missing from the index that reported their exit most recently,
+ * by TGID and leader start time; under elfdet_exits_lock
+ */
+#define ELFDET_EXIT_RECENT 8
+
+static struct {
+	pid_t pid;
+	u64 start_ns;
+} elfdet_exits_recent[ELFDET_EXIT_RECENT];
+static unsigned int elfdet_exits_recent_next;
+
+/* The process's own totals: those of threads already reaped, kept in
+ * signal_struct, plus those of threads still on the list. Read without
+ * siglock, so a thread being reaped right now may be missed.
+ */
+static void elfdet_exit_fill(struct elfdet_exit_record *r,
+			     struct task_struct *p)
+{
+	struct signal_struct *sig = p->signal;
+	struct task_io_accounting ioac = sig->ioac;
+	struct task_struct *t;
+	struct elfdet_io io;
+
+	r->utime_ns = sig->utime;
+	r->stime_ns = sig->stime;
+	r->maj_flt = sig->maj_flt;
+	r->min_flt = sig->min_flt;
+
+	rcu_read_lock();
+	// clang-format off
+	for_each_thread(p, t) {
+		r->utime_ns += t->utime;
+		r->stime_ns += t->stime;
+		r->maj_flt += t->maj_flt;
+		r->min_flt += t->min_flt;
+		task_io_accounting_add(&ioac, &t->ioac);
+	}
+	// clang-format on
+	r->ppid = task_tgid_nr(rcu_dereference(p->real_parent));
+	rcu_read_unlock();
+
+	r->pid = p->tgid;
+	memcpy(r->comm, p->comm, sizeof(r->comm));
+	r->comm[sizeof(r->comm) - 1] = '\0';
+	r->exe[0] = '\0';
+	r->peak_threads = 0;
+	r->lifetime_ns = ktime_get_ns() - p->start_time;
+	/* do_exit() updated maxrss (in pages) just before exit_mm() */
+	r->maxrss_kb = sig->maxrss * (PAGE_SIZE / 1024);
+	elfdet_io_from_ioac(&io, &ioac);
+	r->rchar = io.rchar;
+	r->wchar = io.wchar;
+	r->read_bytes = io.read_bytes;
+	r->write_bytes = io.write_bytes;
+	r->exit_code = (sig->flags & SIGNAL_GROUP_EXIT) ? sig->group_exit_code :
+							   p->exit_code;
+}
+
+static void elfdet_exits_push(const struct elfdet_exit_record *r)
+{
+	u64 total;
+
+	raw_spin_lock(&elfdet_exits_lock);
+	if (elfdet_nr_exits < ELFDET_EXIT_MAX) {
+		elfdet_exits[elfdet_nr_exits++] = *r;
+		raw_spin_unlock(&elfdet_exits_lock);
+		return;
+	}
+	raw_spin_unlock(&elfdet_exits_lock);
+
+	total = atomic64_inc_return(&elfdet_exits_dropped);
+	trace_elfdet_dropped("exits", r->pid, total);
+}
+
+/* Returns true for the first caller reporting the exit of the unindexed
+ * process led by leader.
+ */
+static bool elfdet_exits_claim(struct task_struct *leader)
+{
+	unsigned int i;
+	bool first = true;
+
+	raw_spin_lock(&elfdet_exits_lock);
+	for (i = 0; i < ELFDET_EXIT_RECENT; i++) {
+		if (elfdet_exits_recent[i].pid == leader->pid &&
+		    elfdet_exits_recent[i].start_ns == leader->start_time) {
+			first = false;
+			break;
+		}
+	}
+	if (first) {
+		i = elfdet_exits_recent_next++ % ELFDET_EXIT_RECENT;
+		elfdet_exits_recent[i].pid = leader->pid;
+		elfdet_exits_recent[i].start_ns = leader->start_time;
+	}
+	raw_spin_unlock(&elfdet_exits_lock);
+	return first;
+}
+
+static void elfdet_procs_exit(struct task_struct *p)
+{
+	struct elfdet_exit_record r;
+	struct elfdet_proc *e;
+	bool indexed;
+
+	if (!(p->flags & PF_KTHREAD))
+		elfdet_exit_fill(&r, p);
+
+	raw_spin_lock(&elfdet_procs_lock);
+	e = elfdet_proc_find(p->tgid);
+	if (e) {
+		hash_del(&e->node);
+		elfdet_nr_procs--;
+		elfdet_proc_log_change(e, ELFDET_PROC_EXIT);
+		memcpy(r.exe, e->exe, sizeof(r.exe));
+		r.peak_threads = e->peak_threads;
+	}
+	raw_spin_unlock(&elfdet_procs_lock);
+	indexed = e != NULL;
+	kfree(e);
+
+	if (p->flags & PF_KTHREAD)
+		return;
+	/* Threads of an exit_group() can all see signal->live at 0: only the
+	 * one that removed the index entry reports, or for an unindexed
+	 * process the first one to claim it.
+	 */
+	if (indexed || elfdet_exits_claim(p->group_leader))
+		elfdet_exits_push(&r);
+}
+
+/* sched_process_exit runs for every exiting thread, after exit_mm() and
+ * after signal->live was decremented; a thread that reads it as 0 is one
+ * of the last, and elfdet_procs_exit() picks a single reporter among them.
+ */
+static void elfdet_probe_process_exit(void *data, struct task_struct *p)
+{
+	if (atomic_read(&p->signal->live)) {
+		elfdet_procs_thread_exit(p);
+		return;
+	}
+
+	elfdet_watch_exit(p);
+	elfdet_procs_exit(p);
+}
+
+/* Index the processes that exist at load time. Probes are already
+ * registered, so anything forked meanwhile is indexed by them; exiting
+ * processes are skipped so a finished exit probe is not undone.
+ */
+static void elfdet_procs_populate(void)
+{
+	struct task_struct *p;
+	struct elfdet_proc *e;
+
+	rcu_read_lock();
+	for_each_process(p) {
+		if ((p->flags & PF_EXITING) ||
+		    READ_ONCE(elfdet_nr_procs) >= ELFDET_PROC_MAX)
+			continue;
+		e = kmalloc(sizeof(*e), GFP_ATOMIC | __GFP_NOWARN);
+		if (!e) {
+			elfdet_proc_drop(p->tgid);
+			continue;
+		}
+		elfdet_proc_fill(e, p);
+		raw_spin_lock(&elfdet_procs_lock);
+		elfdet_proc_insert(e);
+		raw_spin_unlock(&elfdet_procs_lock);
+	}
+	rcu_read_unlock();
+}
+
+static void elfdet_procs_free(void)
+{
+	struct elfdet_proc *e;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(elfdet_procs, bkt, tmp, e, node) {
+		hash_del(&e->node);
+		kfree(e);
+	}
+	elfdet_nr_procs = 0;
+	vfree(elfdet_proc_log);
+	elfdet_proc_log = NULL;
+	vfree(elfdet_exits);
+	elfdet_exits = NULL;
+}
+
+/* Detach the per-thread samples of task's watch for a threads read.
+ * Returns false if the process is not watched. *samples is NULL on the
+ * first read or while another threads read of the process holds them.
+ */
+static bool elfdet_watch_take_threads(struct task_struct *task,
+				      struct elfdet_thread_sample **samples,
+				      int *nr,
+				      u64 *ns)
+{
+	struct elfdet_watch *w;
+
+	*samples = NULL;
+	*nr = 0;
+	*ns = 0;
+	if (!READ_ONCE(elfdet_nr_watches))
+		return false;
+
+	raw_spin_lock(&elfdet_watch_lock);
+	w = elfdet_watch_find(task_tgid(task));
+	if (w) {
+		*samples = w->thread_samples;
+		*nr = w->nr_thread_samples;
+		*ns = w->thread_samples_ns;
+		w->thread_samples = NULL;
+		w->nr_thread_samples = 0;
+	}
+	raw_spin_unlock(&elfdet_watch_lock);
+	return w != NULL;
+}
+
+/* Store this read's per-thread samples as the reference for the next one;
+ * they are freed instead if the watch went away or got newer samples.
+ */
+static void elfdet_watch_put_threads(struct task_struct *task,
+				     struct elfdet_thread_sample *samples,
+				     int nr,
+				     u64 ns)
+{
+	struct elfdet_watch *w;
+
+	raw_spin_lock(&elfdet_watch_lock);
+	w = elfdet_watch_find(task_tgid(task));
+	if (w && !w->thread_samples) {
+		w->thread_samples = samples;
+		w->nr_thread_samples = nr;
+		w->thread_samples_ns = ns;
+		samples = NULL;
+	}
+	raw_spin_unlock(&elfdet_watch_lock);
+	kvfree(samples);
+}
+
+// this function is the base function to gather information from kernel
+static void elfdet_report_det(struct seq_file *m, int pid)
+{
+	struct task_struct *task;
+	struct mm_struct *mm;
+	unsigned long bss_start = 0, bss_end = 0;
+	unsigned long heap_start = 0, heap_end = 0;
+	unsigned long stack_start = 0, stack_end = 0;
+	unsigned long elf_base = 0;
+	u64 delta_ns, total_ns;
+	u64 usage_permyriad; // CPU usage in hundredths of a percent (X.XX%)
+	struct elfdet_watch_sample watch;
+	struct elfdet_mark mark;
+	struct elfdet_io io;
+	bool watched;
+	u64 hold_ns;
+	int vma_mode;
+
+	task = elfdet_get_task(pid);
+	if (!task || (task->flags & PF_KTHREAD)) {
+		seq_puts(m, "Invalid PID or process has no memory context\n");
+		goto out;
+	}
+
+	/* Pins the address space; NULL once the process is past exit_mm() */
+	mm = get_task_mm(task);
+	if (!mm) {
+		elfdet_report_exited(m, task);
+		goto out;
+	}
+
+	/* CPU usage: total CPU time of task since start divided by elapsed wall
+	 * time
+	 */
+	total_ns = (u64)task->utime + (u64)task->stime;
+	delta_ns = ktime_get_ns() - task->start_time;
+	usage_permyriad = compute_usage_permyriad(total_ns, delta_ns);
+
+	/* Use mm fields directly for ELF, BSS, heap, and stack
+	 * Note: Modern ELF binaries may have end_data == start_brk (no BSS)
+	 * rodata is typically merged with code section (start_code to end_code)
+	 * Heap shown is brk-based; mmap-allocated heap is not tracked here
+	 */
+
+	/* ELF base: First VMA is typically the ELF binary base (for PIE)
+	 * Stack: the [stack] VMA gives the actual lower boundary
+	 */
+	elfdet_section_begin(m, &mark, pid);
+	stack_start = mm->start_stack;
+	vma_mode = elfdet_read_vmas(m->private, pid, mm, stack_start,
+				    &elf_base, &stack_end, &hold_ns);
+
+	/* BSS: uninitialized data between end_data and start_brk
+	 * May be zero-length in modern binaries
+	 */
+	compute_bss_range(mm->end_data, mm->start_brk, &bss_start,
+			  &bss_end);
+
+	/* Heap: brk-based heap from start_brk to current brk
+	 * Note: Does not include mmap-based allocations (arena heap)
+	 */
+	compute_heap_range(mm->start_brk, mm->brk, &heap_start,
+			   &heap_end);
+	elfdet_section_end(m, ELFDET_SEC_VMA_WALK, &mark);
+
+	// now print the information we want to the det file
+	seq_printf(m, "Process ID:      %d\n", task->pid);
+	seq_printf(m, "Name:            %s\n", task->comm);
+	seq_printf(m, "CPU Usage:       %llu.%02llu%%\n",
+		   (usage_permyriad / 100), (usage_permyriad % 100));
+	seq_printf(m, "CPU Time:        %llu ns\n", total_ns);
+	seq_printf(m, "VMA Walk:        %s", elfdet_vma_mode_name(vma_mode));
+	if (vma_mode == ELFDET_VMA_LOCKED)
+		seq_printf(m, " (mmap_lock held %llu ns)", hold_ns);
+	seq_puts(m, "\n");
+	elfdet_section_begin(m, &mark, pid);
+	print_memory_pressure(m, task, mm);
+	elfdet_section_end(m, ELFDET_SEC_MEMORY_PRESSURE, &mark);
+	elfdet_section_begin(m, &mark, pid);
+	elfdet_process_io(task, &io);
+	print_io_accounting(m, &io);
+	elfdet_section_end(m, ELFDET_SEC_IO, &mark);
+	watched = elfdet_watch_report(m, task, mm, total_ns, &io, &watch);
+	print_memory_layout(m, mm, bss_start, bss_end, heap_start, heap_end,
+			    stack_start, stack_end, elf_base);
+	print_memory_layout_visualization(m, mm, bss_start, bss_end,
+					  heap_start, heap_end, stack_start,
+					  stack_end);
+	elfdet_section_begin(m, &mark, pid);
+	print_network_stats(m, task);
+	elfdet_section_end(m, ELFDET_SEC_NETWORK, &mark);
+	elfdet_section_begin(m, &mark, pid);
+	print_sockets(m, task);
+	elfdet_section_end(m, ELFDET_SEC_SOCKETS, &mark);
+	if (watched && !seq_has_overflowed(m))
+		elfdet_watch_commit(task, mm, &watch);
+	mmput(mm);
+out:
+	if (task)
+		put_task_struct(task);
+}
+
+static int elfdet_show(struct seq_file *m, void *v)
+{
+	struct elfdet_mark mark;
+	int pid;
+
+	if (elfdet_query_pid(m, &pid) != 0) {
+		seq_puts(m, "Failed to parse PID\n");
+		return 0;
+	}
+
+	trace_elfdet_query_start(pid, ELFDET_SEC_DET);
+	elfdet_section_begin(m, &mark, pid);
+	elfdet_cached_report(m, ELFDET_SEC_DET, pid, elfdet_report_det);
+	elfdet_section_end(m, ELFDET_SEC_DET, &mark);
+	return 0;
+}
+
+// this function gathers thread information from kernel
+static void elfdet_report_threads(struct seq_file *m, int pid)
+{
+	struct elfdet_thread_sample *prev = NULL, *cur = NULL, sample;
+	int nr_prev = 0, nr_cur = 0, cap = 0;
+	struct task_struct *task, *thread;
+	struct elfdet_futex *fx;
+	u64 prev_ns, now_ns;
+	struct elfdet_mark mark;
+	int thread_count = 0;
+	bool watched;
+
+	task = elfdet_get_task(pid);
+	if (!task) {
+		seq_puts(m, "Invalid PID\n");
+		return;
+	}
+
+	/* Reaped while we looked it up: thread list already torn down */
+	if (!pid_alive(task)) {
+		elfdet_report_exited(m, task);
+		put_task_struct(task);
+		return;
+	}
+
+	/* Watched: rates against the previous read, and keep this one */
+	watched = elfdet_watch_take_threads(task, &prev, &nr_prev, &prev_ns);
+	if (watched) {
+		cap = get_nr_threads(task) + 16;
+		cur = kvmalloc_array(cap, sizeof(*cur), GFP_KERNEL);
+		if (!cur)
+			cap = 0;
+	}
+
+	/* Profiled by /proc/elf_det/futex: lock waits per thread */
+	fx = elfdet_futex_get(task);
+
+	// Print header
+	seq_puts(m, "TID    NAME             CPU(%)   STATE  PRIORITY  NICE  ");
+	seq_puts(m, "CPU_AFFINITY      ");
+	seq_puts(m, "       RCHAR         WCHAR    READ_BYTES   WRITE_BYTES");
+	seq_puts(m, "     MAJ_FLT     MIN_FLT");
+	if (watched) {
+		seq_puts(m, "    READ_B/S   WRITE_B/S");
+		seq_puts(m, "   INT_CPU%  MAJ_FLT/S  MIN_FLT/S");
+	}
+	if (fx)
+		seq_puts(m, "  FUTEX_WAITS  FUTEX_WAIT_MS  FUTEX_TOP_ADDR");
+	seq_puts(m, "\n");
+	seq_puts(m, "-----  ---------------  -------  -----  --------  ----  ");
+	seq_puts(m, "----------------  ");
+	seq_puts(m, "------------  ------------  ------------  ------------");
+	seq_puts(m, "  ----------  ----------");
+	if (watched) {
+		seq_puts(m, "  ----------  ----------");
+		seq_puts(m, "  ---------  ---------  ---------");
+	}
+	if (fx)
+		seq_puts(m, "  -----------  -------------  ------------------");
+	seq_puts(m, "\n");
+
+	// Iterate through all threads in the thread group
+	elfdet_section_begin(m, &mark, pid);
+	now_ns = ktime_get_ns();
+	rcu_read_lock();
+	// clang-format off
+	for_each_thread(task, thread) {
+		thread_count++;
+		sample.tid = thread->pid;
+		sample.cpu_ns = (u64)thread->utime + (u64)thread->stime;
+		sample.maj_flt = thread->maj_flt;
+		sample.min_flt = thread->min_flt;
+		elfdet_io_from_ioac(&sample.io, &thread->ioac);
+		print_thread_info_line(m, thread, &sample,
+				       elfdet_find_thread_sample(prev, nr_prev,
+								 thread->pid),
+				       now_ns - prev_ns, watched, fx);
+		if (nr_cur < cap)
+			cur[nr_cur++] = sample;
+	}
+	// clang-format on
+	rcu_read_unlock();
+	elfdet_section_end(m, ELFDET_SEC_THREAD_LOOP, &mark);
+	elfdet_futex_put(fx);
+
+	seq_puts(m,
+		 "----------------------------------------------------------");
+	seq_puts(m, "----------------------\n");
+	seq_printf(m, "Total threads: %d\n", thread_count);
+
+	/* seq_file runs an overflowed render again with a bigger buffer: keep
+	 * the previous samples as the reference until a render fits
+	 */
+	if (watched) {
+		if (cur && !seq_has_overflowed(m)) {
+			kvfree(prev);
+			sort(cur, nr_cur, sizeof(*cur), elfdet_cmp_thread_sample,
+			     NULL);
+			elfdet_watch_put_threads(task, cur, nr_cur, now_ns);
+		} else {
+			kvfree(cur);
+			elfdet_watch_put_threads(task, prev, nr_prev, prev_ns);
+		}
+	}
+	put_task_struct(task);
+}
+
+static int elfdet_threads_show(struct seq_file *m, void *v)
+{
+	struct elfdet_mark mark;
+	int pid;
+
+	if (elfdet_query_pid(m, &pid) != 0) {
+		seq_puts(m, "Failed to parse PID\n");
+		return 0;
+	}
+
+	trace_elfdet_query_start(pid, ELFDET_SEC_THREADS);
+	elfdet_section_begin(m, &mark, pid);
+	elfdet_cached_report(m, ELFDET_SEC_THREADS, pid, elfdet_report_threads);
+	elfdet_section_end(m, ELFDET_SEC_THREADS, &mark);
+	return 0;
+}
+
+static int elfdet_session_open(struct file *file,
+			       int (*show)(struct seq_file *, void *))
+{
+	struct elfdet_session *session;
+	int ret;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	ret = single_open(file, show, session);
+	if (ret)
+		kfree(session);
+	return ret;
+}
+
+static int elfdet_session_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *seq = file->private_data;
+
+	kfree(seq->private);
+	return single_release(inode, file);
+}
+
+/* Bind an open det/threads descriptor to a PID; "0" unbinds it.
+ * The next read from offset 0 reports on the new PID.
+ */
+static ssize_t elfdet_session_write(struct file *file,
+				    const char __user *buffer,
+				    size_t length,
+				    loff_t *offset)
+{
+	struct seq_file *seq = file->private_data;
+	struct elfdet_session *session = seq->private;
+	char input_buf[sizeof(buff)];
+	size_t to_copy;
+	int pid;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	if (kstrtoint(strim(input_buf), 10, &pid) || pid < 0)
+		return -EINVAL;
+
+	WRITE_ONCE(session->pid, pid);
+	return length;
+}
+
+// runs when opening file
+static int elfdet_open(struct inode *inode, struct file *file)
+{
+	return elfdet_session_open(file, elfdet_show); // calling elfdet_show
+}
+
+// runs when opening threads file
+static int elfdet_threads_open(struct inode *inode, struct file *file)
+{
+	return elfdet_session_open(file, elfdet_threads_show);
+}
+
+// file operations of det proc (using proc_ops for kernel 5.6+)
+static const struct proc_ops elfdet_det_ops = {
+	.proc_open = elfdet_open,
+	.proc_read = seq_read,
+	.proc_write = elfdet_session_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = elfdet_session_release,
+};
+
+// file operations of threads proc
+static const struct proc_ops elfdet_threads_ops = {
+	.proc_open = elfdet_threads_open,
+	.proc_read = seq_read,
+	.proc_write = elfdet_session_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = elfdet_session_release,
+};
+
+/* Sum the per-CPU counters and print them, one block per section */
+static int elfdet_stats_show(struct seq_file *m, void *v)
+{
+	struct elfdet_section_stats *sum;
+	u64 opens = 0, reads = 0, writes = 0;
+	u64 lockless = 0, holds = 0, hold_ns = 0, busy = 0, stale = 0;
+	u64 exited = 0, hits = 0, misses = 0, waits = 0;
+	int cpu, sec, b;
+
+	sum = kcalloc(ELFDET_NR_SECTIONS, sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		const struct elfdet_cpu_stats *c = per_cpu_ptr(&elfdet_stats, cpu);
+
+		opens += READ_ONCE(c->pid_opens);
+		reads += READ_ONCE(c->pid_reads);
+		writes += READ_ONCE(c->pid_writes);
+		lockless += READ_ONCE(c->vma_lockless);
+		holds += READ_ONCE(c->mmap_lock_holds);
+		hold_ns += READ_ONCE(c->mmap_lock_hold_ns);
+		busy += READ_ONCE(c->mmap_lock_busy);
+		stale += READ_ONCE(c->vma_stale);
+		exited += READ_ONCE(c->exited);
+		hits += READ_ONCE(c->cache_hits);
+		misses += READ_ONCE(c->cache_misses);
+		waits += READ_ONCE(c->cache_waits);
+		for (sec = 0; sec < ELFDET_NR_SECTIONS; sec++) {
+			const struct elfdet_section_stats *s = &c->sec[sec];
+
+			sum[sec].calls += READ_ONCE(s->calls);
+			sum[sec].total_ns += READ_ONCE(s->total_ns);
+			sum[sec].bytes += READ_ONCE(s->bytes);
+			sum[sec].max_ns = max(sum[sec].max_ns,
+					      READ_ONCE(s->max_ns));
+			for (b = 0; b < ELFDET_HIST_BUCKETS; b++)
+				sum[sec].hist[b] += READ_ONCE(s->hist[b]);
+		}
+	}
+
+	seq_printf(m, "pid_opens: %llu\n", opens);
+	seq_printf(m, "pid_reads: %llu\n", reads);
+	seq_printf(m, "pid_writes: %llu\n", writes);
+	seq_printf(m, "vma_lockless: %llu\n", lockless);
+	seq_printf(m, "mmap_lock_holds: %llu\n", holds);
+	seq_printf(m, "mmap_lock_hold_ns: %llu\n", hold_ns);
+	seq_printf(m, "mmap_lock_busy: %llu\n", busy);
+	seq_printf(m, "vma_stale: %llu\n", stale);
+	seq_printf(m, "exited: %llu\n", exited);
+	seq_printf(m, "cache_ttl_ms: %u\n", READ_ONCE(cache_ttl_ms));
+	seq_printf(m, "cache_generation: %lld\n",
+		   (long long)atomic64_read(&elfdet_cache_gen));
+	seq_printf(m, "cache_hits: %llu\n", hits);
+	seq_printf(m, "cache_misses: %llu\n", misses);
+	seq_printf(m, "cache_waits: %llu\n", waits);
+
+	for (sec = 0; sec < ELFDET_NR_SECTIONS; sec++) {
+		seq_printf(m, "\n[%s]\n", elfdet_section_name(sec));
+		seq_printf(m, "calls: %llu\n", sum[sec].calls);
+		seq_printf(m, "total_ns: %llu\n", sum[sec].total_ns);
+		seq_printf(m, "avg_ns: %llu\n",
+			   sum[sec].calls ?
+				   div64_u64(sum[sec].total_ns, sum[sec].calls) :
+				   0);
+		seq_printf(m, "max_ns: %llu\n", sum[sec].max_ns);
+		seq_printf(m, "bytes: %llu\n", sum[sec].bytes);
+
+		/* Non-empty buckets as "<lower bound ns>:<count>" */
+		seq_puts(m, "hist_ns:");
+		for (b = 0; b < ELFDET_HIST_BUCKETS; b++) {
+			if (sum[sec].hist[b])
+				seq_printf(m, " %llu:%llu", elfdet_hist_lower_ns(b),
+					   sum[sec].hist[b]);
+		}
+		seq_puts(m, "\n");
+	}
+
+	kfree(sum);
+	return 0;
+}
+
+static int elfdet_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, elfdet_stats_show, NULL);
+}
+
+/* Any write resets the counters and invalidates cached results. Sections
+ * running concurrently on other CPUs may survive the reset with partial
+ * values.
+ */
+static ssize_t elfdet_stats_write(struct file *file,
+				  const char __user *buffer,
+				  size_t length,
+				  loff_t *offset)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&elfdet_stats, cpu), 0,
+		       sizeof(struct elfdet_cpu_stats));
+	atomic64_inc(&elfdet_cache_gen);
+	return length;
+}
+
+static const struct proc_ops elfdet_stats_ops = {
+	.proc_open = elfdet_stats_open,
+	.proc_read = seq_read,
+	.proc_write = elfdet_stats_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+// elf proc file_operations starts
+
+// runs when elf opens
+// will be called every time this file is accessed; counted in the stats file
+static int procfile_open(struct inode *inode, struct file *file)
+{
+	this_cpu_inc(elfdet_stats.pid_opens);
+	return 0;
+}
+
+// when we cat elf file this function will be run (this is useless here)
+// because our info is in det file not here!
+static ssize_t procfile_read(struct file *file,
+			     char __user *buffer,
+			     size_t length,
+			     loff_t *offset)
+{
+	static int finished;
+	char tmp[64];
+	int len;
+
+	// normal return value other than '0' will cause loop
+
+	this_cpu_inc(elfdet_stats.pid_reads);
+
+	if (procfile_read_should_finish(&finished))
+		return 0;
+
+	len = format_procfile_output(buff, tmp, sizeof(tmp));
+	if (len < 0)
+		return -EFAULT;
+	if (len > length)
+		len = length;
+	if (copy_to_user(buffer, tmp, len))
+		return -EFAULT;
+	return len;
+}
+
+// most important function of elf! called when we write some characters into it
+static ssize_t procfile_write(struct file *file,
+			      const char __user *buffer,
+			      size_t length,
+			      loff_t *offset)
+{
+	char input_buf[sizeof(buff)];
+	size_t to_copy;
+
+	to_copy = min(length, sizeof(input_buf));
+
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+
+	update_pid_write_buffer(buff, sizeof(buff), input_buf, to_copy);
+	this_cpu_inc(elfdet_stats.pid_writes);
+	return length;
+}
+
+static const struct proc_ops write_pops = {
+	.proc_open = procfile_open,
+	.proc_read = procfile_read,
+	.proc_write = procfile_write, // this is the important part
+};
+
+// lists watched processes, one key=value line each
+static int elfdet_watch_show(struct seq_file *m, void *v)
+{
+	struct elfdet_watch *w;
+	u64 now = ktime_get_ns();
+	int bkt;
+
+	raw_spin_lock(&elfdet_watch_lock);
+	hash_for_each(elfdet_watches, bkt, w, node) {
+		seq_printf(m,
+			   "pid=%d comm=%s age_ms=%llu samples=%llu "
+			   "peak_rss_kb=%lu peak_threads=%d\n",
+			   pid_vnr(w->tgid), w->comm,
+			   (now - w->added_ns) / NSEC_PER_MSEC, w->samples,
+			   w->peak_rss_kb, w->peak_threads);
+	}
+	raw_spin_unlock(&elfdet_watch_lock);
+	return 0;
+}
+
+static int elfdet_watch_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, elfdet_watch_show, NULL);
+}
+
+/* "PID" or "+PID" adds, "-PID" removes, "clear" empties the registry */
+static ssize_t elfdet_watch_write(struct file *file,
+				  const char __user *buffer,
+				  size_t length,
+				  loff_t *offset)
+{
+	char input_buf[32];
+	size_t to_copy;
+	int pid = 0, ret;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	switch (elfdet_parse_watch_cmd(input_buf, &pid)) {
+	case ELFDET_WATCH_ADD:
+		ret = elfdet_watch_add(pid);
+		break;
+	case ELFDET_WATCH_REMOVE:
+		ret = elfdet_watch_remove(pid);
+		break;
+	case ELFDET_WATCH_CLEAR:
+		elfdet_watch_clear();
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : length;
+}
+
+static const struct proc_ops elfdet_watch_ops = {
+	.proc_open = elfdet_watch_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+	.proc_write = elfdet_watch_write,
+};
+
+/* Per-open state of /proc/elf_det/procs: a written generation switches
+ * the descriptor from full listings to changes since that generation.
+ */
+struct elfdet_procs_session {
+	bool since_set;
+	u64 since;
+};
+
+static int elfdet_procs_show(struct seq_file *m, void *v)
+{
+	struct elfdet_procs_session *session = m->private;
+	struct elfdet_proc_change *changes = NULL, *c;
+	struct elfdet_proc *procs = NULL, *e;
+	int nr_procs, nr = 0, bkt, i;
+	bool list, resync;
+	size_t cap, need;
+	u64 gen, g;
+
+	/* Copy under the lock and format after dropping it: the fork, exec
+	 * and exit probes of every CPU spin on it meanwhile. The copy is
+	 * sized from an unlocked peek and redone if the index outgrew it.
+	 */
+	for (;;) {
+		gen = READ_ONCE(elfdet_proc_gen);
+		list = !session->since_set ||
+		       !elfdet_log_covers(session->since, gen, ELFDET_PROC_LOG);
+		if (list) {
+			cap = READ_ONCE(elfdet_nr_procs) + 64;
+			procs = kvmalloc_array(cap, sizeof(*procs), GFP_KERNEL);
+		} else {
+			cap = min_t(u64, gen - session->since + 64,
+				    ELFDET_PROC_LOG);
+			changes = kvmalloc_array(cap, sizeof(*changes),
+						 GFP_KERNEL);
+		}
+		if (!procs && !changes)
+			return -ENOMEM;
+
+		raw_spin_lock(&elfdet_procs_lock);
+		gen = elfdet_proc_gen;
+		resync = session->since_set &&
+			 !elfdet_log_covers(session->since, gen,
+					    ELFDET_PROC_LOG);
+		need = list ? elfdet_nr_procs : gen - session->since;
+		if (list == (!session->since_set || resync) && need <= cap)
+			break;
+		raw_spin_unlock(&elfdet_procs_lock);
+		kvfree(procs);
+		kvfree(changes);
+		procs = NULL;
+		changes = NULL;
+	}
+
+	nr_procs = elfdet_nr_procs;
+	if (list) {
+		hash_for_each(elfdet_procs, bkt, e, node)
+			procs[nr++] = *e;
+	} else {
+		for (g = session->since + 1; g <= gen; g++)
+			changes[nr++] = elfdet_proc_log[g % ELFDET_PROC_LOG];
+	}
+	raw_spin_unlock(&elfdet_procs_lock);
+
+	seq_printf(m, "generation: %llu\n", gen);
+	seq_printf(m, "processes: %d\n", nr_procs);
+	seq_printf(m, "dropped: %lld\n",
+		   (long long)atomic64_read(&elfdet_procs_dropped));
+	/* The ring has moved past the reader: start over */
+	if (resync)
+		seq_puts(m, "resync: 1\n");
+
+	for (i = 0; list && i < nr; i++) {
+		e = &procs[i];
+		seq_printf(m,
+			   "pid=%d ppid=%d start_ns=%llu gen=%llu threads=%d "
+			   "comm=%s exe=%s\n",
+			   e->pid, e->ppid, e->start_ns, e->gen, e->threads,
+			   e->comm, e->exe[0] ? e->exe : "-");
+	}
+	for (i = 0; !list && i < nr; i++) {
+		c = &changes[i];
+		seq_printf(m,
+			   "gen=%llu event=%s pid=%d ppid=%d comm=%s "
+			   "exe=%s\n",
+			   c->gen, elfdet_proc_event_name(c->event),
+			   c->pid, c->ppid, c->comm,
+			   c->exe[0] ? c->exe : "-");
+	}
+	kvfree(procs);
+	kvfree(changes);
+	return 0;
+}
+
+static int elfdet_procs_open(struct inode *inode, struct file *file)
+{
+	struct elfdet_procs_session *session;
+	int ret;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	ret = single_open(file, elfdet_procs_show, session);
+	if (ret)
+		kfree(session);
+	return ret;
+}
+
+/* Write a generation to get changes after it on the next read from
+ * offset 0; "-1" returns the descriptor to full listings.
+ */
+static ssize_t elfdet_procs_write(struct file *file,
+				  const char __user *buffer,
+				  size_t length,
+				  loff_t *offset)
+{
+	struct seq_file *seq = file->private_data;
+	struct elfdet_procs_session *session = seq->private;
+	char input_buf[24];
+	size_t to_copy;
+	u64 since;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	if (strcmp(strim(input_buf), "-1") == 0) {
+		session->since_set = false;
+		return length;
+	}
+	if (kstrtoull(strim(input_buf), 10, &since))
+		return -EINVAL;
+
+	session->since = since;
+	session->since_set = true;
+	return length;
+}
+
+static const struct proc_ops elfdet_procs_ops = {
+	.proc_open = elfdet_procs_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = elfdet_session_release,
+	.proc_write = elfdet_procs_write,
+};
+
+/* Records taken out of the exit buffer when exits was opened */
+struct elfdet_exits_snapshot {
+	int nr;
+	struct elfdet_exit_record rec[];
+};
+
+static int elfdet_exits_show(struct seq_file *m, void *v)
+{
+	struct elfdet_exits_snapshot *snap = m->private;
+	struct elfdet_exit_record *r;
+	char status[24];
+	int i;
+
+	seq_printf(m, "records: %d\n", snap->nr);
+	seq_printf(m, "dropped: %lld\n",
+		   (long long)atomic64_read(&elfdet_exits_dropped));
+	for (i = 0; i < snap->nr; i++) {
+		r = &snap->rec[i];
+		elfdet_format_exit_status(r->exit_code, status, sizeof(status));
+		seq_printf(m,
+			   "pid=%d ppid=%d comm=%s exe=%s lifetime_ns=%llu "
+			   "utime_ns=%llu stime_ns=%llu maxrss_kb=%lu "
+			   "maj_flt=%lu min_flt=%lu rchar=%llu wchar=%llu "
+			   "read_bytes=%llu write_bytes=%llu peak_threads=%d "
+			   "%s\n",
+			   r->pid, r->ppid, r->comm, r->exe[0] ? r->exe : "-",
+			   r->lifetime_ns, r->utime_ns, r->stime_ns,
+			   r->maxrss_kb, r->maj_flt, r->min_flt, r->rchar,
+			   r->wchar, r->read_bytes, r->write_bytes,
+			   r->peak_threads, status);
+	}
+	return 0;
+}
+
+/* Opening drains the buffer: each record is read by exactly one opener */
+static int elfdet_exits_open(struct inode *inode, struct file *file)
+{
+	struct elfdet_exits_snapshot *snap;
+	int ret;
+
+	snap = kvmalloc(struct_size(snap, rec, ELFDET_EXIT_MAX), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	raw_spin_lock(&elfdet_exits_lock);
+	snap->nr = elfdet_nr_exits;
+	memcpy(snap->rec, elfdet_exits, snap->nr * sizeof(snap->rec[0]));
+	elfdet_nr_exits = 0;
+	raw_spin_unlock(&elfdet_exits_lock);
+
+	ret = single_open(file, elfdet_exits_show, snap);
+	if (ret)
+		kvfree(snap);
+	return ret;
+}
+
+static int elfdet_exits_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *seq = file->private_data;
+
+	kvfree(seq->private);
+	return single_release(inode, file);
+}
+
+static const struct proc_ops elfdet_exits_ops = {
+	.proc_open = elfdet_exits_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = elfdet_exits_release,
+};
+
+/* Scheduler tracepoints are not exported to modules by symbol; they are
+ * looked up by name and probed through tracepoint_probe_register().
+ */
+struct elfdet_probe {
+	const char *name;
+	void *probe;
+	void *data; /* passed to the probe as its first argument */
+	struct tracepoint *tp; /* set while registered */
+};
+
+/* Always registered: they keep the process index and exit records */
+static struct elfdet_probe elfdet_probes[] = {
+	{ .name = "sched_process_fork", .probe = elfdet_probe_process_fork },
+	{ .name = "sched_process_exec", .probe = elfdet_probe_process_exec },
+	{ .name = "sched_process_exit", .probe = elfdet_probe_process_exit },
+};
+
+static void elfdet_match_tracepoint(struct tracepoint *tp, void *priv)
+{
+	struct elfdet_probe *p = priv;
+
+	if (!p->tp && strcmp(tp->name, p->name) == 0)
+		p->tp = tp;
+}
+
+static void elfdet_probes_unregister(struct elfdet_probe *probes, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!probes[i].tp)
+			continue;
+		tracepoint_probe_unregister(probes[i].tp, probes[i].probe,
+					    probes[i].data);
+		probes[i].tp = NULL;
+	}
+	/* No probe may still be running when its state is freed */
+	tracepoint_synchronize_unregister();
+}
+
+static int elfdet_probes_register(struct elfdet_probe *probes, int n)
+{
+	struct elfdet_probe *p;
+	int i, ret;
+
+	for (i = 0; i < n; i++) {
+		p = &probes[i];
+		for_each_kernel_tracepoint(elfdet_match_tracepoint, p);
+		if (!p->tp) {
+			pr_err("elf_det: tracepoint %s not found\n", p->name);
+			ret = -ENOENT;
+			goto err;
+		}
+		ret = tracepoint_probe_register(p->tp, p->probe, p->data);
+		if (ret) {
+			p->tp = NULL;
+			goto err;
+		}
+	}
+	return 0;
+
+err:
+	elfdet_probes_unregister(probes, n);
+	return ret;
+}
+
+/* Off-CPU stacks (/proc/elf_det/offcpu): while started for a process,
+ * a sched_switch probe saves the kernel stack of each of its threads
+ * that leaves the CPU blocked (S or D) and, when the thread runs again,
+ * charges the time it was off CPU to that stack. The probe is only
+ * registered while profiling, so the scheduler pays nothing otherwise.
+ */
+#define ELFDET_OFFCPU_DEPTH 32
+#define ELFDET_OFFCPU_STACKS 1024
+#define ELFDET_OFFCPU_SLOTS 2048 /* stack hash index, power of two */
+#define ELFDET_OFFCPU_BLOCKED 1024 /* by TID, power of two */
+
+struct elfdet_offcpu_stack {
+	u32 hash;
+	u32 nr;
+	char comm[TASK_COMM_LEN];
+	u64 count; /* times a thread blocked here */
+	u64 ns; /* time off CPU after blocking here */
+	unsigned long ips[ELFDET_OFFCPU_DEPTH]; /* innermost first */
+};
+
+/* A blocked thread and its stack; a direct-mapped slot per TID */
+struct elfdet_offcpu_blocked {
+	pid_t tid; /* 0 if free */
+	u32 stack;
+	u64 since_ns;
+};
+
+struct elfdet_offcpu {
+	raw_spinlock_t lock; /* stacks, index and blocked */
+	struct pid *tgid;
+	int pid;
+	bool running;
+	u64 started_ns, stopped_ns;
+	u32 nr_stacks;
+	u64 dropped;
+	u16 index[ELFDET_OFFCPU_SLOTS]; /* stack + 1, 0 if free */
+	struct elfdet_offcpu_blocked blocked[ELFDET_OFFCPU_BLOCKED];
+	struct elfdet_offcpu_stack stacks[ELFDET_OFFCPU_STACKS];
+};
+
+/* Profile of the last start; kept after stop until the next start */
+static struct elfdet_offcpu *elfdet_offcpu;
+static DEFINE_MUTEX(elfdet_offcpu_mutex); /* start/stop/read vs. free */
+
+/* Caller holds oc->lock. Returns the stack's index or U32_MAX if full. */
+static u32 elfdet_offcpu_stack(struct elfdet_offcpu *oc, u32 hash,
+			       const char *comm, const unsigned long *ips,
+			       u32 nr)
+{
+	struct elfdet_offcpu_stack *st;
+	u32 slot = hash & (ELFDET_OFFCPU_SLOTS - 1), i;
+
+	for (i = 0; i < ELFDET_OFFCPU_SLOTS; i++) {
+		if (!oc->index[slot])
+			break;
+		st = &oc->stacks[oc->index[slot] - 1];
+		if (st->hash == hash && st->nr == nr &&
+		    !strcmp(st->comm, comm) &&
+		    !memcmp(st->ips, ips, nr * sizeof(*ips)))
+			return oc->index[slot] - 1;
+		slot = (slot + 1) & (ELFDET_OFFCPU_SLOTS - 1);
+	}
+	if (i == ELFDET_OFFCPU_SLOTS || oc->nr_stacks == ELFDET_OFFCPU_STACKS)
+		return U32_MAX;
+
+	st = &oc->stacks[oc->nr_stacks];
+	st->hash = hash;
+	st->nr = nr;
+	strscpy(st->comm, comm, sizeof(st->comm));
+	memcpy(st->ips, ips, nr * sizeof(*ips));
+	oc->index[slot] = ++oc->nr_stacks;
+	return oc->nr_stacks - 1;
+}
+
+static void elfdet_offcpu_drop(struct elfdet_offcpu *oc, pid_t tid)
+{
+	trace_elfdet_dropped("offcpu", tid, ++oc->dropped);
+}
+
+/* Runs in __schedule() with the runqueue locked and IRQs off; prev is
+ * current, so stack_trace_save() sees the stack it blocks in.
+ */
+static void elfdet_probe_sched_switch(void *data, bool preempt,
+				      struct task_struct *prev,
+				      struct task_struct *next,
+				      unsigned int prev_state)
+{
+	struct elfdet_offcpu *oc = data;
+	struct elfdet_offcpu_blocked *b;
+	unsigned long ips[ELFDET_OFFCPU_DEPTH];
+	u32 nr, hash, stack;
+	bool blocks, wakes;
+	u64 now;
+
+	blocks = task_tgid(prev) == oc->tgid && !preempt &&
+		 (prev_state & (TASK_INTERRUPTIBLE | TASK_UNINTERRUPTIBLE));
+	wakes = task_tgid(next) == oc->tgid;
+	if (!blocks && !wakes)
+		return;
+	now = ktime_get_ns();
+
+	if (wakes) {
+		b = &oc->blocked[next->pid & (ELFDET_OFFCPU_BLOCKED - 1)];
+		raw_spin_lock(&oc->lock);
+		if (b->tid == next->pid) {
+			oc->stacks[b->stack].ns += now - b->since_ns;
+			b->tid = 0;
+		}
+		raw_spin_unlock(&oc->lock);
+	}
+	if (!blocks)
+		return;
+
+	nr = stack_trace_save(ips, ELFDET_OFFCPU_DEPTH, 0);
+	hash = jhash(ips, nr * sizeof(*ips),
+		     jhash(prev->comm, strnlen(prev->comm, TASK_COMM_LEN), 0));
+	b = &oc->blocked[prev->pid & (ELFDET_OFFCPU_BLOCKED - 1)];
+
+	raw_spin_lock(&oc->lock);
+	stack = elfdet_offcpu_stack(oc, hash, prev->comm, ips, nr);
+	if (stack == U32_MAX) {
+		elfdet_offcpu_drop(oc, prev->pid);
+	} else {
+		oc->stacks[stack].count++;
+		/* A thread that died blocked leaves its slot behind */
+		if (b->tid && b->tid != prev->pid)
+			elfdet_offcpu_drop(oc, b->tid);
+		b->tid = prev->pid;
+		b->stack = stack;
+		b->since_ns = now;
+	}
+	raw_spin_unlock(&oc->lock);
+}
+
+static struct elfdet_probe elfdet_offcpu_probes[] = {
+	{ .name = "sched_switch", .probe = elfdet_probe_sched_switch },
+};
+
+/* Caller holds elfdet_offcpu_mutex */
+static void elfdet_offcpu_stop(void)
+{
+	struct elfdet_offcpu *oc = elfdet_offcpu;
+
+	if (!oc || !oc->running)
+		return;
+	elfdet_probes_unregister(elfdet_offcpu_probes,
+				 ARRAY_SIZE(elfdet_offcpu_probes));
+	oc->running = false;
+	oc->stopped_ns = ktime_get_ns();
+}
+
+/* Start a new profile of the process of pid, replacing the last one */
+static int elfdet_offcpu_start(int pid)
+{
+	struct elfdet_offcpu *oc;
+	struct task_struct *task;
+	struct pid *tgid;
+	int ret;
+
+	task = elfdet_get_task(pid);
+	if (!task)
+		return -ESRCH;
+	tgid = get_pid(task_tgid(task));
+	put_task_struct(task);
+
+	mutex_lock(&elfdet_offcpu_mutex);
+	elfdet_offcpu_stop();
+	oc = elfdet_offcpu;
+	if (!oc) {
+		oc = vmalloc(sizeof(*oc));
+		if (!oc) {
+			mutex_unlock(&elfdet_offcpu_mutex);
+			put_pid(tgid);
+			return -ENOMEM;
+		}
+		elfdet_offcpu = oc;
+	} else {
+		put_pid(oc->tgid);
+	}
+	memset(oc, 0, sizeof(*oc));
+	raw_spin_lock_init(&oc->lock);
+	oc->tgid = tgid;
+	oc->pid = pid;
+	oc->started_ns = ktime_get_ns();
+
+	elfdet_offcpu_probes[0].data = oc;
+	ret = elfdet_probes_register(elfdet_offcpu_probes,
+				     ARRAY_SIZE(elfdet_offcpu_probes));
+	if (!ret)
+		oc->running = true;
+	else
+		oc->stopped_ns = oc->started_ns;
+	mutex_unlock(&elfdet_offcpu_mutex);
+	return ret;
+}
+
+static void elfdet_offcpu_free(void)
+{
+	mutex_lock(&elfdet_offcpu_mutex);
+	elfdet_offcpu_stop();
+	if (elfdet_offcpu) {
+		put_pid(elfdet_offcpu->tgid);
+		vfree(elfdet_offcpu);
+		elfdet_offcpu = NULL;
+	}
+	mutex_unlock(&elfdet_offcpu_mutex);
+}
+
+/* Per-open settings of /proc/elf_det/offcpu */
+struct elfdet_offcpu_session {
+	bool weight_ns; /* weigh stacks by microseconds off CPU */
+};
+
+/* Print one stack in folded form, outermost frame first. Frames from
+ * the probe down to __schedule() are the same for every stack and left
+ * out.
+ */
+static void elfdet_offcpu_fold(struct seq_file *m,
+			       const struct elfdet_offcpu_stack *st, u64 value)
+{
+	char sym[KSYM_SYMBOL_LEN];
+	int i, first = 0;
+
+	for (i = 0; i < (int)st->nr; i++) {
+		snprintf(sym, sizeof(sym), "%ps", (void *)st->ips[i]);
+		if (!strcmp(sym, "__schedule")) {
+			first = i + 1;
+			break;
+		}
+	}
+
+	seq_puts(m, st->comm);
+	for (i = st->nr - 1; i >= first; i--)
+		seq_printf(m, ";%ps", (void *)st->ips[i]);
+	seq_printf(m, " %llu\n", value);
+}
+
+static int elfdet_offcpu_show(struct seq_file *m, void *v)
+{
+	struct elfdet_offcpu_session *session = m->private;
+	struct elfdet_offcpu_stack *st;
+	struct elfdet_offcpu *oc;
+	u64 end_ns, dropped;
+	u32 i, nr;
+
+	mutex_lock(&elfdet_offcpu_mutex);
+	oc = elfdet_offcpu;
+	if (!oc) {
+		mutex_unlock(&elfdet_offcpu_mutex);
+		seq_puts(m, "# not started; write a PID to start\n");
+		return 0;
+	}
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (!st) {
+		mutex_unlock(&elfdet_offcpu_mutex);
+		return -ENOMEM;
+	}
+
+	raw_spin_lock(&oc->lock);
+	nr = oc->nr_stacks;
+	dropped = oc->dropped;
+	raw_spin_unlock(&oc->lock);
+	end_ns = oc->running ? ktime_get_ns() : oc->stopped_ns;
+
+	seq_printf(m,
+		   "# pid=%d running=%d window_ms=%llu stacks=%u dropped=%llu "
+		   "weight=%s\n",
+		   oc->pid, oc->running,
+		   (end_ns - oc->started_ns) / NSEC_PER_MSEC, nr, dropped,
+		   session->weight_ns ? "us" : "count");
+	for (i = 0; i < nr; i++) {
+		/* Stacks are only appended; copy one at a time */
+		raw_spin_lock(&oc->lock);
+		*st = oc->stacks[i];
+		raw_spin_unlock(&oc->lock);
+		elfdet_offcpu_fold(m, st, session->weight_ns ?
+					  st->ns / NSEC_PER_USEC : st->count);
+	}
+	mutex_unlock(&elfdet_offcpu_mutex);
+	kfree(st);
+	return 0;
+}
+
+static int elfdet_offcpu_open(struct inode *inode, struct file *file)
+{
+	struct elfdet_offcpu_session *session;
+	int ret;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	ret = single_open(file, elfdet_offcpu_show, session);
+	if (ret)
+		kfree(session);
+	return ret;
+}
+
+/* "PID" starts profiling, "0"/"stop" stops; "weight=us" or
+ * "weight=count" only changes how this open file prints the stacks.
+ */
+static ssize_t elfdet_offcpu_write(struct file *file,
+				   const char __user *buffer,
+				   size_t length,
+				   loff_t *offset)
+{
+	struct seq_file *seq = file->private_data;
+	struct elfdet_offcpu_session *session = seq->private;
+	char input_buf[32];
+	unsigned int arg;
+	size_t to_copy;
+	int pid, ret;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	if (strcmp(strim(input_buf), "weight=us") == 0) {
+		session->weight_ns = true;
+		return length;
+	}
+	if (strcmp(strim(input_buf), "weight=count") == 0) {
+		session->weight_ns = false;
+		return length;
+	}
+
+	switch (elfdet_parse_profile_cmd(input_buf, &pid, &arg)) {
+	case ELFDET_PROFILE_START:
+		ret = arg ? -EINVAL : elfdet_offcpu_start(pid);
+		break;
+	case ELFDET_PROFILE_STOP:
+		mutex_lock(&elfdet_offcpu_mutex);
+		elfdet_offcpu_stop();
+		mutex_unlock(&elfdet_offcpu_mutex);
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : length;
+}
+
+static const struct proc_ops elfdet_offcpu_ops = {
+	.proc_open = elfdet_offcpu_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = elfdet_session_release,
+	.proc_write = elfdet_offcpu_write,
+};
+
+/* On-CPU profile (/proc/elf_det/profile): a pinned hrtimer on every
+ * online CPU fires at the chosen frequency and, when the interrupted task
+ * belongs to the profiled process, counts the user-space instruction
+ * pointer in that CPU's table. A thread interrupted in the kernel is
+ * counted at the user address it entered the kernel from. Addresses are
+ * attributed to VMAs only when the profile is read.
+ */
+#define ELFDET_PROFILE_SLOT_BITS 10 /* distinct addresses per CPU */
+#define ELFDET_PROFILE_SLOTS (1 << ELFDET_PROFILE_SLOT_BITS)
+#define ELFDET_PROFILE_PROBES 16
+#define ELFDET_PROFILE_HZ 99
+#define ELFDET_PROFILE_MAX_HZ 10000
+#define ELFDET_PROFILE_TOP 64 /* addresses listed by a read */
+
+struct elfdet_profile_slot {
+	unsigned long ip;
+	u64 count; /* 0 if free */
+};
+
+struct elfdet_profile;
+
+struct elfdet_profile_cpu {
+	struct hrtimer timer;
+	struct elfdet_profile *profile;
+	raw_spinlock_t lock; /* taken in hardirq context */
+	u64 samples, dropped;
+	u32 used;
+	struct elfdet_profile_slot slots[ELFDET_PROFILE_SLOTS];
+};
+
+struct elfdet_profile {
+	struct pid *tgid;
+	int pid;
+	unsigned int hz;
+	u64 period_ns;
+	bool running;
+	u64 started_ns, stopped_ns;
+	struct elfdet_profile_cpu *cpu; /* nr_cpu_ids entries */
+};
+
+/* Profile of the last start; kept after stop until the next start */
+static struct elfdet_profile *elfdet_profile;
+static DEFINE_MUTEX(elfdet_profile_mutex); /* start/stop/read vs. free */
+
+static void elfdet_profile_count(struct elfdet_profile_cpu *pc,
+				 unsigned long ip)
+{
+	struct elfdet_profile_slot *slot;
+	u32 h = hash_long(ip, ELFDET_PROFILE_SLOT_BITS), i;
+
+	pc->samples++;
+	for (i = 0; i < ELFDET_PROFILE_PROBES; i++) {
+		slot = &pc->slots[(h + i) & (ELFDET_PROFILE_SLOTS - 1)];
+		if (slot->count && slot->ip == ip) {
+			slot->count++;
+			return;
+		}
+		if (!slot->count) {
+			slot->ip = ip;
+			slot->count = 1;
+			pc->used++;
+			return;
+		}
+	}
+	trace_elfdet_dropped("profile", current->pid, ++pc->dropped);
+}
+
+static enum hrtimer_restart elfdet_profile_tick(struct hrtimer *timer)
+{
+	struct elfdet_profile_cpu *pc =
+		container_of(timer, struct elfdet_profile_cpu, timer);
+	struct elfdet_profile *pr = pc->profile;
+	u64 start = ktime_get_ns();
+
+	hrtimer_forward_now(timer, ns_to_ktime(pr->period_ns));
+	if (task_tgid(current) != pr->tgid || (current->flags & PF_KTHREAD))
+		return HRTIMER_RESTART;
+
+	raw_spin_lock(&pc->lock);
+	elfdet_profile_count(pc,
+			     instruction_pointer(task_pt_regs(current)));
+	raw_spin_unlock(&pc->lock);
+	trace_elfdet_sampler_tick("profile", current->pid,
+				  ktime_get_ns() - start);
+	return HRTIMER_RESTART;
+}
+
+/* Runs on each online CPU through on_each_cpu() */
+static void elfdet_profile_start_cpu(void *info)
+{
+	struct elfdet_profile *pr = info;
+	struct elfdet_profile_cpu *pc = &pr->cpu[smp_processor_id()];
+
+	hrtimer_start(&pc->timer, ns_to_ktime(pr->period_ns),
+		      HRTIMER_MODE_REL_PINNED);
+}
+
+static struct elfdet_profile *elfdet_profile_alloc(void)
+{
+	struct elfdet_profile_cpu *pc;
+	struct elfdet_profile *pr;
+	unsigned int cpu;
+
+	pr = kzalloc(sizeof(*pr), GFP_KERNEL);
+	if (!pr)
+		return NULL;
+	pr->cpu = kvcalloc(nr_cpu_ids, sizeof(*pr->cpu), GFP_KERNEL);
+	if (!pr->cpu) {
+		kfree(pr);
+		return NULL;
+	}
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		pc = &pr->cpu[cpu];
+		pc->profile = pr;
+		raw_spin_lock_init(&pc->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+		hrtimer_setup(&pc->timer, elfdet_profile_tick, CLOCK_MONOTONIC,
+			      HRTIMER_MODE_REL_PINNED);
+#else
+		hrtimer_init(&pc->timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL_PINNED);
+		pc->timer.function = elfdet_profile_tick;
+#endif
+	}
+	return pr;
+}
+
+/* Caller holds elfdet_profile_mutex */
+static void elfdet_profile_stop(void)
+{
+	struct elfdet_profile *pr = elfdet_profile;
+	unsigned int cpu;
+
+	if (!pr || !pr->running)
+		return;
+	/* Also cancels timers that CPU hot-unplug moved to another CPU */
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		hrtimer_cancel(&pr->cpu[cpu].timer);
+	pr->running = false;
+	pr->stopped_ns = ktime_get_ns();
+}
+
+/* Start a new profile of the process of pid at hz, replacing the last */
+static int elfdet_profile_start(int pid, unsigned int hz)
+{
+	struct elfdet_profile_cpu *pc;
+	struct elfdet_profile *pr;
+	struct task_struct *task;
+	unsigned int cpu;
+
+	if (!hz)
+		hz = ELFDET_PROFILE_HZ;
+	if (hz > ELFDET_PROFILE_MAX_HZ)
+		return -EINVAL;
+	task = elfdet_get_task(pid);
+	if (!task)
+		return -ESRCH;
+
+	mutex_lock(&elfdet_profile_mutex);
+	elfdet_profile_stop();
+	pr = elfdet_profile;
+	if (!pr) {
+		pr = elfdet_profile_alloc();
+		if (!pr) {
+			mutex_unlock(&elfdet_profile_mutex);
+			put_task_struct(task);
+			return -ENOMEM;
+		}
+		elfdet_profile = pr;
+	}
+	put_pid(pr->tgid);
+	pr->tgid = get_pid(task_tgid(task));
+	put_task_struct(task);
+	pr->pid = pid;
+	pr->hz = hz;
+	pr->period_ns = NSEC_PER_SEC / hz;
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		pc = &pr->cpu[cpu];
+		memset(pc->slots, 0, sizeof(pc->slots));
+		pc->used = 0;
+		pc->samples = 0;
+		pc->dropped = 0;
+	}
+	pr->started_ns = ktime_get_ns();
+	pr->running = true;
+	/* CPUs brought online later are not sampled */
+	cpus_read_lock();
+	on_each_cpu(elfdet_profile_start_cpu, pr, 1);
+	cpus_read_unlock();
+	mutex_unlock(&elfdet_profile_mutex);
+	return 0;
+}
+
+static void elfdet_profile_free(void)
+{
+	mutex_lock(&elfdet_profile_mutex);
+	elfdet_profile_stop();
+	if (elfdet_profile) {
+		put_pid(elfdet_profile->tgid);
+		kvfree(elfdet_profile->cpu);
+		kfree(elfdet_profile);
+		elfdet_profile = NULL;
+	}
+	mutex_unlock(&elfdet_profile_mutex);
+}
+
+/* A sampled address with its count, merged over all CPUs */
+struct elfdet_profile_hit {
+	unsigned long ip;
+	u64 count;
+	u32 vma; /* index into the read's VMA list */
+};
+
+/* A VMA that holds sampled addresses, as seen when the profile is read */
+struct elfdet_profile_vma {
+	unsigned long start, end, pgoff;
+	int region;
+	u64 count;
+	char name[64];
+};
+
+static int elfdet_cmp_hit_ip(const void *a, const void *b)
+{
+	const struct elfdet_profile_hit *x = a, *y = b;
+
+	return (x->ip > y->ip) - (x->ip < y->ip);
+}
+
+static int elfdet_cmp_hit_count(const void *a, const void *b)
+{
+	const struct elfdet_profile_hit *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+static int elfdet_cmp_vma_count(const void *a, const void *b)
+{
+	const struct elfdet_profile_vma *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+static void elfdet_profile_vma_fill(struct elfdet_profile_vma *pv,
+				    struct mm_struct *mm,
+				    struct vm_area_struct *vma,
+				    const struct elfdet_mm_bounds *b)
+{
+	struct file *exe = mm->exe_file; /* stable under mmap_lock */
+	const char *special = NULL;
+
+	pv->start = vma->vm_start;
+	pv->end = vma->vm_end;
+	pv->pgoff = vma->vm_file ? vma->vm_pgoff : 0;
+	if (!vma->vm_file && vma->vm_ops && vma->vm_ops->name)
+		special = vma->vm_ops->name(vma);
+	pv->region = elfdet_classify_vma(
+		b, vma->vm_start, vma->vm_end,
+		vma->vm_file && exe &&
+			file_inode(vma->vm_file) == file_inode(exe),
+		vma->vm_file != NULL, special != NULL);
+
+	if (vma->vm_file)
+		snprintf(pv->name, sizeof(pv->name), "%pD", vma->vm_file);
+	else if (special)
+		strscpy(pv->name, special, sizeof(pv->name));
+	else
+		strscpy(pv->name, "[anon]", sizeof(pv->name));
+}
+
+/* Attribute the hits, sorted by address, to the VMAs of the process.
+ * Returns the number of VMAs filled in, or 0 if the process is gone.
+ */
+static u32 elfdet_profile_attribute(struct elfdet_profile *pr,
+				    struct elfdet_profile_hit *hits, u32 nr,
+				    struct elfdet_profile_vma *vmas)
+{
+	struct elfdet_mm_bounds b;
+	struct vm_area_struct *vma = NULL;
+	struct task_struct *task;
+	struct mm_struct *mm;
+	u32 i, nr_vmas = 0;
+
+	task = get_pid_task(pr->tgid, PIDTYPE_TGID);
+	if (!task)
+		return 0;
+	mm = get_task_mm(task);
+	put_task_struct(task);
+	if (!mm)
+		return 0;
+	if (mmap_read_lock_killable(mm)) {
+		mmput(mm);
+		return 0;
+	}
+
+	b.start_code = mm->start_code;
+	b.end_code = mm->end_code;
+	b.start_brk = mm->start_brk;
+	b.brk = mm->brk;
+	b.start_stack = mm->start_stack;
+
+	for (i = 0; i < nr; i++) {
+		if (!vma || hits[i].ip >= vma->vm_end) {
+			vma = find_vma(mm, hits[i].ip);
+			if (vma && hits[i].ip < vma->vm_start)
+				vma = NULL;
+			if (vma)
+				elfdet_profile_vma_fill(&vmas[nr_vmas++], mm,
+							vma, &b);
+		}
+		if (!vma) {
+			hits[i].vma = U32_MAX;
+			continue;
+		}
+		hits[i].vma = nr_vmas - 1;
+		vmas[nr_vmas - 1].count += hits[i].count;
+	}
+
+	mmap_read_unlock(mm);
+	mmput(mm);
+	return nr_vmas;
+}
+
+static void elfdet_profile_print_pct(struct seq_file *m, u64 count, u64 total)
+{
+	u64 pmy = compute_usage_permyriad(count, total);
+
+	seq_printf(m, "samples=%llu pct=%llu.%02llu", count, pmy / 100,
+		   pmy % 100);
+}
+
+static int elfdet_profile_show(struct seq_file *m, void *v)
+{
+	struct elfdet_profile_hit *hits = NULL;
+	struct elfdet_profile_vma *vmas = NULL;
+	const struct elfdet_profile_vma *pv;
+	struct elfdet_profile_slot *slot;
+	struct elfdet_profile_cpu *pc;
+	struct elfdet_profile *pr;
+	u64 samples = 0, dropped = 0, end_ns;
+	u32 cap = 0, nr = 0, nr_vmas, i, j;
+	unsigned int cpu;
+	int ret = 0;
+
+	mutex_lock(&elfdet_profile_mutex);
+	pr = elfdet_profile;
+	if (!pr) {
+		seq_puts(m, "# not started; write a PID to start\n");
+		goto out;
+	}
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		cap += READ_ONCE(pr->cpu[cpu].used);
+	hits = kvmalloc_array(max(cap, 1U), sizeof(*hits), GFP_KERNEL);
+	if (!hits) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* Addresses first seen after the count above are left out */
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		pc = &pr->cpu[cpu];
+		raw_spin_lock_irq(&pc->lock);
+		samples += pc->samples;
+		dropped += pc->dropped;
+		for (j = 0; j < ELFDET_PROFILE_SLOTS && nr < cap; j++) {
+			slot = &pc->slots[j];
+			if (!slot->count)
+				continue;
+			hits[nr].ip = slot->ip;
+			hits[nr].vma = U32_MAX;
+			hits[nr++].count = slot->count;
+		}
+		raw_spin_unlock_irq(&pc->lock);
+	}
+
+	/* Merge the counts of an address sampled on several CPUs */
+	sort(hits, nr, sizeof(*hits), elfdet_cmp_hit_ip, NULL);
+	for (i = 0, j = 0; i < nr; i++) {
+		if (j && hits[j - 1].ip == hits[i].ip)
+			hits[j - 1].count += hits[i].count;
+		else
+			hits[j++] = hits[i];
+	}
+	nr = j;
+
+	vmas = kvmalloc_array(max(nr, 1U), sizeof(*vmas), GFP_KERNEL);
+	if (!vmas) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(vmas, 0, max(nr, 1U) * sizeof(*vmas));
+	nr_vmas = elfdet_profile_attribute(pr, hits, nr, vmas);
+
+	end_ns = pr->running ? ktime_get_ns() : pr->stopped_ns;
+	seq_printf(m,
+		   "# pid=%d hz=%u running=%d window_ms=%llu samples=%llu "
+		   "addresses=%u dropped=%llu\n",
+		   pr->pid, pr->hz, pr->running,
+		   (end_ns - pr->started_ns) / NSEC_PER_MSEC, samples, nr,
+		   dropped);
+
+	/* The hits keep their VMA index, so sort them before the VMAs */
+	sort(hits, nr, sizeof(*hits), elfdet_cmp_hit_count, NULL);
+	seq_puts(m, "[addr]\n");
+	for (i = 0; i < nr && i < ELFDET_PROFILE_TOP; i++) {
+		elfdet_profile_print_pct(m, hits[i].count, samples);
+		if (hits[i].vma == U32_MAX) {
+			seq_printf(m, " ip=0x%lx region=%s\n", hits[i].ip,
+				   elfdet_region_name(ELFDET_REGION_UNMAPPED));
+			continue;
+		}
+		/* offset is a file offset for file-backed mappings */
+		pv = &vmas[hits[i].vma];
+		seq_printf(m, " ip=0x%lx region=%s offset=0x%lx name=%s\n",
+			   hits[i].ip, elfdet_region_name(pv->region),
+			   hits[i].ip - pv->start + (pv->pgoff << PAGE_SHIFT),
+			   pv->name);
+	}
+	if (nr > ELFDET_PROFILE_TOP)
+		seq_printf(m, "# %u more addresses\n", nr - ELFDET_PROFILE_TOP);
+
+	sort(vmas, nr_vmas, sizeof(*vmas), elfdet_cmp_vma_count, NULL);
+	seq_puts(m, "[vma]\n");
+	for (i = 0; i < nr_vmas; i++) {
+		pv = &vmas[i];
+		elfdet_profile_print_pct(m, pv->count, samples);
+		seq_printf(m, " region=%s start=0x%lx end=0x%lx name=%s\n",
+			   elfdet_region_name(pv->region), pv->start, pv->end,
+			   pv->name);
+	}
+
+out:
+	mutex_unlock(&elfdet_profile_mutex);
+	kvfree(vmas);
+	kvfree(hits);
+	return ret;
+}
+
+static int elfdet_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, elfdet_profile_show, NULL);
+}
+
+/* "PID [HZ]" starts profiling at HZ (default 99), "0"/"stop" stops */
+static ssize_t elfdet_profile_write(struct file *file,
+				    const char __user *buffer,
+				    size_t length,
+				    loff_t *offset)
+{
+	char input_buf[32];
+	unsigned int hz;
+	size_t to_copy;
+	int pid, ret;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	switch (elfdet_parse_profile_cmd(input_buf, &pid, &hz)) {
+	case ELFDET_PROFILE_START:
+		ret = elfdet_profile_start(pid, hz);
+		break;
+	case ELFDET_PROFILE_STOP:
+		mutex_lock(&elfdet_profile_mutex);
+		elfdet_profile_stop();
+		mutex_unlock(&elfdet_profile_mutex);
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : length;
+}
+
+static const struct proc_ops elfdet_profile_ops = {
+	.proc_open = elfdet_profile_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+	.proc_write = elfdet_profile_write,
+};
+
+/* Futex contention (/proc/elf_det/futex): while started for a process,
+ * probes on the raw syscall tracepoints time every futex() call of its
+ * threads that may sleep (waits and PI locks) and charge the time to the
+ * thread, to the futex address and to the (thread, address) pair. The
+ * pairs name the threads behind each hot lock, and each thread's worst
+ * address is shown next to its other columns in /proc/elf_det/threads.
+ */
+#define ELFDET_FUTEX_THREADS 1024 /* power of two */
+#define ELFDET_FUTEX_ADDRS 1024 /* power of two */
+#define ELFDET_FUTEX_PAIRS 4096 /* power of two */
+#define ELFDET_FUTEX_TOP 32 /* addresses printed */
+#define ELFDET_FUTEX_TIDS 8 /* waiters listed per address */
+
+struct elfdet_futex_thread {
+	pid_t tid; /* 0 if free */
+	u32 pair; /* in the current wait, U32_MAX if not waiting */
+	u32 top; /* pair with the most wait time, U32_MAX if none */
+	unsigned long top_uaddr; /* its address */
+	char comm[TASK_COMM_LEN];
+	u64 since_ns;
+	u64 waits;
+	u64 ns;
+	u64 max_ns;
+};
+
+struct elfdet_futex_addr {
+	unsigned long uaddr; /* 0 if free */
+	u32 waiters; /* threads in futex() on it now */
+	u32 peak_waiters;
+	u32 threads; /* distinct threads that waited on it */
+	u64 waits;
+	u64 ns;
+};
+
+struct elfdet_futex_pair {
+	pid_t tid; /* 0 if free */
+	u32 addr;
+	unsigned long uaddr;
+	u64 waits;
+	u64 ns;
+};
+
+struct elfdet_futex {
+	raw_spinlock_t lock; /* the tables and counters */
+	struct pid *tgid;
+	int pid;
+	bool running;
+	u64 started_ns, stopped_ns;
+	u64 waits;
+	u64 dropped;
+	u32 nr_threads, nr_addrs, nr_pairs;
+	struct elfdet_futex_thread threads[ELFDET_FUTEX_THREADS];
+	struct elfdet_futex_addr addrs[ELFDET_FUTEX_ADDRS];
+	struct elfdet_futex_pair pairs[ELFDET_FUTEX_PAIRS];
+};
+
+/* Profile of the last start; kept after stop until the next start */
+static struct elfdet_futex *elfdet_futex;
+static DEFINE_MUTEX(elfdet_futex_mutex); /* start/stop/read vs. free */
+
+/* Open-addressed lookups; caller holds fx->lock. Each table is filled
+ * to at most 3/4 so probing stays short; U32_MAX means it is full.
+ */
+static u32 elfdet_futex_thread_slot(struct elfdet_futex *fx, pid_t tid,
+				    bool add)
+{
+	u32 slot = hash_32(tid, ilog2(ELFDET_FUTEX_THREADS)), i;
+	struct elfdet_futex_thread *t;
+
+	for (i = 0; i < ELFDET_FUTEX_THREADS; i++) {
+		t = &fx->threads[slot];
+		if (t->tid == tid)
+			return slot;
+		if (!t->tid)
+			break;
+		slot = (slot + 1) & (ELFDET_FUTEX_THREADS - 1);
+	}
+	if (!add || fx->nr_threads >= ELFDET_FUTEX_THREADS / 4 * 3)
+		return U32_MAX;
+	fx->nr_threads++;
+	t->tid = tid;
+	t->pair = U32_MAX;
+	t->top = U32_MAX;
+	strscpy(t->comm, current->comm, sizeof(t->comm));
+	return slot;
+}
+
+static u32 elfdet_futex_addr_slot(struct elfdet_futex *fx,
+				  unsigned long uaddr)
+{
+	u32 slot = hash_long(uaddr, ilog2(ELFDET_FUTEX_ADDRS)), i;
+	struct elfdet_futex_addr *a;
+
+	for (i = 0; i < ELFDET_FUTEX_ADDRS; i++) {
+		a = &fx->addrs[slot];
+		if (a->uaddr == uaddr)
+			return slot;
+		if (!a->uaddr)
+			break;
+		slot = (slot + 1) & (ELFDET_FUTEX_ADDRS - 1);
+	}
+	if (fx->nr_addrs >= ELFDET_FUTEX_ADDRS / 4 * 3)
+		return U32_MAX;
+	fx->nr_addrs++;
+	a->uaddr = uaddr;
+	return slot;
+}
+
+static u32 elfdet_futex_pair_slot(struct elfdet_futex *fx, pid_t tid,
+				  u32 addr, unsigned long uaddr)
+{
+	u32 slot = hash_32(tid ^ (addr << 16), ilog2(ELFDET_FUTEX_PAIRS)), i;
+	struct elfdet_futex_pair *p;
+
+	for (i = 0; i < ELFDET_FUTEX_PAIRS; i++) {
+		p = &fx->pairs[slot];
+		if (p->tid == tid && p->addr == addr)
+			return slot;
+		if (!p->tid)
+			break;
+		slot = (slot + 1) & (ELFDET_FUTEX_PAIRS - 1);
+	}
+	if (fx->nr_pairs >= ELFDET_FUTEX_PAIRS / 4 * 3)
+		return U32_MAX;
+	fx->nr_pairs++;
+	p->tid = tid;
+	p->addr = addr;
+	p->uaddr = uaddr;
+	fx->addrs[addr].threads++;
+	return slot;
+}
+
+static void elfdet_futex_drop(struct elfdet_futex *fx, pid_t tid)
+{
+	trace_elfdet_dropped("futex", tid, ++fx->dropped);
+}
+
+/* Only the futex() syscall of the native ABI is timed; futex_waitv()
+ * waits on several addresses and is left out.
+ */
+static bool elfdet_futex_syscall(struct elfdet_futex *fx, long id)
+{
+	return id == __NR_futex && task_tgid(current) == fx->tgid &&
+	       !in_compat_syscall();
+}
+
+static void elfdet_probe_futex_enter(void *data, struct pt_regs *regs,
+				     long id)
+{
+	struct elfdet_futex *fx = data;
+	struct elfdet_futex_thread *t;
+	unsigned long args[6];
+	u32 thread, addr, pair;
+
+	if (!elfdet_futex_syscall(fx, id))
+		return;
+	syscall_get_arguments(current, regs, args);
+	/* A NULL address only faults; it would also read as a free slot */
+	if (!args[0] || !elfdet_futex_op_waits((int)args[1]))
+		return;
+
+	raw_spin_lock(&fx->lock);
+	thread = elfdet_futex_thread_slot(fx, current->pid, true);
+	addr = elfdet_futex_addr_slot(fx, args[0]);
+	if (thread == U32_MAX || addr == U32_MAX) {
+		elfdet_futex_drop(fx, current->pid);
+		goto out;
+	}
+	pair = elfdet_futex_pair_slot(fx, current->pid, addr, args[0]);
+	if (pair == U32_MAX) {
+		elfdet_futex_drop(fx, current->pid);
+		goto out;
+	}
+	t = &fx->threads[thread];
+	t->pair = pair;
+	t->since_ns = ktime_get_ns();
+	if (++fx->addrs[addr].waiters > fx->addrs[addr].peak_waiters)
+		fx->addrs[addr].peak_waiters = fx->addrs[addr].waiters;
+out:
+	raw_spin_unlock(&fx->lock);
+}
+
+static void elfdet_probe_futex_exit(void *data, struct pt_regs *regs,
+				    long ret)
+{
+	struct elfdet_futex *fx = data;
+	struct elfdet_futex_thread *t;
+	struct elfdet_futex_pair *p;
+	struct elfdet_futex_addr *a;
+	u32 thread;
+	u64 ns;
+
+	if (!elfdet_futex_syscall(fx, syscall_get_nr(current, regs)))
+		return;
+
+	raw_spin_lock(&fx->lock);
+	thread = elfdet_futex_thread_slot(fx, current->pid, false);
+	if (thread == U32_MAX || fx->threads[thread].pair == U32_MAX)
+		goto out;
+	t = &fx->threads[thread];
+	p = &fx->pairs[t->pair];
+	a = &fx->addrs[p->addr];
+	ns = ktime_get_ns() - t->since_ns;
+
+	fx->waits++;
+	t->waits++;
+	t->ns += ns;
+	t->max_ns = max(t->max_ns, ns);
+	a->waits++;
+	a->ns += ns;
+	a->waiters--;
+	p->waits++;
+	p->ns += ns;
+	if (t->top == U32_MAX || p->ns > fx->pairs[t->top].ns) {
+		t->top = t->pair;
+		t->top_uaddr = p->uaddr;
+	}
+	t->pair = U32_MAX;
+out:
+	raw_spin_unlock(&fx->lock);
+}
+
+static struct elfdet_probe elfdet_futex_probes[] = {
+	{ .name = "sys_enter", .probe = elfdet_probe_futex_enter },
+	{ .name = "sys_exit", .probe = elfdet_probe_futex_exit },
+};
+
+/* Caller holds elfdet_futex_mutex */
+static void elfdet_futex_stop(void)
+{
+	struct elfdet_futex *fx = elfdet_futex;
+
+	if (!fx || !fx->running)
+		return;
+	elfdet_probes_unregister(elfdet_futex_probes,
+				 ARRAY_SIZE(elfdet_futex_probes));
+	fx->running = false;
+	fx->stopped_ns = ktime_get_ns();
+}
+
+/* Start a new profile of the process of pid, replacing the last one */
+static int elfdet_futex_start(int pid)
+{
+	struct elfdet_futex *fx;
+	struct task_struct *task;
+	struct pid *tgid;
+	int i, ret;
+
+	task = elfdet_get_task(pid);
+	if (!task)
+		return -ESRCH;
+	tgid = get_pid(task_tgid(task));
+	put_task_struct(task);
+
+	mutex_lock(&elfdet_futex_mutex);
+	elfdet_futex_stop();
+	fx = elfdet_futex;
+	if (!fx) {
+		fx = vmalloc(sizeof(*fx));
+		if (!fx) {
+			mutex_unlock(&elfdet_futex_mutex);
+			put_pid(tgid);
+			return -ENOMEM;
+		}
+		elfdet_futex = fx;
+	} else {
+		put_pid(fx->tgid);
+	}
+	memset(fx, 0, sizeof(*fx));
+	raw_spin_lock_init(&fx->lock);
+	fx->tgid = tgid;
+	fx->pid = pid;
+	fx->started_ns = ktime_get_ns();
+
+	for (i = 0; i < ARRAY_SIZE(elfdet_futex_probes); i++)
+		elfdet_futex_probes[i].data = fx;
+	ret = elfdet_probes_register(elfdet_futex_probes,
+				     ARRAY_SIZE(elfdet_futex_probes));
+	if (!ret)
+		fx->running = true;
+	else
+		fx->stopped_ns = fx->started_ns;
+	mutex_unlock(&elfdet_futex_mutex);
+	return ret;
+}
+
+static void elfdet_futex_free(void)
+{
+	mutex_lock(&elfdet_futex_mutex);
+	elfdet_futex_stop();
+	if (elfdet_futex) {
+		put_pid(elfdet_futex->tgid);
+		vfree(elfdet_futex);
+		elfdet_futex = NULL;
+	}
+	mutex_unlock(&elfdet_futex_mutex);
+}
+
+/* The futex profile if it covers task's process, with elfdet_futex_mutex
+ * held until elfdet_futex_put(); NULL otherwise.
+ */
+static struct elfdet_futex *elfdet_futex_get(struct task_struct *task)
+{
+	mutex_lock(&elfdet_futex_mutex);
+	if (elfdet_futex && elfdet_futex->tgid == task_tgid(task))
+		return elfdet_futex;
+	mutex_unlock(&elfdet_futex_mutex);
+	return NULL;
+}
+
+static void elfdet_futex_put(struct elfdet_futex *fx)
+{
+	if (fx)
+		mutex_unlock(&elfdet_futex_mutex);
+}
+
+/* Futex columns of one row of the threads view */
+static void elfdet_futex_print_thread(struct seq_file *m,
+				      struct elfdet_futex *fx, pid_t tid)
+{
+	struct elfdet_futex_thread t = { 0 };
+	u32 slot;
+
+	raw_spin_lock(&fx->lock);
+	slot = elfdet_futex_thread_slot(fx, tid, false);
+	if (slot != U32_MAX)
+		t = fx->threads[slot];
+	raw_spin_unlock(&fx->lock);
+
+	seq_printf(m, "  %11llu  %13llu", t.waits, t.ns / NSEC_PER_MSEC);
+	if (t.top_uaddr)
+		seq_printf(m, "  0x%-16lx", t.top_uaddr);
+	else
+		seq_printf(m, "  %-18s", "-");
+}
+
+static int elfdet_cmp_futex_thread(const void *a, const void *b)
+{
+	const struct elfdet_futex_thread *x = a, *y = b;
+
+	/* Free slots last */
+	if (!x->tid != !y->tid)
+		return !x->tid ? 1 : -1;
+	if (x->ns != y->ns)
+		return x->ns < y->ns ? 1 : -1;
+	return x->tid - y->tid;
+}
+
+/* Hottest first, free slots last */
+static int elfdet_cmp_futex_addr(const void *a, const void *b)
+{
+	const struct elfdet_futex_addr *x = a, *y = b;
+
+	if (!x->uaddr != !y->uaddr)
+		return !x->uaddr ? 1 : -1;
+	if (x->ns != y->ns)
+		return x->ns < y->ns ? 1 : -1;
+	if (x->waits != y->waits)
+		return x->waits < y->waits ? 1 : -1;
+	return x->uaddr < y->uaddr ? -1 : x->uaddr > y->uaddr;
+}
+
+static int elfdet_futex_show(struct seq_file *m, void *v)
+{
+	struct elfdet_futex_thread *t;
+	struct elfdet_futex_addr *a;
+	struct elfdet_futex_pair *p;
+	struct elfdet_futex *fx, *snap;
+	u32 i, j, nr, tids;
+	u64 end_ns;
+
+	mutex_lock(&elfdet_futex_mutex);
+	fx = elfdet_futex;
+	if (!fx) {
+		mutex_unlock(&elfdet_futex_mutex);
+		seq_puts(m, "# not started; write a PID to start\n");
 		return 0;
 	}
+	snap = vmalloc(sizeof(*snap));
+	if (!snap) {
+		mutex_unlock(&elfdet_futex_mutex);
+		return -ENOMEM;
+	}
+
+	/* Sorted below, so the slot indexes in the copy go stale */
+	raw_spin_lock(&fx->lock);
+	memcpy(snap, fx, sizeof(*snap));
+	raw_spin_unlock(&fx->lock);
+
+	end_ns = fx->running ? ktime_get_ns() : fx->stopped_ns;
+	seq_printf(m,
+		   "# pid=%d running=%d window_ms=%llu waits=%llu threads=%u "
+		   "addresses=%u dropped=%llu\n",
+		   fx->pid, fx->running,
+		   (end_ns - fx->started_ns) / NSEC_PER_MSEC, snap->waits,
+		   snap->nr_threads, snap->nr_addrs, snap->dropped);
+
+	sort(snap->threads, ELFDET_FUTEX_THREADS, sizeof(*t),
+	     elfdet_cmp_futex_thread, NULL);
+	seq_puts(m, "[thread]\n");
+	for (i = 0; i < snap->nr_threads; i++) {
+		t = &snap->threads[i];
+		seq_printf(m,
+			   "tid=%d comm=%s waits=%llu wait_us=%llu "
+			   "max_wait_us=%llu top_uaddr=0x%lx\n",
+			   t->tid, t->comm, t->waits, t->ns / NSEC_PER_USEC,
+			   t->max_ns / NSEC_PER_USEC, t->top_uaddr);
+	}
+
+	sort(snap->addrs, ELFDET_FUTEX_ADDRS, sizeof(*a),
+	     elfdet_cmp_futex_addr, NULL);
+	seq_puts(m, "[addr]\n");
+	nr = min_t(u32, snap->nr_addrs, ELFDET_FUTEX_TOP);
+	for (i = 0; i < nr; i++) {
+		a = &snap->addrs[i];
+		seq_printf(m,
+			   "uaddr=0x%lx waits=%llu wait_us=%llu waiters=%u "
+			   "peak_waiters=%u threads=%u tids=",
+			   a->uaddr, a->waits, a->ns / NSEC_PER_USEC,
+			   a->waiters, a->peak_waiters, a->threads);
+		for (j = 0, tids = 0; j < ELFDET_FUTEX_PAIRS; j++) {
+			p = &snap->pairs[j];
+			if (!p->tid || p->uaddr != a->uaddr)
+				continue;
+			if (tids == ELFDET_FUTEX_TIDS) {
+				seq_puts(m, ",...");
+				break;
+			}
+			seq_printf(m, "%s%d", tids++ ? "," : "", p->tid);
+		}
+		seq_puts(m, "\n");
+	}
+	if (snap->nr_addrs > ELFDET_FUTEX_TOP)
+		seq_printf(m, "# %u more addresses\n",
+			   snap->nr_addrs - ELFDET_FUTEX_TOP);
+
+	mutex_unlock(&elfdet_futex_mutex);
+	vfree(snap);
+	return 0;
+}
+
+static int elfdet_futex_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, elfdet_futex_show, NULL);
+}
+
+/* "PID" starts profiling, "0"/"stop" stops */
+static ssize_t elfdet_futex_write(struct file *file,
+				  const char __user *buffer,
+				  size_t length,
+				  loff_t *offset)
+{
+	char input_buf[32];
+	unsigned int arg;
+	size_t to_copy;
+	int pid, ret;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	switch (elfdet_parse_profile_cmd(input_buf, &pid, &arg)) {
+	case ELFDET_PROFILE_START:
+		ret = arg ? -EINVAL : elfdet_futex_start(pid);
+		break;
+	case ELFDET_PROFILE_STOP:
+		mutex_lock(&elfdet_futex_mutex);
+		elfdet_futex_stop();
+		mutex_unlock(&elfdet_futex_mutex);
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : length;
+}
+
+static const struct proc_ops elfdet_futex_ops = {
+	.proc_open = elfdet_futex_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+	.proc_write = elfdet_futex_write,
+};
+
+/* Syscall profile (/proc/elf_det/syscalls): while started for a process,
+ * raw sys_enter/sys_exit probes count every syscall its threads make and
+ * keep, per (thread, syscall number), the number of calls, their total
+ * and maximum latency and a log2 latency histogram. Threads of other
+ * processes return after one thread-group compare.
+ */
+#define ELFDET_SYSCALL_ENTRIES 2048
+#define ELFDET_SYSCALL_SLOTS 4096 /* entry hash index, power of two */
+#define ELFDET_SYSCALL_PENDING 1024 /* by TID, power of two */
+
+struct elfdet_syscall_entry {
+	pid_t tid;
+	int nr;
+	char comm[TASK_COMM_LEN];
+	u64 calls;
+	u64 ns;
+	u64 max_ns;
+	u32 threads; /* only used when merged per syscall */
+	u32 hist[ELFDET_HIST_BUCKETS];
+};
+
+/* A thread inside a syscall; a direct-mapped slot per TID */
+struct elfdet_syscall_pending {
+	pid_t tid; /* 0 if free */
+	u32 entry;
+	u64 since_ns;
+};
+
+struct elfdet_syscalls {
+	raw_spinlock_t lock; /* entries, index, pending and counters */
+	struct pid *tgid;
+	int pid;
+	bool running;
+	u64 started_ns, stopped_ns;
+	u64 calls;
+	u64 dropped;
+	u32 nr_entries;
+	u16 index[ELFDET_SYSCALL_SLOTS]; /* entry + 1, 0 if free */
+	struct elfdet_syscall_pending pending[ELFDET_SYSCALL_PENDING];
+	struct elfdet_syscall_entry entries[ELFDET_SYSCALL_ENTRIES];
+};
+
+/* Profile of the last start; kept after stop until the next start */
+static struct elfdet_syscalls *elfdet_syscalls;
+static DEFINE_MUTEX(elfdet_syscalls_mutex); /* start/stop/read vs. free */
+
+/* Caller holds sc->lock. Returns the entry's index or U32_MAX if full. */
+static u32 elfdet_syscalls_slot(struct elfdet_syscalls *sc, pid_t tid,
+				int nr)
+{
+	u32 slot = jhash_2words(tid, nr, 0) & (ELFDET_SYSCALL_SLOTS - 1), i;
+	struct elfdet_syscall_entry *e;
+
+	for (i = 0; i < ELFDET_SYSCALL_SLOTS; i++) {
+		if (!sc->index[slot])
+			break;
+		e = &sc->entries[sc->index[slot] - 1];
+		if (e->tid == tid && e->nr == nr)
+			return sc->index[slot] - 1;
+		slot = (slot + 1) & (ELFDET_SYSCALL_SLOTS - 1);
+	}
+	if (i == ELFDET_SYSCALL_SLOTS ||
+	    sc->nr_entries == ELFDET_SYSCALL_ENTRIES)
+		return U32_MAX;
+
+	e = &sc->entries[sc->nr_entries];
+	e->tid = tid;
+	e->nr = nr;
+	strscpy(e->comm, current->comm, sizeof(e->comm));
+	sc->index[slot] = ++sc->nr_entries;
+	return sc->nr_entries - 1;
+}
+
+/* Compat (32-bit) syscalls have their own numbers and are left out */
+static void elfdet_probe_syscalls_enter(void *data, struct pt_regs *regs,
+					long id)
+{
+	struct elfdet_syscalls *sc = data;
+	struct elfdet_syscall_pending *p;
+	u32 entry;
+
+	if (task_tgid(current) != sc->tgid || id < 0 || in_compat_syscall())
+		return;
+	p = &sc->pending[current->pid & (ELFDET_SYSCALL_PENDING - 1)];
+
+	raw_spin_lock(&sc->lock);
+	entry = elfdet_syscalls_slot(sc, current->pid, id);
+	if (entry == U32_MAX) {
+		trace_elfdet_dropped("syscalls", current->pid, ++sc->dropped);
+		/* Do not charge this call to the slot's last syscall */
+		if (p->tid == current->pid)
+			p->tid = 0;
+	} else {
+		/* A thread that exited in a syscall leaves its slot behind */
+		p->tid = current->pid;
+		p->entry = entry;
+		p->since_ns = ktime_get_ns();
+	}
+	raw_spin_unlock(&sc->lock);
+}
+
+static void elfdet_probe_syscalls_exit(void *data, struct pt_regs *regs,
+				       long ret)
+{
+	struct elfdet_syscalls *sc = data;
+	struct elfdet_syscall_pending *p;
+	struct elfdet_syscall_entry *e;
+	u64 ns;
+
+	if (task_tgid(current) != sc->tgid)
+		return;
+	p = &sc->pending[current->pid & (ELFDET_SYSCALL_PENDING - 1)];
+
+	raw_spin_lock(&sc->lock);
+	if (p->tid == current->pid) {
+		e = &sc->entries[p->entry];
+		ns = ktime_get_ns() - p->since_ns;
+		e->calls++;
+		e->ns += ns;
+		e->max_ns = max(e->max_ns, ns);
+		e->hist[elfdet_log2_bucket(ns)]++;
+		sc->calls++;
+		p->tid = 0;
+	}
+	raw_spin_unlock(&sc->lock);
+}
+
+static struct elfdet_probe elfdet_syscalls_probes[] = {
+	{ .name = "sys_enter", .probe = elfdet_probe_syscalls_enter },
+	{ .name = "sys_exit", .probe = elfdet_probe_syscalls_exit },
+};
+
+/* Caller holds elfdet_syscalls_mutex */
+static void elfdet_syscalls_stop(void)
+{
+	struct elfdet_syscalls *sc = elfdet_syscalls;
+
+	if (!sc || !sc->running)
+		return;
+	elfdet_probes_unregister(elfdet_syscalls_probes,
+				 ARRAY_SIZE(elfdet_syscalls_probes));
+	sc->running = false;
+	sc->stopped_ns = ktime_get_ns();
+}
+
+/* Start a new profile of the process of pid, replacing the last one */
+static int elfdet_syscalls_start(int pid)
+{
+	struct elfdet_syscalls *sc;
+	struct task_struct *task;
+	struct pid *tgid;
+	int i, ret;
+
+	task = elfdet_get_task(pid);
+	if (!task)
+		return -ESRCH;
+	tgid = get_pid(task_tgid(task));
+	put_task_struct(task);
+
+	mutex_lock(&elfdet_syscalls_mutex);
+	elfdet_syscalls_stop();
+	sc = elfdet_syscalls;
+	if (!sc) {
+		sc = vmalloc(sizeof(*sc));
+		if (!sc) {
+			mutex_unlock(&elfdet_syscalls_mutex);
+			put_pid(tgid);
+			return -ENOMEM;
+		}
+		elfdet_syscalls = sc;
+	} else {
+		put_pid(sc->tgid);
+	}
+	memset(sc, 0, sizeof(*sc));
+	raw_spin_lock_init(&sc->lock);
+	sc->tgid = tgid;
+	sc->pid = pid;
+	sc->started_ns = ktime_get_ns();
+
+	for (i = 0; i < ARRAY_SIZE(elfdet_syscalls_probes); i++)
+		elfdet_syscalls_probes[i].data = sc;
+	ret = elfdet_probes_register(elfdet_syscalls_probes,
+				     ARRAY_SIZE(elfdet_syscalls_probes));
+	if (!ret)
+		sc->running = true;
+	else
+		sc->stopped_ns = sc->started_ns;
+	mutex_unlock(&elfdet_syscalls_mutex);
+	return ret;
+}
+
+static void elfdet_syscalls_free(void)
+{
+	mutex_lock(&elfdet_syscalls_mutex);
+	elfdet_syscalls_stop();
+	if (elfdet_syscalls) {
+		put_pid(elfdet_syscalls->tgid);
+		vfree(elfdet_syscalls);
+		elfdet_syscalls = NULL;
+	}
+	mutex_unlock(&elfdet_syscalls_mutex);
+}
+
+static int elfdet_cmp_syscall_nr(const void *a, const void *b)
+{
+	const struct elfdet_syscall_entry *x = a, *y = b;
+
+	if (x->nr != y->nr)
+		return x->nr < y->nr ? -1 : 1;
+	return x->tid - y->tid;
+}
+
+static int elfdet_cmp_syscall_calls(const void *a, const void *b)
+{
+	const struct elfdet_syscall_entry *x = a, *y = b;
+
+	if (x->calls != y->calls)
+		return x->calls < y->calls ? 1 : -1;
+	return x->nr - y->nr;
+}
+
+/* Threads in TID order, each thread's busiest syscalls first */
+static int elfdet_cmp_syscall_thread(const void *a, const void *b)
+{
+	const struct elfdet_syscall_entry *x = a, *y = b;
+
+	if (x->tid != y->tid)
+		return x->tid < y->tid ? -1 : 1;
+	return elfdet_cmp_syscall_calls(a, b);
+}
+
+/* Counters of one entry, then its non-empty buckets as
+ * "<lower bound ns>:<count>". merged: e sums a syscall over threads.
+ */
+static void elfdet_syscalls_print(struct seq_file *m,
+				  const struct elfdet_syscall_entry *e,
+				  u64 window_ns, bool merged)
+{
+	int b, n = 0;
+
+	seq_printf(m, "nr=%d ", e->nr);
+	if (merged)
+		seq_printf(m, "threads=%u ", e->threads);
+	seq_printf(m,
+		   "calls=%llu per_sec=%llu total_us=%llu avg_ns=%llu "
+		   "max_ns=%llu hist_ns=",
+		   e->calls, elfdet_rate_per_sec(e->calls, window_ns),
+		   e->ns / NSEC_PER_USEC,
+		   e->calls ? div64_u64(e->ns, e->calls) : 0, e->max_ns);
+	for (b = 0; b < ELFDET_HIST_BUCKETS; b++) {
+		if (e->hist[b])
+			seq_printf(m, "%s%llu:%u", n++ ? "," : "",
+				   elfdet_hist_lower_ns(b), e->hist[b]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int elfdet_syscalls_show(struct seq_file *m, void *v)
+{
+	struct elfdet_syscall_entry *entries = NULL, *merged = NULL, *e;
+	struct elfdet_syscalls *sc;
+	u32 i, j, nr, nr_merged;
+	u64 end_ns, window_ns, calls, dropped;
+	int b, ret = 0;
+
+	mutex_lock(&elfdet_syscalls_mutex);
+	sc = elfdet_syscalls;
+	if (!sc) {
+		seq_puts(m, "# not started; write a PID to start\n");
+		goto out;
+	}
+	entries = kvmalloc_array(ELFDET_SYSCALL_ENTRIES, sizeof(*entries),
+				 GFP_KERNEL);
+	merged = kvmalloc_array(ELFDET_SYSCALL_ENTRIES, sizeof(*merged),
+				GFP_KERNEL);
+	if (!entries || !merged) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	raw_spin_lock(&sc->lock);
+	nr = sc->nr_entries;
+	calls = sc->calls;
+	dropped = sc->dropped;
+	raw_spin_unlock(&sc->lock);
+	/* Entries are only appended; copy one at a time */
+	for (i = 0; i < nr; i++) {
+		raw_spin_lock(&sc->lock);
+		entries[i] = sc->entries[i];
+		raw_spin_unlock(&sc->lock);
+	}
+	end_ns = sc->running ? ktime_get_ns() : sc->stopped_ns;
+	window_ns = end_ns - sc->started_ns;
+
+	/* Sum the threads' entries of each syscall number */
+	sort(entries, nr, sizeof(*entries), elfdet_cmp_syscall_nr, NULL);
+	for (i = 0, nr_merged = 0; i < nr; i++) {
+		e = &entries[i];
+		if (!nr_merged || merged[nr_merged - 1].nr != e->nr) {
+			merged[nr_merged] = *e;
+			merged[nr_merged++].threads = 1;
+			continue;
+		}
+		merged[nr_merged - 1].calls += e->calls;
+		merged[nr_merged - 1].ns += e->ns;
+		merged[nr_merged - 1].max_ns =
+			max(merged[nr_merged - 1].max_ns, e->max_ns);
+		merged[nr_merged - 1].threads++;
+		for (b = 0; b < ELFDET_HIST_BUCKETS; b++)
+			merged[nr_merged - 1].hist[b] += e->hist[b];
+	}
+
+	seq_printf(m,
+		   "# pid=%d running=%d window_ms=%llu calls=%llu "
+		   "syscalls=%u entries=%u dropped=%llu\n",
+		   sc->pid, sc->running, window_ns / NSEC_PER_MSEC, calls,
+		   nr_merged, nr, dropped);
+
+	sort(merged, nr_merged, sizeof(*merged), elfdet_cmp_syscall_calls,
+	     NULL);
+	seq_puts(m, "[syscall]\n");
+	for (j = 0; j < nr_merged; j++)
+		elfdet_syscalls_print(m, &merged[j], window_ns, true);
+
+	sort(entries, nr, sizeof(*entries), elfdet_cmp_syscall_thread, NULL);
+	seq_puts(m, "[thread]\n");
+	for (i = 0; i < nr; i++) {
+		seq_printf(m, "tid=%d comm=%s ", entries[i].tid,
+			   entries[i].comm);
+		elfdet_syscalls_print(m, &entries[i], window_ns, false);
+	}
+
+out:
+	mutex_unlock(&elfdet_syscalls_mutex);
+	kvfree(merged);
+	kvfree(entries);
+	return ret;
+}
+
+static int elfdet_syscalls_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, elfdet_syscalls_show, NULL);
+}
+
+/* "PID" starts profiling, "0"/"stop" stops */
+static ssize_t elfdet_syscalls_write(struct file *file,
+				     const char __user *buffer,
+				     size_t length,
+				     loff_t *offset)
+{
+	char input_buf[32];
+	unsigned int arg;
+	size_t to_copy;
+	int pid, ret;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	switch (elfdet_parse_profile_cmd(input_buf, &pid, &arg)) {
+	case ELFDET_PROFILE_START:
+		ret = arg ? -EINVAL : elfdet_syscalls_start(pid);
+		break;
+	case ELFDET_PROFILE_STOP:
+		mutex_lock(&elfdet_syscalls_mutex);
+		elfdet_syscalls_stop();
+		mutex_unlock(&elfdet_syscalls_mutex);
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : length;
+}
+
+static const struct proc_ops elfdet_syscalls_ops = {
+	.proc_open = elfdet_syscalls_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+	.proc_write = elfdet_syscalls_write,
+};
+
+/* Wakeup graph (/proc/elf_det/wakeups): while started for a process, a
+ * sched_waking probe records which thread (or interrupt) woke each of its
+ * threads, and a sched_switch probe measures how long the woken thread
+ * then waited for a CPU. Both are kept per waker->wakee edge, so a
+ * pipeline stage that is woken often but runs late stands out.
+ */
+#define ELFDET_WAKEUP_EDGES 2048
+#define ELFDET_WAKEUP_SLOTS 4096 /* edge hash index, power of two */
+#define ELFDET_WAKEUP_PENDING 1024 /* by TID, power of two */
+#define ELFDET_WAKER_IRQ (-1) /* no waking task: interrupt context */
+
+struct elfdet_wakeup_edge {
+	pid_t waker; /* ELFDET_WAKER_IRQ from interrupt context */
+	pid_t waker_pid; /* thread group of the waker */
+	pid_t wakee;
+	char waker_comm[TASK_COMM_LEN];
+	char wakee_comm[TASK_COMM_LEN];
+	u64 wakeups;
+	u64 runs; /* wakeups whose delay was measured */
+	u64 delay_ns; /* wakeup to running on a CPU */
+	u64 max_delay_ns;
+};
+
+/* A woken thread not yet on a CPU; a direct-mapped slot per TID */
+struct elfdet_wakeup_pending {
+	pid_t tid; /* 0 if free */
+	u32 edge;
+	u64 since_ns;
+};
+
+struct elfdet_wakeups {
+	raw_spinlock_t lock; /* edges, index, pending and counters */
+	struct pid *tgid;
+	int pid;
+	bool running;
+	u64 started_ns, stopped_ns;
+	u64 wakeups;
+	u64 dropped;
+	u32 nr_edges;
+	u16 index[ELFDET_WAKEUP_SLOTS]; /* edge + 1, 0 if free */
+	struct elfdet_wakeup_pending pending[ELFDET_WAKEUP_PENDING];
+	struct elfdet_wakeup_edge edges[ELFDET_WAKEUP_EDGES];
+};
+
+/* Graph of the last start; kept after stop until the next start */
+static struct elfdet_wakeups *elfdet_wakeups;
+static DEFINE_MUTEX(elfdet_wakeups_mutex); /* start/stop/read vs. free */
+
+/* Caller holds wk->lock. Returns the edge's index or U32_MAX if full. */
+static u32 elfdet_wakeups_edge(struct elfdet_wakeups *wk,
+			       struct task_struct *waker,
+			       struct task_struct *wakee)
+{
+	pid_t from = waker ? waker->pid : ELFDET_WAKER_IRQ;
+	u32 slot = jhash_2words(from, wakee->pid, 0) &
+		   (ELFDET_WAKEUP_SLOTS - 1), i;
+	struct elfdet_wakeup_edge *e;
+
+	for (i = 0; i < ELFDET_WAKEUP_SLOTS; i++) {
+		if (!wk->index[slot])
+			break;
+		e = &wk->edges[wk->index[slot] - 1];
+		if (e->waker == from && e->wakee == wakee->pid)
+			return wk->index[slot] - 1;
+		slot = (slot + 1) & (ELFDET_WAKEUP_SLOTS - 1);
+	}
+	if (i == ELFDET_WAKEUP_SLOTS || wk->nr_edges == ELFDET_WAKEUP_EDGES)
+		return U32_MAX;
 
-	task = pid_task(find_vpid(user_pid), PIDTYPE_PID);
+	e = &wk->edges[wk->nr_edges];
+	e->waker = from;
+	e->wakee = wakee->pid;
+	if (waker) {
+		e->waker_pid = waker->tgid;
+		strscpy(e->waker_comm, waker->comm, sizeof(e->waker_comm));
+	} else {
+		e->waker_pid = ELFDET_WAKER_IRQ;
+		strscpy(e->waker_comm, "[irq]", sizeof(e->waker_comm));
+	}
+	strscpy(e->wakee_comm, wakee->comm, sizeof(e->wakee_comm));
+	wk->index[slot] = ++wk->nr_edges;
+	return wk->nr_edges - 1;
+}
 
-	if (!task) {
-		seq_puts(m, "Invalid PID\n");
-		return 0;
+/* sched_waking runs at the start of try_to_wake_up(), in the context of
+ * the waker: the current task unless the wakeup comes from an interrupt.
+ * sched_wakeup would not do, as with TTWU_QUEUE a remote wakeup completes
+ * from an IPI on the wakee's CPU.
+ */
+static void elfdet_probe_wakeups_waking(void *data, struct task_struct *p)
+{
+	struct elfdet_wakeups *wk = data;
+	struct elfdet_wakeup_pending *b;
+	unsigned long flags;
+	u32 edge;
+
+	if (task_tgid(p) != wk->tgid)
+		return;
+	b = &wk->pending[p->pid & (ELFDET_WAKEUP_PENDING - 1)];
+
+	/* Not raw_spin_lock(): a wakeup of current fires sched_waking with
+	 * IRQs on, and an interrupt waking a sibling thread would re-enter
+	 * this probe and spin on the lock forever
+	 */
+	raw_spin_lock_irqsave(&wk->lock, flags);
+	edge = elfdet_wakeups_edge(wk, in_task() ? current : NULL, p);
+	if (edge == U32_MAX) {
+		trace_elfdet_dropped("wakeups", p->pid, ++wk->dropped);
+		if (b->tid == p->pid)
+			b->tid = 0;
+	} else {
+		wk->wakeups++;
+		wk->edges[edge].wakeups++;
+		/* A thread that died runnable leaves its slot behind */
+		b->tid = p->pid;
+		b->edge = edge;
+		b->since_ns = ktime_get_ns();
 	}
+	raw_spin_unlock_irqrestore(&wk->lock, flags);
+}
 
-	// Print header
-	seq_puts(m, "TID    NAME             CPU(%)   STATE  PRIORITY  NICE  ");
-	seq_puts(m, "CPU_AFFINITY\n");
-	seq_puts(m, "-----  ---------------  -------  -----  --------  ----  ");
-	seq_puts(m, "----------------\n");
+static void elfdet_probe_wakeups_switch(void *data, bool preempt,
+					struct task_struct *prev,
+					struct task_struct *next,
+					unsigned int prev_state)
+{
+	struct elfdet_wakeups *wk = data;
+	struct elfdet_wakeup_pending *b;
+	struct elfdet_wakeup_edge *e;
+	bool leaves, runs;
+	u64 ns;
 
-	// Iterate through all threads in the thread group
-	rcu_read_lock();
-	// clang-format off
-	for_each_thread(task, thread) {
-		thread_count++;
-		print_thread_info_line(m, thread);
+	leaves = task_tgid(prev) == wk->tgid;
+	runs = task_tgid(next) == wk->tgid;
+	if (!leaves && !runs)
+		return;
+
+	raw_spin_lock(&wk->lock);
+	/* Woken before it got to sleep: it never left the CPU */
+	b = &wk->pending[prev->pid & (ELFDET_WAKEUP_PENDING - 1)];
+	if (leaves && b->tid == prev->pid) {
+		wk->edges[b->edge].runs++;
+		b->tid = 0;
 	}
-	// clang-format on
-	rcu_read_unlock();
+	b = &wk->pending[next->pid & (ELFDET_WAKEUP_PENDING - 1)];
+	if (runs && b->tid == next->pid) {
+		e = &wk->edges[b->edge];
+		ns = ktime_get_ns() - b->since_ns;
+		e->runs++;
+		e->delay_ns += ns;
+		e->max_delay_ns = max(e->max_delay_ns, ns);
+		b->tid = 0;
+	}
+	raw_spin_unlock(&wk->lock);
+}
 
-	seq_puts(m,
-		 "----------------------------------------------------------");
-	seq_puts(m, "----------------------\n");
-	seq_printf(m, "Total threads: %d\n", thread_count);
+static struct elfdet_probe elfdet_wakeups_probes[] = {
+	{ .name = "sched_waking", .probe = elfdet_probe_wakeups_waking },
+	{ .name = "sched_switch", .probe = elfdet_probe_wakeups_switch },
+};
 
-	return 0;
+/* Caller holds elfdet_wakeups_mutex */
+static void elfdet_wakeups_stop(void)
+{
+	struct elfdet_wakeups *wk = elfdet_wakeups;
+
+	if (!wk || !wk->running)
+		return;
+	elfdet_probes_unregister(elfdet_wakeups_probes,
+				 ARRAY_SIZE(elfdet_wakeups_probes));
+	wk->running = false;
+	wk->stopped_ns = ktime_get_ns();
 }
 
-// runs when opening file
-static int elfdet_open(struct inode *inode, struct file *file)
+/* Start a new graph of the process of pid, replacing the last one */
+static int elfdet_wakeups_start(int pid)
+{
+	struct elfdet_wakeups *wk;
+	struct task_struct *task;
+	struct pid *tgid;
+	int i, ret;
+
+	task = elfdet_get_task(pid);
+	if (!task)
+		return -ESRCH;
+	tgid = get_pid(task_tgid(task));
+	put_task_struct(task);
+
+	mutex_lock(&elfdet_wakeups_mutex);
+	elfdet_wakeups_stop();
+	wk = elfdet_wakeups;
+	if (!wk) {
+		wk = vmalloc(sizeof(*wk));
+		if (!wk) {
+			mutex_unlock(&elfdet_wakeups_mutex);
+			put_pid(tgid);
+			return -ENOMEM;
+		}
+		elfdet_wakeups = wk;
+	} else {
+		put_pid(wk->tgid);
+	}
+	memset(wk, 0, sizeof(*wk));
+	raw_spin_lock_init(&wk->lock);
+	wk->tgid = tgid;
+	wk->pid = pid;
+	wk->started_ns = ktime_get_ns();
+
+	for (i = 0; i < ARRAY_SIZE(elfdet_wakeups_probes); i++)
+		elfdet_wakeups_probes[i].data = wk;
+	ret = elfdet_probes_register(elfdet_wakeups_probes,
+				     ARRAY_SIZE(elfdet_wakeups_probes));
+	if (!ret)
+		wk->running = true;
+	else
+		wk->stopped_ns = wk->started_ns;
+	mutex_unlock(&elfdet_wakeups_mutex);
+	return ret;
+}
+
+static void elfdet_wakeups_free(void)
 {
-	return single_open(file, elfdet_show, NULL); // calling elfdet_show
+	mutex_lock(&elfdet_wakeups_mutex);
+	elfdet_wakeups_stop();
+	if (elfdet_wakeups) {
+		put_pid(elfdet_wakeups->tgid);
+		vfree(elfdet_wakeups);
+		elfdet_wakeups = NULL;
+	}
+	mutex_unlock(&elfdet_wakeups_mutex);
 }
 
-// runs when opening threads file
-static int elfdet_threads_open(struct inode *inode, struct file *file)
+static int elfdet_cmp_wakeup_edge(const void *a, const void *b)
 {
-	return single_open(file, elfdet_threads_show, NULL);
+	const struct elfdet_wakeup_edge *x = a, *y = b;
+
+	if (x->wakeups != y->wakeups)
+		return x->wakeups < y->wakeups ? 1 : -1;
+	if (x->waker != y->waker)
+		return x->waker < y->waker ? -1 : 1;
+	return x->wakee - y->wakee;
 }
 
-// file operations of det proc (using proc_ops for kernel 5.6+)
-static const struct proc_ops elfdet_det_ops = {
-	.proc_open = elfdet_open,
+static int elfdet_wakeups_show(struct seq_file *m, void *v)
+{
+	struct elfdet_wakeup_edge *edges = NULL, *e;
+	struct elfdet_wakeups *wk;
+	u64 end_ns, window_ns, wakeups, dropped;
+	int ret = 0;
+	u32 i, nr;
+
+	mutex_lock(&elfdet_wakeups_mutex);
+	wk = elfdet_wakeups;
+	if (!wk) {
+		seq_puts(m, "# not started; write a PID to start\n");
+		goto out;
+	}
+	edges = kvmalloc_array(ELFDET_WAKEUP_EDGES, sizeof(*edges),
+			       GFP_KERNEL);
+	if (!edges) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* IRQs off: interrupt handlers wake threads, and the probe with them */
+	raw_spin_lock_irq(&wk->lock);
+	nr = wk->nr_edges;
+	wakeups = wk->wakeups;
+	dropped = wk->dropped;
+	raw_spin_unlock_irq(&wk->lock);
+	/* Edges are only appended; copy one at a time */
+	for (i = 0; i < nr; i++) {
+		raw_spin_lock_irq(&wk->lock);
+		edges[i] = wk->edges[i];
+		raw_spin_unlock_irq(&wk->lock);
+	}
+	end_ns = wk->running ? ktime_get_ns() : wk->stopped_ns;
+	window_ns = end_ns - wk->started_ns;
+
+	seq_printf(m,
+		   "# pid=%d running=%d window_ms=%llu wakeups=%llu edges=%u "
+		   "dropped=%llu\n",
+		   wk->pid, wk->running, window_ns / NSEC_PER_MSEC, wakeups, nr,
+		   dropped);
+
+	/* One edge per line, most frequent first */
+	sort(edges, nr, sizeof(*edges), elfdet_cmp_wakeup_edge, NULL);
+	for (i = 0; i < nr; i++) {
+		e = &edges[i];
+		seq_printf(m,
+			   "waker=%d waker_pid=%d waker_comm=%s wakee=%d "
+			   "wakee_comm=%s wakeups=%llu per_sec=%llu "
+			   "delay_avg_ns=%llu delay_max_ns=%llu "
+			   "delay_total_us=%llu\n",
+			   e->waker, e->waker_pid, e->waker_comm, e->wakee,
+			   e->wakee_comm, e->wakeups,
+			   elfdet_rate_per_sec(e->wakeups, window_ns),
+			   e->runs ? div64_u64(e->delay_ns, e->runs) : 0,
+			   e->max_delay_ns, e->delay_ns / NSEC_PER_USEC);
+	}
+
+out:
+	mutex_unlock(&elfdet_wakeups_mutex);
+	kvfree(edges);
+	return ret;
+}
+
+static int elfdet_wakeups_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, elfdet_wakeups_show, NULL);
+}
+
+/* "PID" starts recording, "0"/"stop" stops */
+static ssize_t elfdet_wakeups_write(struct file *file,
+				    const char __user *buffer,
+				    size_t length,
+				    loff_t *offset)
+{
+	char input_buf[32];
+	unsigned int arg;
+	size_t to_copy;
+	int pid, ret;
+
+	to_copy = min(length, sizeof(input_buf) - 1);
+	if (copy_from_user(input_buf, buffer, to_copy))
+		return -EFAULT;
+	input_buf[to_copy] = '\0';
+
+	switch (elfdet_parse_profile_cmd(input_buf, &pid, &arg)) {
+	case ELFDET_PROFILE_START:
+		ret = arg ? -EINVAL : elfdet_wakeups_start(pid);
+		break;
+	case ELFDET_PROFILE_STOP:
+		mutex_lock(&elfdet_wakeups_mutex);
+		elfdet_wakeups_stop();
+		mutex_unlock(&elfdet_wakeups_mutex);
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : length;
+}
+
+static const struct proc_ops elfdet_wakeups_ops = {
+	.proc_open = elfdet_wakeups_open,
 	.proc_read = seq_read,
 	.proc_lseek = seq_lseek,
 	.proc_release = single_release,
+	.proc_write = elfdet_wakeups_write,
 };
 
-// file operations of threads proc
-static const struct proc_ops elfdet_threads_ops = {
-	.proc_open = elfdet_threads_open,
-	.proc_read = seq_read,
-	.proc_lseek = seq_lseek,
-	.proc_release = single_release,
+/* Page-fault attribution (/proc/elf_det/faults): while started for a
+ * process, a probe on the x86 page_fault_user tracepoint records the
+ * address of every Nth user page fault of its threads in 64 KiB chunks.
+ * The tracepoint fires before the fault is handled, so a recorded fault
+ * is classified major or minor at the thread's next fault or syscall, by
+ * which of its fault counters moved. Chunks are attributed to VMAs and
+ * file offsets only when the file is read.
+ */
+#define ELFDET_FAULT_CHUNK_SHIFT 16
+#define ELFDET_FAULT_CHUNKS 4096
+#define ELFDET_FAULT_SLOTS 8192 /* chunk hash index, power of two */
+#define ELFDET_FAULT_PENDING 1024 /* by TID, power of two */
+#define ELFDET_FAULT_BUCKET_SHIFT 20 /* file offset buckets of 1 MiB */
+#define ELFDET_FAULT_PERIOD_MAX 1000000
+#define ELFDET_FAULT_TOP 64 /* file rows printed */
+
+struct elfdet_fault_chunk {
+	unsigned long chunk; /* address >> ELFDET_FAULT_CHUNK_SHIFT */
+	unsigned long addr; /* first recorded fault in it */
+	u64 kinds[ELFDET_NR_FAULT_KINDS];
 };
 
-// elf proc file_operations starts
+/* A recorded fault not yet classified; a direct-mapped slot per TID */
+struct elfdet_fault_pending {
+	pid_t tid; /* 0 if free */
+	u32 chunk;
+	unsigned long maj_flt, min_flt; /* the thread's, at the fault */
+};
 
-// runs when elf opens
-// will be called every time this file is accessed shows number of accessed
-// times
-static int procfile_open(struct inode *inode, struct file *file)
+struct elfdet_faults {
+	raw_spinlock_t lock; /* chunks, index, pending and counters */
+	struct pid *tgid;
+	int pid;
+	unsigned int period;
+	unsigned int skip; /* faults until the next recorded one */
+	bool running;
+	u64 started_ns, stopped_ns;
+	u64 faults; /* seen, recorded or not */
+	u64 recorded;
+	u64 dropped;
+	u64 lost; /* recorded but never classified */
+	u32 nr_chunks;
+	u16 index[ELFDET_FAULT_SLOTS]; /* chunk + 1, 0 if free */
+	struct elfdet_fault_pending pending[ELFDET_FAULT_PENDING];
+	struct elfdet_fault_chunk chunks[ELFDET_FAULT_CHUNKS];
+};
+
+/* Profile of the last start; kept after stop until the next start */
+static struct elfdet_faults *elfdet_faults;
+static DEFINE_MUTEX(elfdet_faults_mutex); /* start/stop/read vs. free */
+
+/* Caller holds fl->lock. Returns the chunk's index or U32_MAX if full. */
+static u32 elfdet_faults_chunk(struct elfdet_faults *fl, unsigned long addr)
 {
-	number_opens++;
-	pr_info("procfile opened %d times\n", number_opens);
-	return 0;
+	unsigned long chunk = addr >> ELFDET_FAULT_CHUNK_SHIFT;
+	u32 slot = hash_long(chunk, ilog2(ELFDET_FAULT_SLOTS)), i;
+	struct elfdet_fault_chunk *c;
+
+	for (i = 0; i < ELFDET_FAULT_SLOTS; i++) {
+		if (!fl->index[slot])
+			break;
+		c = &fl->chunks[fl->index[slot] - 1];
+		if (c->chunk == chunk)
+			return fl->index[slot] - 1;
+		slot = (slot + 1) & (ELFDET_FAULT_SLOTS - 1);
+	}
+	if (i == ELFDET_FAULT_SLOTS || fl->nr_chunks == ELFDET_FAULT_CHUNKS)
+		return U32_MAX;
+
+	c = &fl->chunks[fl->nr_chunks];
+	c->chunk = chunk;
+	c->addr = addr;
+	fl->index[slot] = ++fl->nr_chunks;
+	return fl->nr_chunks - 1;
 }
 
-// when we cat elf file this function will be run (this is useless here)
-// because our info is in det file not here!
-static ssize_t procfile_read(struct file *file,
-			     char __user *buffer,
-			     size_t length,
-			     loff_t *offset)
+/* Caller holds fl->lock. Classify task's recorded fault, if it has one;
+ * task is past that fault (at another fault or a syscall, or not current).
+ */
+static void elfdet_faults_resolve(struct elfdet_faults *fl,
+				  struct task_struct *task)
 {
-	static int finished;
-	char tmp[64];
-	int len;
+	struct elfdet_fault_pending *b;
 
-	// normal return value other than '0' will cause loop
+	b = &fl->pending[task->pid & (ELFDET_FAULT_PENDING - 1)];
+	if (b->tid != task->pid)
+		return;
+	fl->chunks[b->chunk].kinds[elfdet_fault_kind(
+		b->maj_flt, b->min_flt, READ_ONCE(task->maj_flt),
+		READ_ONCE(task->min_flt))]++;
+	b->tid = 0;
+}
 
-	pr_info("procfile read called\n");
+static void elfdet_probe_faults_fault(void *data, unsigned long address,
+				      struct pt_regs *regs,
+				      unsigned long error_code)
+{
+	struct elfdet_faults *fl = data;
+	struct elfdet_fault_pending *b;
+	u32 chunk;
 
-	if (procfile_read_should_finish(&finished)) {
-		pr_info("procfs read: END\n");
-		return 0;
+	if (task_tgid(current) != fl->tgid)
+		return;
+
+	raw_spin_lock(&fl->lock);
+	elfdet_faults_resolve(fl, current);
+	fl->faults++;
+	if (--fl->skip)
+		goto out;
+	fl->skip = fl->period;
+
+	chunk = elfdet_faults_chunk(fl, address);
+	if (chunk == U32_MAX) {
+		trace_elfdet_dropped("faults", current->pid, ++fl->dropped);
+		goto out;
 	}
+	/* A thread that exited in a fault leaves its slot behind, and
+	 * threads whose TIDs collide share one: the older fault is lost
+	 */
+	b = &fl->pending[current->pid & (ELFDET_FAULT_PENDING - 1)];
+	if (b->tid && b->tid != current->pid)
+		fl->lost++;
+	b->tid = current->pid;
+	b->chunk = chunk;
+	b->maj_flt = current->maj_flt;
+	b->min_flt = current->min_flt;
+	fl->recorded++;
+out:
+	raw_spin_unlock(&fl->lock);
+}
 
-	len = format_procfile_output(buff, tmp, sizeof(tmp));
-	if (len < 0)
-		return -EFAULT;
-	if (len > length)
-		len = length;
-	if (copy_to_user(buffer, tmp, len))
-		return -EFAULT;
-	return len;
+/* A syscall entry ends any fault the thread was in, before the syscall
+ * itself can fault on user memory and move the counters.
+ */
+static void elfdet_probe_faults_syscall(void *data, struct pt_regs *regs,
+					long id)
+{
+	struct elfdet_faults *fl = data;
+
+	if (task_tgid(current) != fl->tgid ||
+	    READ_ONCE(fl->pending[current->pid & (ELFDET_FAULT_PENDING - 1)]
+			      .tid) != current->pid)
+		return;
+
+	raw_spin_lock(&fl->lock);
+	elfdet_faults_resolve(fl, current);
+	raw_spin_unlock(&fl->lock);
 }
 
-// most important function of elf! called when we write some characters into it
-static ssize_t procfile_write(struct file *file,
-			      const char __user *buffer,
-			      size_t length,
-			      loff_t *offset)
+static struct elfdet_probe elfdet_faults_probes[] = {
+	{ .name = "page_fault_user", .probe = elfdet_probe_faults_fault },
+	{ .name = "sys_enter", .probe = elfdet_probe_faults_syscall },
+};
+
+/* Caller holds elfdet_faults_mutex */
+static void elfdet_faults_stop(void)
 {
-	char input_buf[sizeof(buff)];
-	size_t to_copy;
+	struct elfdet_faults *fl = elfdet_faults;
 
-	to_copy = min(length, sizeof(input_buf));
+	if (!fl || !fl->running)
+		return;
+	elfdet_probes_unregister(elfdet_faults_probes,
+				 ARRAY_SIZE(elfdet_faults_probes));
+	fl->running = false;
+	fl->stopped_ns = ktime_get_ns();
+}
+
+/* Start recording every period-th fault of the process of pid, replacing
+ * the last profile. -ENOENT where the architecture has no
+ * page_fault_user tracepoint.
+ */
+static int elfdet_faults_start(int pid, unsigned int period)
+{
+	struct elfdet_faults *fl;
+	struct task_struct *task;
+	struct pid *tgid;
+	int i, ret;
+
+	if (!period)
+		period = 1;
+	if (period > ELFDET_FAULT_PERIOD_MAX)
+		return -EINVAL;
+
+	task = elfdet_get_task(pid);
+	if (!task)
+		return -ESRCH;
+	tgid = get_pid(task_tgid(task));
+	put_task_struct(task);
+
+	mutex_lock(&elfdet_faults_mutex);
+	elfdet_faults_stop();
+	fl = elfdet_faults;
+	if (!fl) {
+		fl = vmalloc(sizeof(*fl));
+		if (!fl) {
+			mutex_unlock(&elfdet_faults_mutex);
+			put_pid(tgid);
+			return -ENOMEM;
+		}
+		elfdet_faults = fl;
+	} else {
+		put_pid(fl->tgid);
+	}
+	memset(fl, 0, sizeof(*fl));
+	raw_spin_lock_init(&fl->lock);
+	fl->tgid = tgid;
+	fl->pid = pid;
+	fl->period = period;
+	fl->skip = 1; /* record the first fault */
+	fl->started_ns = ktime_get_ns();
+
+	for (i = 0; i < ARRAY_SIZE(elfdet_faults_probes); i++)
+		elfdet_faults_probes[i].data = fl;
+	ret = elfdet_probes_register(elfdet_faults_probes,
+				     ARRAY_SIZE(elfdet_faults_probes));
+	if (!ret)
+		fl->running = true;
+	else
+		fl->stopped_ns = fl->started_ns;
+	mutex_unlock(&elfdet_faults_mutex);
+	return ret;
+}
+
+static void elfdet_faults_free(void)
+{
+	mutex_lock(&elfdet_faults_mutex);
+	elfdet_faults_stop();
+	if (elfdet_faults) {
+		put_pid(elfdet_faults->tgid);
+		vfree(elfdet_faults);
+		elfdet_faults = NULL;
+	}
+	mutex_unlock(&elfdet_faults_mutex);
+}
+
+/* Classify faults still pending when the file is read. Their threads are
+ * not current, so a fault that was in progress counts by what it did so
+ * far.
+ */
+static void elfdet_faults_resolve_all(struct elfdet_faults *fl)
+{
+	struct task_struct *task;
+	pid_t tid;
+	u32 i;
+
+	for (i = 0; i < ELFDET_FAULT_PENDING; i++) {
+		tid = READ_ONCE(fl->pending[i].tid);
+		if (!tid)
+			continue;
+		/* Slots hold global TIDs, whatever the reader's namespace */
+		rcu_read_lock();
+		task = get_pid_task(find_pid_ns(tid, &init_pid_ns),
+				    PIDTYPE_PID);
+		rcu_read_unlock();
+		raw_spin_lock(&fl->lock);
+		if (task && task_tgid(task) == fl->tgid) {
+			elfdet_faults_resolve(fl, task);
+		} else if (fl->pending[i].tid == tid) {
+			fl->pending[i].tid = 0; /* exited: not classified */
+			fl->lost++;
+		}
+		raw_spin_unlock(&fl->lock);
+		if (task)
+			put_task_struct(task);
+	}
+}
+
+/* One row of the [file] section: faults in one offset bucket of a file */
+struct elfdet_fault_row {
+	char name[64];
+	u64 offset;
+	u64 kinds[ELFDET_NR_FAULT_KINDS];
+};
+
+static int elfdet_cmp_fault_chunk(const void *a, const void *b)
+{
+	const struct elfdet_fault_chunk *x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int elfdet_cmp_fault_row_key(const void *a, const void *b)
+{
+	const struct elfdet_fault_row *x = a, *y = b;
+	int ret = strcmp(x->name, y->name);
+
+	if (ret)
+		return ret;
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Most major faults first, then most minor faults */
+static int elfdet_cmp_fault_row(const void *a, const void *b)
+{
+	const struct elfdet_fault_row *x = a, *y = b;
+	int k;
+
+	for (k = 0; k < ELFDET_NR_FAULT_KINDS; k++) {
+		if (x->kinds[k] != y->kinds[k])
+			return x->kinds[k] < y->kinds[k] ? 1 : -1;
+	}
+	return elfdet_cmp_fault_row_key(a, b);
+}
+
+static void elfdet_faults_print_kinds(struct seq_file *m, const u64 *kinds)
+{
+	int k;
+
+	for (k = 0; k < ELFDET_NR_FAULT_KINDS; k++)
+		seq_printf(m, " %s=%llu", elfdet_fault_kind_name(k), kinds[k]);
+	seq_puts(m, "\n");
+}
+
+/* Attribute the chunks, sorted by address, to the VMAs of the process:
+ * sum them per region and, for file-backed VMAs, into one row per file
+ * offset bucket. Returns the number of rows, unmerged.
+ */
+static u32 elfdet_faults_attribute(struct elfdet_faults *fl,
+				   const struct elfdet_fault_chunk *chunks,
+				   u32 nr,
+				   u64 (*regions)[ELFDET_NR_FAULT_KINDS],
+				   struct elfdet_fault_row *rows)
+{
+	struct elfdet_profile_vma pv = { 0 };
+	struct vm_area_struct *vma = NULL;
+	struct elfdet_mm_bounds b;
+	struct task_struct *task;
+	struct mm_struct *mm = NULL;
+	u64 offset;
+	u32 i, nr_rows = 0;
+	int k, region;
+
+	task = get_pid_task(fl->tgid, PIDTYPE_TGID);
+	if (task) {
+		mm = get_task_mm(task);
+		put_task_struct(task);
+	}
+	if (mm && mmap_read_lock_killable(mm)) {
+		mmput(mm);
+		mm = NULL;
+	}
+	if (mm) {
+		b.start_code = mm->start_code;
+		b.end_code = mm->end_code;
+		b.start_brk = mm->start_brk;
+		b.brk = mm->brk;
+		b.start_stack = mm->start_stack;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (mm && (!vma || chunks[i].addr >= vma->vm_end)) {
+			vma = find_vma(mm, chunks[i].addr);
+			if (vma && chunks[i].addr < vma->vm_start)
+				vma = NULL;
+			if (vma)
+				elfdet_profile_vma_fill(&pv, mm, vma, &b);
+		}
+		region = vma ? pv.region : ELFDET_REGION_UNMAPPED;
+		for (k = 0; k < ELFDET_NR_FAULT_KINDS; k++)
+			regions[region][k] += chunks[i].kinds[k];
+		if (!vma || !vma->vm_file)
+			continue;
+
+		offset = chunks[i].addr - pv.start +
+			 ((u64)pv.pgoff << PAGE_SHIFT);
+		strscpy(rows[nr_rows].name, pv.name, sizeof(rows[0].name));
+		rows[nr_rows].offset =
+			round_down(offset, 1ULL << ELFDET_FAULT_BUCKET_SHIFT);
+		memcpy(rows[nr_rows].kinds, chunks[i].kinds,
+		       sizeof(rows[0].kinds));
+		nr_rows++;
+	}
+
+	if (mm) {
+		mmap_read_unlock(mm);
+		mmput(mm);
+	}
+	return nr_rows;
+}
+
+static int elfdet_faults_show(struct seq_file *m, void *v)
+{
+	u64 regions[ELFDET_NR_REGIONS][ELFDET_NR_FAULT_KINDS] = { { 0 } };
+	u64 kinds[ELFDET_NR_FAULT_KINDS] = { 0 };
+	struct elfdet_fault_chunk *chunks = NULL;
+	struct elfdet_fault_row *rows = NULL;
+	u64 end_ns, faults, recorded, dropped, lost;
+	struct elfdet_faults *fl;
+	u32 i, j, nr, nr_rows;
+	int k, ret = 0;
+
+	mutex_lock(&elfdet_faults_mutex);
+	fl = elfdet_faults;
+	if (!fl) {
+		seq_puts(m, "# not started; write a PID to start\n");
+		goto out;
+	}
+	chunks = kvmalloc_array(ELFDET_FAULT_CHUNKS, sizeof(*chunks),
+				GFP_KERNEL);
+	rows = kvmalloc_array(ELFDET_FAULT_CHUNKS, sizeof(*rows), GFP_KERNEL);
+	if (!chunks || !rows) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	elfdet_faults_resolve_all(fl);
+	raw_spin_lock(&fl->lock);
+	nr = fl->nr_chunks;
+	faults = fl->faults;
+	recorded = fl->recorded;
+	dropped = fl->dropped;
+	lost = fl->lost;
+	raw_spin_unlock(&fl->lock);
+	/* Chunks are only appended; copy one at a time */
+	for (i = 0; i < nr; i++) {
+		raw_spin_lock(&fl->lock);
+		chunks[i] = fl->chunks[i];
+		raw_spin_unlock(&fl->lock);
+		for (k = 0; k < ELFDET_NR_FAULT_KINDS; k++)
+			kinds[k] += chunks[i].kinds[k];
+	}
+
+	sort(chunks, nr, sizeof(*chunks), elfdet_cmp_fault_chunk, NULL);
+	nr_rows = elfdet_faults_attribute(fl, chunks, nr, regions, rows);
+
+	/* One row per (file, offset bucket) */
+	sort(rows, nr_rows, sizeof(*rows), elfdet_cmp_fault_row_key, NULL);
+	for (i = 0, j = 0; i < nr_rows; i++) {
+		if (j && !elfdet_cmp_fault_row_key(&rows[j - 1], &rows[i])) {
+			for (k = 0; k < ELFDET_NR_FAULT_KINDS; k++)
+				rows[j - 1].kinds[k] += rows[i].kinds[k];
+		} else {
+			rows[j++] = rows[i];
+		}
+	}
+	nr_rows = j;
+
+	end_ns = fl->running ? ktime_get_ns() : fl->stopped_ns;
+	seq_printf(m,
+		   "# pid=%d period=%u running=%d window_ms=%llu faults=%llu "
+		   "recorded=%llu chunks=%u dropped=%llu lost=%llu",
+		   fl->pid, fl->period, fl->running,
+		   (end_ns - fl->started_ns) / NSEC_PER_MSEC, faults, recorded,
+		   nr, dropped, lost);
+	elfdet_faults_print_kinds(m, kinds);
+
+	seq_puts(m, "[region]\n");
+	for (i = 0; i < ELFDET_NR_REGIONS; i++) {
+		for (k = 0; k < ELFDET_NR_FAULT_KINDS; k++) {
+			if (regions[i][k])
+				break;
+		}
+		if (k == ELFDET_NR_FAULT_KINDS)
+			continue;
+		seq_printf(m, "region=%s", elfdet_region_name(i));
+		elfdet_faults_print_kinds(m, regions[i]);
+	}
+
+	sort(rows, nr_rows, sizeof(*rows), elfdet_cmp_fault_row, NULL);
+	seq_puts(m, "[file]\n");
+	for (i = 0; i < nr_rows && i < ELFDET_FAULT_TOP; i++) {
+		seq_printf(m, "name=%s offset=0x%llx", rows[i].name,
+			   rows[i].offset);
+		elfdet_faults_print_kinds(m, rows[i].kinds);
+	}
+	if (nr_rows > ELFDET_FAULT_TOP)
+		seq_printf(m, "# %u more file ranges\n",
+			   nr_rows - ELFDET_FAULT_TOP);
+
+out:
+	mutex_unlock(&elfdet_faults_mutex);
+	kvfree(rows);
+	kvfree(chunks);
+	return ret;
+}
+
+static int elfdet_faults_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, elfdet_faults_show, NULL);
+}
+
+/* "PID [PERIOD]" records every PERIOD-th fault (default 1), "0"/"stop"
+ * stops
+ */
+static ssize_t elfdet_faults_write(struct file *file,
+				   const char __user *buffer,
+				   size_t length,
+				   loff_t *offset)
+{
+	char input_buf[32];
+	unsigned int period;
+	size_t to_copy;
+	int pid, ret;
 
+	to_copy = min(length, sizeof(input_buf) - 1);
 	if (copy_from_user(input_buf, buffer, to_copy))
 		return -EFAULT;
+	input_buf[to_copy] = '\0';
 
-	update_pid_write_buffer(buff, sizeof(buff), input_buf, to_copy);
-	pr_info("procfs_write called\n");
-	return length;
+	switch (elfdet_parse_profile_cmd(input_buf, &pid, &period)) {
+	case ELFDET_PROFILE_START:
+		ret = elfdet_faults_start(pid, period);
+		break;
+	case ELFDET_PROFILE_STOP:
+		mutex_lock(&elfdet_faults_mutex);
+		elfdet_faults_stop();
+		mutex_unlock(&elfdet_faults_mutex);
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	return ret ? ret : length;
 }
 
-static const struct proc_ops write_pops = {
-	.proc_open = procfile_open,
-	.proc_read = procfile_read,
-	.proc_write = procfile_write, // this is the important part
+static const struct proc_ops elfdet_faults_ops = {
+	.proc_open = elfdet_faults_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+	.proc_write = elfdet_faults_write,
 };
 
 static int elfdet_init(void)
 {
+	int ret;
+
+	elfdet_cache_init();
+
 	elfdet_dir = proc_mkdir("elf_det", NULL);
 	// creating the directory: elf_det in proc
 
@@ -758,8 +5394,52 @@ static int elfdet_init(void)
 	// create proc file threads with elfdet_threads_ops
 	pr_info("threads initiated; /proc/elf_det/threads created\n");
 
-	if (!elfdet_det_entry || !elfdet_threads_entry)
+	elfdet_stats_entry =
+		proc_create("stats", 0644, elfdet_dir, &elfdet_stats_ops);
+	elfdet_watch_entry =
+		proc_create("watch", 0644, elfdet_dir, &elfdet_watch_ops);
+	elfdet_procs_entry =
+		proc_create("procs", 0644, elfdet_dir, &elfdet_procs_ops);
+	// 0400: reading drains the records, so only root may do it
+	elfdet_exits_entry =
+		proc_create("exits", 0400, elfdet_dir, &elfdet_exits_ops);
+	// 0600: writing starts a probe in the scheduler, reading shows
+	// kernel stacks
+	elfdet_offcpu_entry =
+		proc_create("offcpu", 0600, elfdet_dir, &elfdet_offcpu_ops);
+	elfdet_profile_entry =
+		proc_create("profile", 0600, elfdet_dir, &elfdet_profile_ops);
+	elfdet_futex_entry =
+		proc_create("futex", 0600, elfdet_dir, &elfdet_futex_ops);
+	elfdet_syscalls_entry =
+		proc_create("syscalls", 0600, elfdet_dir, &elfdet_syscalls_ops);
+	elfdet_wakeups_entry =
+		proc_create("wakeups", 0600, elfdet_dir, &elfdet_wakeups_ops);
+	elfdet_faults_entry =
+		proc_create("faults", 0600, elfdet_dir, &elfdet_faults_ops);
+
+	if (!elfdet_det_entry || !elfdet_threads_entry || !elfdet_stats_entry ||
+	    !elfdet_watch_entry || !elfdet_procs_entry || !elfdet_exits_entry ||
+	    !elfdet_offcpu_entry || !elfdet_profile_entry ||
+	    !elfdet_futex_entry || !elfdet_syscalls_entry ||
+	    !elfdet_wakeups_entry || !elfdet_faults_entry)
+		return -ENOMEM;
+
+	elfdet_proc_log = vzalloc(sizeof(*elfdet_proc_log) * ELFDET_PROC_LOG);
+	elfdet_exits = vzalloc(sizeof(*elfdet_exits) * ELFDET_EXIT_MAX);
+	if (!elfdet_proc_log || !elfdet_exits) {
+		proc_remove(elfdet_dir);
+		elfdet_procs_free();
 		return -ENOMEM;
+	}
+
+	ret = elfdet_probes_register(elfdet_probes, ARRAY_SIZE(elfdet_probes));
+	if (ret) {
+		proc_remove(elfdet_dir);
+		elfdet_procs_free();
+		return ret;
+	}
+	elfdet_procs_populate();
 
 	return 0;
 }
@@ -773,7 +5453,27 @@ static void elfdet_exit(void)
 	pr_info("elf_det exited; /proc/elf_det/pid deleted\n");
 	proc_remove(elfdet_threads_entry);
 	pr_info("elf_det exited; /proc/elf_det/threads deleted\n");
+	proc_remove(elfdet_stats_entry);
+	proc_remove(elfdet_watch_entry);
+	proc_remove(elfdet_procs_entry);
+	proc_remove(elfdet_exits_entry);
+	proc_remove(elfdet_offcpu_entry);
+	proc_remove(elfdet_profile_entry);
+	proc_remove(elfdet_futex_entry);
+	proc_remove(elfdet_syscalls_entry);
+	proc_remove(elfdet_wakeups_entry);
+	proc_remove(elfdet_faults_entry);
 	proc_remove(elfdet_dir);
+	elfdet_offcpu_free();
+	elfdet_profile_free();
+	elfdet_futex_free();
+	elfdet_syscalls_free();
+	elfdet_wakeups_free();
+	elfdet_faults_free();
+	elfdet_probes_unregister(elfdet_probes, ARRAY_SIZE(elfdet_probes));
+	elfdet_watch_clear();
+	elfdet_procs_free();
+	elfdet_cache_free();
 }
 
 // macros for init and exit
@@ -5,11 +5,15 @@
 #include <linux/types.h>
 #include <linux/if.h>
 #include <linux/string.h>
+#include <linux/stat.h>
+#include <linux/futex.h>
 typedef u64 eh_u64;
 #else
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
 #ifndef IFNAMSIZ
 #define IFNAMSIZ 16
 #endif
@@ -502,3 +506,552 @@ static inline const char *socket_state_to_string(unsigned char state)
 		return "UNKNOWN";
 	}
 }
+
+/* Module self-instrumentation: sections of a query that are timed and
+ * exposed at /proc/elf_det/stats.
+ */
+enum elfdet_section {
+	ELFDET_SEC_DET, /* whole det query */
+	ELFDET_SEC_THREADS, /* whole threads query */
+	ELFDET_SEC_MEMORY_PRESSURE,
+	ELFDET_SEC_VMA_WALK,
+	ELFDET_SEC_NETWORK,
+	ELFDET_SEC_SOCKETS,
+	ELFDET_SEC_THREAD_LOOP,
+	ELFDET_SEC_IO, /* process-wide I/O accounting sum */
+	ELFDET_NR_SECTIONS
+};
+
+/* log2 latency buckets: bucket i counts durations in [2^i, 2^(i+1)) ns,
+ * bucket 0 also takes 0 ns and the last bucket everything above.
+ */
+#define ELFDET_HIST_BUCKETS 32
+
+static inline const char *elfdet_section_name(int sec)
+{
+	static const char *const names[ELFDET_NR_SECTIONS] = {
+		"det",	    "threads", "memory_pressure", "vma_walk",
+		"network",  "sockets", "thread_loop",	  "io",
+	};
+
+	if (sec < 0 || sec >= ELFDET_NR_SECTIONS)
+		return "unknown";
+	return names[sec];
+}
+
+static inline int elfdet_log2_bucket(eh_u64 ns)
+{
+	int bucket;
+
+	if (ns < 2)
+		return 0;
+	bucket = 63 - __builtin_clzll(ns);
+	return bucket < ELFDET_HIST_BUCKETS ? bucket : ELFDET_HIST_BUCKETS - 1;
+}
+
+/* Smallest duration counted in bucket, as printed in "<ns>:<count>" */
+static inline eh_u64 elfdet_hist_lower_ns(int bucket)
+{
+	return bucket > 0 ? 1ULL << bucket : 0;
+}
+
+/* How the VMA-derived fields of a det query (ELF base, stack end) were read */
+enum elfdet_vma_mode {
+	ELFDET_VMA_RCU, /* lockless maple-tree walk, mmap_lock untouched */
+	ELFDET_VMA_LOCKED, /* under mmap_read_trylock() */
+	ELFDET_VMA_STALE, /* lock busy: values of the previous query */
+	ELFDET_VMA_NONE, /* lock busy and nothing cached: values are 0 */
+};
+
+static inline const char *elfdet_vma_mode_name(int mode)
+{
+	switch (mode) {
+	case ELFDET_VMA_RCU:
+		return "lockless";
+	case ELFDET_VMA_LOCKED:
+		return "locked";
+	case ELFDET_VMA_STALE:
+		return "stale";
+	case ELFDET_VMA_NONE:
+		return "unavailable";
+	default:
+		return "unknown";
+	}
+}
+
+/* Commands accepted by /proc/elf_det/watch */
+enum elfdet_watch_op {
+	ELFDET_WATCH_INVALID,
+	ELFDET_WATCH_ADD, /* "PID" or "+PID" */
+	ELFDET_WATCH_REMOVE, /* "-PID" */
+	ELFDET_WATCH_CLEAR, /* "clear" */
+};
+
+/* Parse one watch command; trailing whitespace is ignored. Returns an
+ * elfdet_watch_op and stores the PID of add/remove in *pid.
+ */
+static inline int elfdet_parse_watch_cmd(const char *s, int *pid)
+{
+	int op = ELFDET_WATCH_ADD;
+	long val = 0;
+	int digits = 0;
+
+	if (!s || !pid)
+		return ELFDET_WATCH_INVALID;
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	if (strncmp(s, "clear", 5) == 0) {
+		s += 5;
+		op = ELFDET_WATCH_CLEAR;
+	} else {
+		if (*s == '+' || *s == '-')
+			op = *s++ == '-' ? ELFDET_WATCH_REMOVE :
+					   ELFDET_WATCH_ADD;
+		for (; *s >= '0' && *s <= '9'; s++, digits++) {
+			val = val * 10 + (*s - '0');
+			if (val > 0x3fffffff) /* beyond PID_MAX_LIMIT */
+				return ELFDET_WATCH_INVALID;
+		}
+		if (!digits || val == 0)
+			return ELFDET_WATCH_INVALID;
+		*pid = (int)val;
+	}
+
+	while (*s == ' ' || *s == '\t' || *s == '\n')
+		s++;
+	return *s ? ELFDET_WATCH_INVALID : op;
+}
+
+/* Commands written to the on-demand profilers (/proc/elf_det/offcpu, ...) */
+enum elfdet_profile_op {
+	ELFDET_PROFILE_INVALID,
+	ELFDET_PROFILE_START,
+	ELFDET_PROFILE_STOP,
+};
+
+/* "PID" or "PID ARG" starts profiling PID, "0" or "stop" stops. ARG is
+ * specific to the profiler (e.g. a sampling frequency) and 0 if absent.
+ */
+static inline int elfdet_parse_profile_cmd(const char *s, int *pid,
+					   unsigned int *arg)
+{
+	long val[2] = { 0, 0 };
+	int n, digits;
+
+	if (!s || !pid || !arg)
+		return ELFDET_PROFILE_INVALID;
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	if (strncmp(s, "stop", 4) == 0) {
+		s += 4;
+		n = 0;
+	} else {
+		for (n = 0; n < 2; n++) {
+			for (digits = 0; *s >= '0' && *s <= '9'; s++, digits++) {
+				val[n] = val[n] * 10 + (*s - '0');
+				if (val[n] > 0x3fffffff)
+					return ELFDET_PROFILE_INVALID;
+			}
+			if (!digits)
+				break;
+			while (*s == ' ' || *s == '\t')
+				s++;
+		}
+		if (n == 0)
+			return ELFDET_PROFILE_INVALID;
+	}
+
+	while (*s == ' ' || *s == '\t' || *s == '\n')
+		s++;
+	if (*s)
+		return ELFDET_PROFILE_INVALID;
+	if (n == 0 || val[0] == 0)
+		return n <= 1 ? ELFDET_PROFILE_STOP : ELFDET_PROFILE_INVALID;
+	*pid = (int)val[0];
+	*arg = (unsigned int)val[1];
+	return ELFDET_PROFILE_START;
+}
+
+/* Task I/O accounting (struct task_io_accounting) in plain counters;
+ * fields the kernel was built without stay 0.
+ */
+struct elfdet_io {
+	eh_u64 rchar; /* bytes through read-like syscalls */
+	eh_u64 wchar; /* bytes through write-like syscalls */
+	eh_u64 syscr;
+	eh_u64 syscw;
+	eh_u64 read_bytes; /* fetched from storage */
+	eh_u64 write_bytes; /* sent to storage (at dirtying time) */
+	eh_u64 cancelled_write_bytes; /* dirtied, then truncated away */
+};
+
+/* Counters of a watched process at one read */
+struct elfdet_watch_sample {
+	eh_u64 ns; /* monotonic time of the read */
+	eh_u64 cpu_ns;
+	unsigned long maj_flt;
+	unsigned long min_flt;
+	unsigned long rss_kb;
+	int threads;
+	struct elfdet_io io;
+};
+
+/* Counters of one thread of a watched process at one threads read */
+struct elfdet_thread_sample {
+	int tid;
+	eh_u64 cpu_ns; /* utime + stime */
+	unsigned long maj_flt;
+	unsigned long min_flt;
+	struct elfdet_io io;
+};
+
+/* Order thread samples by TID (for sort()/qsort()) */
+static inline int elfdet_cmp_thread_sample(const void *a, const void *b)
+{
+	const struct elfdet_thread_sample *x = a, *y = b;
+
+	return (x->tid > y->tid) - (x->tid < y->tid);
+}
+
+/* The sample of tid in n samples sorted by TID, or NULL */
+static inline const struct elfdet_thread_sample *
+elfdet_find_thread_sample(const struct elfdet_thread_sample *s, int n, int tid)
+{
+	int lo = 0, hi = n - 1, mid;
+
+	while (s && lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s[mid].tid == tid)
+			return &s[mid];
+		if (s[mid].tid < tid)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+/* Per-second rate of a counter that grew by delta over interval_ns,
+ * without overflowing the intermediate product. Exact for intervals up
+ * to about 17 s; longer ones are computed at microsecond resolution.
+ */
+static inline eh_u64 elfdet_rate_per_sec(eh_u64 delta, eh_u64 interval_ns)
+{
+	if (interval_ns == 0)
+		return 0;
+	if (delta < (1ULL << 34))
+		return delta * 1000000000ULL / interval_ns;
+	if (interval_ns < (1ULL << 34))
+		return delta / interval_ns * 1000000000ULL +
+		       delta % interval_ns * 1000000000ULL / interval_ns;
+	return delta / (interval_ns / 1000) * 1000000ULL;
+}
+
+/* Growth of a monotonic counter; 0 if it went backwards (e.g. exec) */
+static inline eh_u64 elfdet_counter_delta(eh_u64 prev, eh_u64 cur)
+{
+	return cur > prev ? cur - prev : 0;
+}
+
+/* Events of the process index change log (/proc/elf_det/procs) */
+enum elfdet_proc_event {
+	ELFDET_PROC_FORK,
+	ELFDET_PROC_EXEC,
+	ELFDET_PROC_EXIT,
+};
+
+static inline const char *elfdet_proc_event_name(int event)
+{
+	switch (event) {
+	case ELFDET_PROC_FORK:
+		return "fork";
+	case ELFDET_PROC_EXEC:
+		return "exec";
+	case ELFDET_PROC_EXIT:
+		return "exit";
+	default:
+		return "unknown";
+	}
+}
+
+/* Whether a change log of log_size entries that has reached generation
+ * cur still holds every change after generation since.
+ */
+static inline int elfdet_log_covers(eh_u64 since, eh_u64 cur, eh_u64 log_size)
+{
+	if (since > cur)
+		return 0;
+	return cur - since <= log_size;
+}
+
+/* Copy the end of src into dst (size bytes incl. NUL); a path keeps its
+ * binary name when it does not fit. Returns the length copied.
+ */
+static inline size_t elfdet_copy_tail(char *dst, size_t size, const char *src)
+{
+	size_t len;
+
+	if (!dst || size == 0)
+		return 0;
+	len = src ? strlen(src) : 0;
+	if (len >= size) {
+		src += len - (size - 1);
+		len = size - 1;
+	}
+	memcpy(dst, src ? src : "", len);
+	dst[len] = '\0';
+	return len;
+}
+
+/* Format a wait(2)-style exit code as "exit=N" or "signal=N[,core]" */
+static inline int elfdet_format_exit_status(int code, char *buf, size_t size)
+{
+	if (!buf || size == 0)
+		return 0;
+	if ((code & 0x7f) == 0)
+		return snprintf(buf, size, "exit=%d", (code >> 8) & 0xff);
+	return snprintf(buf, size, "signal=%d%s", code & 0x7f,
+			(code & 0x80) ? ",core" : "");
+}
+
+/* Kinds of open file in the fd inventory of det */
+enum elfdet_fd_type {
+	ELFDET_FD_REG,
+	ELFDET_FD_DIR,
+	ELFDET_FD_CHR,
+	ELFDET_FD_BLK,
+	ELFDET_FD_PIPE, /* anonymous pipe(2) */
+	ELFDET_FD_FIFO, /* named FIFO */
+	ELFDET_FD_SOCKET,
+	ELFDET_FD_EVENTFD,
+	ELFDET_FD_EPOLL,
+	ELFDET_FD_TIMERFD,
+	ELFDET_FD_SIGNALFD,
+	ELFDET_FD_IO_URING,
+	ELFDET_FD_PIDFD,
+	ELFDET_FD_INOTIFY,
+	ELFDET_FD_ANON, /* any other anonymous inode */
+	ELFDET_FD_OTHER,
+	ELFDET_NR_FD_TYPES
+};
+
+static inline const char *elfdet_fd_type_name(int type)
+{
+	static const char *const names[ELFDET_NR_FD_TYPES] = {
+		"reg",	    "dir",	"chr",	    "blk",	"pipe",
+		"fifo",	    "socket",	"eventfd",  "epoll",	"timerfd",
+		"signalfd", "io_uring", "pidfd",    "inotify",	"anon",
+		"other",
+	};
+
+	if (type < 0 || type >= ELFDET_NR_FD_TYPES)
+		return "unknown";
+	return names[type];
+}
+
+/* Type of a file from its inode mode; a FIFO is reported as a named one */
+static inline int elfdet_fd_type_from_mode(unsigned int mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		return ELFDET_FD_REG;
+	case S_IFDIR:
+		return ELFDET_FD_DIR;
+	case S_IFCHR:
+		return ELFDET_FD_CHR;
+	case S_IFBLK:
+		return ELFDET_FD_BLK;
+	case S_IFIFO:
+		return ELFDET_FD_FIFO;
+	case S_IFSOCK:
+		return ELFDET_FD_SOCKET;
+	default:
+		return ELFDET_FD_OTHER;
+	}
+}
+
+/* Type of an anonymous-inode file from its dentry name, the name its
+ * creator passed to anon_inode_getfile() (as shown in /proc/PID/fd).
+ */
+static inline int elfdet_anon_fd_type(const char *name)
+{
+	static const struct {
+		const char *name;
+		int type;
+	} anon[] = {
+		{ "[eventfd]", ELFDET_FD_EVENTFD },
+		{ "[eventpoll]", ELFDET_FD_EPOLL },
+		{ "[timerfd]", ELFDET_FD_TIMERFD },
+		{ "[signalfd]", ELFDET_FD_SIGNALFD },
+		{ "[io_uring]", ELFDET_FD_IO_URING },
+		{ "[pidfd]", ELFDET_FD_PIDFD },
+		{ "inotify", ELFDET_FD_INOTIFY },
+	};
+	size_t i;
+
+	if (!name)
+		return ELFDET_FD_ANON;
+	for (i = 0; i < sizeof(anon) / sizeof(anon[0]); i++) {
+		if (!strcmp(name, anon[i].name))
+			return anon[i].type;
+	}
+	return ELFDET_FD_ANON;
+}
+
+/* Descriptors a process can still open before EMFILE: the lowest free
+ * fd is always used, so the limit is reached once nr_open fds are open.
+ */
+static inline eh_u64 elfdet_fd_headroom(eh_u64 limit, eh_u64 nr_open)
+{
+	return limit > nr_open ? limit - nr_open : 0;
+}
+
+/* Parse the hexadecimal field key (e.g. "eventfd-count") out of len bytes
+ * of fdinfo text, which is not NUL-terminated. Returns 0 on success.
+ */
+static inline int elfdet_fdinfo_hex(const char *buf, size_t len,
+				    const char *key, eh_u64 *val)
+{
+	size_t klen = strlen(key), i = 0, j;
+	eh_u64 v;
+	int digits, d;
+
+	while (i + klen < len) {
+		if (!memcmp(buf + i, key, klen) && buf[i + klen] == ':') {
+			j = i + klen + 1;
+			while (j < len && (buf[j] == ' ' || buf[j] == '\t'))
+				j++;
+			for (v = 0, digits = 0; j < len; j++, digits++) {
+				if (buf[j] >= '0' && buf[j] <= '9')
+					d = buf[j] - '0';
+				else if (buf[j] >= 'a' && buf[j] <= 'f')
+					d = buf[j] - 'a' + 10;
+				else if (buf[j] >= 'A' && buf[j] <= 'F')
+					d = buf[j] - 'A' + 10;
+				else
+					break;
+				if (digits == 16)
+					return -1;
+				v = (v << 4) | (eh_u64)d;
+			}
+			if (!digits)
+				return -1;
+			*val = v;
+			return 0;
+		}
+		/* Keys only start at the beginning of a line */
+		while (i < len && buf[i] != '\n')
+			i++;
+		i++;
+	}
+	return -1;
+}
+
+/* Where a sampled address lies, by the mapping that contains it */
+enum elfdet_region {
+	ELFDET_REGION_CODE, /* text of the main executable */
+	ELFDET_REGION_DATA, /* other mappings of the main executable */
+	ELFDET_REGION_HEAP,
+	ELFDET_REGION_STACK,
+	ELFDET_REGION_LIB, /* other file-backed mappings */
+	ELFDET_REGION_ANON, /* anonymous memory, e.g. JIT code */
+	ELFDET_REGION_SPECIAL, /* [vdso], [vsyscall], ... */
+	ELFDET_REGION_UNMAPPED,
+	ELFDET_NR_REGIONS
+};
+
+static inline const char *elfdet_region_name(int region)
+{
+	static const char *const names[ELFDET_NR_REGIONS] = {
+		"code", "data",	   "heap",    "stack",
+		"lib",	"anon",	   "special", "unmapped",
+	};
+
+	if (region < 0 || region >= ELFDET_NR_REGIONS)
+		return "unknown";
+	return names[region];
+}
+
+/* Layout of an address space as mm_struct records it */
+struct elfdet_mm_bounds {
+	unsigned long start_code, end_code;
+	unsigned long start_brk, brk;
+	unsigned long start_stack;
+};
+
+/* Classify the mapping [start, end). is_exe: it maps the main executable;
+ * file_backed: it maps some other file; special: it is a named special
+ * mapping such as the vDSO.
+ */
+static inline int elfdet_classify_vma(const struct elfdet_mm_bounds *b,
+				      unsigned long start, unsigned long end,
+				      int is_exe, int file_backed, int special)
+{
+	if (is_exe)
+		return start < b->end_code && end > b->start_code ?
+			       ELFDET_REGION_CODE :
+			       ELFDET_REGION_DATA;
+	if (file_backed)
+		return ELFDET_REGION_LIB;
+	if (special)
+		return ELFDET_REGION_SPECIAL;
+	if (start < b->brk && end > b->start_brk)
+		return ELFDET_REGION_HEAP;
+	if (is_address_in_range(b->start_stack, start, end))
+		return ELFDET_REGION_STACK;
+	return ELFDET_REGION_ANON;
+}
+
+/* Whether a futex() op can put the caller to sleep on its first address:
+ * the wait and PI-lock operations. Wakes and requeues never block.
+ */
+static inline int elfdet_futex_op_waits(int op)
+{
+	switch (op & FUTEX_CMD_MASK) {
+	case FUTEX_WAIT:
+	case FUTEX_WAIT_BITSET:
+	case FUTEX_LOCK_PI:
+	case FUTEX_WAIT_REQUEUE_PI:
+#ifdef FUTEX_LOCK_PI2
+	case FUTEX_LOCK_PI2:
+#endif
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* How a user page fault was resolved, from the thread's fault counters
+ * before it and after it
+ */
+enum elfdet_fault_kind {
+	ELFDET_FAULT_MAJOR, /* needed I/O */
+	ELFDET_FAULT_MINOR,
+	ELFDET_FAULT_NONE, /* not counted: signal, retry or fixup */
+	ELFDET_NR_FAULT_KINDS
+};
+
+static inline int elfdet_fault_kind(unsigned long maj_before,
+				    unsigned long min_before,
+				    unsigned long maj_after,
+				    unsigned long min_after)
+{
+	if (maj_after != maj_before)
+		return ELFDET_FAULT_MAJOR;
+	if (min_after != min_before)
+		return ELFDET_FAULT_MINOR;
+	return ELFDET_FAULT_NONE;
+}
+
+static inline const char *elfdet_fault_kind_name(int kind)
+{
+	static const char *const names[ELFDET_NR_FAULT_KINDS] = {
+		"major", "minor", "none",
+	};
+
+	if (kind < 0 || kind >= ELFDET_NR_FAULT_KINDS)
+		return "unknown";
+	return names[kind];
+}
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 int main(void)
@@ -569,6 +570,250 @@ int main(void)
 		assert(strcmp(out_buf, "buff variable : 42\n") == 0);
 	}
 
+	/* self-instrumentation helpers */
+	{
+		assert(elfdet_log2_bucket(0) == 0);
+		assert(elfdet_log2_bucket(1) == 0);
+		assert(elfdet_log2_bucket(2) == 1);
+		assert(elfdet_log2_bucket(3) == 1);
+		assert(elfdet_log2_bucket(1024) == 10);
+		assert(elfdet_log2_bucket(2047) == 10);
+		assert(elfdet_log2_bucket(1ULL << 40) ==
+		       ELFDET_HIST_BUCKETS - 1);
+		assert(elfdet_hist_lower_ns(0) == 0);
+		assert(elfdet_hist_lower_ns(1) == 2);
+		assert(elfdet_hist_lower_ns(10) == 1024);
+		assert(elfdet_log2_bucket(elfdet_hist_lower_ns(20)) == 20);
+
+		assert(strcmp(elfdet_section_name(ELFDET_SEC_DET), "det") == 0);
+		assert(strcmp(elfdet_section_name(ELFDET_SEC_VMA_WALK),
+			      "vma_walk") == 0);
+		assert(strcmp(elfdet_section_name(ELFDET_SEC_THREAD_LOOP),
+			      "thread_loop") == 0);
+		assert(strcmp(elfdet_section_name(ELFDET_NR_SECTIONS),
+			      "unknown") == 0);
+		assert(strcmp(elfdet_section_name(-1), "unknown") == 0);
+
+		assert(strcmp(elfdet_vma_mode_name(ELFDET_VMA_RCU),
+			      "lockless") == 0);
+		assert(strcmp(elfdet_vma_mode_name(ELFDET_VMA_LOCKED),
+			      "locked") == 0);
+		assert(strcmp(elfdet_vma_mode_name(ELFDET_VMA_STALE), "stale") ==
+		       0);
+		assert(strcmp(elfdet_vma_mode_name(ELFDET_VMA_NONE),
+			      "unavailable") == 0);
+		assert(strcmp(elfdet_vma_mode_name(42), "unknown") == 0);
+	}
+
+	{
+		int pid = 0;
+
+		assert(elfdet_parse_watch_cmd("1234\n", &pid) ==
+		       ELFDET_WATCH_ADD && pid == 1234);
+		assert(elfdet_parse_watch_cmd(" +42", &pid) ==
+		       ELFDET_WATCH_ADD && pid == 42);
+		assert(elfdet_parse_watch_cmd("-7 \n", &pid) ==
+		       ELFDET_WATCH_REMOVE && pid == 7);
+		assert(elfdet_parse_watch_cmd("clear\n", &pid) ==
+		       ELFDET_WATCH_CLEAR);
+		assert(elfdet_parse_watch_cmd("0", &pid) ==
+		       ELFDET_WATCH_INVALID);
+		assert(elfdet_parse_watch_cmd("-", &pid) ==
+		       ELFDET_WATCH_INVALID);
+		assert(elfdet_parse_watch_cmd("12x", &pid) ==
+		       ELFDET_WATCH_INVALID);
+		assert(elfdet_parse_watch_cmd("99999999999", &pid) ==
+		       ELFDET_WATCH_INVALID);
+		assert(elfdet_parse_watch_cmd("clearx", &pid) ==
+		       ELFDET_WATCH_INVALID);
+		assert(elfdet_parse_watch_cmd(NULL, &pid) ==
+		       ELFDET_WATCH_INVALID);
+
+		assert(elfdet_counter_delta(10, 25) == 15);
+		assert(elfdet_counter_delta(25, 10) == 0);
+		assert(elfdet_counter_delta(5, 5) == 0);
+	}
+
+	{
+		char exe[8];
+
+		assert(strcmp(elfdet_proc_event_name(ELFDET_PROC_FORK),
+			      "fork") == 0);
+		assert(strcmp(elfdet_proc_event_name(ELFDET_PROC_EXIT),
+			      "exit") == 0);
+		assert(strcmp(elfdet_proc_event_name(9), "unknown") == 0);
+
+		assert(elfdet_log_covers(10, 10, 4));
+		assert(elfdet_log_covers(6, 10, 4));
+		assert(!elfdet_log_covers(5, 10, 4));
+		assert(!elfdet_log_covers(11, 10, 4));
+
+		assert(elfdet_copy_tail(exe, sizeof(exe), "/bin/sh") == 7);
+		assert(strcmp(exe, "/bin/sh") == 0);
+		assert(elfdet_copy_tail(exe, sizeof(exe), "/usr/bin/python3") ==
+		       7);
+		assert(strcmp(exe, "python3") == 0);
+		assert(elfdet_copy_tail(exe, sizeof(exe), NULL) == 0);
+		assert(exe[0] == '\0');
+	}
+
+	{
+		char status[24];
+
+		elfdet_format_exit_status(0, status, sizeof(status));
+		assert(strcmp(status, "exit=0") == 0);
+		elfdet_format_exit_status(3 << 8, status, sizeof(status));
+		assert(strcmp(status, "exit=3") == 0);
+		elfdet_format_exit_status(9, status, sizeof(status));
+		assert(strcmp(status, "signal=9") == 0);
+		elfdet_format_exit_status(11 | 0x80, status, sizeof(status));
+		assert(strcmp(status, "signal=11,core") == 0);
+	}
+
+	{
+		struct elfdet_thread_sample ts[4] = {
+			{ .tid = 30 }, { .tid = 10 }, { .tid = 40 }, { .tid = 20 },
+		};
+
+		qsort(ts, 4, sizeof(ts[0]), elfdet_cmp_thread_sample);
+		assert(ts[0].tid == 10 && ts[3].tid == 40);
+		assert(elfdet_find_thread_sample(ts, 4, 30) == &ts[2]);
+		assert(elfdet_find_thread_sample(ts, 4, 10) == &ts[0]);
+		assert(elfdet_find_thread_sample(ts, 4, 40) == &ts[3]);
+		assert(elfdet_find_thread_sample(ts, 4, 25) == NULL);
+		assert(elfdet_find_thread_sample(NULL, 0, 10) == NULL);
+
+		assert(elfdet_rate_per_sec(500, 500000000ULL) == 1000);
+		assert(elfdet_rate_per_sec(500, 0) == 0);
+		assert(elfdet_rate_per_sec(1ULL << 40, 2000000000ULL) ==
+		       1ULL << 39);
+		assert(strcmp(elfdet_section_name(ELFDET_SEC_IO), "io") == 0);
+	}
+
+	{
+		assert(elfdet_fd_type_from_mode(S_IFREG | 0644) == ELFDET_FD_REG);
+		assert(elfdet_fd_type_from_mode(S_IFDIR | 0755) == ELFDET_FD_DIR);
+		assert(elfdet_fd_type_from_mode(S_IFIFO | 0600) ==
+		       ELFDET_FD_FIFO);
+		assert(elfdet_fd_type_from_mode(S_IFSOCK | 0777) ==
+		       ELFDET_FD_SOCKET);
+		assert(elfdet_fd_type_from_mode(0) == ELFDET_FD_OTHER);
+		assert(elfdet_anon_fd_type("[eventfd]") == ELFDET_FD_EVENTFD);
+		assert(elfdet_anon_fd_type("[eventpoll]") == ELFDET_FD_EPOLL);
+		assert(elfdet_anon_fd_type("[io_uring]") == ELFDET_FD_IO_URING);
+		assert(elfdet_anon_fd_type("inotify") == ELFDET_FD_INOTIFY);
+		assert(elfdet_anon_fd_type("[userfaultfd]") == ELFDET_FD_ANON);
+		assert(elfdet_anon_fd_type(NULL) == ELFDET_FD_ANON);
+		assert(strcmp(elfdet_fd_type_name(ELFDET_FD_TIMERFD),
+			      "timerfd") == 0);
+		assert(strcmp(elfdet_fd_type_name(ELFDET_FD_OTHER), "other") ==
+		       0);
+		assert(strcmp(elfdet_fd_type_name(ELFDET_NR_FD_TYPES),
+			      "unknown") == 0);
+		assert(elfdet_fd_headroom(1024, 37) == 987);
+		assert(elfdet_fd_headroom(16, 20) == 0);
+	}
+
+	{
+		const char info[] = "pos:\t0\nflags:\t02\n"
+				    "eventfd-count:                2a\n"
+				    "eventfd-id: 7\n";
+		eh_u64 v = 0;
+
+		assert(elfdet_fdinfo_hex(info, strlen(info), "eventfd-count",
+					 &v) == 0);
+		assert(v == 0x2a);
+		assert(elfdet_fdinfo_hex(info, strlen(info), "eventfd-id",
+					 &v) == 0);
+		assert(v == 7);
+		assert(elfdet_fdinfo_hex(info, strlen(info), "count", &v) ==
+		       -1);
+		assert(elfdet_fdinfo_hex(info, strlen(info), "missing", &v) ==
+		       -1);
+		/* Not NUL-terminated: the value is cut at len */
+		assert(elfdet_fdinfo_hex(info, 15, "flags", &v) == 0);
+		assert(v == 0);
+		assert(elfdet_fdinfo_hex(info, 16, "flags", &v) == 0);
+		assert(v == 2);
+	}
+
+	{
+		int pid = 0;
+		unsigned int arg = 7;
+
+		assert(elfdet_parse_profile_cmd("1234\n", &pid, &arg) ==
+		       ELFDET_PROFILE_START);
+		assert(pid == 1234 && arg == 0);
+		assert(elfdet_parse_profile_cmd(" 42 99", &pid, &arg) ==
+		       ELFDET_PROFILE_START);
+		assert(pid == 42 && arg == 99);
+		assert(elfdet_parse_profile_cmd("0\n", &pid, &arg) ==
+		       ELFDET_PROFILE_STOP);
+		assert(elfdet_parse_profile_cmd("stop", &pid, &arg) ==
+		       ELFDET_PROFILE_STOP);
+		assert(elfdet_parse_profile_cmd("0 5", &pid, &arg) ==
+		       ELFDET_PROFILE_INVALID);
+		assert(elfdet_parse_profile_cmd("", &pid, &arg) ==
+		       ELFDET_PROFILE_INVALID);
+		assert(elfdet_parse_profile_cmd("12x", &pid, &arg) ==
+		       ELFDET_PROFILE_INVALID);
+		assert(elfdet_parse_profile_cmd("1 2 3", &pid, &arg) ==
+		       ELFDET_PROFILE_INVALID);
+		assert(elfdet_parse_profile_cmd("stop 1", &pid, &arg) ==
+		       ELFDET_PROFILE_INVALID);
+		assert(elfdet_parse_profile_cmd("99999999999", &pid, &arg) ==
+		       ELFDET_PROFILE_INVALID);
+	}
+
+	{
+		struct elfdet_mm_bounds b = {
+			.start_code = 0x400000, .end_code = 0x401000,
+			.start_brk = 0x600000, .brk = 0x621000,
+			.start_stack = 0x7ffd0000,
+		};
+
+		assert(elfdet_classify_vma(&b, 0x400000, 0x402000, 1, 1, 0) ==
+		       ELFDET_REGION_CODE);
+		assert(elfdet_classify_vma(&b, 0x402000, 0x403000, 1, 1, 0) ==
+		       ELFDET_REGION_DATA);
+		assert(elfdet_classify_vma(&b, 0x7f000000, 0x7f100000, 0, 1,
+					   0) == ELFDET_REGION_LIB);
+		assert(elfdet_classify_vma(&b, 0x600000, 0x621000, 0, 0, 0) ==
+		       ELFDET_REGION_HEAP);
+		assert(elfdet_classify_vma(&b, 0x7ffc0000, 0x7ffe0000, 0, 0,
+					   0) == ELFDET_REGION_STACK);
+		assert(elfdet_classify_vma(&b, 0x7fff0000, 0x7fff2000, 0, 0,
+					   1) == ELFDET_REGION_SPECIAL);
+		assert(elfdet_classify_vma(&b, 0x10000000, 0x10010000, 0, 0,
+					   0) == ELFDET_REGION_ANON);
+		assert(strcmp(elfdet_region_name(ELFDET_REGION_LIB), "lib") ==
+		       0);
+		assert(strcmp(elfdet_region_name(-1), "unknown") == 0);
+	}
+
+	{
+		assert(elfdet_futex_op_waits(FUTEX_WAIT));
+		assert(elfdet_futex_op_waits(FUTEX_WAIT_PRIVATE));
+		assert(elfdet_futex_op_waits(FUTEX_WAIT_BITSET |
+					     FUTEX_CLOCK_REALTIME));
+		assert(elfdet_futex_op_waits(FUTEX_LOCK_PI_PRIVATE));
+		assert(elfdet_futex_op_waits(FUTEX_WAIT_REQUEUE_PI));
+		assert(!elfdet_futex_op_waits(FUTEX_WAKE));
+		assert(!elfdet_futex_op_waits(FUTEX_WAKE_PRIVATE));
+		assert(!elfdet_futex_op_waits(FUTEX_UNLOCK_PI));
+		assert(!elfdet_futex_op_waits(FUTEX_CMP_REQUEUE));
+	}
+
+	{
+		assert(elfdet_fault_kind(3, 10, 4, 11) == ELFDET_FAULT_MAJOR);
+		assert(elfdet_fault_kind(3, 10, 3, 11) == ELFDET_FAULT_MINOR);
+		assert(elfdet_fault_kind(3, 10, 3, 10) == ELFDET_FAULT_NONE);
+		assert(strcmp(elfdet_fault_kind_name(ELFDET_FAULT_MINOR),
+			      "minor") == 0);
+		assert(strcmp(elfdet_fault_kind_name(ELFDET_NR_FAULT_KINDS),
+			      "unknown") == 0);
+	}
+
 	puts("elf_helpers tests passed");
 	puts("memory_pressure tests passed");
 	puts("socket_helpers tests passed");
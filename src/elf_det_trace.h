@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause) */
+/* Tracepoints of the elf_det module, visible as elf_det:* in ftrace/perf */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM elf_det
+
+#if !defined(_ELF_DET_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ELF_DET_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+#include "elf_det.h"
+
+/* __assign_str() lost its source argument in 6.10 */
+#ifndef elfdet_assign_str
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#define elfdet_assign_str(dst, src) __assign_str(dst)
+#else
+#define elfdet_assign_str(dst, src) __assign_str(dst, src)
+#endif
+#endif
+
+TRACE_DEFINE_ENUM(ELFDET_SEC_DET);
+TRACE_DEFINE_ENUM(ELFDET_SEC_THREADS);
+TRACE_DEFINE_ENUM(ELFDET_SEC_MEMORY_PRESSURE);
+TRACE_DEFINE_ENUM(ELFDET_SEC_VMA_WALK);
+TRACE_DEFINE_ENUM(ELFDET_SEC_NETWORK);
+TRACE_DEFINE_ENUM(ELFDET_SEC_SOCKETS);
+TRACE_DEFINE_ENUM(ELFDET_SEC_THREAD_LOOP);
+TRACE_DEFINE_ENUM(ELFDET_SEC_IO);
+
+#define show_elfdet_section(sec)                                        \
+	__print_symbolic(sec, { ELFDET_SEC_DET, "det" },                \
+			 { ELFDET_SEC_THREADS, "threads" },             \
+			 { ELFDET_SEC_MEMORY_PRESSURE, "memory_pressure" }, \
+			 { ELFDET_SEC_VMA_WALK, "vma_walk" },           \
+			 { ELFDET_SEC_NETWORK, "network" },             \
+			 { ELFDET_SEC_SOCKETS, "sockets" },             \
+			 { ELFDET_SEC_THREAD_LOOP, "thread_loop" },     \
+			 { ELFDET_SEC_IO, "io" })
+
+/* A det or threads query for pid begins */
+TRACE_EVENT(elfdet_query_start,
+
+	TP_PROTO(int pid, int section),
+
+	TP_ARGS(pid, section),
+
+	TP_STRUCT__entry(
+		__field(int, pid)
+		__field(int, section)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->section = section;
+	),
+
+	TP_printk("pid=%d query=%s", __entry->pid,
+		  show_elfdet_section(__entry->section))
+);
+
+/* Shared layout of events that report a finished, timed piece of work */
+DECLARE_EVENT_CLASS(elfdet_timed,
+
+	TP_PROTO(int pid, int section, u64 duration_ns, size_t bytes),
+
+	TP_ARGS(pid, section, duration_ns, bytes),
+
+	TP_STRUCT__entry(
+		__field(int, pid)
+		__field(int, section)
+		__field(u64, duration_ns)
+		__field(size_t, bytes)
+	),
+
+	TP_fast_assign(
+		__entry->pid = pid;
+		__entry->section = section;
+		__entry->duration_ns = duration_ns;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("pid=%d section=%s duration_ns=%llu bytes=%zu",
+		  __entry->pid, show_elfdet_section(__entry->section),
+		  __entry->duration_ns, __entry->bytes)
+);
+
+/* A whole query finished */
+DEFINE_EVENT(elfdet_timed, elfdet_query_end,
+	TP_PROTO(int pid, int section, u64 duration_ns, size_t bytes),
+	TP_ARGS(pid, section, duration_ns, bytes)
+);
+
+/* One section of a query finished */
+DEFINE_EVENT(elfdet_timed, elfdet_section,
+	TP_PROTO(int pid, int section, u64 duration_ns, size_t bytes),
+	TP_ARGS(pid, section, duration_ns, bytes)
+);
+
+/* A sampler took one sample of pid on the current CPU */
+TRACE_EVENT(elfdet_sampler_tick,
+
+	TP_PROTO(const char *sampler, int pid, u64 duration_ns),
+
+	TP_ARGS(sampler, pid, duration_ns),
+
+	TP_STRUCT__entry(
+		__string(sampler, sampler)
+		__field(int, pid)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		elfdet_assign_str(sampler, sampler);
+		__entry->pid = pid;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("sampler=%s pid=%d duration_ns=%llu", __get_str(sampler),
+		  __entry->pid, __entry->duration_ns)
+);
+
+/* A fixed-size table was full and an event for pid was not recorded */
+TRACE_EVENT(elfdet_dropped,
+
+	TP_PROTO(const char *table, int pid, u64 total_dropped),
+
+	TP_ARGS(table, pid, total_dropped),
+
+	TP_STRUCT__entry(
+		__string(table, table)
+		__field(int, pid)
+		__field(u64, total_dropped)
+	),
+
+	TP_fast_assign(
+		elfdet_assign_str(table, table);
+		__entry->pid = pid;
+		__entry->total_dropped = total_dropped;
+	),
+
+	TP_printk("table=%s pid=%d total_dropped=%llu", __get_str(table),
+		  __entry->pid, __entry->total_dropped)
+);
+
+#endif /* _ELF_DET_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE elf_det_trace
+#include <trace/define_trace.h>
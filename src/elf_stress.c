@@ -0,0 +1,370 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+// Concurrent-reader stress harness for the /proc/elf_det files
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proc_elf_ctrl.h"
+
+#define STRESS_MAX_STAGES  16
+#define STRESS_MAX_THREADS 256
+#define STRESS_MAX_TARGETS 1024
+#define STRESS_BUF_INIT	   65536
+#define STRESS_LAT_MAX	   (1 << 20) /* latency samples kept per stage */
+#define FAULT_PAGES	   64 /* pages touched per fault round */
+
+/* Page-fault latency of one target, shared with the harness */
+struct fault_stats {
+	unsigned long long rounds;
+	unsigned int hist[REC_HIST_BUCKETS];
+};
+
+struct stress_stage {
+	int readers;
+	int writers;
+	unsigned long long end_ns;
+	const pid_t *targets;
+	int nr_targets;
+
+	/* results, updated atomically by the threads */
+	unsigned long long queries;
+	unsigned long long mismatches;
+	unsigned long long errors;
+	unsigned long long *lat; /* per-query latency samples */
+	unsigned long long nr_lat;
+};
+
+struct stress_thread {
+	struct stress_stage *stage;
+	pthread_t tid;
+	unsigned int seed;
+};
+
+static unsigned long long stress_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+	       (unsigned long long)ts.tv_nsec;
+}
+
+/* Target body: fault in FAULT_PAGES fresh pages, time it, unmap, pause.
+ * Faults have to take mmap_lock for read, so a reader holding it for long
+ * stretches shows up as fault latency here.
+ */
+static void target_loop(struct fault_stats *st)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t len = (size_t)page * FAULT_PAGES, off;
+	unsigned long long t0, dt;
+	char *p;
+
+	for (;;) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			_exit(1);
+		t0 = stress_now_ns();
+		for (off = 0; off < len; off += (size_t)page)
+			p[off] = 1;
+		dt = (stress_now_ns() - t0) / FAULT_PAGES;
+		munmap(p, len);
+
+		__atomic_fetch_add(&st->hist[hist_index(dt)], 1,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->rounds, 1, __ATOMIC_RELAXED);
+		usleep(1000);
+	}
+}
+
+/* Read the whole session file from offset 0 into *buf (NUL terminated) */
+static long read_all(int fd, char **buf, size_t *size)
+{
+	size_t total = 0;
+	ssize_t n;
+
+	for (;;) {
+		if (total + 1 >= *size) {
+			char *bigger = realloc(*buf, *size * 2);
+
+			if (!bigger)
+				return -1;
+			*buf = bigger;
+			*size *= 2;
+		}
+		n = pread(fd, *buf + total, *size - total - 1, (off_t)total);
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		total += (size_t)n;
+	}
+	(*buf)[total] = '\0';
+	return (long)total;
+}
+
+static int bind_pid(int fd, pid_t pid)
+{
+	char s[16];
+	int len = snprintf(s, sizeof(s), "%d", (int)pid);
+
+	return write(fd, s, (size_t)len) == len ? 0 : -1;
+}
+
+/* Reader: each query binds its own det/threads sessions to a random target
+ * and checks that both answers describe that target.
+ */
+static void *reader_thread(void *arg)
+{
+	struct stress_thread *t = arg;
+	struct stress_stage *sg = t->stage;
+	struct ctrl_snapshot *det, *threads;
+	char *det_path = build_proc_path("det");
+	char *threads_path = build_proc_path("threads");
+	size_t size = STRESS_BUF_INIT;
+	char *buf = malloc(size);
+	unsigned long long t0, idx;
+	int det_fd = -1, threads_fd = -1;
+	pid_t pid;
+
+	det = calloc(1, sizeof(*det));
+	threads = calloc(1, sizeof(*threads));
+	if (det_path && threads_path) {
+		det_fd = open(det_path, O_RDWR);
+		threads_fd = open(threads_path, O_RDWR);
+	}
+	if (!buf || !det || !threads || det_fd < 0 || threads_fd < 0) {
+		__atomic_fetch_add(&sg->errors, 1, __ATOMIC_RELAXED);
+		goto out;
+	}
+
+	while ((t0 = stress_now_ns()) < sg->end_ns) {
+		pid = sg->targets[rand_r(&t->seed) % (unsigned int)sg->nr_targets];
+
+		if (bind_pid(det_fd, pid) || read_all(det_fd, &buf, &size) < 0) {
+			__atomic_fetch_add(&sg->errors, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		parse_snapshot(buf, det);
+		if (bind_pid(threads_fd, pid) ||
+		    read_all(threads_fd, &buf, &size) < 0) {
+			__atomic_fetch_add(&sg->errors, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		parse_snapshot(buf, threads);
+
+		idx = __atomic_fetch_add(&sg->nr_lat, 1, __ATOMIC_RELAXED);
+		if (idx < STRESS_LAT_MAX)
+			sg->lat[idx] = stress_now_ns() - t0;
+		__atomic_fetch_add(&sg->queries, 1, __ATOMIC_RELAXED);
+		if (!snapshot_describes_pid(det, threads, pid))
+			__atomic_fetch_add(&sg->mismatches, 1,
+					   __ATOMIC_RELAXED);
+	}
+
+out:
+	if (det_fd >= 0)
+		close(det_fd);
+	if (threads_fd >= 0)
+		close(threads_fd);
+	if (threads)
+		snapshot_free(threads);
+	if (det)
+		snapshot_free(det);
+	free(threads);
+	free(det);
+	free(buf);
+	free(threads_path);
+	free(det_path);
+	return NULL;
+}
+
+/* Writer: keeps re-targeting the global pid file, which must not leak into
+ * the readers' sessions.
+ */
+static void *writer_thread(void *arg)
+{
+	struct stress_thread *t = arg;
+	struct stress_stage *sg = t->stage;
+	char *path = build_proc_path("pid");
+	int fd = path ? open(path, O_WRONLY) : -1;
+	pid_t pid;
+
+	if (fd < 0) {
+		__atomic_fetch_add(&sg->errors, 1, __ATOMIC_RELAXED);
+		free(path);
+		return NULL;
+	}
+	while (stress_now_ns() < sg->end_ns) {
+		pid = sg->targets[rand_r(&t->seed) % (unsigned int)sg->nr_targets];
+		if (bind_pid(fd, pid))
+			__atomic_fetch_add(&sg->errors, 1, __ATOMIC_RELAXED);
+	}
+	close(fd);
+	free(path);
+	return NULL;
+}
+
+static void fault_snapshot(const struct fault_stats *st, int n,
+			   unsigned int *hist, unsigned long long *rounds)
+{
+	int i, b;
+
+	memset(hist, 0, REC_HIST_BUCKETS * sizeof(*hist));
+	*rounds = 0;
+	for (i = 0; i < n; i++) {
+		*rounds += __atomic_load_n(&st[i].rounds, __ATOMIC_RELAXED);
+		for (b = 0; b < REC_HIST_BUCKETS; b++)
+			hist[b] += __atomic_load_n(&st[i].hist[b],
+						   __ATOMIC_RELAXED);
+	}
+}
+
+static int run_stage(struct stress_stage *sg, unsigned int duration_ms,
+		     const struct fault_stats *faults)
+{
+	static unsigned int before[REC_HIST_BUCKETS], after[REC_HIST_BUCKETS];
+	static struct stress_thread threads[2 * STRESS_MAX_THREADS];
+	unsigned long long start, elapsed, r0, r1, n;
+	int i, nr = sg->readers + sg->writers, b;
+
+	fault_snapshot(faults, sg->nr_targets, before, &r0);
+	start = stress_now_ns();
+	sg->end_ns = start + duration_ms * 1000000ULL;
+
+	for (i = 0; i < nr; i++) {
+		threads[i].stage = sg;
+		threads[i].seed = (unsigned int)(start + (unsigned int)i * 7919);
+		if (pthread_create(&threads[i].tid, NULL,
+				   i < sg->readers ? reader_thread : writer_thread,
+				   &threads[i])) {
+			sg->end_ns = 0;
+			nr = i;
+			__atomic_fetch_add(&sg->errors, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	if (sg->readers + sg->writers == 0)
+		usleep(duration_ms * 1000);
+	for (i = 0; i < nr; i++)
+		pthread_join(threads[i].tid, NULL);
+	elapsed = stress_now_ns() - start;
+	fault_snapshot(faults, sg->nr_targets, after, &r1);
+	for (b = 0; b < REC_HIST_BUCKETS; b++)
+		after[b] -= before[b];
+
+	n = sg->nr_lat < STRESS_LAT_MAX ? sg->nr_lat : STRESS_LAT_MAX;
+	qsort(sg->lat, n, sizeof(*sg->lat), compare_ull);
+	printf("readers=%d writers=%d targets=%d duration_ms=%llu "
+	       "queries=%llu qps=%.1f mismatches=%llu errors=%llu "
+	       "p50_ns=%llu p99_ns=%llu max_ns=%llu "
+	       "fault_rounds=%llu fault_p50_ns=%llu fault_p99_ns=%llu\n",
+	       sg->readers, sg->writers, sg->nr_targets, elapsed / 1000000ULL,
+	       sg->queries,
+	       elapsed ? sg->queries * 1e9 / (double)elapsed : 0.0,
+	       sg->mismatches, sg->errors, sorted_percentile(sg->lat, n, 50),
+	       sorted_percentile(sg->lat, n, 99), n ? sg->lat[n - 1] : 0,
+	       r1 - r0, hist_percentile(after, r1 - r0, 50),
+	       hist_percentile(after, r1 - r0, 99));
+	fflush(stdout);
+	return sg->mismatches || sg->errors;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [--readers <n,n,...>] [--writers <n>] "
+		"[--targets <n>] [--duration <ms>]\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	int readers[STRESS_MAX_STAGES] = { 1, 2, 4, 8, 16 }, nr_stages = 5;
+	int writers = 1, nr_targets = 8, duration_ms = 2000;
+	static pid_t targets[STRESS_MAX_TARGETS];
+	struct fault_stats *faults;
+	struct stress_stage sg;
+	int i, failed = 0;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		if (!strcmp(argv[i], "--readers"))
+			nr_stages = parse_int_list(argv[i + 1], readers,
+						   STRESS_MAX_STAGES, 0);
+		else if (!strcmp(argv[i], "--writers"))
+			writers = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "--targets"))
+			nr_targets = atoi(argv[i + 1]);
+		else if (!strcmp(argv[i], "--duration"))
+			duration_ms = atoi(argv[i + 1]);
+		else
+			nr_stages = -1;
+	}
+	if (i != argc || nr_stages <= 0 || writers < 0 ||
+	    writers > STRESS_MAX_THREADS || nr_targets < 1 ||
+	    nr_targets > STRESS_MAX_TARGETS || duration_ms < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = 0; i < nr_stages; i++) {
+		if (readers[i] > STRESS_MAX_THREADS) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	faults = mmap(NULL, (size_t)nr_targets * sizeof(*faults),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	memset(&sg, 0, sizeof(sg));
+	sg.lat = malloc(STRESS_LAT_MAX * sizeof(*sg.lat));
+	if (faults == MAP_FAILED || !sg.lat) {
+		perror("elf_stress");
+		return 1;
+	}
+
+	for (i = 0; i < nr_targets; i++) {
+		targets[i] = fork();
+		if (targets[i] == 0)
+			target_loop(&faults[i]);
+		if (targets[i] < 0) {
+			perror("fork");
+			nr_targets = i;
+			failed = 1;
+			break;
+		}
+	}
+
+	/* Stage 0 has no readers and gives the fault-latency baseline */
+	printf("# elf_stress format=1 targets=%d writers=%d\n", nr_targets,
+	       writers);
+	for (i = -1; i < nr_stages && nr_targets > 0; i++) {
+		unsigned long long *lat = sg.lat;
+
+		memset(&sg, 0, sizeof(sg));
+		sg.lat = lat;
+		sg.readers = i < 0 ? 0 : readers[i];
+		sg.writers = i < 0 ? 0 : writers;
+		sg.targets = targets;
+		sg.nr_targets = nr_targets;
+		failed |= run_stage(&sg, (unsigned int)duration_ms, faults);
+	}
+
+	for (i = 0; i < nr_targets; i++) {
+		kill(targets[i], SIGKILL);
+		waitpid(targets[i], NULL, 0);
+	}
+	free(sg.lat);
+	munmap(faults, (size_t)nr_targets * sizeof(*faults));
+	if (failed)
+		fprintf(stderr, "elf_stress: mismatched or failed queries\n");
+	return failed;
+}
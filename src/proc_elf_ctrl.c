@@ -3,8 +3,40 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include "proc_elf_ctrl.h"
 
+#define WATCH_BUF_INIT	    (64 * 1024)
+#define COLLECT_MAX_JOBS    64
+#define COLLECT_MAX_PIDS    (1 << 20)
+#define EXPORT_MAX_CGROUPS  16
+#define EXPORT_MAX_TARGETS  4096
+#define EXPORT_CACHE_MS_DEF 1000
+#define SYM_MAX_MODULES	    256
+#define SYM_MAX_ADDRS	    4096
+
+/* A proc file kept open across watch ticks */
+struct watch_file {
+	const char *name;
+	int fd;
+	char *buf;
+	size_t size;
+	struct ctrl_snapshot prev;
+	struct ctrl_snapshot cur;
+};
+
 static void print_cmdline(const char *pid_str)
 {
 	char path[64];
@@ -89,20 +121,2059 @@ static void print_process_info(const char *pid_str)
 	puts("===============================================================");
 }
 
+static int open_watch_file(struct watch_file *wf, const char *name, int flags)
+{
+	char *path;
+
+	memset(wf, 0, sizeof(*wf));
+	wf->name = name;
+	wf->fd = -1;
+
+	path = build_proc_path(name);
+	if (!path)
+		return -1;
+	wf->fd = open(path, flags);
+	free(path);
+	if (wf->fd < 0) {
+		perror(name);
+		return -1;
+	}
+
+	if (flags == O_WRONLY)
+		return 0;
+
+	wf->size = WATCH_BUF_INIT;
+	wf->buf = malloc(wf->size);
+	if (!wf->buf)
+		return -1;
+	return 0;
+}
+
+static void close_watch_file(struct watch_file *wf)
+{
+	if (wf->fd >= 0)
+		close(wf->fd);
+	free(wf->buf);
+	snapshot_free(&wf->prev);
+	snapshot_free(&wf->cur);
+	wf->fd = -1;
+	wf->buf = NULL;
+}
+
+/* Re-read the whole file from offset 0 without reopening it.
+ * The seq_file behind det/threads regenerates its content on every read
+ * at offset 0. The buffer grows when the output does not fit.
+ */
+static int read_watch_file(struct watch_file *wf)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	for (;;) {
+		n = pread(wf->fd, wf->buf + off, wf->size - 1 - off,
+			  (off_t)off);
+		if (n < 0) {
+			perror(wf->name);
+			return -1;
+		}
+		if (n == 0)
+			break;
+
+		off += (size_t)n;
+		if (off == wf->size - 1) {
+			char *bigger = realloc(wf->buf, wf->size * 2);
+
+			if (!bigger)
+				return -1;
+			wf->buf = bigger;
+			wf->size *= 2;
+		}
+	}
+
+	wf->buf[off] = '\0';
+	parse_snapshot(wf->buf, &wf->cur);
+	return 0;
+}
+
+static void print_changed_fields(const struct watch_file *wf)
+{
+	const char *old_value;
+	int i, j, nth;
+
+	for (i = 0; i < wf->cur.count; i++) {
+		const struct ctrl_field *f = &wf->cur.fields[i];
+
+		if (!snapshot_field_changed(&wf->prev, &wf->cur, i, &old_value))
+			continue;
+		if (old_value)
+			printf("  %-24s %s -> %s\n", f->key, old_value,
+			       f->value);
+		else
+			printf("  %-24s (new) %s\n", f->key, f->value);
+	}
+
+	/* Fields that disappeared, e.g. exited threads or closed sockets */
+	for (i = 0; i < wf->prev.count; i++) {
+		const struct ctrl_field *f = &wf->prev.fields[i];
+
+		nth = 0;
+		for (j = 0; j < i; j++) {
+			if (!strcmp(wf->prev.fields[j].key, f->key))
+				nth++;
+		}
+		if (snapshot_find(&wf->cur, f->key, nth) < 0)
+			printf("  %-24s (gone) %s\n", f->key, f->value);
+	}
+}
+
+static void print_watch_rates(const struct ctrl_snapshot *prev,
+			      const struct ctrl_snapshot *cur,
+			      unsigned long long interval_ns)
+{
+	unsigned long long faults, rx, tx, cpu;
+
+	faults = rate_per_sec_x100(snapshot_get_ull(prev, "Major") +
+					   snapshot_get_ull(prev, "Minor"),
+				   snapshot_get_ull(cur, "Major") +
+					   snapshot_get_ull(cur, "Minor"),
+				   interval_ns);
+	rx = rate_per_sec_x100(snapshot_get_ull(prev, "rx_bytes"),
+			       snapshot_get_ull(cur, "rx_bytes"), interval_ns);
+	tx = rate_per_sec_x100(snapshot_get_ull(prev, "tx_bytes"),
+			       snapshot_get_ull(cur, "tx_bytes"), interval_ns);
+	cpu = interval_cpu_permyriad(snapshot_get_ull(prev, "CPU Time"),
+				     snapshot_get_ull(cur, "CPU Time"),
+				     interval_ns);
+
+	printf("  rates: faults/s=%llu.%02llu rx_bytes/s=%llu.%02llu "
+	       "tx_bytes/s=%llu.%02llu cpu=%llu.%02llu%%\n",
+	       faults / 100, faults % 100, rx / 100, rx % 100, tx / 100,
+	       tx % 100, cpu / 100, cpu % 100);
+}
+
+static unsigned long long monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+	       (unsigned long long)ts.tv_nsec;
+}
+
+/* Bind an open det/threads descriptor to one PID (kernel-side session),
+ * so reads through it are not affected by other users of the pid file.
+ */
+static int bind_session(const struct watch_file *wf, const char *pid_str)
+{
+	if (write(wf->fd, pid_str, strlen(pid_str)) < 0) {
+		perror(wf->name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Watch one PID: keep det/threads open, re-read every interval and
+ * print only the fields that changed plus per-interval rates.
+ * count == 0 watches until the process goes away.
+ */
+static int
+watch_process(const char *pid_str, unsigned int interval_ms, unsigned long count)
+{
+	struct watch_file det, threads;
+	struct timespec pause;
+	unsigned long long now_ns, last_ns = 0;
+	unsigned long tick;
+	int ret = 1;
+
+	det.fd = -1;
+	det.buf = NULL;
+	threads.fd = -1;
+	threads.buf = NULL;
+	if (open_watch_file(&det, "det", O_RDWR) ||
+	    open_watch_file(&threads, "threads", O_RDWR) ||
+	    bind_session(&det, pid_str) || bind_session(&threads, pid_str))
+		goto out;
+
+	pause.tv_sec = interval_ms / 1000;
+	pause.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+
+	for (tick = 0; count == 0 || tick < count; tick++) {
+		now_ns = monotonic_ns();
+		if (read_watch_file(&det) || read_watch_file(&threads))
+			goto out;
+
+		if (!snapshot_is_live(&det.cur)) {
+			printf("%s", det.buf);
+			break;
+		}
+
+		if (tick == 0) {
+			printf("\n");
+			puts("===============================================================");
+			printf("WATCHING PID %s (interval %u ms)\n", pid_str,
+			       interval_ms);
+			puts("===============================================================");
+			printf("%s\n%s", det.buf, threads.buf);
+		} else {
+			printf("\n--- tick %lu (+%llu.%03llus) ---\n", tick,
+			       (now_ns - last_ns) / 1000000000ULL,
+			       ((now_ns - last_ns) / 1000000ULL) % 1000ULL);
+			print_changed_fields(&det);
+			print_changed_fields(&threads);
+			print_watch_rates(&det.prev, &det.cur,
+					  now_ns - last_ns);
+		}
+		fflush(stdout);
+
+		/* The next tick parses into the old previous snapshot */
+		snapshot_swap(&det.prev, &det.cur);
+		snapshot_swap(&threads.prev, &threads.cur);
+		last_ns = now_ns;
+
+		if (count == 0 || tick + 1 < count)
+			nanosleep(&pause, NULL);
+	}
+	ret = 0;
+
+out:
+	close_watch_file(&det);
+	close_watch_file(&threads);
+	return ret;
+}
+
+/* Work shared by the collector threads */
+struct collect_ctx {
+	struct pid_summary *results;
+	size_t count;
+	size_t next; /* next result slot to claim */
+};
+
+static void collect_one(struct watch_file *det, struct pid_summary *sum)
+{
+	char pid_str[16];
+
+	snprintf(pid_str, sizeof(pid_str), "%d", sum->pid);
+	sum->ok = 0;
+	if (bind_session(det, pid_str) || read_watch_file(det))
+		return;
+	fill_pid_summary(&det->cur, sum);
+}
+
+/* Each worker owns one det descriptor (its kernel session) and claims
+ * PIDs from the shared list until it is exhausted.
+ */
+static void *collect_worker(void *arg)
+{
+	struct collect_ctx *ctx = arg;
+	struct watch_file *det;
+	size_t i;
+
+	det = malloc(sizeof(*det));
+	if (!det)
+		return NULL;
+	if (open_watch_file(det, "det", O_RDWR) == 0) {
+		for (;;) {
+			i = __atomic_fetch_add(&ctx->next, 1,
+					       __ATOMIC_RELAXED);
+			if (i >= ctx->count)
+				break;
+			collect_one(det, &ctx->results[i]);
+		}
+	}
+	close_watch_file(det);
+	free(det);
+	return NULL;
+}
+
+/* Collect every numeric /proc entry; returns the PID count or -1. */
+static int list_all_pids(int **out)
+{
+	DIR *dir;
+	struct dirent *de;
+	int *pids = NULL, *bigger;
+	int n = 0, cap = 0;
+
+	dir = opendir("/proc");
+	if (!dir) {
+		perror("/proc");
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		char *end;
+		long v = strtol(de->d_name, &end, 10);
+
+		if (*end != '\0' || v <= 0)
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			bigger = realloc(pids, (size_t)cap * sizeof(*pids));
+			if (!bigger) {
+				free(pids);
+				closedir(dir);
+				return -1;
+			}
+			pids = bigger;
+		}
+		pids[n++] = (int)v;
+	}
+	closedir(dir);
+
+	*out = pids;
+	return n;
+}
+
+/* Collect many PIDs with a pool of jobs workers and print one report
+ * sorted by sort_key ("pid", "cpu" or "rss").
+ */
+static int
+collect_pids(const int *pids, int count, int jobs, const char *sort_key)
+{
+	pthread_t workers[COLLECT_MAX_JOBS];
+	struct collect_ctx ctx;
+	unsigned long long start_ns, elapsed_ns;
+	int (*cmp)(const void *, const void *) = compare_summary_pid;
+	int started = 0, ok = 0;
+	int i;
+
+	if (!strcmp(sort_key, "cpu"))
+		cmp = compare_summary_cpu;
+	else if (!strcmp(sort_key, "rss"))
+		cmp = compare_summary_rss;
+
+	ctx.results = calloc((size_t)count, sizeof(*ctx.results));
+	if (!ctx.results)
+		return 1;
+	ctx.count = (size_t)count;
+	ctx.next = 0;
+	for (i = 0; i < count; i++)
+		ctx.results[i].pid = pids[i];
+
+	if (jobs > count)
+		jobs = count;
+
+	start_ns = monotonic_ns();
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&workers[i], NULL, collect_worker, &ctx))
+			break;
+		started++;
+	}
+	if (started == 0)
+		collect_worker(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	elapsed_ns = monotonic_ns() - start_ns;
+
+	qsort(ctx.results, (size_t)count, sizeof(*ctx.results), cmp);
+
+	printf("%-8s %-16s %8s %10s %10s %12s %8s\n", "PID", "NAME",
+	       "CPU(%)", "RSS(KB)", "SWAP(KB)", "FAULTS", "SOCKETS");
+	for (i = 0; i < count; i++) {
+		const struct pid_summary *r = &ctx.results[i];
+
+		if (!r->ok)
+			continue;
+		ok++;
+		printf("%-8d %-16s %5llu.%02llu %10llu %10llu %12llu %8llu\n",
+		       r->pid, r->name, r->cpu_x100 / 100, r->cpu_x100 % 100,
+		       r->rss_kb, r->swap_kb, r->faults, r->sockets);
+	}
+	printf("Collected %d of %d processes in %llu.%03llu ms "
+	       "with %d workers\n",
+	       ok, count, elapsed_ns / 1000000ULL,
+	       (elapsed_ns / 1000ULL) % 1000ULL, started ? started : 1);
+
+	free(ctx.results);
+	return 0;
+}
+
+/* Growable text buffer for rendered metrics */
+struct text_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static void tb_append(struct text_buf *tb, const char *fmt, ...)
+{
+	va_list args;
+	size_t need, cap;
+	char *bigger;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (n < 0)
+		return;
+
+	need = tb->len + (size_t)n + 1;
+	if (need > tb->cap) {
+		cap = tb->cap ? tb->cap : 16384;
+		while (cap < need)
+			cap *= 2;
+		bigger = realloc(tb->data, cap);
+		if (!bigger)
+			return;
+		tb->data = bigger;
+		tb->cap = cap;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(tb->data + tb->len, tb->cap - tb->len, fmt, args);
+	va_end(args);
+	tb->len += (size_t)n;
+}
+
+/* A simple per-process metric read straight from struct export_sample */
+struct metric_desc {
+	const char *name; /* family name, without _total */
+	const char *type; /* "gauge" or "counter" */
+	const char *help; /* set on the first entry of a family only */
+	const char *label; /* optional extra label */
+	const char *label_value;
+	size_t offset; /* unsigned long long field in export_sample */
+	unsigned long long scale; /* 1024 converts KB fields to bytes */
+};
+
+#define SAMPLE_FIELD(f) offsetof(struct export_sample, f)
+
+static const struct metric_desc metric_descs[] = {
+	{"elfdet_rss_bytes", "gauge", "Resident set size by component",
+	 "component", "total", SAMPLE_FIELD(rss_kb), 1024},
+	{"elfdet_rss_bytes", "gauge", NULL, "component", "anon",
+	 SAMPLE_FIELD(anon_kb), 1024},
+	{"elfdet_rss_bytes", "gauge", NULL, "component", "file",
+	 SAMPLE_FIELD(file_kb), 1024},
+	{"elfdet_rss_bytes", "gauge", NULL, "component", "shmem",
+	 SAMPLE_FIELD(shmem_kb), 1024},
+	{"elfdet_virtual_memory_bytes", "gauge", "Total virtual memory (VSZ)",
+	 NULL, NULL, SAMPLE_FIELD(vsz_kb), 1024},
+	{"elfdet_swap_bytes", "gauge", "Swapped-out anonymous memory", NULL,
+	 NULL, SAMPLE_FIELD(swap_kb), 1024},
+	{"elfdet_page_faults", "counter", "Page faults since process start",
+	 "type", "major", SAMPLE_FIELD(maj_flt), 1},
+	{"elfdet_page_faults", "counter", NULL, "type", "minor",
+	 SAMPLE_FIELD(min_flt), 1},
+	{"elfdet_sockets", "gauge", "Open sockets by protocol", "proto", "all",
+	 SAMPLE_FIELD(sockets), 1},
+	{"elfdet_sockets", "gauge", NULL, "proto", "tcp", SAMPLE_FIELD(tcp),
+	 1},
+	{"elfdet_sockets", "gauge", NULL, "proto", "udp", SAMPLE_FIELD(udp),
+	 1},
+	{"elfdet_sockets", "gauge", NULL, "proto", "unix",
+	 SAMPLE_FIELD(unix_socks), 1},
+	{"elfdet_tcp_segments", "counter", "TCP segments over open sockets",
+	 "direction", "rx", SAMPLE_FIELD(rx_packets), 1},
+	{"elfdet_tcp_segments", "counter", NULL, "direction", "tx",
+	 SAMPLE_FIELD(tx_packets), 1},
+	{"elfdet_tcp_bytes", "counter", "TCP bytes over open sockets",
+	 "direction", "rx", SAMPLE_FIELD(rx_bytes), 1},
+	{"elfdet_tcp_bytes", "counter", NULL, "direction", "tx",
+	 SAMPLE_FIELD(tx_bytes), 1},
+	{"elfdet_tcp_retransmits", "gauge",
+	 "Retransmitted TCP segments in flight", NULL, NULL,
+	 SAMPLE_FIELD(tcp_retransmits), 1},
+	{"elfdet_socket_drops", "counter", "Packets dropped on open sockets",
+	 NULL, NULL, SAMPLE_FIELD(drops), 1},
+};
+
+/* Emit HELP/TYPE for a family. OpenMetrics names counter families without
+ * the _total suffix; the classic text format (textfile collector) with it.
+ */
+static void render_family_header(struct text_buf *tb,
+				 const char *name,
+				 const char *type,
+				 const char *help,
+				 int openmetrics)
+{
+	const char *suffix =
+		(!openmetrics && !strcmp(type, "counter")) ? "_total" : "";
+
+	tb_append(tb, "# HELP %s%s %s\n", name, suffix, help);
+	tb_append(tb, "# TYPE %s%s %s\n", name, suffix, type);
+}
+
+/* Render samples as Prometheus/OpenMetrics text. Samples of one family
+ * are kept contiguous as both formats require.
+ */
+static void render_metrics(struct text_buf *tb,
+			   const struct export_sample *samples,
+			   int count,
+			   int openmetrics)
+{
+	char comm[48];
+	size_t i;
+	int j, k;
+
+	tb->len = 0;
+	for (i = 0; i < sizeof(metric_descs) / sizeof(metric_descs[0]); i++) {
+		const struct metric_desc *d = &metric_descs[i];
+		const char *suffix = !strcmp(d->type, "counter") ? "_total" : "";
+
+		if (d->help)
+			render_family_header(tb, d->name, d->type, d->help,
+					     openmetrics);
+
+		for (j = 0; j < count; j++) {
+			const struct export_sample *s = &samples[j];
+			unsigned long long v;
+
+			memcpy(&v, (const char *)s + d->offset, sizeof(v));
+			escape_label_value(s->comm, comm, sizeof(comm));
+			tb_append(tb, "%s%s{pid=\"%d\",comm=\"%s\"", d->name,
+				  suffix, s->pid, comm);
+			if (d->label)
+				tb_append(tb, ",%s=\"%s\"", d->label,
+					  d->label_value);
+			tb_append(tb, "} %llu\n", v * d->scale);
+		}
+	}
+
+	render_family_header(tb, "elfdet_cpu_seconds", "counter",
+			     "CPU time (user + system) since process start",
+			     openmetrics);
+	for (j = 0; j < count; j++) {
+		escape_label_value(samples[j].comm, comm, sizeof(comm));
+		tb_append(tb,
+			  "elfdet_cpu_seconds_total{pid=\"%d\",comm=\"%s\"} "
+			  "%llu.%09llu\n",
+			  samples[j].pid, comm, samples[j].cpu_ns / 1000000000ULL,
+			  samples[j].cpu_ns % 1000000000ULL);
+	}
+
+	render_family_header(tb, "elfdet_oom_score_adj", "gauge",
+			     "OOM killer score adjustment", openmetrics);
+	for (j = 0; j < count; j++) {
+		escape_label_value(samples[j].comm, comm, sizeof(comm));
+		tb_append(tb, "elfdet_oom_score_adj{pid=\"%d\",comm=\"%s\"} %lld\n",
+			  samples[j].pid, comm, samples[j].oom_score_adj);
+	}
+
+	render_family_header(tb, "elfdet_threads", "gauge",
+			     "Threads by scheduler state", openmetrics);
+	for (j = 0; j < count; j++) {
+		escape_label_value(samples[j].comm, comm, sizeof(comm));
+		for (k = 0; k < EXPORT_NR_STATES; k++)
+			tb_append(tb,
+				  "elfdet_threads{pid=\"%d\",comm=\"%s\","
+				  "state=\"%c\"} %u\n",
+				  samples[j].pid, comm,
+				  EXPORT_THREAD_STATES[k],
+				  samples[j].threads[k]);
+	}
+
+	if (openmetrics)
+		tb_append(tb, "# EOF\n");
+}
+
+/* Exporter state: target list, kernel sessions and the scrape cache */
+struct exporter {
+	int *pids; /* explicit --pids targets */
+	int nr_pids;
+	const char *cgroups[EXPORT_MAX_CGROUPS];
+	int nr_cgroups;
+	int openmetrics;
+	unsigned int cache_ms;
+	struct watch_file det;
+	struct watch_file threads;
+	struct export_sample *samples;
+	struct text_buf text;
+	unsigned long long stamp_ns; /* 0 until the first collection */
+};
+
+/* Append the PIDs listed in <cgroup>/cgroup.procs to targets. */
+static int read_cgroup_pids(const char *cgroup, int *targets, int n, int max)
+{
+	char path[4096];
+	char line[32];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/cgroup.procs", cgroup);
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return n;
+	}
+	while (n < max && fgets(line, sizeof(line), fp)) {
+		int pid = atoi(line);
+
+		if (pid > 0)
+			targets[n++] = pid;
+	}
+	fclose(fp);
+	return n;
+}
+
+/* Collect det/threads of every target into ex->samples; returns the number
+ * of processes that could be read.
+ */
+static int exporter_collect(struct exporter *ex)
+{
+	static int targets[EXPORT_MAX_TARGETS];
+	char pid_str[16];
+	int n, i, count = 0;
+
+	n = ex->nr_pids < EXPORT_MAX_TARGETS ? ex->nr_pids : EXPORT_MAX_TARGETS;
+	if (n > 0)
+		memcpy(targets, ex->pids, (size_t)n * sizeof(int));
+	for (i = 0; i < ex->nr_cgroups; i++)
+		n = read_cgroup_pids(ex->cgroups[i], targets, n,
+				     EXPORT_MAX_TARGETS);
+
+	for (i = 0; i < n; i++) {
+		snprintf(pid_str, sizeof(pid_str), "%d", targets[i]);
+		if (bind_session(&ex->det, pid_str) ||
+		    bind_session(&ex->threads, pid_str) ||
+		    read_watch_file(&ex->det) || read_watch_file(&ex->threads))
+			continue;
+		if (fill_export_sample(&ex->det.cur, &ex->threads.cur,
+				       &ex->samples[count]))
+			count++;
+	}
+	return count;
+}
+
+/* Re-collect every target when the cache has expired. Scrapes inside the
+ * cache window are served from the last rendering, so any number of
+ * scrapers cost one kernel collection per window.
+ */
+static void exporter_refresh(struct exporter *ex)
+{
+	unsigned long long now = monotonic_ns();
+	int count;
+
+	if (ex->stamp_ns &&
+	    now - ex->stamp_ns < (unsigned long long)ex->cache_ms * 1000000ULL)
+		return;
+
+	count = exporter_collect(ex);
+	render_metrics(&ex->text, ex->samples, count, ex->openmetrics);
+	ex->stamp_ns = now;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static void serve_one(struct exporter *ex, int client)
+{
+	static const char not_found[] = "HTTP/1.0 404 Not Found\r\n"
+					"Content-Length: 0\r\n\r\n";
+	struct timeval tv = {2, 0};
+	char req[1024];
+	char hdr[256];
+	ssize_t n;
+
+	/* Never let a stalled scraper block the others for long */
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	n = recv(client, req, sizeof(req) - 1, 0);
+	if (n <= 0)
+		return;
+	req[n] = '\0';
+
+	if (strncmp(req, "GET /metrics", 12) != 0) {
+		send_all(client, not_found, sizeof(not_found) - 1);
+		return;
+	}
+
+	exporter_refresh(ex);
+	snprintf(hdr, sizeof(hdr),
+		 "HTTP/1.0 200 OK\r\n"
+		 "Content-Type: application/openmetrics-text; version=1.0.0; "
+		 "charset=utf-8\r\n"
+		 "Content-Length: %zu\r\n\r\n",
+		 ex->text.len);
+	if (send_all(client, hdr, strlen(hdr)) == 0)
+		send_all(client, ex->text.data, ex->text.len);
+}
+
+/* Serve /metrics on 127.0.0.1:port until killed. Scrapes are handled one
+ * at a time; concurrent scrapers queue on accept() and hit the cache.
+ */
+static int serve_metrics(struct exporter *ex, int port)
+{
+	struct sockaddr_in addr;
+	int sock, client, opt = 1;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons((unsigned short)port);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, 16)) {
+		perror("bind");
+		close(sock);
+		return 1;
+	}
+
+	printf("Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+	fflush(stdout);
+	for (;;) {
+		client = accept(sock, NULL, NULL);
+		if (client < 0)
+			continue;
+		serve_one(ex, client);
+		close(client);
+	}
+	return 0;
+}
+
+/* Write the metrics to path every interval via an atomic rename, for the
+ * node_exporter textfile collector. count == 0 runs until killed.
+ */
+static int write_textfile(struct exporter *ex,
+			  const char *path,
+			  unsigned int interval_ms,
+			  unsigned long count)
+{
+	struct timespec pause;
+	char tmp[4096];
+	unsigned long i;
+	FILE *fp;
+
+	pause.tv_sec = interval_ms / 1000;
+	pause.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	for (i = 0; count == 0 || i < count; i++) {
+		ex->stamp_ns = 0;
+		exporter_refresh(ex);
+
+		fp = fopen(tmp, "w");
+		if (!fp) {
+			perror(tmp);
+			return 1;
+		}
+		fwrite(ex->text.data, 1, ex->text.len, fp);
+		if (fclose(fp) || rename(tmp, path)) {
+			perror(path);
+			return 1;
+		}
+
+		if (count == 0 || i + 1 < count)
+			nanosleep(&pause, NULL);
+	}
+	return 0;
+}
+
+/* Open the kernel sessions and sample storage shared by the exporter and
+ * the recorder.
+ */
+static int exporter_open(struct exporter *ex)
+{
+	ex->det.fd = -1;
+	ex->det.buf = NULL;
+	ex->threads.fd = -1;
+	ex->threads.buf = NULL;
+	ex->samples = calloc(EXPORT_MAX_TARGETS, sizeof(*ex->samples));
+	if (!ex->samples)
+		return -1;
+	if (open_watch_file(&ex->det, "det", O_RDWR) ||
+	    open_watch_file(&ex->threads, "threads", O_RDWR))
+		return -1;
+	return 0;
+}
+
+static void exporter_close(struct exporter *ex)
+{
+	close_watch_file(&ex->det);
+	close_watch_file(&ex->threads);
+	free(ex->samples);
+	free(ex->text.data);
+	ex->samples = NULL;
+	ex->text.data = NULL;
+}
+
+static int run_exporter(struct exporter *ex,
+			int port,
+			const char *textfile,
+			unsigned int interval_ms,
+			unsigned long count)
+{
+	int ret = 1;
+
+	if (exporter_open(ex))
+		goto out;
+
+	if (textfile) {
+		ex->openmetrics = 0;
+		ret = write_textfile(ex, textfile,
+				     interval_ms ? interval_ms : 15000, count);
+	} else {
+		ex->openmetrics = 1;
+		ret = serve_metrics(ex, port);
+	}
+
+out:
+	exporter_close(ex);
+	return ret;
+}
+
+/* Recording file layout (all integers are LEB128 varints):
+ *   magic "ELFREC1\n"
+ *   'H' start_unix_ms interval_ms            new segment, resets slots
+ *   'P' slot pid comm_len comm               slot now tracks pid
+ *   'X' slot                                 slot's process went away
+ *   'S' dt_ms nr_changed {slot mask delta...} one sample
+ * A sample lists only processes with at least one changed metric; mask
+ * has bit i set for each rec_metric i that follows as a zigzag delta
+ * against the slot's previous value. Idle processes cost nothing.
+ */
+#define REC_MAGIC	"ELFREC1\n"
+#define REC_MAGIC_LEN	8
+#define REC_TAG_SEGMENT 'H'
+#define REC_TAG_PROCESS 'P'
+#define REC_TAG_EXIT	'X'
+#define REC_TAG_SAMPLE	'S'
+
+struct rec_slot {
+	int pid;
+	int live;
+	int seen;
+	unsigned long long last[REC_NR_METRICS];
+};
+
+struct recorder {
+	FILE *fp;
+	struct rec_slot slots[EXPORT_MAX_TARGETS];
+	int nr_slots;
+	unsigned long long last_ms;
+	unsigned char *sample_buf; /* body of the sample being built */
+	size_t sample_len;
+};
+
+static void rec_put_varint(FILE *fp, unsigned long long v)
+{
+	unsigned char tmp[10];
+
+	fwrite(tmp, 1, varint_encode(v, tmp), fp);
+}
+
+static void rec_buf_varint(struct recorder *rec, unsigned long long v)
+{
+	rec->sample_len += varint_encode(v, rec->sample_buf + rec->sample_len);
+}
+
+/* Start a segment; writes the file magic first when the file is empty. */
+static void recorder_begin(struct recorder *rec,
+			   unsigned long long start_unix_ms,
+			   unsigned int interval_ms)
+{
+	if (ftell(rec->fp) == 0)
+		fwrite(REC_MAGIC, 1, REC_MAGIC_LEN, rec->fp);
+
+	fputc(REC_TAG_SEGMENT, rec->fp);
+	rec_put_varint(rec->fp, start_unix_ms);
+	rec_put_varint(rec->fp, interval_ms);
+	rec->nr_slots = 0;
+	rec->last_ms = start_unix_ms;
+}
+
+static int recorder_slot(struct recorder *rec, const struct export_sample *s)
+{
+	int i, free_slot = -1;
+	size_t len;
+
+	for (i = 0; i < rec->nr_slots; i++) {
+		if (rec->slots[i].live && rec->slots[i].pid == s->pid)
+			return i;
+		if (!rec->slots[i].live && free_slot < 0)
+			free_slot = i;
+	}
+
+	if (free_slot < 0) {
+		if (rec->nr_slots >= EXPORT_MAX_TARGETS)
+			return -1;
+		free_slot = rec->nr_slots++;
+	}
+
+	memset(&rec->slots[free_slot], 0, sizeof(rec->slots[free_slot]));
+	rec->slots[free_slot].pid = s->pid;
+	rec->slots[free_slot].live = 1;
+
+	len = strlen(s->comm);
+	fputc(REC_TAG_PROCESS, rec->fp);
+	rec_put_varint(rec->fp, (unsigned long long)free_slot);
+	rec_put_varint(rec->fp, (unsigned long long)s->pid);
+	rec_put_varint(rec->fp, len);
+	fwrite(s->comm, 1, len, rec->fp);
+	return free_slot;
+}
+
+/* Append one delta-encoded sample of count processes taken at now_ms. */
+static void recorder_write_sample(struct recorder *rec,
+				  const struct export_sample *samples,
+				  int count,
+				  unsigned long long now_ms)
+{
+	unsigned long long cur[REC_NR_METRICS];
+	unsigned long long mask;
+	unsigned int changed = 0;
+	int i, m, slot;
+
+	for (i = 0; i < rec->nr_slots; i++)
+		rec->slots[i].seen = 0;
+
+	rec->sample_len = 0;
+	for (i = 0; i < count; i++) {
+		struct rec_slot *rs;
+
+		slot = recorder_slot(rec, &samples[i]);
+		if (slot < 0)
+			continue;
+		rs = &rec->slots[slot];
+		rs->seen = 1;
+
+		export_sample_metrics(&samples[i], cur);
+		mask = 0;
+		for (m = 0; m < REC_NR_METRICS; m++) {
+			if (cur[m] != rs->last[m])
+				mask |= 1ULL << m;
+		}
+		if (!mask)
+			continue;
+
+		rec_buf_varint(rec, (unsigned long long)slot);
+		rec_buf_varint(rec, mask);
+		for (m = 0; m < REC_NR_METRICS; m++) {
+			if (!(mask & (1ULL << m)))
+				continue;
+			rec_buf_varint(rec, zigzag_encode((long long)(cur[m] -
+								      rs->last[m])));
+			rs->last[m] = cur[m];
+		}
+		changed++;
+	}
+
+	for (i = 0; i < rec->nr_slots; i++) {
+		if (rec->slots[i].live && !rec->slots[i].seen) {
+			rec->slots[i].live = 0;
+			fputc(REC_TAG_EXIT, rec->fp);
+			rec_put_varint(rec->fp, (unsigned long long)i);
+		}
+	}
+
+	fputc(REC_TAG_SAMPLE, rec->fp);
+	rec_put_varint(rec->fp, now_ms - rec->last_ms);
+	rec_put_varint(rec->fp, changed);
+	fwrite(rec->sample_buf, 1, rec->sample_len, rec->fp);
+	rec->last_ms = now_ms;
+}
+
+static unsigned long long realtime_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long)ts.tv_sec * 1000ULL +
+	       (unsigned long long)ts.tv_nsec / 1000000ULL;
+}
+
+/* Sample the exporter targets every interval and append them to path.
+ * count == 0 records until killed.
+ */
+static int record_to_file(struct exporter *ex,
+			  const char *path,
+			  unsigned int interval_ms,
+			  unsigned long count)
+{
+	struct recorder *rec;
+	struct timespec pause;
+	unsigned long i;
+	int n, ret = 1;
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return 1;
+	/* slot + mask + one 10-byte delta per metric */
+	rec->sample_buf =
+		malloc(EXPORT_MAX_TARGETS * (2 + REC_NR_METRICS) * 10);
+	rec->fp = fopen(path, "ab");
+	if (!rec->sample_buf || !rec->fp) {
+		perror(path);
+		goto out;
+	}
+
+	pause.tv_sec = interval_ms / 1000;
+	pause.tv_nsec = (long)(interval_ms % 1000) * 1000000L;
+
+	recorder_begin(rec, realtime_ms(), interval_ms);
+	for (i = 0; count == 0 || i < count; i++) {
+		n = exporter_collect(ex);
+		recorder_write_sample(rec, ex->samples, n, realtime_ms());
+		fflush(rec->fp);
+
+		if (count == 0 || i + 1 < count)
+			nanosleep(&pause, NULL);
+	}
+	ret = 0;
+
+out:
+	if (rec->fp)
+		fclose(rec->fp);
+	free(rec->sample_buf);
+	free(rec);
+	return ret;
+}
+
+/* Statistics the report derives per process */
+enum rep_stat_id {
+	REP_RSS_KB,
+	REP_SWAP_KB,
+	REP_THREADS,
+	REP_SOCKETS,
+	REP_CPU_X100, /* percent * 100 over each interval */
+	REP_FAULTS_X100, /* faults/s * 100 */
+	REP_RX_BPS,
+	REP_TX_BPS,
+	REP_NR_STATS
+};
+
+static const char *const rep_stat_names[REP_NR_STATS] = {
+	"rss_kb",  "swap_kb",  "threads",    "sockets",
+	"cpu_%",   "faults/s", "rx_bytes/s", "tx_bytes/s",
+};
+
+struct rep_stat {
+	unsigned long long min, max, sum, n;
+	unsigned int hist[REC_HIST_BUCKETS];
+};
+
+/* Everything the report knows about one recorded process */
+struct rep_series {
+	int pid;
+	char comm[20];
+	unsigned long long samples;
+	unsigned long long first_ms, last_ms;
+	struct rep_stat stats[REP_NR_STATS];
+};
+
+struct rep_slot {
+	int live;
+	int have_base;
+	int series;
+	int changed;
+	unsigned long long cur[REC_NR_METRICS];
+	unsigned long long base[REC_NR_METRICS];
+};
+
+struct rep_state {
+	struct rep_slot slots[EXPORT_MAX_TARGETS];
+	struct rep_series *series;
+	int nr_series;
+	int cap_series;
+	unsigned long long now_ms;
+	unsigned long long samples;
+	unsigned long long first_ms;
+	int segments;
+	int timeline; /* print every changed process per sample */
+	int filter_pid; /* timeline only this PID when > 0 */
+};
+
+static void rep_stat_add(struct rep_stat *st, unsigned long long v)
+{
+	if (st->n == 0 || v < st->min)
+		st->min = v;
+	if (v > st->max)
+		st->max = v;
+	st->sum += v;
+	st->n++;
+	st->hist[hist_index(v)]++;
+}
+
+static int rep_find_series(struct rep_state *st, int pid, const char *comm)
+{
+	struct rep_series *bigger;
+	int i;
+
+	for (i = 0; i < st->nr_series; i++) {
+		if (st->series[i].pid == pid &&
+		    !strcmp(st->series[i].comm, comm))
+			return i;
+	}
+
+	if (st->nr_series == st->cap_series) {
+		int cap = st->cap_series ? st->cap_series * 2 : 64;
+
+		bigger = realloc(st->series, (size_t)cap * sizeof(*bigger));
+		if (!bigger)
+			return -1;
+		st->series = bigger;
+		st->cap_series = cap;
+	}
+
+	memset(&st->series[st->nr_series], 0, sizeof(st->series[0]));
+	st->series[st->nr_series].pid = pid;
+	snprintf(st->series[st->nr_series].comm,
+		 sizeof(st->series[0].comm), "%s", comm);
+	return st->nr_series++;
+}
+
+/* Fold one decoded sample into the per-process statistics */
+static void rep_apply_sample(struct rep_state *st, unsigned long long dt_ms)
+{
+	unsigned long long interval_ns = dt_ms * 1000000ULL;
+	unsigned long long *cur, *base;
+	unsigned long long rates[4];
+	int i;
+
+	st->now_ms += dt_ms;
+	st->samples++;
+
+	for (i = 0; i < EXPORT_MAX_TARGETS; i++) {
+		struct rep_slot *rs = &st->slots[i];
+		struct rep_series *se;
+
+		if (!rs->live || rs->series < 0)
+			continue;
+		se = &st->series[rs->series];
+		cur = rs->cur;
+		base = rs->base;
+
+		if (se->samples == 0)
+			se->first_ms = st->now_ms;
+		se->samples++;
+		se->last_ms = st->now_ms;
+
+		rep_stat_add(&se->stats[REP_RSS_KB], cur[REC_RSS_KB]);
+		rep_stat_add(&se->stats[REP_SWAP_KB], cur[REC_SWAP_KB]);
+		rep_stat_add(&se->stats[REP_THREADS], cur[REC_THREADS]);
+		rep_stat_add(&se->stats[REP_SOCKETS], cur[REC_SOCKETS]);
+
+		if (rs->have_base) {
+			rates[0] = interval_cpu_permyriad(base[REC_CPU_NS],
+							  cur[REC_CPU_NS],
+							  interval_ns);
+			rates[1] = rate_per_sec_x100(base[REC_MAJ_FLT] +
+							     base[REC_MIN_FLT],
+						     cur[REC_MAJ_FLT] +
+							     cur[REC_MIN_FLT],
+						     interval_ns);
+			rates[2] = rate_per_sec_x100(base[REC_RX_BYTES],
+						     cur[REC_RX_BYTES],
+						     interval_ns) /
+				   100;
+			rates[3] = rate_per_sec_x100(base[REC_TX_BYTES],
+						     cur[REC_TX_BYTES],
+						     interval_ns) /
+				   100;
+			rep_stat_add(&se->stats[REP_CPU_X100], rates[0]);
+			rep_stat_add(&se->stats[REP_FAULTS_X100], rates[1]);
+			rep_stat_add(&se->stats[REP_RX_BPS], rates[2]);
+			rep_stat_add(&se->stats[REP_TX_BPS], rates[3]);
+
+			if (st->timeline && rs->changed &&
+			    (st->filter_pid <= 0 || st->filter_pid == se->pid))
+				printf("+%llu.%03llus pid=%d comm=%s "
+				       "rss_kb=%llu cpu=%llu.%02llu%% "
+				       "faults/s=%llu.%02llu rx_bytes/s=%llu "
+				       "tx_bytes/s=%llu threads=%llu\n",
+				       (st->now_ms - st->first_ms) / 1000,
+				       (st->now_ms - st->first_ms) % 1000,
+				       se->pid, se->comm, cur[REC_RSS_KB],
+				       rates[0] / 100, rates[0] % 100,
+				       rates[1] / 100, rates[1] % 100,
+				       rates[2], rates[3], cur[REC_THREADS]);
+		}
+
+		memcpy(base, cur, sizeof(rs->base));
+		rs->have_base = 1;
+		rs->changed = 0;
+	}
+}
+
+/* Decode a recording held in memory. Returns 0, or -1 when the data is
+ * corrupt (statistics up to that point are kept).
+ */
+static int
+parse_recording(const unsigned char *buf, size_t len, struct rep_state *st)
+{
+	unsigned long long a, b, c, mask, v;
+	size_t pos = REC_MAGIC_LEN, n;
+	char comm[20];
+	int i, m;
+
+#define REC_READ(var)                                                    \
+	do {                                                             \
+		n = varint_decode(buf + pos, len - pos, &(var));         \
+		if (!n)                                                  \
+			return -1;                                       \
+		pos += n;                                                \
+	} while (0)
+
+	if (len < REC_MAGIC_LEN || memcmp(buf, REC_MAGIC, REC_MAGIC_LEN))
+		return -1;
+
+	while (pos < len) {
+		switch (buf[pos++]) {
+		case REC_TAG_SEGMENT:
+			REC_READ(a);
+			REC_READ(b);
+			for (i = 0; i < EXPORT_MAX_TARGETS; i++)
+				st->slots[i].live = 0;
+			if (st->segments++ == 0)
+				st->first_ms = a;
+			st->now_ms = a;
+			break;
+		case REC_TAG_PROCESS:
+			REC_READ(a);
+			REC_READ(b);
+			REC_READ(c);
+			if (a >= EXPORT_MAX_TARGETS || c > len - pos)
+				return -1;
+			snprintf(comm, sizeof(comm), "%.*s",
+				 (int)(c < sizeof(comm) ? c : sizeof(comm) - 1),
+				 (const char *)buf + pos);
+			pos += c;
+			memset(&st->slots[a], 0, sizeof(st->slots[a]));
+			st->slots[a].live = 1;
+			st->slots[a].series = rep_find_series(st, (int)b, comm);
+			break;
+		case REC_TAG_EXIT:
+			REC_READ(a);
+			if (a >= EXPORT_MAX_TARGETS)
+				return -1;
+			st->slots[a].live = 0;
+			break;
+		case REC_TAG_SAMPLE:
+			REC_READ(a);
+			REC_READ(b);
+			for (; b > 0; b--) {
+				REC_READ(c);
+				REC_READ(mask);
+				if (c >= EXPORT_MAX_TARGETS)
+					return -1;
+				for (m = 0; m < REC_NR_METRICS; m++) {
+					if (!(mask & (1ULL << m)))
+						continue;
+					REC_READ(v);
+					st->slots[c].cur[m] +=
+						(unsigned long long)
+							zigzag_decode(v);
+				}
+				st->slots[c].changed = 1;
+			}
+			rep_apply_sample(st, a);
+			break;
+		default:
+			return -1;
+		}
+	}
+#undef REC_READ
+	return 0;
+}
+
+static void print_rep_series(const struct rep_series *se)
+{
+	int i;
+
+	printf("\nPID %d (%s): %llu samples over %llu.%03llus\n", se->pid,
+	       se->comm, se->samples, (se->last_ms - se->first_ms) / 1000,
+	       (se->last_ms - se->first_ms) % 1000);
+	printf("  %-12s %12s %12s %12s %12s %12s %12s\n", "metric", "min",
+	       "p50", "p95", "p99", "max", "avg");
+
+	for (i = 0; i < REP_NR_STATS; i++) {
+		const struct rep_stat *st = &se->stats[i];
+		unsigned long long vals[6];
+		int j, hundredths = (i == REP_CPU_X100 || i == REP_FAULTS_X100);
+
+		if (st->n == 0)
+			continue;
+		vals[0] = st->min;
+		vals[1] = hist_percentile(st->hist, st->n, 50);
+		vals[2] = hist_percentile(st->hist, st->n, 95);
+		vals[3] = hist_percentile(st->hist, st->n, 99);
+		vals[4] = st->max;
+		vals[5] = st->sum / st->n;
+
+		printf("  %-12s", rep_stat_names[i]);
+		for (j = 0; j < 6; j++) {
+			if (hundredths)
+				printf(" %9llu.%02llu", vals[j] / 100,
+				       vals[j] % 100);
+			else
+				printf(" %12llu", vals[j]);
+		}
+		printf("\n");
+	}
+}
+
+/* Print the timeline (replay) and/or per-process summary of a recording */
+static int report_recording(const char *path, int timeline, int filter_pid)
+{
+	struct rep_state *st;
+	unsigned char *buf = NULL;
+	size_t len = 0, cap = 0, n;
+	FILE *fp;
+	int i, ret;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		perror(path);
+		return 1;
+	}
+	for (;;) {
+		if (len == cap) {
+			unsigned char *bigger;
+
+			cap = cap ? cap * 2 : 1 << 20;
+			bigger = realloc(buf, cap);
+			if (!bigger) {
+				fclose(fp);
+				free(buf);
+				return 1;
+			}
+			buf = bigger;
+		}
+		n = fread(buf + len, 1, cap - len, fp);
+		if (n == 0)
+			break;
+		len += n;
+	}
+	fclose(fp);
+
+	st = calloc(1, sizeof(*st));
+	if (!st) {
+		free(buf);
+		return 1;
+	}
+	st->timeline = timeline;
+	st->filter_pid = filter_pid;
+
+	ret = parse_recording(buf, len, st);
+	if (ret)
+		fprintf(stderr, "%s: corrupt or truncated recording\n", path);
+
+	printf("\nRecording %s: %zu bytes, %d segment(s), %llu samples, "
+	       "%d process(es)\n",
+	       path, len, st->segments, st->samples, st->nr_series);
+	if (!timeline) {
+		for (i = 0; i < st->nr_series; i++) {
+			if (filter_pid <= 0 || st->series[i].pid == filter_pid)
+				print_rep_series(&st->series[i]);
+		}
+	}
+
+	free(st->series);
+	free(st);
+	free(buf);
+	return ret ? 1 : 0;
+}
+
+static void copy_pid_arg(char *dst, size_t dst_size, const char *src)
+{
+	size_t len;
+
+	/* Safe string copy with explicit bounds checking */
+	len = strlen(src);
+	if (len >= dst_size)
+		len = dst_size - 1;
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+static int run_collect(const char *pid_list, int jobs, const char *sort_key)
+{
+	int *pids;
+	int count, max, ret;
+
+	if (!pid_list) {
+		count = list_all_pids(&pids);
+		if (count < 0)
+			return 1;
+	} else {
+		max = count_list_items(pid_list);
+		if (max > COLLECT_MAX_PIDS)
+			max = COLLECT_MAX_PIDS;
+		if (max < 1)
+			max = 1;
+		pids = malloc((size_t)max * sizeof(*pids));
+		if (!pids)
+			return 1;
+		count = parse_pid_list(pid_list, pids, max);
+		if (count < 0) {
+			fprintf(stderr, "invalid PID list: %s\n", pid_list);
+			free(pids);
+			return 1;
+		}
+	}
+
+	ret = count > 0 ? collect_pids(pids, count, jobs, sort_key) : 0;
+	free(pids);
+	return ret;
+}
+
+/* Read a whole (proc) file into a NUL-terminated malloc'ed buffer */
+static char *read_text_file(const char *path)
+{
+	size_t len = 0, size = 64 * 1024;
+	char *buf = malloc(size), *bigger;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || !buf) {
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		return NULL;
+	}
+	while ((n = read(fd, buf + len, size - 1 - len)) > 0) {
+		len += (size_t)n;
+		if (len < size - 1)
+			continue;
+		bigger = realloc(buf, size * 2);
+		if (!bigger) {
+			n = -1;
+			break;
+		}
+		buf = bigger;
+		size *= 2;
+	}
+	close(fd);
+	if (n < 0) {
+		free(buf);
+		return NULL;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+/* An ELF file mapped by the target and its symbol index */
+struct sym_module {
+	char path[256];
+	void *block; /* mmap of the cache file, or malloc'ed */
+	size_t block_len;
+	int mapped;
+	int failed;
+	struct sym_index idx;
+};
+
+struct symbolizer {
+	const char *pid;
+	struct maps_entry *maps;
+	int nr_maps;
+	struct sym_module mods[SYM_MAX_MODULES];
+	int nr_mods;
+	char cache_dir[PATH_MAX];
+};
+
+/* $ELF_DET_SYMCACHE, else $XDG_CACHE_HOME/elf_det, else
+ * ~/.cache/elf_det; created if missing. Returns 0 if usable.
+ */
+static int sym_cache_dir(char *dir, size_t size)
+{
+	const char *env = getenv("ELF_DET_SYMCACHE");
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char parent[PATH_MAX];
+	int n;
+
+	/* A truncated path would point the cache at the wrong directory */
+	if (env && *env) {
+		n = snprintf(dir, size, "%s", env);
+	} else if (xdg && *xdg) {
+		n = snprintf(parent, sizeof(parent), "%s", xdg);
+		if (n < 0 || (size_t)n >= sizeof(parent))
+			return -1;
+		mkdir(parent, 0755);
+		n = snprintf(dir, size, "%s/elf_det", parent);
+	} else if (home && *home) {
+		n = snprintf(parent, sizeof(parent), "%s/.cache", home);
+		if (n < 0 || (size_t)n >= sizeof(parent))
+			return -1;
+		mkdir(parent, 0755);
+		n = snprintf(dir, size, "%s/elf_det", parent);
+	} else {
+		return -1;
+	}
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/* Use the cached index of build-id bid if there is a valid one */
+static int sym_cache_load(const struct symbolizer *sz, const char *bid,
+			  struct sym_module *mod)
+{
+	char path[PATH_MAX + 80];
+	struct stat st;
+	void *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s.sym", sz->cache_dir, bid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	if (sym_index_from_block(map, (size_t)st.st_size, &mod->idx)) {
+		munmap(map, (size_t)st.st_size);
+		return -1;
+	}
+	mod->block = map;
+	mod->block_len = (size_t)st.st_size;
+	mod->mapped = 1;
+	return 0;
+}
+
+/* Write the index atomically, so concurrent runs never see half a file */
+static void sym_cache_store(const struct symbolizer *sz, const char *bid,
+			    const struct sym_module *mod)
+{
+	char path[PATH_MAX + 80], tmp[PATH_MAX + 100];
+	int fd, ok;
+
+	snprintf(path, sizeof(path), "%s/%s.sym", sz->cache_dir, bid);
+	snprintf(tmp, sizeof(tmp), "%s/.%s.%d.tmp", sz->cache_dir, bid,
+		 (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	ok = write(fd, mod->block, mod->block_len) == (ssize_t)mod->block_len;
+	if (close(fd) || !ok || rename(tmp, path))
+		unlink(tmp);
+}
+
+/* Map the ELF file of mod, then take its index from the cache or build
+ * it. The file is opened through /proc/PID/root first so that targets in
+ * another mount namespace resolve against their own files.
+ */
+static int sym_module_load(const struct symbolizer *sz, struct sym_module *mod)
+{
+	char path[PATH_MAX + 300], bid[SYM_BUILD_ID_HEX];
+	int fd, have_bid = 0;
+	struct stat st;
+	void *elf;
+
+	snprintf(path, sizeof(path), "/proc/%s/root%s", sz->pid, mod->path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		fd = open(mod->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+	elf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (elf == MAP_FAILED)
+		return -1;
+
+	if (sz->cache_dir[0] &&
+	    !sym_elf_build_id(elf, (size_t)st.st_size, bid, sizeof(bid))) {
+		have_bid = 1;
+		if (!sym_cache_load(sz, bid, mod)) {
+			munmap(elf, (size_t)st.st_size);
+			return 0;
+		}
+	}
+
+	mod->block = sym_parse_elf(elf, (size_t)st.st_size, &mod->block_len);
+	munmap(elf, (size_t)st.st_size);
+	if (!mod->block ||
+	    sym_index_from_block(mod->block, mod->block_len, &mod->idx)) {
+		free(mod->block);
+		mod->block = NULL;
+		return -1;
+	}
+	if (have_bid)
+		sym_cache_store(sz, bid, mod);
+	return 0;
+}
+
+static struct sym_module *sym_module_get(struct symbolizer *sz,
+					 const char *path)
+{
+	struct sym_module *mod;
+	int i;
+
+	for (i = 0; i < sz->nr_mods; i++) {
+		if (!strcmp(sz->mods[i].path, path))
+			return sz->mods[i].failed ? NULL : &sz->mods[i];
+	}
+	if (sz->nr_mods == SYM_MAX_MODULES)
+		return NULL;
+	mod = &sz->mods[sz->nr_mods++];
+	memset(mod, 0, sizeof(*mod));
+	snprintf(mod->path, sizeof(mod->path), "%s", path);
+	mod->failed = sym_module_load(sz, mod) != 0;
+	return mod->failed ? NULL : mod;
+}
+
+/* ELF base reported by the module's det for pid, 0 if unavailable */
+static unsigned long long sym_det_elf_base(const char *pid)
+{
+	unsigned long long base = 0;
+	struct watch_file det;
+	int idx;
+
+	if (open_watch_file(&det, "det", O_RDWR))
+		goto out;
+	if (bind_session(&det, pid) || read_watch_file(&det))
+		goto out;
+	idx = snapshot_find(&det.cur, "ELF Base", 0);
+	if (idx >= 0 && snapshot_is_live(&det.cur))
+		base = strtoull(det.cur.fields[idx].value, NULL, 16);
+out:
+	close_watch_file(&det);
+	return base;
+}
+
+/* Executable of pid, from /proc/PID/exe or the module's process index */
+static int sym_exe_path(const char *pid, char *exe, size_t size)
+{
+	char path[64], key[32], *procs, *line, *p;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/proc/%s/exe", pid);
+	n = readlink(path, exe, size - 1);
+	if (n > 0) {
+		exe[n] = '\0';
+		return 0;
+	}
+
+	procs = build_proc_path("procs");
+	p = procs ? read_text_file(procs) : NULL;
+	free(procs);
+	if (!p)
+		return -1;
+	snprintf(key, sizeof(key), "pid=%s ", pid);
+	n = -1;
+	for (line = p; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncmp(line, key, strlen(key)))
+			continue;
+		line = strstr(line, " exe=");
+		if (line) {
+			line += 5;
+			copy_trimmed(exe, size, line, line + strcspn(line, "\n"));
+			n = exe[0] == '/' ? 0 : -1;
+		}
+		break;
+	}
+	free(p);
+	return n < 0 ? -1 : 0;
+}
+
+/* Load the mappings of the target. Without access to /proc/PID/maps,
+ * fall back to one mapping of the executable at the ELF base the module
+ * reports; that resolves addresses in the main executable only.
+ */
+static int sym_load_maps(struct symbolizer *sz)
+{
+	char path[64], *text, *line, *nl;
+	struct maps_entry me;
+	int cap = 0;
+
+	snprintf(path, sizeof(path), "/proc/%s/maps", sz->pid);
+	text = read_text_file(path);
+	if (!text || !*text) {
+		free(text);
+		sz->maps = calloc(1, sizeof(*sz->maps));
+		if (!sz->maps || sym_exe_path(sz->pid, sz->maps[0].path,
+					      sizeof(sz->maps[0].path)))
+			return -1;
+		sz->maps[0].start = sym_det_elf_base(sz->pid);
+		sz->maps[0].end = ~0ULL;
+		if (!sz->maps[0].start)
+			return -1;
+		sz->nr_maps = 1;
+		fprintf(stderr,
+			"%s unreadable; using ELF base 0x%llx of %s from det\n",
+			path, sz->maps[0].start, sz->maps[0].path);
+		return 0;
+	}
+
+	for (line = text; line && *line; line = nl) {
+		nl = strchr(line, '\n');
+		if (nl)
+			*nl++ = '\0';
+		if (parse_maps_line(line, &me))
+			continue;
+		if (sz->nr_maps == cap) {
+			struct maps_entry *bigger;
+
+			cap = cap ? cap * 2 : 256;
+			bigger = realloc(sz->maps, cap * sizeof(*bigger));
+			if (!bigger)
+				break;
+			sz->maps = bigger;
+		}
+		sz->maps[sz->nr_maps++] = me;
+	}
+	free(text);
+	return sz->nr_maps ? 0 : -1;
+}
+
+/* Format "func+0xoff path" (or "?? path+0xoff") for one address */
+static void sym_resolve(struct symbolizer *sz, unsigned long long addr,
+			char *out, size_t size)
+{
+	const struct maps_entry *me = NULL;
+	const struct sym_entry *e;
+	struct sym_module *mod;
+	unsigned long long off, vaddr;
+	int lo = 0, hi = sz->nr_maps - 1, mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (addr < sz->maps[mid].start) {
+			hi = mid - 1;
+		} else if (addr >= sz->maps[mid].end) {
+			lo = mid + 1;
+		} else {
+			me = &sz->maps[mid];
+			break;
+		}
+	}
+	if (!me) {
+		snprintf(out, size, "?? [unmapped]");
+		return;
+	}
+	if (me->path[0] != '/') {
+		snprintf(out, size, "?? %s", me->path[0] ? me->path : "[anon]");
+		return;
+	}
+
+	off = addr - me->start + me->pgoff;
+	mod = sym_module_get(sz, me->path);
+	if (!mod || sym_offset_to_vaddr(&mod->idx, off, &vaddr) ||
+	    !(e = sym_lookup(&mod->idx, vaddr))) {
+		snprintf(out, size, "?? %s+0x%llx", me->path, off);
+		return;
+	}
+	snprintf(out, size, "%s+0x%llx %s", mod->idx.names + e->name,
+		 vaddr - e->addr, me->path);
+}
+
+static void sym_free(struct symbolizer *sz)
+{
+	int i;
+
+	for (i = 0; i < sz->nr_mods; i++) {
+		if (sz->mods[i].mapped)
+			munmap(sz->mods[i].block, sz->mods[i].block_len);
+		else
+			free(sz->mods[i].block);
+	}
+	free(sz->maps);
+}
+
+/* Annotate the [addr] lines of the module's on-CPU profile of pid */
+static int symbolize_profile(struct symbolizer *sz)
+{
+	char *path, *text, *line, *nl, *ip, sym[512], key[32];
+	int ret = 1;
+
+	path = build_proc_path("profile");
+	text = path ? read_text_file(path) : NULL;
+	if (!text) {
+		perror("profile");
+		goto out;
+	}
+	snprintf(key, sizeof(key), "# pid=%s ", sz->pid);
+	if (strncmp(text, key, strlen(key))) {
+		fprintf(stderr, "the module's profile is not of PID %s\n",
+			sz->pid);
+		goto out;
+	}
+
+	for (line = text; *line; line = nl) {
+		nl = strchr(line, '\n');
+		if (nl)
+			*nl++ = '\0';
+		else
+			nl = line + strlen(line);
+		ip = strncmp(line, "samples=", 8) ? NULL : strstr(line, " ip=");
+		if (!ip) {
+			printf("%s\n", line);
+			continue;
+		}
+		sym_resolve(sz, strtoull(ip + 4, NULL, 16), sym, sizeof(sym));
+		printf("%s sym=%s\n", line, sym);
+	}
+	ret = 0;
+out:
+	free(text);
+	free(path);
+	return ret;
+}
+
+/* --symbolize: resolve a list of addresses of pid, or the addresses of
+ * the module's on-CPU profile ("profile"), to functions.
+ */
+static int run_symbolize(const char *pid, const char *what)
+{
+	struct symbolizer *sz = calloc(1, sizeof(*sz));
+	unsigned long long addr;
+	char sym[512], *end;
+	int ret = 1, n = 0;
+
+	if (!sz)
+		return 1;
+	sz->pid = pid;
+	if (sym_cache_dir(sz->cache_dir, sizeof(sz->cache_dir)))
+		sz->cache_dir[0] = '\0';
+	if (sym_load_maps(sz)) {
+		fprintf(stderr, "cannot read the mappings of PID %s\n", pid);
+		goto out;
+	}
+
+	if (!strcmp(what, "profile")) {
+		ret = symbolize_profile(sz);
+		goto out;
+	}
+	while (*what && n < SYM_MAX_ADDRS) {
+		addr = strtoull(what, &end, 16);
+		if (end == what || (*end && *end != ',')) {
+			fprintf(stderr, "invalid address list: %s\n", what);
+			goto out;
+		}
+		sym_resolve(sz, addr, sym, sizeof(sym));
+		printf("0x%llx %s\n", addr, sym);
+		what = *end ? end + 1 : end;
+		n++;
+	}
+	ret = 0;
+out:
+	sym_free(sz);
+	free(sz);
+	return ret;
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [PID]\n"
+		"       %s --watch <seconds> [--count <n>] <PID>\n"
+		"       %s --pids <pid,pid,...>|--all [--jobs <n>] "
+		"[--sort pid|cpu|rss]\n"
+		"       %s --export <port>|--textfile <path> "
+		"[--pids <list>] [--cgroup <dir>]...\n"
+		"          [--cache-ms <ms>] [--interval <seconds>] "
+		"[--count <n>]\n"
+		"       %s --record <file> [--pids <list>] [--cgroup <dir>]... "
+		"[--interval <seconds>] [--count <n>]\n"
+		"       %s --report|--replay <file> [PID]\n"
+		"       %s --symbolize <addr,addr,...>|profile <PID>\n",
+		prog, prog, prog, prog, prog, prog, prog);
+}
+
+/* Parsed command line of the option-driven modes */
+struct ctrl_options {
+	char pid[20];
+	unsigned int watch_ms;
+	unsigned int interval_ms;
+	unsigned long count;
+	const char *pid_list;
+	int all;
+	long jobs;
+	const char *sort_key;
+	int export_port;
+	const char *textfile;
+	const char *cgroups[EXPORT_MAX_CGROUPS];
+	int nr_cgroups;
+	unsigned int cache_ms;
+	const char *record;
+	const char *report;
+	int replay;
+	const char *symbolize;
+};
+
+static int parse_options(int argc, char **argv, struct ctrl_options *opt)
+{
+	int i;
+
+	memset(opt, 0, sizeof(*opt));
+	opt->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	opt->sort_key = "pid";
+	opt->cache_ms = EXPORT_CACHE_MS_DEF;
+
+	for (i = 1; i < argc; i++) {
+		const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+
+		if (!strcmp(argv[i], "--all")) {
+			opt->all = 1;
+			continue;
+		}
+		if (argv[i][0] != '-' && !opt->pid[0]) {
+			copy_pid_arg(opt->pid, sizeof(opt->pid), argv[i]);
+			continue;
+		}
+		if (!val)
+			return -1;
+		i++;
+
+		if (!strcmp(argv[i - 1], "--pids")) {
+			opt->pid_list = val;
+		} else if (!strcmp(argv[i - 1], "--jobs")) {
+			opt->jobs = strtol(val, NULL, 10);
+		} else if (!strcmp(argv[i - 1], "--sort")) {
+			opt->sort_key = val;
+		} else if (!strcmp(argv[i - 1], "--watch")) {
+			if (!parse_interval_ms(val, &opt->watch_ms))
+				return -1;
+		} else if (!strcmp(argv[i - 1], "--interval")) {
+			if (!parse_interval_ms(val, &opt->interval_ms))
+				return -1;
+		} else if (!strcmp(argv[i - 1], "--count")) {
+			opt->count = strtoul(val, NULL, 10);
+		} else if (!strcmp(argv[i - 1], "--export")) {
+			opt->export_port = atoi(val);
+			if (opt->export_port <= 0 || opt->export_port > 65535)
+				return -1;
+		} else if (!strcmp(argv[i - 1], "--textfile")) {
+			opt->textfile = val;
+		} else if (!strcmp(argv[i - 1], "--cgroup")) {
+			if (opt->nr_cgroups >= EXPORT_MAX_CGROUPS)
+				return -1;
+			opt->cgroups[opt->nr_cgroups++] = val;
+		} else if (!strcmp(argv[i - 1], "--cache-ms")) {
+			opt->cache_ms = (unsigned int)strtoul(val, NULL, 10);
+		} else if (!strcmp(argv[i - 1], "--record")) {
+			opt->record = val;
+		} else if (!strcmp(argv[i - 1], "--report")) {
+			opt->report = val;
+		} else if (!strcmp(argv[i - 1], "--replay")) {
+			opt->report = val;
+			opt->replay = 1;
+		} else if (!strcmp(argv[i - 1], "--symbolize")) {
+			opt->symbolize = val;
+		} else {
+			return -1;
+		}
+	}
+
+	if (opt->jobs < 1)
+		opt->jobs = 1;
+	if (opt->jobs > COLLECT_MAX_JOBS)
+		opt->jobs = COLLECT_MAX_JOBS;
+	return 0;
+}
+
+static int run_export_options(const struct ctrl_options *opt)
+{
+	struct exporter ex;
+	int ret;
+
+	memset(&ex, 0, sizeof(ex));
+	ex.cache_ms = opt->cache_ms;
+	memcpy(ex.cgroups, opt->cgroups, sizeof(ex.cgroups));
+	ex.nr_cgroups = opt->nr_cgroups;
+
+	if (opt->pid_list) {
+		ex.pids = malloc(EXPORT_MAX_TARGETS * sizeof(*ex.pids));
+		if (!ex.pids)
+			return 1;
+		ex.nr_pids = parse_pid_list(opt->pid_list, ex.pids,
+					    EXPORT_MAX_TARGETS);
+		if (ex.nr_pids < 0) {
+			fprintf(stderr, "invalid PID list: %s\n",
+				opt->pid_list);
+			free(ex.pids);
+			return 1;
+		}
+	}
+	if (ex.nr_pids == 0 && ex.nr_cgroups == 0) {
+		fprintf(stderr, "%s needs --pids or --cgroup\n",
+			opt->record ? "recorder" : "exporter");
+		free(ex.pids);
+		return 1;
+	}
+
+	if (opt->record) {
+		ret = exporter_open(&ex) ||
+		      record_to_file(&ex, opt->record,
+				     opt->interval_ms ? opt->interval_ms : 1000,
+				     opt->count);
+		exporter_close(&ex);
+	} else {
+		ret = run_exporter(&ex, opt->export_port, opt->textfile,
+				   opt->interval_ms, opt->count);
+	}
+	free(ex.pids);
+	return ret;
+}
+
+static int run_options(int argc, char **argv)
+{
+	struct ctrl_options opt;
+
+	if (parse_options(argc, argv, &opt)) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (opt.symbolize) {
+		if (!opt.pid[0]) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		return run_symbolize(opt.pid, opt.symbolize);
+	}
+
+	if (opt.report)
+		return report_recording(opt.report, opt.replay,
+					opt.pid[0] ? atoi(opt.pid) : 0);
+
+	if (opt.export_port || opt.textfile || opt.record)
+		return run_export_options(&opt);
+
+	if (opt.pid_list || opt.all)
+		return run_collect(opt.pid_list, (int)opt.jobs, opt.sort_key);
+
+	if (!opt.pid[0] || opt.watch_ms == 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	return watch_process(opt.pid, opt.watch_ms, opt.count);
+}
+
 int main(int argc, char **argv)
 {
 	char pid_user[20];
 
-	if (argc > 1) {
-		size_t len;
-
-		/* Safe string copy with explicit bounds checking */
-		len = strlen(argv[1]);
-		if (len >= sizeof(pid_user))
-			len = sizeof(pid_user) - 1;
-		memcpy(pid_user, argv[1], len);
-		pid_user[len] = '\0';
+	if (argc > 1 && !strncmp(argv[1], "--", 2))
+		return run_options(argc, argv);
 
+	if (argc > 1) {
+		copy_pid_arg(pid_user, sizeof(pid_user), argv[1]);
 		print_process_info(pid_user);
 		return 0;
 	}
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause) */
 #pragma once
 
+#include <elf.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,3 +22,1064 @@ static inline char *build_proc_path(const char *name)
 	snprintf(p, len, "%s/%s", base, name);
 	return p;
 }
+
+/* Watch mode helpers */
+
+#define ELF_CTRL_KEY_MAX    48
+#define ELF_CTRL_VALUE_MAX  112
+#define ELF_CTRL_FIELDS_INIT 256
+
+/* One "key: value" line of det/threads output */
+struct ctrl_field {
+	char key[ELF_CTRL_KEY_MAX];
+	char value[ELF_CTRL_VALUE_MAX];
+};
+
+/* All fields parsed from one read of a proc file. A zeroed snapshot is
+ * empty; the field array grows as needed and is released by snapshot_free().
+ */
+struct ctrl_snapshot {
+	struct ctrl_field *fields;
+	int count;
+	int cap;
+};
+
+/* Copy [start, end) into dst with surrounding whitespace removed. */
+static inline void
+copy_trimmed(char *dst, size_t dst_size, const char *start, const char *end)
+{
+	size_t len;
+
+	if (!dst || dst_size == 0)
+		return;
+
+	while (start < end && (*start == ' ' || *start == '\t'))
+		start++;
+	while (end > start &&
+	       (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n'))
+		end--;
+
+	len = (size_t)(end - start);
+	if (len >= dst_size)
+		len = dst_size - 1;
+	memcpy(dst, start, len);
+	dst[len] = '\0';
+}
+
+/* Split one output line into key and value.
+ * "    - Major:       12" gives key "Major" and value "12".
+ * Thread rows ("7645   node   2.28   S ...") are keyed by "TID <tid>".
+ * Returns 1 when the line holds a field with a non-empty value, 0 otherwise.
+ */
+static inline int parse_field_line(const char *line,
+				   size_t line_len,
+				   char *key,
+				   size_t key_size,
+				   char *value,
+				   size_t value_size)
+{
+	const char *end = line + line_len;
+	const char *colon;
+	const char *p = line;
+
+	if (!line || !key || !value || key_size == 0 || value_size == 0)
+		return 0;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (p + 1 < end && p[0] == '-' && p[1] == ' ')
+		p += 2;
+
+	colon = memchr(p, ':', (size_t)(end - p));
+	if (colon) {
+		copy_trimmed(key, key_size, p, colon);
+		copy_trimmed(value, value_size, colon + 1, end);
+		return key[0] != '\0' && value[0] != '\0';
+	}
+
+	if (p < end && *p >= '0' && *p <= '9') {
+		const char *q = p;
+		char tid[24];
+
+		while (q < end && *q >= '0' && *q <= '9')
+			q++;
+		copy_trimmed(tid, sizeof(tid), p, q);
+		snprintf(key, key_size, "TID %s", tid);
+		copy_trimmed(value, value_size, q, end);
+		return value[0] != '\0';
+	}
+
+	return 0;
+}
+
+/* Parse a whole proc file read into a snapshot; returns number of fields. */
+static inline int parse_snapshot(const char *text, struct ctrl_snapshot *snap)
+{
+	const char *line = text;
+
+	if (!snap)
+		return 0;
+	snap->count = 0;
+	if (!text)
+		return 0;
+
+	while (*line) {
+		const char *nl = strchr(line, '\n');
+		size_t len = nl ? (size_t)(nl - line) : strlen(line);
+		struct ctrl_field *f;
+
+		if (snap->count == snap->cap) {
+			int cap = snap->cap ? snap->cap * 2 : ELF_CTRL_FIELDS_INIT;
+			struct ctrl_field *bigger;
+
+			bigger = realloc(snap->fields, (size_t)cap * sizeof(*f));
+			if (!bigger)
+				break;
+			snap->fields = bigger;
+			snap->cap = cap;
+		}
+		f = &snap->fields[snap->count];
+
+		if (parse_field_line(line, len, f->key, sizeof(f->key),
+				     f->value, sizeof(f->value)))
+			snap->count++;
+
+		if (!nl)
+			break;
+		line = nl + 1;
+	}
+
+	return snap->count;
+}
+
+static inline void snapshot_swap(struct ctrl_snapshot *a,
+				 struct ctrl_snapshot *b)
+{
+	struct ctrl_snapshot tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+static inline void snapshot_free(struct ctrl_snapshot *snap)
+{
+	free(snap->fields);
+	snap->fields = NULL;
+	snap->count = 0;
+	snap->cap = 0;
+}
+
+/* Find the n-th (0-based) field named key; returns its index or -1. */
+static inline int
+snapshot_find(const struct ctrl_snapshot *snap, const char *key, int nth)
+{
+	int i;
+
+	if (!snap || !key)
+		return -1;
+
+	for (i = 0; i < snap->count; i++) {
+		if (strcmp(snap->fields[i].key, key) != 0)
+			continue;
+		if (nth-- == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* Leading unsigned number of a field value ("1234 KB" -> 1234); 0 if
+ * the field is missing.
+ */
+static inline unsigned long long
+snapshot_get_ull(const struct ctrl_snapshot *snap, const char *key)
+{
+	int idx = snapshot_find(snap, key, 0);
+
+	if (idx < 0)
+		return 0;
+	return strtoull(snap->fields[idx].value, NULL, 10);
+}
+
+/* A det snapshot of a live process: it has a "Process ID" and no
+ * "Status: exited" (the module pinned the task but it was already exiting).
+ */
+static inline int snapshot_is_live(const struct ctrl_snapshot *snap)
+{
+	int idx;
+
+	if (snapshot_find(snap, "Process ID", 0) < 0)
+		return 0;
+	idx = snapshot_find(snap, "Status", 0);
+	return idx < 0 || strcmp(snap->fields[idx].value, "exited") != 0;
+}
+
+/* Check whether field idx of cur differs from the field with the same key
+ * and occurrence in prev. New fields count as changed.
+ */
+static inline int snapshot_field_changed(const struct ctrl_snapshot *prev,
+					 const struct ctrl_snapshot *cur,
+					 int idx,
+					 const char **old_value)
+{
+	const struct ctrl_field *f;
+	int nth = 0;
+	int i, prev_idx;
+
+	if (old_value)
+		*old_value = NULL;
+	if (!cur || idx < 0 || idx >= cur->count)
+		return 0;
+
+	f = &cur->fields[idx];
+	for (i = 0; i < idx; i++) {
+		if (!strcmp(cur->fields[i].key, f->key))
+			nth++;
+	}
+
+	prev_idx = snapshot_find(prev, f->key, nth);
+	if (prev_idx < 0)
+		return 1;
+	if (old_value)
+		*old_value = prev->fields[prev_idx].value;
+	return strcmp(prev->fields[prev_idx].value, f->value) != 0;
+}
+
+/* Per-second rate of a counter in hundredths (rate * 100).
+ * Counter resets (cur < prev) yield 0.
+ */
+static inline unsigned long long rate_per_sec_x100(unsigned long long prev,
+						   unsigned long long cur,
+						   unsigned long long interval_ns)
+{
+	if (interval_ns == 0 || cur < prev)
+		return 0;
+	/* double avoids overflowing delta * 1e11 for byte counters */
+	return (unsigned long long)((double)(cur - prev) * 1e11 /
+				    (double)interval_ns);
+}
+
+/* CPU usage over an interval in permyriad (percent * 100) from two
+ * cumulative CPU time readings in ns.
+ */
+static inline unsigned long long
+interval_cpu_permyriad(unsigned long long prev_ns,
+		       unsigned long long cur_ns,
+		       unsigned long long interval_ns)
+{
+	if (interval_ns == 0 || cur_ns < prev_ns)
+		return 0;
+	return ((cur_ns - prev_ns) * 10000ULL) / interval_ns;
+}
+
+/* Parse an interval in seconds ("2", "0.5") into milliseconds.
+ * Returns 1 on success, 0 on invalid or non-positive input.
+ */
+static inline int parse_interval_ms(const char *s, unsigned int *out_ms)
+{
+	char *end;
+	double secs;
+
+	if (!s || !*s || !out_ms)
+		return 0;
+
+	secs = strtod(s, &end);
+	if (*end != '\0' || secs <= 0.0 || secs > 86400.0)
+		return 0;
+
+	*out_ms = (unsigned int)(secs * 1000.0 + 0.5);
+	if (*out_ms == 0)
+		*out_ms = 1;
+	return 1;
+}
+
+/* Multi-PID collection helpers */
+
+/* Parse a percentage such as "2.28%" into hundredths (228). */
+static inline unsigned long long parse_percent_x100(const char *s)
+{
+	unsigned long long whole, frac = 0;
+	char *end;
+
+	if (!s)
+		return 0;
+
+	whole = strtoull(s, &end, 10);
+	if (*end == '.') {
+		const char *p = end + 1;
+		int digits = 0;
+
+		while (*p >= '0' && *p <= '9' && digits < 2) {
+			frac = frac * 10 + (unsigned long long)(*p - '0');
+			digits++;
+			p++;
+		}
+		if (digits == 1)
+			frac *= 10;
+	}
+	return whole * 100 + frac;
+}
+
+/* Parse a comma-separated list of integers >= min ("1,22,333") into out.
+ * Returns the number of values stored, or -1 on malformed input.
+ */
+static inline int parse_int_list(const char *s, int *out, int max, int min)
+{
+	int n = 0;
+
+	if (!s || !out || max <= 0)
+		return -1;
+
+	while (*s) {
+		char *end;
+		long v = strtol(s, &end, 10);
+
+		if (end == s || v < min || v > 0x3fffffff)
+			return -1;
+		if (*end != ',' && *end != '\0')
+			return -1;
+		if (n >= max)
+			return -1;
+
+		out[n++] = (int)v;
+		s = (*end == ',') ? end + 1 : end;
+	}
+	return n;
+}
+
+/* Upper bound of the number of values in a comma-separated list */
+static inline int count_list_items(const char *s)
+{
+	int n = 1;
+
+	if (!s || !*s)
+		return 0;
+	for (; *s; s++)
+		n += *s == ',';
+	return n;
+}
+
+/* Parse a comma-separated PID list ("1,22,333") into out.
+ * Returns the number of PIDs stored, or -1 on malformed input.
+ */
+static inline int parse_pid_list(const char *s, int *out, int max)
+{
+	return parse_int_list(s, out, max, 1);
+}
+
+/* Process summary line of a multi-PID report */
+struct pid_summary {
+	int pid;
+	int ok; /* 0 when the PID vanished or has no mm */
+	char name[20];
+	unsigned long long cpu_x100;
+	unsigned long long rss_kb;
+	unsigned long long swap_kb;
+	unsigned long long faults;
+	unsigned long long sockets;
+};
+
+/* Fill a summary from a parsed det snapshot; returns 1 when det described
+ * a process.
+ */
+static inline int fill_pid_summary(const struct ctrl_snapshot *det,
+				   struct pid_summary *sum)
+{
+	int idx;
+
+	sum->ok = 0;
+	if (!snapshot_is_live(det))
+		return 0;
+
+	idx = snapshot_find(det, "Name", 0);
+	snprintf(sum->name, sizeof(sum->name), "%.*s",
+		 (int)sizeof(sum->name) - 1,
+		 idx >= 0 ? det->fields[idx].value : "?");
+	idx = snapshot_find(det, "CPU Usage", 0);
+	sum->cpu_x100 =
+		idx >= 0 ? parse_percent_x100(det->fields[idx].value) : 0;
+	sum->rss_kb = snapshot_get_ull(det, "RSS (Resident)");
+	sum->swap_kb = snapshot_get_ull(det, "Swap Usage");
+	sum->faults = snapshot_get_ull(det, "Major") +
+		      snapshot_get_ull(det, "Minor");
+	sum->sockets = snapshot_get_ull(det, "sockets_total");
+	sum->ok = 1;
+	return 1;
+}
+
+/* qsort comparators for the multi-PID report */
+static inline int compare_summary_pid(const void *a, const void *b)
+{
+	const struct pid_summary *x = a, *y = b;
+
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+static inline int compare_summary_cpu(const void *a, const void *b)
+{
+	const struct pid_summary *x = a, *y = b;
+
+	if (x->cpu_x100 != y->cpu_x100)
+		return x->cpu_x100 < y->cpu_x100 ? 1 : -1;
+	return compare_summary_pid(a, b);
+}
+
+static inline int compare_summary_rss(const void *a, const void *b)
+{
+	const struct pid_summary *x = a, *y = b;
+
+	if (x->rss_kb != y->rss_kb)
+		return x->rss_kb < y->rss_kb ? 1 : -1;
+	return compare_summary_pid(a, b);
+}
+
+/* Metrics exporter helpers */
+
+#define EXPORT_THREAD_STATES "RSDTtZX?"
+#define EXPORT_NR_STATES     8
+
+/* Every det/threads field the exporter publishes for one process */
+struct export_sample {
+	int pid;
+	char comm[20];
+	unsigned long long rss_kb, anon_kb, file_kb, shmem_kb;
+	unsigned long long vsz_kb, swap_kb;
+	unsigned long long maj_flt, min_flt;
+	unsigned long long cpu_ns;
+	unsigned long long sockets, tcp, udp, unix_socks;
+	unsigned long long rx_packets, tx_packets, rx_bytes, tx_bytes;
+	unsigned long long tcp_retransmits, drops;
+	long long oom_score_adj;
+	unsigned int threads[EXPORT_NR_STATES]; /* by EXPORT_THREAD_STATES */
+};
+
+/* Parse "19 (tcp: 2, udp: 0, unix: 17)"; returns 1 on success. */
+static inline int parse_socket_counts(const char *s,
+				      unsigned long long *total,
+				      unsigned long long *tcp,
+				      unsigned long long *udp,
+				      unsigned long long *unix_socks)
+{
+	if (!s)
+		return 0;
+	return sscanf(s, "%llu (tcp: %llu, udp: %llu, unix: %llu)", total, tcp,
+		      udp, unix_socks) == 4;
+}
+
+/* Thread state letter from the value of a "TID <tid>" field.
+ * The value starts with the 15-column padded thread name followed by the
+ * CPU(%) column and the STATE column. Returns '?' when malformed.
+ */
+static inline char thread_row_state(const char *value)
+{
+	const char *p;
+
+	if (!value || strlen(value) < 16)
+		return '?';
+
+	p = value + 15;
+	while (*p == ' ')
+		p++;
+	while ((*p >= '0' && *p <= '9') || *p == '.')
+		p++;
+	while (*p == ' ')
+		p++;
+	return *p ? *p : '?';
+}
+
+/* Index of a thread state letter in EXPORT_THREAD_STATES */
+static inline int export_state_index(char state)
+{
+	const char *p = strchr(EXPORT_THREAD_STATES, state);
+
+	if (!p || state == '\0')
+		return EXPORT_NR_STATES - 1;
+	return (int)(p - EXPORT_THREAD_STATES);
+}
+
+/* Fill an export sample from parsed det and threads snapshots.
+ * Returns 1 when det described a process.
+ */
+static inline int fill_export_sample(const struct ctrl_snapshot *det,
+				     const struct ctrl_snapshot *threads,
+				     struct export_sample *s)
+{
+	int i, idx;
+
+	memset(s->threads, 0, sizeof(s->threads));
+	if (!snapshot_is_live(det))
+		return 0;
+
+	s->pid = (int)snapshot_get_ull(det, "Process ID");
+	idx = snapshot_find(det, "Name", 0);
+	snprintf(s->comm, sizeof(s->comm), "%.*s", (int)sizeof(s->comm) - 1,
+		 idx >= 0 ? det->fields[idx].value : "");
+	s->rss_kb = snapshot_get_ull(det, "RSS (Resident)");
+	s->anon_kb = snapshot_get_ull(det, "Anonymous");
+	s->file_kb = snapshot_get_ull(det, "File-backed");
+	s->shmem_kb = snapshot_get_ull(det, "Shared Mem");
+	s->vsz_kb = snapshot_get_ull(det, "VSZ (Virtual)");
+	s->swap_kb = snapshot_get_ull(det, "Swap Usage");
+	s->maj_flt = snapshot_get_ull(det, "Major");
+	s->min_flt = snapshot_get_ull(det, "Minor");
+	s->cpu_ns = snapshot_get_ull(det, "CPU Time");
+	s->rx_packets = snapshot_get_ull(det, "rx_packets");
+	s->tx_packets = snapshot_get_ull(det, "tx_packets");
+	s->rx_bytes = snapshot_get_ull(det, "rx_bytes");
+	s->tx_bytes = snapshot_get_ull(det, "tx_bytes");
+	s->tcp_retransmits = snapshot_get_ull(det, "tcp_retransmits");
+	s->drops = snapshot_get_ull(det, "drops");
+
+	idx = snapshot_find(det, "OOM Score Adj", 0);
+	s->oom_score_adj = idx >= 0 ? strtoll(det->fields[idx].value, NULL, 10)
+				    : 0;
+
+	s->sockets = s->tcp = s->udp = s->unix_socks = 0;
+	idx = snapshot_find(det, "sockets_total", 0);
+	if (idx >= 0)
+		parse_socket_counts(det->fields[idx].value, &s->sockets,
+				    &s->tcp, &s->udp, &s->unix_socks);
+
+	for (i = 0; threads && i < threads->count; i++) {
+		if (strncmp(threads->fields[i].key, "TID ", 4) != 0)
+			continue;
+		s->threads[export_state_index(
+			thread_row_state(threads->fields[i].value))]++;
+	}
+	return 1;
+}
+
+/* Escape a label value for the Prometheus/OpenMetrics text format. */
+static inline void
+escape_label_value(const char *src, char *dst, size_t dst_size)
+{
+	size_t n = 0;
+
+	if (!dst || dst_size == 0)
+		return;
+
+	for (; src && *src && n + 2 < dst_size; src++) {
+		if (*src == '"' || *src == '\\') {
+			dst[n++] = '\\';
+			dst[n++] = *src;
+		} else if (*src == '\n') {
+			dst[n++] = '\\';
+			dst[n++] = 'n';
+		} else {
+			dst[n++] = *src;
+		}
+	}
+	dst[n] = '\0';
+}
+
+/* Time-series recorder helpers */
+
+/* Metrics stored per process in a recording, in on-disk order */
+enum rec_metric {
+	REC_CPU_NS,
+	REC_RSS_KB,
+	REC_SWAP_KB,
+	REC_VSZ_KB,
+	REC_MAJ_FLT,
+	REC_MIN_FLT,
+	REC_RX_BYTES,
+	REC_TX_BYTES,
+	REC_THREADS,
+	REC_SOCKETS,
+	REC_NR_METRICS
+};
+
+/* Log-linear histogram: exact below 16, then 16 sub-buckets per power of
+ * two (worst-case error 1/16) up to 2^64.
+ */
+#define REC_HIST_SUB	 16
+#define REC_HIST_BUCKETS (61 * REC_HIST_SUB)
+
+/* LEB128 varint; out needs 10 bytes. Returns bytes written. */
+static inline size_t varint_encode(unsigned long long v, unsigned char *out)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		out[n++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	out[n++] = (unsigned char)v;
+	return n;
+}
+
+/* Decode a varint from in[0..len). Returns bytes consumed, 0 when the
+ * input is truncated or longer than 10 bytes.
+ */
+static inline size_t
+varint_decode(const unsigned char *in, size_t len, unsigned long long *v)
+{
+	unsigned long long result = 0;
+	size_t i;
+
+	for (i = 0; i < len && i < 10; i++) {
+		result |= (unsigned long long)(in[i] & 0x7f) << (7 * i);
+		if (!(in[i] & 0x80)) {
+			*v = result;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/* Map signed deltas to unsigned so small magnitudes stay short. */
+static inline unsigned long long zigzag_encode(long long v)
+{
+	return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static inline long long zigzag_decode(unsigned long long v)
+{
+	return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static inline int hist_index(unsigned long long v)
+{
+	int msb, shift;
+
+	if (v < REC_HIST_SUB)
+		return (int)v;
+
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - 4;
+	return (shift + 1) * REC_HIST_SUB +
+	       (int)((v >> shift) & (REC_HIST_SUB - 1));
+}
+
+/* Lower bound of the values mapped to bucket idx */
+static inline unsigned long long hist_bucket_value(int idx)
+{
+	int shift;
+
+	if (idx < REC_HIST_SUB)
+		return (unsigned long long)idx;
+
+	shift = idx / REC_HIST_SUB - 1;
+	return (unsigned long long)(REC_HIST_SUB + idx % REC_HIST_SUB)
+	       << shift;
+}
+
+/* pct-th percentile (0-100) of a histogram holding total values */
+static inline unsigned long long hist_percentile(const unsigned int *hist,
+						 unsigned long long total,
+						 unsigned int pct)
+{
+	unsigned long long rank, seen = 0;
+	int i;
+
+	if (total == 0)
+		return 0;
+
+	rank = (total * pct + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < REC_HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= rank)
+			return hist_bucket_value(i);
+	}
+	return hist_bucket_value(REC_HIST_BUCKETS - 1);
+}
+
+/* Flatten an export sample into the recorded metric vector */
+static inline void export_sample_metrics(const struct export_sample *s,
+					 unsigned long long *out)
+{
+	unsigned long long threads = 0;
+	int i;
+
+	for (i = 0; i < EXPORT_NR_STATES; i++)
+		threads += s->threads[i];
+
+	out[REC_CPU_NS] = s->cpu_ns;
+	out[REC_RSS_KB] = s->rss_kb;
+	out[REC_SWAP_KB] = s->swap_kb;
+	out[REC_VSZ_KB] = s->vsz_kb;
+	out[REC_MAJ_FLT] = s->maj_flt;
+	out[REC_MIN_FLT] = s->min_flt;
+	out[REC_RX_BYTES] = s->rx_bytes;
+	out[REC_TX_BYTES] = s->tx_bytes;
+	out[REC_THREADS] = threads;
+	out[REC_SOCKETS] = s->sockets;
+}
+
+/* Benchmark helpers */
+
+static inline int compare_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank pct-th percentile (0-100) of n ascending values */
+static inline unsigned long long
+sorted_percentile(const unsigned long long *v, size_t n, unsigned int pct)
+{
+	size_t rank;
+
+	if (n == 0)
+		return 0;
+	rank = (n * pct + 99) / 100;
+	if (rank == 0)
+		rank = 1;
+	return v[rank - 1];
+}
+
+/* Stress harness helpers */
+
+/* Check that a det and a threads snapshot both describe pid: det's
+ * "Process ID" and the first thread row, which is the group leader.
+ */
+static inline int snapshot_describes_pid(const struct ctrl_snapshot *det,
+					 const struct ctrl_snapshot *threads,
+					 int pid)
+{
+	int i;
+
+	if (snapshot_find(det, "Process ID", 0) < 0 ||
+	    snapshot_get_ull(det, "Process ID") != (unsigned long long)pid)
+		return 0;
+	for (i = 0; i < threads->count; i++) {
+		if (!strncmp(threads->fields[i].key, "TID ", 4))
+			return atoi(threads->fields[i].key + 4) == pid;
+	}
+	return 0;
+}
+
+/* Symbolizer helpers */
+
+#define SYM_CACHE_MAGIC	 "ELFDSYM1"
+#define SYM_BUILD_ID_HEX 65 /* up to 32 bytes of build-id as hex + NUL */
+
+/* A function symbol of an ELF file, at its link-time address */
+struct sym_entry {
+	unsigned long long addr;
+	unsigned long long size;
+	unsigned int name; /* offset into the name pool */
+	unsigned int pad;
+};
+
+/* A PT_LOAD segment: maps file offsets to link-time addresses */
+struct sym_segment {
+	unsigned long long vaddr;
+	unsigned long long offset;
+	unsigned long long filesz;
+};
+
+/* Symbol index of one ELF file as a single block, the same in memory
+ * and in the on-disk cache: header, segments, symbols sorted by address,
+ * then the NUL-terminated names.
+ */
+struct sym_cache_hdr {
+	char magic[8];
+	unsigned int nr_segs;
+	unsigned int nr_syms;
+	unsigned int names_len;
+	unsigned int pad;
+};
+
+struct sym_index {
+	const struct sym_segment *segs;
+	unsigned int nr_segs;
+	const struct sym_entry *syms;
+	unsigned int nr_syms;
+	const char *names;
+	unsigned int names_len;
+};
+
+/* Point idx into a symbol block (from sym_parse_elf() or a cache file)
+ * after checking that it is complete. Returns 0 on success.
+ */
+static inline int sym_index_from_block(const void *block, size_t len,
+				       struct sym_index *idx)
+{
+	const struct sym_cache_hdr *hdr = block;
+	const char *p = block;
+	size_t need;
+
+	if (!block || len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, SYM_CACHE_MAGIC, sizeof(hdr->magic)))
+		return -1;
+	need = sizeof(*hdr) + (size_t)hdr->nr_segs * sizeof(struct sym_segment) +
+	       (size_t)hdr->nr_syms * sizeof(struct sym_entry) +
+	       hdr->names_len;
+	if (need != len || (hdr->names_len && p[len - 1] != '\0'))
+		return -1;
+
+	idx->nr_segs = hdr->nr_segs;
+	idx->nr_syms = hdr->nr_syms;
+	idx->names_len = hdr->names_len;
+	idx->segs = (const struct sym_segment *)(p + sizeof(*hdr));
+	idx->syms = (const struct sym_entry *)(idx->segs + idx->nr_segs);
+	idx->names = (const char *)(idx->syms + idx->nr_syms);
+	return 0;
+}
+
+/* Whether [off, off + size) lies inside a buffer of len bytes */
+static inline int sym_in_bounds(unsigned long long off, unsigned long long size,
+				size_t len)
+{
+	return off <= len && size <= len - off;
+}
+
+/* Validated ELF header of a 64-bit, native-endian ELF file, or NULL */
+static inline const Elf64_Ehdr *sym_elf_header(const unsigned char *buf,
+					       size_t len)
+{
+	const Elf64_Ehdr *eh = (const Elf64_Ehdr *)buf;
+	const unsigned short one = 1;
+	int native = *(const unsigned char *)&one ? ELFDATA2LSB : ELFDATA2MSB;
+
+	if (!buf || len < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+	    eh->e_ident[EI_DATA] != native)
+		return NULL;
+	if (eh->e_phnum &&
+	    (eh->e_phentsize != sizeof(Elf64_Phdr) ||
+	     !sym_in_bounds(eh->e_phoff,
+			    (unsigned long long)eh->e_phnum * sizeof(Elf64_Phdr),
+			    len)))
+		return NULL;
+	if (eh->e_shnum &&
+	    (eh->e_shentsize != sizeof(Elf64_Shdr) ||
+	     !sym_in_bounds(eh->e_shoff,
+			    (unsigned long long)eh->e_shnum * sizeof(Elf64_Shdr),
+			    len)))
+		return NULL;
+	return eh;
+}
+
+/* GNU build-id of an ELF file as lowercase hex. Only program headers and
+ * notes are read, so this is cheap enough to run before a cache lookup.
+ * Returns 0 on success.
+ */
+static inline int sym_elf_build_id(const unsigned char *buf, size_t len,
+				   char *hex, size_t size)
+{
+	const Elf64_Ehdr *eh = sym_elf_header(buf, len);
+	const Elf64_Phdr *ph;
+	const Elf64_Nhdr *nh;
+	unsigned long long off, end;
+	unsigned int i, j;
+
+	if (!eh || !hex || size == 0)
+		return -1;
+	ph = (const Elf64_Phdr *)(buf + eh->e_phoff);
+	for (i = 0; i < eh->e_phnum; i++) {
+		if (ph[i].p_type != PT_NOTE ||
+		    !sym_in_bounds(ph[i].p_offset, ph[i].p_filesz, len))
+			continue;
+		off = ph[i].p_offset;
+		end = off + ph[i].p_filesz;
+		while (off + sizeof(*nh) <= end) {
+			nh = (const Elf64_Nhdr *)(buf + off);
+			off += sizeof(*nh);
+			if ((unsigned long long)((nh->n_namesz + 3) & ~3U) +
+				    ((nh->n_descsz + 3) & ~3U) > end - off)
+				break;
+			if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+			    !memcmp(buf + off, "GNU", 4) && nh->n_descsz &&
+			    nh->n_descsz * 2 < size) {
+				off += 4;
+				for (j = 0; j < nh->n_descsz; j++)
+					snprintf(hex + j * 2, 3, "%02x",
+						 buf[off + j]);
+				return 0;
+			}
+			off += ((nh->n_namesz + 3) & ~3U) +
+			       ((nh->n_descsz + 3) & ~3U);
+		}
+	}
+	return -1;
+}
+
+static inline int sym_compare_entry(const void *a, const void *b)
+{
+	const struct sym_entry *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	/* Of aliases at one address, the sized one sorts first */
+	return (x->size < y->size) - (x->size > y->size);
+}
+
+/* Build the symbol block of an ELF file from its function symbols
+ * (.symtab, or .dynsym for a stripped file). Returns the malloc'ed block
+ * and its length in *len, or NULL.
+ */
+static inline void *sym_parse_elf(const unsigned char *buf, size_t len,
+				  size_t *out_len)
+{
+	const Elf64_Ehdr *eh = sym_elf_header(buf, len);
+	const Elf64_Shdr *sh, *symtab = NULL, *strtab;
+	const Elf64_Phdr *ph;
+	const Elf64_Sym *sym;
+	struct sym_cache_hdr *hdr;
+	struct sym_segment *segs;
+	struct sym_entry *syms;
+	unsigned int nr_segs = 0, nr_syms = 0, names_len = 0, i, j, nsym;
+	const char *name;
+	size_t block_len, nlen;
+	char *block, *names;
+
+	if (!eh || !out_len)
+		return NULL;
+	ph = (const Elf64_Phdr *)(buf + eh->e_phoff);
+	sh = (const Elf64_Shdr *)(buf + eh->e_shoff);
+
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type == SHT_SYMTAB ||
+		    (sh[i].sh_type == SHT_DYNSYM && !symtab))
+			symtab = &sh[i];
+	}
+	if (symtab && (symtab->sh_link >= eh->e_shnum ||
+		       symtab->sh_entsize != sizeof(Elf64_Sym) ||
+		       !sym_in_bounds(symtab->sh_offset, symtab->sh_size, len) ||
+		       !sym_in_bounds(sh[symtab->sh_link].sh_offset,
+				      sh[symtab->sh_link].sh_size, len)))
+		symtab = NULL;
+	strtab = symtab ? &sh[symtab->sh_link] : NULL;
+	nsym = symtab ? (unsigned int)(symtab->sh_size / sizeof(*sym)) : 0;
+
+	/* First pass: sizes */
+	for (i = 0; i < eh->e_phnum; i++)
+		nr_segs += ph[i].p_type == PT_LOAD;
+	for (i = 0; i < nsym; i++) {
+		sym = (const Elf64_Sym *)(buf + symtab->sh_offset) + i;
+		if ((ELF64_ST_TYPE(sym->st_info) != STT_FUNC &&
+		     ELF64_ST_TYPE(sym->st_info) != STT_GNU_IFUNC) ||
+		    sym->st_shndx == SHN_UNDEF || !sym->st_value ||
+		    sym->st_name >= strtab->sh_size)
+			continue;
+		name = (const char *)buf + strtab->sh_offset + sym->st_name;
+		nlen = strnlen(name, strtab->sh_size - sym->st_name);
+		if (nlen == strtab->sh_size - sym->st_name)
+			continue;
+		nr_syms++;
+		names_len += (unsigned int)nlen + 1;
+	}
+
+	block_len = sizeof(*hdr) + nr_segs * sizeof(*segs) +
+		    nr_syms * sizeof(*syms) + names_len;
+	block = calloc(1, block_len);
+	if (!block)
+		return NULL;
+	hdr = (struct sym_cache_hdr *)block;
+	segs = (struct sym_segment *)(hdr + 1);
+	syms = (struct sym_entry *)(segs + nr_segs);
+	names = (char *)(syms + nr_syms);
+	memcpy(hdr->magic, SYM_CACHE_MAGIC, sizeof(hdr->magic));
+
+	/* Second pass: fill */
+	for (i = 0, j = 0; i < eh->e_phnum; i++) {
+		if (ph[i].p_type != PT_LOAD)
+			continue;
+		segs[j].vaddr = ph[i].p_vaddr;
+		segs[j].offset = ph[i].p_offset;
+		segs[j++].filesz = ph[i].p_filesz;
+	}
+	hdr->nr_segs = j;
+	for (i = 0, j = 0; i < nsym; i++) {
+		sym = (const Elf64_Sym *)(buf + symtab->sh_offset) + i;
+		if ((ELF64_ST_TYPE(sym->st_info) != STT_FUNC &&
+		     ELF64_ST_TYPE(sym->st_info) != STT_GNU_IFUNC) ||
+		    sym->st_shndx == SHN_UNDEF || !sym->st_value ||
+		    sym->st_name >= strtab->sh_size)
+			continue;
+		name = (const char *)buf + strtab->sh_offset + sym->st_name;
+		nlen = strnlen(name, strtab->sh_size - sym->st_name);
+		if (nlen == strtab->sh_size - sym->st_name)
+			continue;
+		syms[j].addr = sym->st_value;
+		syms[j].size = sym->st_size;
+		syms[j++].name = hdr->names_len;
+		memcpy(names + hdr->names_len, name, nlen + 1);
+		hdr->names_len += (unsigned int)nlen + 1;
+	}
+
+	/* Sort and drop aliases; their names stay unused in the pool */
+	qsort(syms, j, sizeof(*syms), sym_compare_entry);
+	for (i = 0, nr_syms = 0; i < j; i++) {
+		if (nr_syms && syms[nr_syms - 1].addr == syms[i].addr)
+			continue;
+		syms[nr_syms++] = syms[i];
+	}
+	if (nr_syms != j) {
+		memmove(syms + nr_syms, names, hdr->names_len);
+		block_len -= (size_t)(j - nr_syms) * sizeof(*syms);
+	}
+	hdr->nr_syms = nr_syms;
+	*out_len = block_len;
+	return block;
+}
+
+/* Link-time address of a file offset, via the PT_LOAD segments */
+static inline int sym_offset_to_vaddr(const struct sym_index *idx,
+				      unsigned long long off,
+				      unsigned long long *vaddr)
+{
+	unsigned int i;
+
+	for (i = 0; i < idx->nr_segs; i++) {
+		if (off >= idx->segs[i].offset &&
+		    off - idx->segs[i].offset < idx->segs[i].filesz) {
+			*vaddr = off - idx->segs[i].offset + idx->segs[i].vaddr;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* The function containing vaddr, or NULL. A symbol without a size
+ * covers everything up to the next symbol.
+ */
+static inline const struct sym_entry *
+sym_lookup(const struct sym_index *idx, unsigned long long vaddr)
+{
+	unsigned int lo = 0, hi = idx->nr_syms, mid;
+	const struct sym_entry *e;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->syms[mid].addr <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	e = &idx->syms[lo - 1];
+	if (e->size && vaddr - e->addr >= e->size)
+		return NULL;
+	return e;
+}
+
+/* One line of /proc/PID/maps */
+struct maps_entry {
+	unsigned long long start, end, pgoff;
+	char path[256]; /* empty for anonymous mappings */
+};
+
+/* Parse "start-end perms offset dev inode [path]"; returns 0 on success */
+static inline int parse_maps_line(const char *line, struct maps_entry *me)
+{
+	char perms[8], dev[16];
+	unsigned long inode;
+	int n = 0;
+
+	me->path[0] = '\0';
+	if (sscanf(line, "%llx-%llx %7s %llx %15s %lu %n", &me->start, &me->end,
+		   perms, &me->pgoff, dev, &inode, &n) < 6 ||
+	    me->end <= me->start)
+		return -1;
+	if (n > 0)
+		copy_trimmed(me->path, sizeof(me->path), line + n,
+			     line + strlen(line));
+	return 0;
+}
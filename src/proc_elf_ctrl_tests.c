@@ -3,6 +3,7 @@
 #include "proc_elf_ctrl.h"
 #include <assert.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -279,6 +280,465 @@ static void test_main_interactive_repeats_until_input_fails(void)
 	assert(count_substr(output_buf, "PROCESS INFORMATION") == 2);
 }
 
+static void test_parse_field_line_variants(void)
+{
+	char key[ELF_CTRL_KEY_MAX];
+	char value[ELF_CTRL_VALUE_MAX];
+	const char *l1 = "    - Major:       12\n";
+	const char *l2 = "7645   node               2.28   S";
+	const char *l3 = "Memory Pressure Statistics:";
+	const char *l4 = "      [=====     ]";
+
+	assert(parse_field_line(l1, strlen(l1), key, sizeof(key), value,
+				sizeof(value)) == 1);
+	assert(strcmp(key, "Major") == 0);
+	assert(strcmp(value, "12") == 0);
+
+	assert(parse_field_line(l2, strlen(l2), key, sizeof(key), value,
+				sizeof(value)) == 1);
+	assert(strcmp(key, "TID 7645") == 0);
+	assert(strcmp(value, "node               2.28   S") == 0);
+
+	/* Section headers and bars carry no value */
+	assert(parse_field_line(l3, strlen(l3), key, sizeof(key), value,
+				sizeof(value)) == 0);
+	assert(parse_field_line(l4, strlen(l4), key, sizeof(key), value,
+				sizeof(value)) == 0);
+}
+
+static void test_snapshot_changes_and_rates(void)
+{
+	static struct ctrl_snapshot prev, cur;
+	const char *old_value;
+	int idx;
+
+	parse_snapshot("Process ID: 5\n  - Total: 10\nrx_bytes: 100\n"
+		       "  - Total: 1\n",
+		       &prev);
+	parse_snapshot("Process ID: 5\n  - Total: 10\nrx_bytes: 300\n"
+		       "  - Total: 2\nTotal threads: 4\n",
+		       &cur);
+	assert(prev.count == 4);
+	assert(cur.count == 5);
+	assert(snapshot_get_ull(&cur, "rx_bytes") == 300);
+	assert(snapshot_get_ull(&cur, "missing") == 0);
+
+	/* Duplicate keys are matched by occurrence */
+	assert(snapshot_find(&cur, "Total", 1) == 3);
+	assert(snapshot_field_changed(&prev, &cur, 1, &old_value) == 0);
+	assert(snapshot_field_changed(&prev, &cur, 3, &old_value) == 1);
+	assert(strcmp(old_value, "1") == 0);
+
+	idx = snapshot_find(&cur, "Total threads", 0);
+	assert(snapshot_field_changed(&prev, &cur, idx, &old_value) == 1);
+	assert(old_value == NULL);
+
+	/* 200 bytes over 2 seconds = 100.00/s */
+	assert(rate_per_sec_x100(100, 300, 2000000000ULL) == 10000);
+	assert(rate_per_sec_x100(300, 100, 2000000000ULL) == 0);
+	assert(rate_per_sec_x100(0, 5, 0) == 0);
+	/* Large byte counters must not overflow */
+	assert(rate_per_sec_x100(0, 1ULL << 40, 1000000000ULL) ==
+	       (1ULL << 40) * 100);
+
+	/* 250ms of CPU in 500ms = 50.00% */
+	assert(interval_cpu_permyriad(0, 250000000ULL, 500000000ULL) == 5000);
+	assert(interval_cpu_permyriad(10, 5, 100) == 0);
+
+	/* Rows past the initial capacity are kept, e.g. many threads */
+	{
+		char *text = malloc(1000 * 16);
+		size_t off = 0;
+		int i;
+
+		assert(text);
+		for (i = 0; i < 1000; i++)
+			off += (size_t)sprintf(text + off, "%d  t  S\n", 100 + i);
+		parse_snapshot(text, &cur);
+		assert(cur.count == 1000);
+		assert(snapshot_find(&cur, "TID 1099", 0) == 999);
+		free(text);
+	}
+
+	snapshot_swap(&prev, &cur);
+	assert(prev.count == 1000);
+	assert(cur.count == 4);
+	snapshot_free(&prev);
+	snapshot_free(&cur);
+	assert(prev.fields == NULL && prev.count == 0);
+}
+
+static void test_parse_interval_ms(void)
+{
+	unsigned int ms;
+
+	assert(parse_interval_ms("2", &ms) == 1 && ms == 2000);
+	assert(parse_interval_ms("0.5", &ms) == 1 && ms == 500);
+	assert(parse_interval_ms("0.0001", &ms) == 1 && ms == 1);
+	assert(parse_interval_ms("0", &ms) == 0);
+	assert(parse_interval_ms("-1", &ms) == 0);
+	assert(parse_interval_ms("1s", &ms) == 0);
+	assert(parse_interval_ms("", &ms) == 0);
+}
+
+static void test_main_watch_rejects_bad_arguments(void)
+{
+	char *argv1[] = {"prog", "--watch", "abc", "1"};
+	char *argv2[] = {"prog", "--watch", "1"};
+
+	reset_mocks();
+	assert(proc_elf_ctrl_entry(4, argv1) == 1);
+	assert(proc_elf_ctrl_entry(3, argv2) == 1);
+	assert(pid_stream_buf == NULL);
+}
+
+static void test_multi_pid_helpers(void)
+{
+	static struct ctrl_snapshot det;
+	struct pid_summary sums[3];
+	int pids[4];
+
+	assert(parse_pid_list("1,22,333", pids, 4) == 3);
+	assert(pids[0] == 1 && pids[1] == 22 && pids[2] == 333);
+	assert(parse_pid_list("7", pids, 4) == 1 && pids[0] == 7);
+	assert(parse_pid_list("1,,2", pids, 4) == -1);
+	assert(count_list_items("1,22,333") == 3);
+	assert(count_list_items("7") == 1);
+	assert(count_list_items("") == 0);
+	assert(parse_pid_list("1,x", pids, 4) == -1);
+	assert(parse_pid_list("0", pids, 4) == -1);
+	assert(parse_pid_list("1,2,3,4,5", pids, 4) == -1);
+
+	assert(parse_percent_x100("2.28%") == 228);
+	assert(parse_percent_x100("0.5%") == 50);
+	assert(parse_percent_x100("12%") == 1200);
+
+	parse_snapshot("Process ID:      42\nName:            worker\n"
+		       "CPU Usage:       3.07%\n"
+		       "  RSS (Resident):  2048 KB\n"
+		       "  Swap Usage:      16 KB\n"
+		       "    - Major:       2\n    - Minor:       40\n"
+		       "sockets_total: 3 (tcp: 1, udp: 0, unix: 2)\n",
+		       &det);
+	sums[0].pid = 42;
+	assert(fill_pid_summary(&det, &sums[0]) == 1);
+	assert(strcmp(sums[0].name, "worker") == 0);
+	assert(sums[0].cpu_x100 == 307);
+	assert(sums[0].rss_kb == 2048 && sums[0].swap_kb == 16);
+	assert(sums[0].faults == 42 && sums[0].sockets == 3);
+
+	parse_snapshot("Invalid PID or process has no memory context\n", &det);
+	assert(fill_pid_summary(&det, &sums[1]) == 0);
+	assert(sums[1].ok == 0);
+
+	parse_snapshot("Process ID:      42\nName:            worker\n"
+		       "Status:          exited\n",
+		       &det);
+	assert(!snapshot_is_live(&det));
+	assert(fill_pid_summary(&det, &sums[1]) == 0);
+
+	memset(sums, 0, sizeof(sums));
+	sums[0].pid = 30;
+	sums[0].rss_kb = 10;
+	sums[1].pid = 10;
+	sums[1].rss_kb = 30;
+	sums[2].pid = 20;
+	sums[2].rss_kb = 30;
+	qsort(sums, 3, sizeof(sums[0]), compare_summary_pid);
+	assert(sums[0].pid == 10 && sums[1].pid == 20 && sums[2].pid == 30);
+	qsort(sums, 3, sizeof(sums[0]), compare_summary_rss);
+	assert(sums[0].pid == 10 && sums[1].pid == 20 && sums[2].pid == 30);
+	sums[2].cpu_x100 = 500;
+	qsort(sums, 3, sizeof(sums[0]), compare_summary_cpu);
+	assert(sums[0].pid == 30 && sums[1].pid == 10);
+}
+
+static void test_export_sample_and_rendering(void)
+{
+	static struct ctrl_snapshot det, threads;
+	struct export_sample samples[2];
+	struct text_buf tb = {NULL, 0, 0};
+	char esc[32];
+	const char *rss, *faults;
+
+	assert(thread_row_state("node               2.28   S        0") ==
+	       'S');
+	assert(thread_row_state("a b c          100.00   R        0") == 'R');
+	assert(thread_row_state("short") == '?');
+	assert(export_state_index('D') == 2);
+	assert(export_state_index('W') == EXPORT_NR_STATES - 1);
+
+	escape_label_value("a\"b\\c", esc, sizeof(esc));
+	assert(strcmp(esc, "a\\\"b\\\\c") == 0);
+
+	parse_snapshot("Process ID:      42\nName:            web\n"
+		       "CPU Time:        1500000000 ns\n"
+		       "  RSS (Resident):  300 KB\n    - Anonymous:   200 KB\n"
+		       "    - File-backed: 100 KB\n    - Shared Mem:  0 KB\n"
+		       "    - Major:       1\n    - Minor:       9\n"
+		       "  OOM Score Adj:   -500\n"
+		       "sockets_total: 4 (tcp: 2, udp: 1, unix: 1)\n"
+		       "rx_bytes: 1000\ntx_bytes: 2000\n",
+		       &det);
+	parse_snapshot("TID    NAME\n"
+		       "42     web                0.10   S        0\n"
+		       "43     web-worker         5.00   R        0\n"
+		       "44     web-worker         0.00   S        0\n"
+		       "Total threads: 3\n",
+		       &threads);
+	assert(fill_export_sample(&det, &threads, &samples[0]) == 1);
+	assert(samples[0].pid == 42);
+	assert(samples[0].anon_kb == 200 && samples[0].file_kb == 100);
+	assert(samples[0].oom_score_adj == -500);
+	assert(samples[0].sockets == 4 && samples[0].tcp == 2);
+	assert(samples[0].udp == 1 && samples[0].unix_socks == 1);
+	assert(samples[0].threads[export_state_index('S')] == 2);
+	assert(samples[0].threads[export_state_index('R')] == 1);
+
+	samples[1] = samples[0];
+	samples[1].pid = 7;
+
+	render_metrics(&tb, samples, 2, 1);
+	assert(strstr(tb.data, "# TYPE elfdet_page_faults counter\n"));
+	assert(strstr(tb.data, "elfdet_page_faults_total{pid=\"42\","
+			       "comm=\"web\",type=\"minor\"} 9\n"));
+	assert(strstr(tb.data, "elfdet_rss_bytes{pid=\"7\",comm=\"web\","
+			       "component=\"anon\"} 204800\n"));
+	assert(strstr(tb.data, "elfdet_cpu_seconds_total{pid=\"42\","
+			       "comm=\"web\"} 1.500000000\n"));
+	assert(strstr(tb.data, "state=\"R\"} 1\n"));
+	assert(strcmp(tb.data + tb.len - 6, "# EOF\n") == 0);
+
+	/* A family's samples stay contiguous: no rss line after faults */
+	rss = strstr(tb.data, "elfdet_rss_bytes{pid=\"7\"");
+	faults = strstr(tb.data, "# TYPE elfdet_page_faults");
+	assert(rss && faults && rss < faults);
+	assert(count_substr(tb.data, "# TYPE elfdet_rss_bytes") == 1);
+
+	/* Classic text format names counter families with _total */
+	render_metrics(&tb, samples, 2, 0);
+	assert(strstr(tb.data, "# TYPE elfdet_page_faults_total counter\n"));
+	assert(!strstr(tb.data, "# EOF"));
+	free(tb.data);
+}
+
+static void test_main_export_requires_targets(void)
+{
+	char *argv1[] = {"prog", "--export", "9100"};
+	char *argv2[] = {"prog", "--export", "0", "--pids", "1"};
+
+	reset_mocks();
+	assert(proc_elf_ctrl_entry(3, argv1) == 1);
+	assert(proc_elf_ctrl_entry(5, argv2) == 1);
+}
+
+static void test_recorder_helpers(void)
+{
+	unsigned char buf[10];
+	unsigned long long v;
+	unsigned int hist[REC_HIST_BUCKETS];
+	int i;
+
+	assert(varint_encode(0, buf) == 1 && buf[0] == 0);
+	assert(varint_encode(300, buf) == 2);
+	assert(varint_decode(buf, 2, &v) == 2 && v == 300);
+	assert(varint_decode(buf, 1, &v) == 0);
+	assert(varint_encode(~0ULL, buf) == 10);
+	assert(varint_decode(buf, 10, &v) == 10 && v == ~0ULL);
+
+	assert(zigzag_encode(0) == 0 && zigzag_encode(-1) == 1);
+	assert(zigzag_encode(1) == 2);
+	assert(zigzag_decode(zigzag_encode(-123456789LL)) == -123456789LL);
+
+	/* Values within a bucket are at most 1/16 apart */
+	assert(hist_index(5) == 5);
+	assert(hist_bucket_value(hist_index(1000)) <= 1000);
+	assert(hist_bucket_value(hist_index(1000)) >= 1000 - 1000 / 16);
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 1; i <= 100; i++)
+		hist[hist_index((unsigned long long)i)]++;
+	assert(hist_percentile(hist, 100, 50) == 50);
+	assert(hist_percentile(hist, 100, 99) >= 96);
+	assert(hist_percentile(hist, 100, 99) <= 99);
+}
+
+static void test_record_and_report_round_trip(void)
+{
+	struct recorder *rec = calloc(1, sizeof(*rec));
+	struct rep_state *st = calloc(1, sizeof(*st));
+	struct export_sample s[2];
+	const struct rep_series *web;
+	char *data = NULL;
+	size_t len = 0;
+
+	assert(rec && st);
+	rec->sample_buf = malloc(4096);
+	rec->fp = open_memstream(&data, &len);
+	assert(rec->sample_buf && rec->fp);
+
+	memset(s, 0, sizeof(s));
+	s[0].pid = 42;
+	strcpy(s[0].comm, "web");
+	s[0].rss_kb = 1000;
+	s[0].threads[0] = 2;
+	s[1].pid = 43;
+	strcpy(s[1].comm, "idle");
+	s[1].rss_kb = 10;
+
+	recorder_begin(rec, 5000, 1000);
+	recorder_write_sample(rec, s, 2, 6000);
+	/* web burns half a CPU and grows, idle does not change */
+	s[0].cpu_ns = 500000000ULL;
+	s[0].rss_kb = 3000;
+	s[0].rx_bytes = 4096;
+	recorder_write_sample(rec, s, 2, 7000);
+	recorder_write_sample(rec, s, 1, 8000);
+	fflush(rec->fp);
+
+	/* Samples only carry changed processes, so the file stays tiny */
+	assert(len < 64);
+
+	reset_mocks();
+	st->timeline = 1;
+	assert(parse_recording((unsigned char *)data, len, st) == 0);
+	assert(st->samples == 3 && st->segments == 1);
+	assert(st->nr_series == 2);
+	assert(strstr(output_buf, "+2.000s pid=42 comm=web rss_kb=3000 "
+				  "cpu=50.00% faults/s=0.00 "
+				  "rx_bytes/s=4096"));
+	assert(!strstr(output_buf, "pid=43"));
+
+	web = &st->series[0];
+	assert(web->pid == 42 && web->samples == 3);
+	assert(web->stats[REP_RSS_KB].min == 1000);
+	assert(web->stats[REP_RSS_KB].max == 3000);
+	assert(web->stats[REP_THREADS].max == 2);
+	assert(web->stats[REP_CPU_X100].n == 2);
+	assert(web->stats[REP_CPU_X100].max == 5000);
+	assert(web->stats[REP_CPU_X100].min == 0);
+	assert(st->series[1].samples == 2);
+
+	reset_mocks();
+	print_rep_series(web);
+	assert(strstr(output_buf, "PID 42 (web): 3 samples over 2.000s"));
+	assert(strstr(output_buf, "50.00        25.00\n"));
+
+	/* Truncation is detected rather than misread */
+	free(st->series);
+	memset(st, 0, sizeof(*st));
+	assert(parse_recording((unsigned char *)data, len - 1, st) == -1);
+	assert(parse_recording((unsigned char *)"ELFREC0\n", 8, st) == -1);
+
+	free(st->series);
+	free(st);
+	fclose(rec->fp);
+	free(rec->sample_buf);
+	free(rec);
+	free(data);
+}
+
+static void test_symbolizer_helpers(void)
+{
+	unsigned long long addr = (unsigned long long)(uintptr_t)
+		test_symbolizer_helpers, off, vaddr;
+	struct maps_entry me;
+	struct sym_index idx;
+	const struct sym_entry *e;
+	char bid[SYM_BUILD_ID_HEX], *maps, *line;
+	unsigned char *elf;
+	size_t elf_len = 0, block_len;
+	void *block;
+	FILE *fp;
+	int found = 0;
+
+	assert(parse_maps_line("55d0c4a00000-55d0c4a6f000 r-xp 00002000 "
+			       "fe:00 467835   /usr/bin/server\n", &me) == 0);
+	assert(me.start == 0x55d0c4a00000ULL && me.end == 0x55d0c4a6f000ULL);
+	assert(me.pgoff == 0x2000 && strcmp(me.path, "/usr/bin/server") == 0);
+	assert(parse_maps_line("7ffd1000-7ffd3000 rw-p 00000000 00:00 0 ",
+			       &me) == 0);
+	assert(me.path[0] == '\0');
+	assert(parse_maps_line("garbage", &me) == -1);
+
+	/* The test binary symbolizes its own functions */
+	fp = fopen("/proc/self/exe", "r");
+	elf = malloc(16 << 20);
+	assert(fp && elf);
+	elf_len = fread(elf, 1, 16 << 20, fp);
+	fclose(fp);
+	assert(sym_elf_header(elf, elf_len));
+	assert(sym_elf_build_id(elf, elf_len, bid, sizeof(bid)) == 0);
+	assert(strlen(bid) == 40);
+	block = sym_parse_elf(elf, elf_len, &block_len);
+	assert(block && sym_index_from_block(block, block_len, &idx) == 0);
+	assert(idx.nr_syms > 0 && idx.nr_segs > 0);
+	/* Truncated or foreign blocks are rejected */
+	assert(sym_index_from_block(block, block_len - 1, &idx) == -1);
+	assert(sym_elf_header(elf, 16) == NULL);
+	assert(sym_index_from_block(elf, elf_len, &idx) == -1);
+	assert(sym_index_from_block(block, block_len, &idx) == 0);
+
+	maps = read_text_file("/proc/self/maps");
+	assert(maps);
+	for (line = strtok(maps, "\n"); line; line = strtok(NULL, "\n")) {
+		if (parse_maps_line(line, &me) || addr < me.start ||
+		    addr >= me.end)
+			continue;
+		off = addr - me.start + me.pgoff;
+		assert(sym_offset_to_vaddr(&idx, off, &vaddr) == 0);
+		e = sym_lookup(&idx, vaddr);
+		assert(e && strcmp(idx.names + e->name,
+				   "test_symbolizer_helpers") == 0);
+		assert(vaddr == e->addr);
+		found = 1;
+	}
+	assert(found);
+	assert(sym_lookup(&idx, 0) == NULL);
+
+	free(maps);
+	free(block);
+	free(elf);
+}
+
+static void test_bench_helpers(void)
+{
+	unsigned long long v[] = { 5, 1, 4, 2, 3, 9, 8, 7, 6, 10 };
+	int out[4];
+
+	assert(parse_int_list("0,16,4096", out, 4, 0) == 3);
+	assert(out[0] == 0 && out[2] == 4096);
+	assert(parse_int_list("0", out, 4, 1) == -1);
+	assert(parse_int_list("1,,2", out, 4, 0) == -1);
+	assert(parse_pid_list("0", out, 4) == -1);
+
+	qsort(v, 10, sizeof(v[0]), compare_ull);
+	assert(v[0] == 1 && v[9] == 10);
+	assert(sorted_percentile(v, 10, 50) == 5);
+	assert(sorted_percentile(v, 10, 99) == 10);
+	assert(sorted_percentile(v, 10, 0) == 1);
+	assert(sorted_percentile(v, 0, 50) == 0);
+}
+
+static void test_snapshot_describes_pid(void)
+{
+	static struct ctrl_snapshot det, threads;
+
+	parse_snapshot("Process ID:      42\nName:            web\n", &det);
+	parse_snapshot("TID    NAME\n"
+		       "42     web                0.10   S        0\n"
+		       "43     web-worker         5.00   R        0\n",
+		       &threads);
+	assert(snapshot_describes_pid(&det, &threads, 42));
+	assert(!snapshot_describes_pid(&det, &threads, 43));
+
+	/* det answered for another process than threads */
+	parse_snapshot("Process ID:      43\n", &det);
+	assert(!snapshot_describes_pid(&det, &threads, 43));
+	parse_snapshot("", &det);
+	assert(!snapshot_describes_pid(&det, &threads, 0));
+}
+
 int main(void)
 {
 	test_build_proc_path_helper();
@@ -286,6 +746,18 @@ int main(void)
 	test_print_process_info_happy_path();
 	test_main_argument_pid_is_bounded();
 	test_main_interactive_repeats_until_input_fails();
+	test_parse_field_line_variants();
+	test_snapshot_changes_and_rates();
+	test_parse_interval_ms();
+	test_main_watch_rejects_bad_arguments();
+	test_multi_pid_helpers();
+	test_export_sample_and_rendering();
+	test_main_export_requires_targets();
+	test_recorder_helpers();
+	test_record_and_report_round_trip();
+	test_bench_helpers();
+	test_snapshot_describes_pid();
+	test_symbolizer_helpers();
 	puts("proc_elf_ctrl tests passed");
 	reset_mocks();
 	return 0;
@@ -1,48 +1,351 @@
 // SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
-// Simple multi-threaded test program for E2E testing
+// Multi-threaded workload generator for E2E testing and benchmarking.
+// Without options it reproduces the original fixed target: 4 workers, a TCP
+// listener, a UDP socket and a UNIX socket, exiting after about 10 seconds.
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
-#define NUM_THREADS 4
+#include "proc_elf_ctrl.h"
 
-void *worker_thread(void *arg)
+#define NUM_THREADS	  4
+#define MAX_THREADS	  4096
+#define MAX_TCP_CONNS	  4096
+#define DEFAULT_PORT	  12345
+#define DEFAULT_DURATION  10
+#define DUTY_PERIOD_US	  100000 /* one busy/sleep cycle */
+#define TICK_US		  10000 /* main loop: traffic pump and heap growth */
+#define TRAFFIC_CHUNK	  4096
+#define HEAP_CHUNK	  (64 * 1024) /* below the malloc mmap threshold */
+
+struct workload {
+	int threads;
+	int busy[MAX_THREADS]; /* CPU percent per worker, cycled */
+	int nr_busy;
+	int duration_s;
+	int port;
+	int tcp_conns;
+	int traffic_kbps; /* per connection */
+	int anon_maps;
+	int file_maps;
+	int map_kb;
+	int sparse_fds;
+	int fd_stride;
+	int heap_mb;
+	int shared_lock; /* workers spin holding one mutex */
+};
+
+struct worker_arg {
+	long id;
+	int busy_pct;
+	unsigned long long end_ns;
+	pthread_mutex_t *lock; /* held while busy, if set */
+};
+
+/* Loopback connection: client writes, the accepted end drains */
+struct tcp_pair {
+	int client;
+	int server;
+};
+
+static unsigned long long now_ns(void)
 {
-	long thread_id = (long)arg;
-	long i;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL +
+	       (unsigned long long)ts.tv_nsec;
+}
+
+static void spin_until(unsigned long long deadline)
+{
+	volatile unsigned long long sink = 0;
 
-	printf("Thread %ld started\n", thread_id);
+	while (now_ns() < deadline)
+		sink += deadline;
+}
 
-	/* Do some work to show CPU usage and keep thread alive */
-	for (i = 0; i < 1000000; i++) {
-		/* Light CPU work */
-		long tmp = i * i;
-		(void)tmp;
+void *worker_thread(void *arg)
+{
+	struct worker_arg *w = arg;
+	unsigned long long busy_ns, cycle;
 
-		/* Sleep occasionally to avoid 100% CPU */
-		if (i % 10000 == 0)
-			usleep(100000); /* Sleep 100ms */
+	printf("Thread %ld started (busy %d%%)\n", w->id, w->busy_pct);
+
+	/* Spin for busy_pct of each period and sleep the remainder */
+	busy_ns = (unsigned long long)DUTY_PERIOD_US * 1000ULL * w->busy_pct /
+		  100;
+	while ((cycle = now_ns()) < w->end_ns) {
+		if (busy_ns && w->lock) {
+			/* Waiters queue on the mutex's futex */
+			pthread_mutex_lock(w->lock);
+			spin_until(now_ns() + busy_ns);
+			pthread_mutex_unlock(w->lock);
+		} else if (busy_ns) {
+			spin_until(cycle + busy_ns);
+		}
+		if (w->busy_pct < 100)
+			usleep(DUTY_PERIOD_US - (useconds_t)(busy_ns / 1000));
 	}
 
-	printf("Thread %ld finished\n", thread_id);
+	printf("Thread %ld finished\n", w->id);
 	return NULL;
 }
 
-int main(void)
+static void usage(const char *prog)
 {
-	pthread_t threads[NUM_THREADS];
+	fprintf(stderr,
+		"Usage: %s [--threads <n>] [--busy <pct,pct,...>] "
+		"[--duration <s>] [--port <p>]\n"
+		"          [--tcp-conns <m>] [--traffic-kbps <kb>] "
+		"[--anon-maps <k>] [--file-maps <k>] [--map-kb <kb>]\n"
+		"          [--sparse-fds <n>] [--fd-stride <s>] "
+		"[--heap-mb <mb>] [--shared-lock <n>]\n",
+		prog);
+}
+
+static int parse_workload(int argc, char **argv, struct workload *wl)
+{
+	int i;
+
+	memset(wl, 0, sizeof(*wl));
+	wl->threads = NUM_THREADS;
+	wl->nr_busy = 1;
+	wl->duration_s = DEFAULT_DURATION;
+	wl->port = DEFAULT_PORT;
+	wl->traffic_kbps = 64;
+	wl->map_kb = 64;
+	wl->fd_stride = 64;
+
+	for (i = 1; i + 1 < argc; i += 2) {
+		const char *opt = argv[i], *val = argv[i + 1];
+		int v = atoi(val);
+
+		if (!strcmp(opt, "--busy")) {
+			wl->nr_busy = parse_int_list(val, wl->busy, MAX_THREADS,
+						     0);
+			if (wl->nr_busy <= 0)
+				return -1;
+			continue;
+		}
+		if (v < 0)
+			return -1;
+		if (!strcmp(opt, "--threads"))
+			wl->threads = v;
+		else if (!strcmp(opt, "--duration"))
+			wl->duration_s = v;
+		else if (!strcmp(opt, "--port"))
+			wl->port = v;
+		else if (!strcmp(opt, "--tcp-conns"))
+			wl->tcp_conns = v;
+		else if (!strcmp(opt, "--traffic-kbps"))
+			wl->traffic_kbps = v;
+		else if (!strcmp(opt, "--anon-maps"))
+			wl->anon_maps = v;
+		else if (!strcmp(opt, "--file-maps"))
+			wl->file_maps = v;
+		else if (!strcmp(opt, "--map-kb"))
+			wl->map_kb = v;
+		else if (!strcmp(opt, "--sparse-fds"))
+			wl->sparse_fds = v;
+		else if (!strcmp(opt, "--fd-stride"))
+			wl->fd_stride = v;
+		else if (!strcmp(opt, "--heap-mb"))
+			wl->heap_mb = v;
+		else if (!strcmp(opt, "--shared-lock"))
+			wl->shared_lock = v;
+		else
+			return -1;
+	}
+
+	if (i != argc || wl->threads > MAX_THREADS ||
+	    wl->tcp_conns > MAX_TCP_CONNS || wl->port == 0 ||
+	    wl->port > 65534 || wl->map_kb == 0 || wl->fd_stride == 0)
+		return -1;
+	for (i = 0; i < wl->nr_busy; i++) {
+		if (wl->busy[i] > 100)
+			return -1;
+	}
+	return 0;
+}
+
+/* Connect tcp_conns clients to the listener and accept each of them */
+static struct tcp_pair *open_tcp_pairs(int listener,
+				       const struct sockaddr_in *addr, int n)
+{
+	struct tcp_pair *pairs;
+	int i;
+
+	pairs = calloc((size_t)n, sizeof(*pairs));
+	if (!pairs)
+		return NULL;
+
+	for (i = 0; i < n; i++) {
+		pairs[i].client = socket(AF_INET, SOCK_STREAM, 0);
+		if (pairs[i].client < 0 ||
+		    connect(pairs[i].client, (const struct sockaddr *)addr,
+			    sizeof(*addr))) {
+			perror("TCP connect failed");
+			break;
+		}
+		pairs[i].server = accept(listener, NULL, NULL);
+		if (pairs[i].server < 0) {
+			perror("TCP accept failed");
+			break;
+		}
+		fcntl(pairs[i].client, F_SETFL, O_NONBLOCK);
+		fcntl(pairs[i].server, F_SETFL, O_NONBLOCK);
+	}
+
+	if (i < n) {
+		for (n = i, i = 0; i <= n; i++) {
+			if (pairs[i].client > 0)
+				close(pairs[i].client);
+			if (pairs[i].server > 0)
+				close(pairs[i].server);
+		}
+		free(pairs);
+		return NULL;
+	}
+	printf("Opened %d loopback TCP connections on port %d\n", n,
+	       ntohs(addr->sin_port));
+	return pairs;
+}
+
+/* Move up to budget bytes through every connection, draining the peer */
+static void pump_traffic(struct tcp_pair *pairs, int n, size_t budget)
+{
+	static char chunk[TRAFFIC_CHUNK];
+	size_t len;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		size_t left = budget;
+
+		while (left > 0) {
+			len = left < sizeof(chunk) ? left : sizeof(chunk);
+			if (send(pairs[i].client, chunk, len, MSG_NOSIGNAL) <= 0)
+				break;
+			left -= len;
+		}
+		while (recv(pairs[i].server, chunk, sizeof(chunk), 0) > 0)
+			;
+	}
+}
+
+static void close_tcp_pairs(struct tcp_pair *pairs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		close(pairs[i].client);
+		close(pairs[i].server);
+	}
+	free(pairs);
+}
+
+/* Map count regions of map_kb each; file mappings share one unlinked file.
+ * A one-page hole after each region keeps neighbours from merging into a
+ * single VMA, and every page is touched so the mappings count towards RSS.
+ */
+static int create_maps(int count, int map_kb, int file_backed)
+{
+	size_t len = (size_t)map_kb * 1024, off;
+	char path[] = "/tmp/test_multithread_XXXXXX";
+	int i, fd = -1;
+	char *p;
+
+	if (count == 0)
+		return 0;
+	if (file_backed) {
+		fd = mkstemp(path);
+		if (fd < 0)
+			return -1;
+		unlink(path);
+		if (ftruncate(fd, (off_t)len + 4096)) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		p = mmap(NULL, len + 4096, PROT_READ | PROT_WRITE,
+			 file_backed ? MAP_SHARED : MAP_PRIVATE | MAP_ANONYMOUS,
+			 fd, 0);
+		if (p == MAP_FAILED)
+			break;
+		munmap(p + len, 4096);
+		for (off = 0; off < len; off += 4096)
+			p[off] = (char)i;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	printf("Created %d %s mappings of %d KB\n", i,
+	       file_backed ? "file" : "anonymous", map_kb);
+	return i == count ? 0 : -1;
+}
+
+/* Scatter n descriptors across the fd table, stride apart */
+static int open_sparse_fds(int n, int stride)
+{
+	struct rlimit rl;
+	rlim_t need = (rlim_t)n * (rlim_t)stride + 64;
+	int i, devnull;
+
+	if (n == 0)
+		return 0;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < need) {
+		rl.rlim_cur = need < rl.rlim_max ? need : rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	devnull = open("/dev/null", O_RDONLY);
+	if (devnull < 0)
+		return -1;
+	for (i = 1; i <= n; i++) {
+		if (dup2(devnull, i * stride + 64) < 0) {
+			perror("dup2");
+			break;
+		}
+	}
+	close(devnull);
+	printf("Opened %d sparse descriptors up to fd %d\n", i - 1,
+	       (i - 1) * stride + 64);
+	return i > n ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	static pthread_t threads[MAX_THREADS];
+	static struct worker_arg args[MAX_THREADS];
+	static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
 	struct sockaddr_in tcp_addr, udp_addr;
 	struct sockaddr_un unix_addr;
+	struct tcp_pair *pairs = NULL;
+	struct workload wl;
+	unsigned long long start, end, tick;
+	size_t heap_target, heap_goal, heap_grown = 0, budget;
 	int tcp_sock = -1, udp_sock = -1, unix_sock = -1;
 	long i;
 	int rc;
 
+	if (parse_workload(argc, argv, &wl)) {
+		usage(argv[0]);
+		return 1;
+	}
+
 	printf("Multi-threaded test application with sockets\n");
 	printf("Main PID: %d\n", getpid());
 
@@ -52,7 +355,7 @@ int main(void)
 		memset(&tcp_addr, 0, sizeof(tcp_addr));
 		tcp_addr.sin_family = AF_INET;
 		tcp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-		tcp_addr.sin_port = htons(12345);
+		tcp_addr.sin_port = htons((unsigned short)wl.port);
 
 		/* Allow reuse to avoid "Address already in use" errors */
 		int opt = 1;
@@ -62,10 +365,10 @@ int main(void)
 
 		if (bind(tcp_sock, (struct sockaddr *)&tcp_addr,
 			 sizeof(tcp_addr)) == 0) {
-			listen(tcp_sock, 5);
-			printf("TCP socket listening on 127.0.0.1:12345 "
+			listen(tcp_sock, wl.tcp_conns > 5 ? wl.tcp_conns : 5);
+			printf("TCP socket listening on 127.0.0.1:%d "
 			       "(fd=%d)\n",
-			       tcp_sock);
+			       wl.port, tcp_sock);
 		} else {
 			perror("TCP bind failed");
 			close(tcp_sock);
@@ -79,12 +382,12 @@ int main(void)
 		memset(&udp_addr, 0, sizeof(udp_addr));
 		udp_addr.sin_family = AF_INET;
 		udp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-		udp_addr.sin_port = htons(12346);
+		udp_addr.sin_port = htons((unsigned short)(wl.port + 1));
 
 		if (bind(udp_sock, (struct sockaddr *)&udp_addr,
 			 sizeof(udp_addr)) == 0) {
-			printf("UDP socket bound to 127.0.0.1:12346 (fd=%d)\n",
-			       udp_sock);
+			printf("UDP socket bound to 127.0.0.1:%d (fd=%d)\n",
+			       wl.port + 1, udp_sock);
 		} else {
 			perror("UDP bind failed");
 			close(udp_sock);
@@ -115,12 +418,28 @@ int main(void)
 		}
 	}
 
-	printf("\nCreating %d threads...\n\n", NUM_THREADS);
+	if (wl.tcp_conns && tcp_sock >= 0)
+		pairs = open_tcp_pairs(tcp_sock, &tcp_addr, wl.tcp_conns);
+	if (wl.tcp_conns && !pairs)
+		wl.tcp_conns = 0;
+	if (create_maps(wl.anon_maps, wl.map_kb, 0) ||
+	    create_maps(wl.file_maps, wl.map_kb, 1))
+		fprintf(stderr, "Could not create all mappings\n");
+	if (open_sparse_fds(wl.sparse_fds, wl.fd_stride))
+		fprintf(stderr, "Could not open all sparse descriptors\n");
+
+	printf("\nCreating %d threads...\n\n", wl.threads);
+
+	start = now_ns();
+	end = start + (unsigned long long)wl.duration_s * 1000000000ULL;
 
 	/* Create worker threads */
-	for (i = 0; i < NUM_THREADS; i++) {
-		rc = pthread_create(&threads[i], NULL, worker_thread,
-				    (void *)i);
+	for (i = 0; i < wl.threads; i++) {
+		args[i].id = i;
+		args[i].busy_pct = wl.busy[i % wl.nr_busy];
+		args[i].end_ns = end;
+		args[i].lock = wl.shared_lock ? &shared_lock : NULL;
+		rc = pthread_create(&threads[i], NULL, worker_thread, &args[i]);
 		if (rc) {
 			fprintf(stderr, "Error creating thread %ld: %d\n", i,
 				rc);
@@ -128,14 +447,46 @@ int main(void)
 		}
 	}
 
+	/* The main thread drives traffic and heap growth until the end */
+	heap_target = (size_t)wl.heap_mb * 1024 * 1024;
+	budget = (size_t)wl.traffic_kbps * 1024 * TICK_US / 1000000;
+	while (pairs || heap_grown < heap_target) {
+		tick = now_ns();
+		if (tick >= end)
+			break;
+		if (pairs)
+			pump_traffic(pairs, wl.tcp_conns, budget);
+		/* Grow linearly so the heap reaches heap_mb at the end. In KiB
+		 * and ms: bytes times ns overflows 64 bits past ~17000 MB*s.
+		 */
+		heap_goal = (size_t)((unsigned long long)(heap_target / 1024) *
+				     ((tick - start) / 1000000) /
+				     ((end - start) / 1000000) * 1024);
+		while (heap_grown < heap_target && heap_grown < heap_goal) {
+			char *chunk = malloc(HEAP_CHUNK);
+
+			if (!chunk) {
+				heap_target = heap_grown;
+				break;
+			}
+			memset(chunk, 0x5a, HEAP_CHUNK);
+			heap_grown += HEAP_CHUNK;
+		}
+		usleep(TICK_US);
+	}
+
 	/* Wait for threads to complete */
-	for (i = 0; i < NUM_THREADS; i++)
+	for (i = 0; i < wl.threads; i++)
 		pthread_join(threads[i], NULL);
 
 	printf("\nAll threads completed\n");
-	printf("Total threads (%s + workers): %d\n", __func__, NUM_THREADS + 1);
+	printf("Total threads (%s + workers): %d\n", __func__, wl.threads + 1);
+	if (heap_target)
+		printf("Heap grown by %zu KB\n", heap_grown / 1024);
 
 	/* Clean up sockets */
+	if (pairs)
+		close_tcp_pairs(pairs, wl.tcp_conns);
 	if (tcp_sock >= 0) {
 		close(tcp_sock);
 		printf("Closed TCP socket\n");